@@ -0,0 +1,261 @@
+/*
+************************************************************************
+*   Включаемый файл: разбор блоков конфигурации и копий счётчиков,
+*      хранящихся в NVS, и образов EEPROM прежних версий прошивки
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Значения счётчиков пишутся поочередно в несколько копий - отдельные ключи NVS "cnt0".."cntN". Каждая копия несет номер
+// записи (generation), растущий с каждым сохранением, и CRC16. При загрузке берется целая копия с наибольшим номером,
+// а копия с номером на единицу больше, но испорченным содержимым, означает, что питание пропало во время записи.
+// Функции работают с буфером и не зависят от Arduino, FreeRTOS и NVS - их проверяют тесты test/test_power_cut и
+// test/test_config_layouts на компьютере (последний - на образах всех прежних раскладок хранения).
+
+#define C_CFG_MAGIC 0x47464343                    // сигнатура блока статических параметров "CCFG"
+#define C_CNT_MAX_CHANNELS 100                    // наибольшее количество значений в копии, записанной сборкой с любым количеством входов
+
+struct __attribute__((packed)) CounterHeader {    // заголовок копии значений счётчиков, за ним channels значений по 4 байта и CRC16
+  uint8_t         version;                        // версия формата
+  uint8_t         channels;                       // количество значений (при изменении количества входов переносятся общие)
+  uint16_t        counter_reboot;                 // счётчик перезагрузок
+  uint32_t        generation;                     // номер записи - растет с каждым сохранением
+};
+
+// --- статический блок (версия 3): заголовок и записи [номер][длина][данные] ---
+struct __attribute__((packed)) ConfigHeader {     // заголовок блока статических параметров
+  uint32_t        magic;                          // сигнатура C_CFG_MAGIC
+  uint8_t         version;                        // версия формата, которой записан блок
+  uint8_t         reserved;
+  uint16_t        length;                         // длина записей после заголовка
+  uint16_t        crc;                            // контрольная сумма записей
+};
+
+struct __attribute__((packed)) ChannelRecord {    // запись параметров входа (более короткие записи прежних версий дополняются текущими значениями)
+  uint8_t         index;                          // индекс входа
+  uint8_t         mode;                           // режим входа ChannelMode_t
+  uint16_t        gate_ms;                        // время усреднения частоты в мс
+  uint16_t        min_low_ms;                     // параметры фильтра в мс
+  uint16_t        min_high_ms;
+  uint16_t        hyst_ms;
+};
+
+inline uint16_t GetCrc16Simple(const uint8_t *data, uint16_t len) { // процедура упрощенного расчета CRC16 для блока данных
+  uint8_t lo;
+  union // представляем crc как слово и как верхний и нижний байт
+  {
+    uint16_t value;
+    struct { uint8_t lo, hi; } bytes;
+  } crc;
+
+  crc.value = 0xFFFF;  // начальное значение для расчета
+  while ( len-- )
+    {
+        lo = crc.bytes.lo;
+        crc.bytes.lo = crc.bytes.hi;
+        crc.bytes.hi = lo ^ *data++;
+        uint8_t mask = 1;
+        if ( crc.bytes.hi & mask ) crc.value ^= 0x0240;
+        if ( crc.bytes.hi & ( mask << 1 ) ) crc.value ^= 0x0480;
+        if ( crc.bytes.hi & ( mask << 2 ) ) crc.bytes.hi ^= 0x09;
+        if ( crc.bytes.hi & ( mask << 3 ) ) crc.bytes.hi ^= 0x12;
+        if ( crc.bytes.hi & ( mask << 4 ) ) crc.bytes.hi ^= 0x24;
+        if ( crc.bytes.hi & ( mask << 5 ) ) crc.bytes.hi ^= 0x48;
+        if ( crc.bytes.hi & ( mask << 6 ) ) crc.bytes.hi ^= 0x90;
+        if ( crc.bytes.hi & ( mask << 7 ) ) crc.value ^= 0x2001;
+    }
+     return crc.value;
+}
+
+constexpr size_t CounterSlotSize(uint8_t Channels) { // размер копии счётчиков
+  return sizeof(CounterHeader) + 4 * Channels + 2;
+}
+
+inline size_t EncodeCounterSlot(const uint32_t *Counters, uint8_t Channels, uint16_t Reboot, uint8_t Version, uint32_t Generation, uint8_t *Buf) { // кодирование копии счётчиков в Buf, возвращает длину
+  CounterHeader _header = {Version, Channels, Reboot, Generation};
+  size_t        _len = sizeof(_header) + 4 * Channels;
+  uint16_t      _crc;
+
+  memcpy(Buf, &_header, sizeof(_header));
+  memcpy(Buf + sizeof(_header), Counters, 4 * Channels);
+  _crc = GetCrc16Simple(Buf, _len);
+  memcpy(Buf + _len, &_crc, sizeof(_crc));
+  return _len + sizeof(_crc);
+}
+
+// разбор копии счётчиков с проверкой CRC: Counters - Channels значений (при другом количестве входов переносятся общие, остальные - 0),
+// Generation - номер записи, если заголовок читается (даже при испорченных данных)
+inline bool DecodeCounterSlot(const uint8_t *Buf, size_t Len, uint32_t *Counters, uint8_t Channels, uint16_t &Reboot, uint32_t &Generation) {
+  CounterHeader _header;
+  size_t        _data;
+  uint16_t      _crc;
+
+  Generation = 0;
+  if ((Len < sizeof(_header) + 2) or (Len > CounterSlotSize(C_CNT_MAX_CHANNELS))) return false;
+  memcpy(&_header, Buf, sizeof(_header));
+  Generation = _header.generation;
+  _data = sizeof(_header) + 4 * _header.channels;
+  if (Len != _data + 2) return false;
+  memcpy(&_crc, Buf + _data, sizeof(_crc));
+  if (GetCrc16Simple(Buf, _data) != _crc) return false;
+  memset(Counters, 0, 4 * Channels);
+  memcpy(Counters, Buf + sizeof(_header), 4 * ((_header.channels < Channels) ? _header.channels : Channels));
+  Reboot = _header.counter_reboot;
+  return true;
+}
+
+// выбор копии для загрузки: индекс целой копии с наибольшим номером записи (-1 - целых копий нет),
+// Interrupted - есть испорченная копия со следующим номером (запись прервалась)
+inline int8_t SelectCounterSlot(const bool *Valid, const uint32_t *Generation, uint8_t Slots, bool &Interrupted) {
+  int8_t _best = -1;
+  Interrupted = false;
+  for (uint8_t i = 0; i < Slots; i++) {
+    if (Valid[i] and ((_best < 0) or ((int32_t)(Generation[i] - Generation[_best]) > 0))) _best = i;
+  }
+  if (_best < 0) return _best;
+  for (uint8_t i = 0; i < Slots; i++) {
+    if (!Valid[i] and (Generation[i] == Generation[_best] + 1)) Interrupted = true;
+  }
+  return _best;
+}
+
+inline uint8_t NextCounterSlot(uint8_t Active, uint8_t Slots) { // копия для следующей записи - не та, что записана последней
+  return (Active + 1) % Slots;
+}
+
+inline bool CheckConfigBlock(const uint8_t *Buf, size_t Len, ConfigHeader &Header) { // проверка заголовка и CRC статического блока
+  if (Len < sizeof(Header)) return false;
+  memcpy(&Header, Buf, sizeof(Header));
+  if ((Header.magic != C_CFG_MAGIC) or (Header.length != Len - sizeof(Header))) return false;
+  return GetCrc16Simple(Buf + sizeof(Header), Header.length) == Header.crc;
+}
+
+// следующая запись статического блока с позиции Pos: 1 - запись прочитана, 0 - записей больше нет, -1 - запись выходит за границу блока
+inline int8_t NextConfigRecord(const uint8_t *Buf, size_t Len, size_t &Pos, uint8_t &Id, uint8_t &Size, const uint8_t *&Data) {
+  if (Pos + 2 > Len) return 0;
+  Id = Buf[Pos];
+  Size = Buf[Pos + 1];
+  Data = Buf + Pos + 2;
+  Pos += 2 + Size;
+  return (Pos > Len) ? -1 : 1;
+}
+
+inline void MergeChannelRecord(const uint8_t *Data, uint8_t Size, ChannelRecord &Rec) { // запись параметров входа поверх Rec (короткая запись меняет только свои поля)
+  memcpy(&Rec, Data, (Size < sizeof(Rec)) ? Size : sizeof(Rec));
+}
+
+// --- образы EEPROM прежних версий прошивки (только для переноса конфигурации при первой загрузке новой версии) ---
+// Библиотека EEPROM хранит весь буфер одним блоком NVS "eeprom", все версии были собраны для двух входов
+#define C_LEGACY_CHANNELS 2                       // количество входов в образах прежних версий
+struct LegacyParams {                             // блок конфигурации v1.3b: единственный блок в начале EEPROM или копия в формате с двумя копиями
+  uint32_t        counter[C_LEGACY_CHANNELS];
+  uint16_t        counter_reboot;
+  char            wifi_ssid[40];
+  char            wifi_pwd[40];
+  char            mqtt_usr[40];
+  char            mqtt_pwd[40];
+  char            mqtt_host_s[80];
+  uint16_t        mqtt_port;
+  char            command_topic[80];
+  char            report_topic[80];
+  char            lwt_topic[80];
+  uint16_t        simple_crc16;                   // CRC считалась по sizeof - 4 байта (без CRC и выравнивания)
+};
+
+struct LegacySlot {                               // копия конфигурации формата с двумя копиями
+  LegacyParams    params;
+  uint32_t        generation;
+  uint16_t        slot_crc;                       // CRC параметров и номера записи
+};
+
+struct LegacyChannelsV1 {                         // блок параметров входов версии 1 (режим и время усреднения)
+  uint8_t         version;
+  uint8_t         mode[C_LEGACY_CHANNELS];
+  uint8_t         reserved;
+  uint16_t        gate_ms[C_LEGACY_CHANNELS];
+  uint16_t        crc;
+};
+
+struct LegacyChannelsV2 {                         // блок параметров входов версии 2 (добавлены параметры фильтра)
+  uint8_t         version;
+  uint8_t         mode[C_LEGACY_CHANNELS];
+  uint8_t         reserved;
+  uint16_t        gate_ms[C_LEGACY_CHANNELS];
+  uint16_t        min_low_ms[C_LEGACY_CHANNELS];
+  uint16_t        min_high_ms[C_LEGACY_CHANNELS];
+  uint16_t        hyst_ms[C_LEGACY_CHANNELS];
+  uint16_t        crc;
+};
+#define C_LEGACY_SLOTS 2                                                            // копий конфигурации в формате с двумя копиями
+#define C_LEGACY_CHANNELS_ADDR (sizeof(LegacySlot) * C_LEGACY_SLOTS)                // адрес блока параметров входов
+#define C_LEGACY_EEPROM_SIZE (C_LEGACY_CHANNELS_ADDR + sizeof(LegacyChannelsV2))    // размер самого длинного образа
+
+enum LegacyLayout_t : uint8_t {                   // какой образ EEPROM был перенесен при загрузке
+  LL_NONE,                                        // перенос не выполнялся
+  LL_SINGLE,                                      // единственный блок конфигурации (v1.3b)
+  LL_SLOTS                                        // две копии конфигурации с номером записи
+};
+
+inline bool IsLegacyParamsValid(const LegacyParams &Params) { // проверка CRC блока конфигурации прежних версий
+  return GetCrc16Simple((const uint8_t*)&Params, sizeof(Params) - 4) == Params.simple_crc16;
+}
+
+// разбор образа EEPROM: из формата с двумя копиями - целая копия с последним номером записи, иначе единственный блок v1.3b
+// (он же начало первой копии). Образ короче раскладки дополняется нулями, как это делает библиотека EEPROM
+inline LegacyLayout_t DecodeLegacyConfig(const uint8_t *Buf, size_t Len, LegacyParams &Params) {
+  LegacySlot _slot;
+  uint32_t   _generation = 0;
+  int8_t     _best = -1;
+
+  for (uint8_t i = 0; i < C_LEGACY_SLOTS; i++) {
+    if (Len < (i + 1) * sizeof(LegacySlot)) break;
+    memcpy(&_slot, Buf + i * sizeof(LegacySlot), sizeof(_slot));
+    // формат с двумя копиями нумеровал записи с 1. Копия с номером 0 - это блок v1.3b, дополненный нулями: CRC блока вместе
+    // с его же CRC равна 0, поэтому нулевые номер и CRC копии проходят проверку
+    if (_slot.generation == 0) continue;
+    if ((GetCrc16Simple((const uint8_t*)&_slot, offsetof(LegacySlot, slot_crc)) != _slot.slot_crc) or !IsLegacyParamsValid(_slot.params)) continue;
+    if ((_best < 0) or ((int32_t)(_slot.generation - _generation) > 0)) {
+      _best = i;
+      _generation = _slot.generation;
+      Params = _slot.params;
+    }
+  }
+  if (_best >= 0) return LL_SLOTS;
+  memset(&Params, 0, sizeof(Params));
+  memcpy(&Params, Buf, (Len < sizeof(Params)) ? Len : sizeof(Params));
+  return IsLegacyParamsValid(Params) ? LL_SINGLE : LL_NONE;
+}
+
+// разбор блока параметров входов после копий конфигурации: версия блока (0 - блока нет или он испорчен).
+// Версия 1 меняет только режимы и время усреднения - параметры фильтра в Channels остаются переданными
+inline uint8_t DecodeLegacyChannels(const uint8_t *Buf, size_t Len, LegacyChannelsV2 &Channels) {
+  LegacyChannelsV1 _v1;
+  LegacyChannelsV2 _v2;
+
+  if (Len <= C_LEGACY_CHANNELS_ADDR) return 0;
+  Buf += C_LEGACY_CHANNELS_ADDR;
+  Len -= C_LEGACY_CHANNELS_ADDR;
+  switch (Buf[0]) {                                                        // первый байт блока - версия
+    case 2:
+      if (Len < sizeof(_v2)) return 0;
+      memcpy(&_v2, Buf, sizeof(_v2));
+      if (GetCrc16Simple((const uint8_t*)&_v2, offsetof(LegacyChannelsV2, crc)) != _v2.crc) return 0;
+      Channels = _v2;
+      return 2;
+    case 1:
+      if (Len < sizeof(_v1)) return 0;
+      memcpy(&_v1, Buf, sizeof(_v1));
+      if (GetCrc16Simple((const uint8_t*)&_v1, offsetof(LegacyChannelsV1, crc)) != _v1.crc) return 0;
+      Channels.version = 1;
+      memcpy(Channels.mode, _v1.mode, sizeof(_v1.mode));
+      memcpy(Channels.gate_ms, _v1.gate_ms, sizeof(_v1.gate_ms));
+      return 1;
+    default:
+      return 0;
+  }
+}
@@ -0,0 +1,106 @@
+/*
+************************************************************************
+*   Включаемый файл: один проход задачи подсчёта - фронты счётных входов
+*      через фильтр, окна измерения частоты и время до пробуждения
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include "input_filter.h"
+#include "freq_meter.h"
+
+// Задача подсчёта просыпается по фронту (обработчик прерывания кладет его в буфер фильтра - FilterPushEdge) или по времени,
+// которое вернул CountingWait_us, и выполняет CountingStep, а при пропадании питания перед сохранением - CountingFlush.
+// Часы, счётчики, журнал и защита от обработчика захвата передаются через платформу Port, поэтому файл не зависит от Arduino
+// и FreeRTOS: в прошивке это CountingPort (src/main.cpp), а тест test/test_counting_task гоняет тот же проход на виртуальных
+// часах с планировщиком, будящим задачу с задержкой.
+
+#define C_WAIT_FOREVER UINT32_MAX                 // CountingWait_us: переходов по времени нет - ждем фронта
+
+// режим работы счётного входа
+enum ChannelMode_t : uint8_t {
+  CM_COUNT,                                       // подсчёт импульсов по прерыванию с подавлением дребезга
+  CM_FREQUENCY                                    // измерение частоты и скважности по меткам времени таймера захвата (импульсы тоже считаются)
+};
+
+// Port - платформа задачи подсчёта:
+//   uint8_t      Channels()                             - количество входов
+//   uint8_t      Mode(uint8_t Channel)                  - режим входа ChannelMode_t
+//   InputFilter &Filter(uint8_t Channel)                - фильтр счётного входа
+//   FilterTiming Timing(uint8_t Channel)                - параметры фильтра в мкс
+//   uint32_t     FilterNow()                            - текущий момент для фильтров в мкс (фронты до него уже в буфере)
+//   uint32_t     Millis()                               - текущий момент для окон измерения частоты в мс
+//   uint32_t    &NextGate(uint8_t Channel)              - окончание текущего окна измерения частоты
+//   uint16_t     Gate(uint8_t Channel)                  - длительность окна в мс
+//   FreqMeter    CloseWindow(uint8_t Channel)           - FreqMeterClose, согласованный с обработчиком захвата
+//   void         Pulse(uint8_t Channel, uint32_t Start_us)         - засчитан импульс (начало замыкания - Start_us)
+//   void         Bounce(uint8_t Channel)                - изменение уровня поглощено гистерезисом
+//   void         Glitch(uint8_t Channel)                - замыкание отброшено как помеха
+//   void         Window(uint8_t Channel, const FreqMeter &Window)  - окно частоты закрыто (замыкания окна - в счётчик)
+
+template <class Port>
+struct CountingEvents {                           // события фильтра входа (обработчик FilterDrain)
+  Port            &port;
+  uint8_t         channel;
+
+  uint32_t Now() {
+    return port.FilterNow();
+  }
+
+  void Event(FilterEvent_t Event, uint32_t Start_us) {
+    if (Event == FE_PULSE) port.Pulse(channel, Start_us);
+    else if (Event == FE_BOUNCE) port.Bounce(channel);
+    else if (Event == FE_GLITCH) port.Glitch(channel);
+  }
+};
+
+template <class Port>
+inline void CountingGate(Port &P, uint8_t Channel) { // окончание окна измерения частоты
+  P.Window(Channel, P.CloseWindow(Channel));
+  uint32_t &_next = P.NextGate(Channel);
+  _next += P.Gate(Channel);
+  if ((int32_t)(P.Millis() - _next) >= 0) _next = P.Millis() + P.Gate(Channel);   // пропущенные окна не догоняем
+}
+
+template <class Port>
+inline void CountingStep(Port &P) { // проход задачи подсчёта после пробуждения
+  // обработка входов в режиме подсчёта импульсов
+  for (uint8_t i = 0; i < P.Channels(); i++) {
+    if (P.Mode(i) != CM_COUNT) continue;
+    CountingEvents<Port> _events = {P, i};
+    FilterDrain(P.Filter(i), P.Timing(i), _events);
+  }
+  // окончание окон измерения частоты
+  for (uint8_t i = 0; i < P.Channels(); i++) {
+    if ((P.Mode(i) == CM_FREQUENCY) and ((int32_t)(P.Millis() - P.NextGate(i)) >= 0)) CountingGate(P, i);
+  }
+}
+
+template <class Port>
+inline void CountingFlush(Port &P) { // пропадание питания: замыкания незакрытых окон частоты - в счётчики перед сохранением
+  for (uint8_t i = 0; i < P.Channels(); i++) {
+    if (P.Mode(i) == CM_FREQUENCY) P.Window(i, P.CloseWindow(i));
+  }
+}
+
+template <class Port>
+inline uint32_t CountingWait_us(Port &P) { // время до ближайшего перехода фильтра или окончания окна, C_WAIT_FOREVER - ждем фронта
+  uint32_t _wait = C_WAIT_FOREVER;
+  for (uint8_t i = 0; i < P.Channels(); i++) {
+    int32_t _left;
+    if (P.Mode(i) == CM_COUNT) {
+      uint32_t _deadline;
+      if (!FilterDeadline(P.Filter(i).core, P.Timing(i), _deadline)) continue;
+      _left = _deadline - P.FilterNow();
+    }
+    else {
+      _left = P.NextGate(i) - P.Millis();
+      if (_left > 0) _left = (_left > INT32_MAX / 1000) ? INT32_MAX : _left * 1000;
+    }
+    if (_left <= 0) return 0;
+    if ((uint32_t)_left < _wait) _wait = _left;
+  }
+  return _wait;
+}
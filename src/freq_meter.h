@@ -0,0 +1,80 @@
+/*
+************************************************************************
+*   Включаемый файл: измерение частоты и скважности входа по меткам
+*         времени фронтов таймера захвата (окно усреднения)
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Фронты приходят с метками времени таймера захвата (такты Clock_hz, счётчик 32 бита переполняется - разности считаются по модулю).
+// Частота считается по целому числу периодов (от спада до спада) внутри окна, поэтому не зависит от задержки обработки прерываний.
+// Следующее окно начинается с последнего спада предыдущего - периоды на границе окон не теряются. Файл не зависит от Arduino
+// и FreeRTOS - расчет на сигнале генератора импульсов проверяет тест test/test_freq_mode.
+
+struct FreqMeter {
+  uint32_t        first_ts;                       // спад, с которого начался первый период окна
+  uint32_t        last_ts;                        // последний спад в окне
+  uint32_t        periods;                        // количество полных периодов между first_ts и last_ts
+  uint32_t        low_ticks;                      // суммарное время замкнутого состояния в полных периодах
+  uint32_t        pending_low;                    // время замыкания в текущем (еще не законченном) периоде
+  uint32_t        pulses;                         // количество замыканий в окне (добавляются к счётчику)
+  bool            has_fall;                       // first_ts задан
+  bool            closed;                         // текущее состояние входа
+};
+
+struct FreqResult {                               // результат окна измерения
+  uint32_t        freq_mhz;                       // частота в мГц (0 - полных периодов в окне нет)
+  uint32_t        duty_pm;                        // доля замкнутого состояния в тысячных
+};
+
+inline void FreqMeterReset(FreqMeter &M, bool Closed) { // измерение начинается заново с текущего уровня входа
+  memset(&M, 0, sizeof(M));
+  M.closed = Closed;
+}
+
+// вызывается из обработчика прерывания таймера захвата - always_inline оставляет код в IRAM вместе с обработчиком
+inline __attribute__((always_inline)) void FreqMeterEdge(FreqMeter &M, bool Closed, uint32_t Timestamp) { // учёт фронта
+  if (Closed and !M.closed) {                                             // спад (замыкание) - конец периода и начало следующего
+    if (M.has_fall) {
+      M.periods++;
+      M.low_ticks += M.pending_low;
+    }
+    else {
+      M.first_ts = Timestamp;
+      M.has_fall = true;
+    }
+    M.last_ts = Timestamp;
+    M.pending_low = 0;
+    M.pulses++;
+  }
+  else if (!Closed and M.closed and M.has_fall) M.pending_low = Timestamp - M.last_ts;   // подъем (размыкание) - длительность замыкания
+  M.closed = Closed;
+}
+
+inline FreqMeter FreqMeterClose(FreqMeter &M) { // окончание окна: возвращает накопленное за окно и начинает следующее
+  FreqMeter _window = M;
+  M.first_ts = _window.last_ts;
+  M.periods = 0;
+  M.low_ticks = 0;
+  M.pulses = 0;
+  if (_window.pulses == 0) M.has_fall = false;                            // за окно не было спадов - старую метку не переносим (таймер переполняется)
+  return _window;
+}
+
+inline FreqResult FreqMeterResult(const FreqMeter &Window, uint32_t Clock_hz) { // частота и скважность по закрытому окну
+  FreqResult _result;
+  uint32_t   _span = Window.last_ts - Window.first_ts;
+  if ((Window.periods > 0) and (_span > 0)) {
+    _result.freq_mhz = (uint64_t)Window.periods * Clock_hz * 1000 / _span;
+    _result.duty_pm = (uint64_t)Window.low_ticks * 1000 / _span;
+  }
+  else {                                                                  // полных периодов нет - вход стоит в одном состоянии
+    _result.freq_mhz = 0;
+    _result.duty_pm = Window.closed ? 1000 : 0;
+  }
+  return _result;
+}
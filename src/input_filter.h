@@ -0,0 +1,253 @@
+/*
+************************************************************************
+*   Включаемый файл: фильтр дребезга и помех счётного входа и генератор
+*         импульсов для проверки подсчёта (PULSE_SIMULATOR)
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+
+// Фильтр входа: импульс засчитывается, когда вход был замкнут не меньше min_low, следующий - только после размыкания
+// не короче min_high. Изменения уровня короче hyst внутри этих интервалов считаются дребезгом и отсчет не прерывают.
+// Все переходы идут только по меткам времени фронтов и по переданному "текущему" моменту - фильтр не читает часы сам.
+// Файл не зависит от Arduino и FreeRTOS - логику проверяет тест test/test_pulse_sim на компьютере, а обработку буфера фронтов
+// задачей подсчёта (FilterDrain) - тесты test/test_heap_soak и test/test_counting_task.
+
+#define C_EDGE_QUEUE 16                           // количество фронтов входа в буфере между обработчиком прерывания и задачей подсчёта
+
+enum FilterState_t : uint8_t {
+  FS_OPEN,                                        // вход разомкнут, ждем замыкания
+  FS_CLOSING,                                     // вход замкнут, ждем min_low
+  FS_CLOSING_BLIP,                                // во время отсчета min_low вход разомкнулся - ждем, дребезг это или конец помехи
+  FS_CLOSED,                                      // импульс засчитан, ждем размыкания
+  FS_OPENING,                                     // вход разомкнут, ждем min_high
+  FS_OPENING_BLIP                                 // во время отсчета min_high вход замкнулся - ждем, дребезг это или контакт еще замкнут
+};
+
+enum FilterEvent_t : uint8_t {
+  FE_WAIT,                                        // переходов к этому моменту нет
+  FE_NONE,                                        // переход без события
+  FE_PULSE,                                       // импульс засчитан (начало замыкания - start_us)
+  FE_GLITCH,                                      // замыкание отброшено как помеха
+  FE_BOUNCE                                       // изменение уровня поглощено гистерезисом (дребезг)
+};
+
+struct FilterTiming {
+  uint32_t        low_us;                         // минимальное время замыкания
+  uint32_t        high_us;                        // минимальное время размыкания
+  uint32_t        hyst_us;                        // гистерезис
+};
+
+struct FilterCore {
+  FilterState_t   state;                          // состояние фильтра
+  uint32_t        start_us;                       // начало текущего замыкания или размыкания
+  uint32_t        blip_us;                        // начало кратковременного изменения уровня
+};
+
+// фильтр счётного входа: обработчик прерывания только складывает фронты с метками времени в буфер, а состояние
+// фильтра ведет задача подсчёта (FilterDrain)
+struct InputEdge {
+  uint32_t        time_us;                        // момент фронта в мкс
+  bool            closed;                         // уровень входа после фронта
+};
+
+struct InputFilter {
+  InputEdge       edges[C_EDGE_QUEUE];            // кольцевой буфер фронтов (пишет обработчик прерывания, читает задача подсчёта)
+  volatile uint8_t head;                          // позиция следующей записи
+  volatile uint8_t tail;                          // позиция следующего чтения
+  FilterCore      core;                           // состояние фильтра
+};
+
+// вызывается из обработчика прерывания входа - always_inline оставляет код в IRAM вместе с обработчиком
+inline __attribute__((always_inline)) bool FilterPushEdge(InputFilter &F, bool Closed, uint32_t Time_us) { // фронт в буфер, false - буфер заполнен и фронт потерян
+  uint8_t _next = (F.head + 1) % C_EDGE_QUEUE;
+  if (_next == F.tail) return false;                                  // уровень придет со следующим фронтом
+  F.edges[F.head].time_us = Time_us;
+  F.edges[F.head].closed = Closed;
+  __sync_synchronize();
+  F.head = _next;
+  return true;
+}
+
+inline FilterEvent_t FilterAdvanceStep(FilterCore &F, const FilterTiming &T, uint32_t Now_us) { // один переход по времени, наступивший к моменту Now_us
+  switch (F.state) {
+    case FS_CLOSING:                                                  // вход замкнут не меньше min_low - засчитываем импульс
+      if ((int32_t)(Now_us - F.start_us) < (int32_t)T.low_us) return FE_WAIT;
+      F.state = FS_CLOSED;
+      return FE_PULSE;
+    case FS_CLOSING_BLIP:                                             // размыкание длиннее гистерезиса - замыкание было помехой
+      if ((int32_t)(Now_us - F.blip_us) < (int32_t)T.hyst_us) return FE_WAIT;
+      F.state = FS_OPEN;
+      return FE_GLITCH;
+    case FS_OPENING:                                                  // вход разомкнут не меньше min_high - ждем следующего импульса
+      if ((int32_t)(Now_us - F.start_us) < (int32_t)T.high_us) return FE_WAIT;
+      F.state = FS_OPEN;
+      return FE_NONE;
+    case FS_OPENING_BLIP:                                             // замыкание длиннее гистерезиса - контакт еще не отпущен
+      if ((int32_t)(Now_us - F.blip_us) < (int32_t)T.hyst_us) return FE_WAIT;
+      F.state = FS_CLOSED;
+      return FE_NONE;
+    default:
+      return FE_WAIT;
+  }
+}
+
+inline FilterEvent_t FilterEdgeStep(FilterCore &F, bool Closed, uint32_t Time_us) { // переход фильтра по фронту
+  switch (F.state) {
+    case FS_OPEN:
+      if (Closed) {
+        F.state = FS_CLOSING;
+        F.start_us = Time_us;
+      }
+      break;
+    case FS_CLOSING:
+      if (!Closed) {
+        F.state = FS_CLOSING_BLIP;
+        F.blip_us = Time_us;
+      }
+      break;
+    case FS_CLOSING_BLIP:                                             // размыкание короче гистерезиса - дребезг, отсчет min_low продолжается
+      if (Closed) {
+        F.state = FS_CLOSING;
+        return FE_BOUNCE;
+      }
+      break;
+    case FS_CLOSED:
+      if (!Closed) {
+        F.state = FS_OPENING;
+        F.start_us = Time_us;
+      }
+      break;
+    case FS_OPENING:
+      if (Closed) {
+        F.state = FS_OPENING_BLIP;
+        F.blip_us = Time_us;
+      }
+      break;
+    case FS_OPENING_BLIP:                                             // замыкание короче гистерезиса - дребезг, отсчет min_high продолжается
+      if (!Closed) {
+        F.state = FS_OPENING;
+        return FE_BOUNCE;
+      }
+      break;
+  }
+  return FE_NONE;
+}
+
+// Handler - обработчик событий фильтра: uint32_t Now() - текущий момент (фронты, пришедшие позже, будут в буфере),
+// void Event(FilterEvent_t Event, uint32_t Start_us) - событие фильтра (для FE_PULSE Start_us - начало замыкания)
+template <class Handler>
+inline void FilterAdvanceTo(FilterCore &F, const FilterTiming &T, uint32_t Now_us, Handler &H) { // все переходы по времени, наступившие к моменту Now_us
+  FilterEvent_t _event;
+  while ((_event = FilterAdvanceStep(F, T, Now_us)) != FE_WAIT) H.Event(_event, F.start_us);
+}
+
+template <class Handler>
+inline void FilterDrain(InputFilter &F, const FilterTiming &T, Handler &H) { // обработка накопленных фронтов и переходов по времени до H.Now()
+  uint32_t _now;
+  do {
+    _now = H.Now();                                                   // фронты, пришедшие после этого момента, будут в буфере
+    while (F.tail != F.head) {
+      InputEdge _edge = F.edges[F.tail];
+      __sync_synchronize();
+      F.tail = (F.tail + 1) % C_EDGE_QUEUE;
+      FilterAdvanceTo(F.core, T, _edge.time_us, H);                   // сначала переходы, наступившие до фронта
+      H.Event(FilterEdgeStep(F.core, _edge.closed, _edge.time_us), _edge.time_us);
+    }
+  } while (F.tail != F.head);
+  FilterAdvanceTo(F.core, T, _now, H);
+}
+
+inline bool FilterDeadline(const FilterCore &F, const FilterTiming &T, uint32_t &Deadline_us) { // момент ближайшего перехода по времени, false - переход возможен только по фронту
+  switch (F.state) {
+    case FS_CLOSING:
+      Deadline_us = F.start_us + T.low_us;
+      return true;
+    case FS_OPENING:
+      Deadline_us = F.start_us + T.high_us;
+      return true;
+    case FS_CLOSING_BLIP:
+    case FS_OPENING_BLIP:
+      Deadline_us = F.blip_us + T.hyst_us;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Генератор импульсов: форма сигнала (периоды, дребезг, помехи) строится по виртуальным часам в мкс от генератора
+// псевдослучайных чисел xorshift32, поэтому одинаковое начальное значение дает одинаковую последовательность фронтов.
+// Для входа в режиме частоты генерируется чистый прямоугольный сигнал с известными частотой и скважностью.
+
+struct SimWave {
+  uint32_t        period_ms;                      // средний период импульсов
+  uint32_t        jitter_ms;                      // разброс периода +/-
+  uint32_t        width_ms;                       // длительность замыкания (импульса)
+  uint32_t        bounce_edges;                   // максимальное количество пар фронтов дребезга при переключении
+  uint32_t        bounce_span_ms;                 // максимальный интервал между фронтами дребезга
+  uint32_t        glitch_pct;                     // доля коротких помех в %
+  uint32_t        glitch_max_us;                  // максимальная длительность помехи (должна быть короче min_low)
+  uint32_t        freq_period_us;                 // период сигнала в режиме частоты
+  uint32_t        freq_duty_pct;                  // доля замкнутого состояния в режиме частоты
+  bool            frequency;                      // вход в режиме частоты - сигнал без дребезга и помех
+};
+
+struct SimChannel {
+  bool            closed;                         // уровень входа
+  uint32_t        next_edge;                      // момент следующего фронта по виртуальным часам в мкс
+  uint32_t        pulse_start;                    // момент начала текущего импульса
+  uint8_t         bounces;                        // оставшееся количество фронтов дребезга в текущем переключении
+  bool            glitch;                         // текущее замыкание - короткая помеха, а не импульс
+  uint32_t        pulses;                         // сгенерировано импульсов (должны быть засчитаны)
+  uint32_t        glitches;                       // сгенерировано помех (должны быть отброшены)
+};
+
+inline uint32_t SimRandom(uint32_t &State, uint32_t Range) { // псевдослучайное число 0..Range-1 (xorshift32)
+  State ^= State << 13;
+  State ^= State >> 17;
+  State ^= State << 5;
+  return (Range > 0) ? State % Range : 0;
+}
+
+inline void SimStart(SimChannel &Channel, const SimWave &Wave) { // первый импульс через период после старта, он всегда настоящий
+  Channel = SimChannel();
+  Channel.next_edge = Channel.pulse_start = Wave.period_ms * 1000;
+  Channel.pulses = 1;
+}
+
+inline uint32_t SimPulsesDone(const SimChannel &Channel, uint32_t Now_us, uint32_t MinLow_us) { // импульсов, замкнутых к моменту Now_us не меньше MinLow_us (должны быть засчитаны)
+  // pulses учитывает и запланированный импульс - он еще не начался или замкнут меньше MinLow_us
+  bool _pending = !Channel.glitch and ((int32_t)(Now_us - Channel.pulse_start) < (int32_t)MinLow_us);
+  return Channel.pulses - (_pending ? 1 : 0);
+}
+
+inline void SimEdge(SimChannel &Channel, const SimWave &Wave, uint32_t &Random) { // выполняем фронт на входе и планируем следующий
+  Channel.closed = !Channel.closed;
+  if (Wave.frequency) {                                                 // прямоугольный сигнал без дребезга
+    if (Channel.closed) Channel.next_edge = Channel.pulse_start + Wave.freq_period_us * Wave.freq_duty_pct / 100;
+    else {
+      Channel.pulse_start += Wave.freq_period_us;
+      Channel.next_edge = Channel.pulse_start;
+      Channel.pulses++;
+    }
+    return;
+  }
+  if (Channel.bounces > 0) {                                            // идет дребезг - следующий фронт почти сразу
+    Channel.bounces--;
+    Channel.next_edge += SimRandom(Random, Wave.bounce_span_ms * 1000 + 1);
+  }
+  else if (Channel.closed) {                                            // контакт установился замкнутым - ждем размыкания
+    Channel.next_edge = Channel.pulse_start + (Channel.glitch ? 1000 + SimRandom(Random, Wave.glitch_max_us) : Wave.width_ms * 1000);
+    Channel.bounces = Channel.glitch ? 0 : SimRandom(Random, Wave.bounce_edges + 1) * 2;
+  }
+  else {                                                                // контакт разомкнут - планируем следующий импульс
+    Channel.next_edge = Channel.pulse_start + (Wave.period_ms - Wave.jitter_ms + SimRandom(Random, Wave.jitter_ms * 2 + 1)) * 1000;
+    Channel.pulse_start = Channel.next_edge;
+    Channel.glitch = (SimRandom(Random, 100) < Wave.glitch_pct);
+    Channel.bounces = Channel.glitch ? 0 : SimRandom(Random, Wave.bounce_edges + 1) * 2;
+    if (Channel.glitch) Channel.glitches++;
+      else Channel.pulses++;
+  }
+}
@@ -14,7 +14,9 @@
 При этом есть есть отдельный счётчик, который ведет подсчёт количества пропаданий питания со времени своего последнего сброса.
 
 При старте устройства текущие значения счётчиков вычитываются их FLASH памяти. Значения счётчиков могут быть сброшены принудительно, нажатием на 
-кнопку CLEAR на плате. Однократное нажатие сбрасывает счётчик 1, двойное - счётчик 2.
+кнопку CLEAR на плате. Однократное нажатие сбрасывает счётчик 1, двойное - счётчик 2 (N-кратное - счётчик входа N).
+Входы описываются таблицей c_Inputs (пин входа, светодиод, объем на импульс) - по ней строятся обработчики прерываний, ключи JSON 
+(cntNN, set_value_N ...), поля WEB страниц и карта регистров Modbus, поэтому для платы с другим количеством входов достаточно изменить таблицу.
 Для полного сброса всех настроек модуля к базовым, необходимо более чем на 1 секунду нажать одновременно кнопки CLEAR и FLASH.
 
 По умолчанию, модуль подключается к WiFi сети с настройками прошитыми в FLASH памяти. Там же хранятся настройки подключения и описания топиков MQTT сервера, 
@@ -24,15 +26,36 @@
 где хххх - последние цифры MAC адреса ESP32s. После поднятия точки доступа, можно соединится со страницей настроек модуля,
 которая будет доступна по адресу default gateway точки доступа. Эти же настройки доступны и при успешном подключении модуля к WiFi сети. Адрес при этом будет 
 получен динамически от вашего маршрутизатора. Поддерживается только сеть 2.4МГц (это ограничение самого ESP32). Отдельным пунктом меню можно обнулить оба счётчика по отдельности. 
+Изменения на странице конфигурации применяются без перезагрузки: топики - переподпиской, параметры MQTT сервера - переподключением к MQTT,
+параметры WiFi - переподключением к сети (c_ConfigFields задает для каждого параметра, что нужно сделать для его применения).
 
 Встроенный WEB сервер можно так же использовать для получения значения счётчиков в текущий момент времени, или их установки. 
 Для этого нужно:
 
 - для получения данных обратится по адресу [адрес_модуля]/get_data?cntr=х - где х - номер счётчика, значение которого мы хотим получить 0..2 (0 - счётчик перезагрузок).
+- для получения текущего расхода обратится по адресу [адрес_модуля]/get_data?flow=х - где х - номер входа 1..2, ответ - расход в л/мин.
+- для входа в режиме измерения частоты [адрес_модуля]/get_data?freq=х возвращает частоту в Гц, а [адрес_модуля]/get_data?duty=х - долю замкнутого состояния в %.
 - для задания значений счётчиков обратится по адресу [адрес_модуля]/set_data?cntr=х&value=nnn - где х - номер счётчика, значение которого мы хотим установить 0..2 (0 - счётчик перезагрузок), 
-  а nnn - новое значение этого счётчика;
+  а nnn - новое значение этого счётчика (параметры - в любом порядке);
+- для получения внутренней статистики работы модуля в формате Prometheus обратится по адресу [адрес_модуля]/metrics
+- для получения загрузки ядер и задач, свободного стека задач и состояния памяти в формате JSON обратится по адресу [адрес_модуля]/diag
+- для выгрузки журнала последних засчитанных импульсов (вход и время начала замыкания в мкс по esp_timer и, после синхронизации по SNTP, в UTC)
+  обратится по адресу [адрес_модуля]/pulses (NDJSON) или [адрес_модуля]/pulses?format=bin (двоичный формат, см. tools/pulse_log.py), 
+  параметр since=N отдает только записи начиная с номера N
+  (загрузка считается с момента прошлого запроса страницы)
+- для выгрузки журнала трассировки (события работы модуля вместо отладочного вывода в порт) обратится по адресу [адрес_модуля]/trace (NDJSON)
+  или [адрес_модуля]/trace?format=bin (см. tools/trace_dump.py), параметр mask=M включает категории событий
+- для обновления прошивки образ или дельта (tools/ota_delta.py) загружается на [адрес_модуля]/update (POST, параметры sha256 и sig - подпись tools/ota_delta.py sign), 
+  после проверки модуль перезагружается в новую прошивку; не подтвержденная прошивка после трех перезагрузок возвращается на прежнюю
+- для выполнения нескольких команд одной транзакцией JSON массив команд (как в топике [SET]) передается на [адрес_модуля]/batch (POST),
+  ответ - результат по каждой команде
+- для быстрого опроса значений счётчиков без HTTP используется UDP протокол на порту 4210 (кадры фиксированного размера, поиск модулей 
+  широковещательным запросом, подпись HMAC при заданном ключе P_UDP_KEY) - см. клиент tools/udp_poll.py
 
 Доступ к модулю через MQTT возможен при правильной настройке параметров подключения.  При этом это может быть как локальный, так и глобальный MQTT сервер. 
+Кроме основного сервера можно задать до трех резервных (поле "Backup MQTT hosts" на странице конфигурации: host[:port] через запятую,
+те же имя пользователя, пароль и топики). При отказе сервера модуль сразу, без переподключения WiFi, подключается к следующему исправному
+из списка, а работая через резервный, каждые 30 сек проверяет более приоритетные и возвращается на них. Адреса серверов кэшируются на 5 мин.
 Работа с сервером идет через три топика:
 - топик команд [SET] ;
 - топик состояния подключения устройства [LWT];
@@ -52,6 +75,18 @@
 {"clear":"reboot"}		        - сброс счётчика перезагрузок (считает от момента прошлого сброса)
 {"set_value_1":<значение>}	  - установка значения счётчика №1*
 {"set_value_2":<значение>}	  - установка значения счётчика №2*
+{"diag":<период>}		        - публикация диагностики (как на странице /diag) в топик [STATUS]/diag каждые <период> сек, 0 - выключить
+{"mode_1":"count"|"freq"}	    - режим входа №1: подсчёт импульсов или измерение частоты и скважности по таймеру захвата (так же "mode_2")
+{"gate_1":<мс>}		        - окно усреднения частоты по входу №1 100..10000 мс (так же "gate_2")
+{"filter_1":{"low":<мс>,"high":<мс>,"hyst":<мс>}} - фильтр входа №1: мин. время замыкания, мин. время размыкания, гистерезис дребезга (так же "filter_2")
+{"ota":"<ссылка>","sha256":"<hex>","sig":"<hex>"} - обновление прошивки (образ или дельта) по ссылке http, результат - в топик [STATUS]/ota
+{"trace":<маска>}                - включение категорий журнала трассировки, {"trace":"dump"} - публикация журнала в топик [STATUS]/trace
+[{...},{...}]                     - пакет команд (до 16, сообщение до 511 байт): сначала проверяются все команды, при ошибке не выполняется ни одна,
+                                    иначе изменения применяются разом - одна запись во FLASH и один отчёт; результат по командам - в топик [STATUS]/result.
+                                    {"clear":"config"} и {"ota":...} в пакете не принимаются, {"reboot"} выполняется после записи.
+{"provision":{...},"seq":N,"sig":"<hex>"} - подписанный блок настроек (WiFi, MQTT, топики, фильтры входов), применяется без перезагрузки,
+                                    результат - в топик [STATUS]/result (см. tools/provision.py)
+@<условие> <команда>             - команда только для модулей, выбранных условием (по номеру модуля и меткам) - для групповых топиков
 
 	* допустимое значение счётчика от 0 до 4 294 967 295 (0xFFFFFFFF)
 
@@ -59,11 +94,16 @@
 Ниже приведен пример отчета в JSON формате, генерируемого модулем в топик [STATUS]:
 
 
-{"cnt01":<значение1>,"cnt02":<значение2>,"cnt_reboot":<значение3>,"ip":<xx.xx.xx.xx>}  - где:
+{"cnt01":<значение1>,"cnt02":<значение2>,"cnt_reboot":<значение3>,"flow01":<расход1>,"flow02":<расход2>,"ip":<xx.xx.xx.xx>}  - где:
 
 	- <значение1>, <значение2>	- текущие значения счётчиков №1 и №2;
 	- <значение3> 			- значение счётчика перезагрузок;
-	- <xx.xx.xx.xx>			- текущий IP модуля для облегчения доступа к его страницам настроек.
+	- <расход1>, <расход2>		- текущий сглаженный расход по входам №1 и №2 в л/мин;
+	- для входов в режиме частоты добавляются "freq01"/"freq02" (частота в Гц) и "duty01"/"duty02" (доля замкнутого состояния в %);
+	- <xx.xx.xx.xx>			- текущий IP модуля для облегчения доступа к его страницам настроек;
+	- "pulse_age"			- возраст самого свежего засчитанного импульса в мс (от начала замыкания, нет до первого импульса).
+Отчёт публикуется с QoS 1: по подтверждению сервера считаются гистограммы задержки доставки значения по этапам
+(подсчёт -> сборка отчёта -> передача -> подтверждение), они видны на страницах /metrics и /diag.
 */
 
 
@@ -71,13 +111,30 @@
 #include <WiFi.h>
 #include <WebServer.h>
 #include <EEPROM.h>
+#include <Preferences.h>
+#include <HTTPClient.h>
+#include <sys/time.h>
 
 extern "C" {
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "lwip/sockets.h"
+#include "mbedtls/md.h"
 #include "esp_mac.h"
+#include "esp_freertos_hooks.h"
 #include "soc/rtc_wdt.h"
+#include "driver/mcpwm.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_heap_caps.h"
+#ifdef POWER_SAVE_MODE
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#endif
 }
 
 #include "GyverButton.h"
@@ -85,9 +142,25 @@ extern "C" {
 #include <ArduinoJson.h>
 
 #include "webPageConst.h"                         // сюда вынесены все константные строки для генерации WEB страниц
+#include "seqlock.h"                              // согласованные копии curConfig без блокирования читателей
+#include "input_filter.h"                         // фильтр дребезга входа, буфер фронтов (C_EDGE_QUEUE) и генератор импульсов
+#include "config_store.h"                         // копии значений счётчиков в NVS и CRC16
+#include "ota_stream.h"                           // разбор образа или дельты и пробные загрузки новой прошивки
+#include "rate_engine.h"                          // расчет скорости счёта по входу (RateEngine, FlowRates)
+#include "metrics_format.h"                       // порционный вывод страницы /metrics (MetricsOut)
+#include "modbus_frame.h"                         // разбор кадров Modbus TCP (ModbusHandleFrame)
+#include "freq_meter.h"                           // расчет частоты и скважности по меткам времени фронтов (FreqMeter)
+#include "counting_task.h"                        // проход задачи подсчёта (CountingStep) и режимы входов ChannelMode_t
 
 // устанавливаем режим отладки
 // #define DEBUG_LEVEL_PORT                          // устанавливаем режим отладки через порт
+// #define LOAD_SIMULATION                           // режим имитации нагрузки WEB и MQTT для измерения задержки обработки импульсов
+// #define TASK_LAYOUT_UNPINNED                      // старое размещение задач (без привязки к ядрам, с одинаковым приоритетом) - для сравнения задержек
+// #define POWER_SAVE_MODE                           // режим энергосбережения - динамическое изменение частоты CPU и автоматический light sleep
+// #define PULSE_SIMULATOR                           // генератор импульсов с дребезгом и помехами вместо реальных входов - проверка точности подсчёта без стенда
+// #define MODBUS_SERVER                             // сервер Modbus TCP - значения счётчиков в input/holding регистрах
+// #define STATIC_ALLOCATION                         // постоянные задачи, очереди и семафоры - в статической памяти (без выделения из кучи; страницы WEB - по-прежнему String)
+// #define OTA_UNSIGNED                              // обновление прошивки без подписи P_PROV_KEY (прошивку может заменить любой, кто отправит команду или откроет /update)
 
 #define FW_VERSION "v1.3b"                        // версия ПО
 
@@ -106,13 +179,164 @@ extern "C" {
 // определяем константы для задержек
 #define C_WIFI_CONNECT_TIMEOUT 60000              // задержка для установления WiFi соединения (60 сек)
 #define C_MQTT_CONNECT_TIMEOUT 30000              // задержка для установления MQTT соединения (30 сек)
+#define C_MQTT_FAILOVER_TIMEOUT 5000              // задержка установления MQTT соединения, если есть резервные серверы (5 сек)
+#define C_MQTT_BROKERS 4                          // максимальное количество MQTT серверов: основной и резервные из строки mqtt_backup
+#define C_MQTT_BACKOFF_MIN 1000                   // пауза перед повторным подключением к серверу после первой неудачи (удваивается с каждой неудачей)
+#define C_MQTT_BACKOFF_MAX 60000                  // максимальная пауза перед повторным подключением к серверу
+#define C_MQTT_HEALTHY 40                         // оценка исправности (0..100), ниже которой сервер пропускается, если есть исправные
+#define C_MQTT_FAILBACK_PERIOD 30000              // период проверки более приоритетных серверов при работе через резервный (30 сек)
+#define C_MQTT_PROBE_TIMEOUT 1000                 // таймаут TCP соединения и ответа CONNACK при проверке сервера
+#define C_DNS_TTL 300000                          // время жизни адреса сервера в кэше DNS (5 мин)
+#define C_DNS_REFRESH_FAILS 3                     // после стольких неудач подряд адрес сервера запрашивается у DNS повторно, не дожидаясь C_DNS_TTL
 #define C_WIFI_AP_WAIT 180000                     // таймуат поднятой AP без соединения с клиентами (после этого опять пытаемся подключится как клиент) (180 сек)
 #define C_WIFI_CYCLE_WAIT 10000                   // таймуат цикла переустановки соединения с WiFi (10 сек)
-#define C_BLINKER_DELAY 300                       // задержка для мигания индикаторными светодиодами
-#define C_COUNTER_DELAY 50                        // задержка для подавления дребезга на счётных входах 50ms - нижняя граница пропускания 20Гц
+#define C_WIFI_CHECK_DELAY 1000                   // период проверки наличия соединений в рабочем режиме (1 сек)
+#define C_WEB_POLL_DELAY 20                       // период опроса входящих соединений WEB сервера
+#define C_BUTTON_POLL_DELAY 10                    // период опроса кнопок, пока они активны
+#define C_BUTTON_ACTIVE_TIME 1500                 // сколько опрашиваем кнопки после последнего изменения их состояния (больше таймаутов удержания и кликов)
+#define C_COUNTER_DELAY 50                        // минимальное время замыкания входа для засчитывания импульса по умолчанию (50 мс - до 20 Гц)
+#define C_FILTER_HIGH_DEFAULT 20                  // минимальное время размыкания входа перед следующим импульсом по умолчанию в мс
+#define C_FILTER_HYST_DEFAULT 5                   // гистерезис фильтра по умолчанию: изменения уровня короче этого времени в мс считаются дребезгом
+#define C_FILTER_MAX 10000                        // максимальное значение параметров фильтра входа в мс
+#define C_PULSE_VOLUME_CH1 10000                  // объем на один импульс по входу 1 в мл (10 л - типовой счётчик воды)
+#define C_PULSE_VOLUME_CH2 10000                  // объем на один импульс по входу 2 в мл
+#define C_GATE_DEFAULT 1000                       // время усреднения частоты по умолчанию в мс
+#define C_GATE_MIN 100                            // минимальное время усреднения частоты в мс
+#define C_GATE_MAX 10000                          // максимальное время усреднения частоты в мс (частоты ниже 1/gate не измеряются)
+#define C_CAPTURE_CLOCK 80000000                  // частота таймера захвата MCPWM (APB) в Гц - разрешение метки времени фронта 12.5 нс
+#define C_PULSE_LOG_SIZE 512                      // количество записей журнала импульсов в RAM (8 байт на запись)
+#define C_PULSE_LOG_VERSION 1                     // версия двоичного формата выгрузки журнала импульсов
+#define C_TRACE_SIZE 512                          // количество записей журнала трассировки в RAM (16 байт на запись, степень двойки)
+#define C_TRACE_VERSION 1                         // версия двоичного формата выгрузки журнала трассировки
+#define C_TRACE_MQTT_CHUNK 32                     // записей журнала трассировки в одной публикации в топик [STATUS]/trace
+#define C_TRACE_MQTT_RETRY 5                      // повторов публикации порции журнала трассировки при заполненном буфере отправки
+#define C_TRACE_PRINT_DELAY 100                   // период вывода новых событий трассировки в порт при отладке в мс
+#define C_TIME_VALID_EPOCH 1577836800             // время до 01.01.2020 считаем не синхронизированным (SNTP еще не ответил)
+#define C_PIN_NONE 0xFF                           // пин не подключен (вход без светодиода индикации)
+
+// таблица счётных входов: по ней строятся массивы состояния входов, обработчики прерываний, ключи JSON (номер входа - индекс + 1),
+// поля WEB страниц и карта регистров Modbus. Для платы с другим количеством входов достаточно изменить таблицу
+struct InputChannel {
+  uint8_t         pin;                            // пин входа (замыкание - низкий уровень)
+  uint8_t         led;                            // пин светодиода индикации замыкания (C_PIN_NONE - нет)
+  uint32_t        volume_ml;                      // объем на один импульс в мл
+};
+constexpr InputChannel c_Inputs[] DRAM_ATTR = {              // в DRAM - таблицу читают обработчики прерываний
+  {PIN_INP_CH1, LED_RED_PIN, C_PULSE_VOLUME_CH1},
+  {PIN_INP_CH2, LED_BLUE_PIN, C_PULSE_VOLUME_CH2}
+};
+#define C_INP_CHANNELS ((uint8_t)(sizeof(c_Inputs) / sizeof(c_Inputs[0])))     // количество счётных входов
+#define C_CAPTURE_CHANNELS 6                      // входов с аппаратным захватом фронтов (2 блока MCPWM по 3 канала), остальные - только подсчёт
+static_assert((C_INP_CHANNELS > 0) and (C_INP_CHANNELS < 100), "номер входа в ключах JSON - не более двух цифр");
+
+// параметры сбора внутренней статистики прошивки для страницы /metrics
+#define C_LAT_BUCKETS 8                           // количество корзин гистограммы задержек (последняя - +Inf)
+#define C_MQTT_CMD_SIZE 512                       // максимальный размер команды MQTT с завершающим нулем (команды длиннее отбрасываются, вмещает подписанный блок настроек)
+#define C_MQTT_CMD_QUEUE 8                        // длина очереди команд MQTT (при переполнении команды отбрасываются)
+#define C_BATCH_MAX 16                            // максимальное количество команд в пакете (JSON массив в [SET] или POST /batch)
+#define C_BATCH_RESULT_SIZE 320                   // размер буфера результата пакета команд
+#define C_BATCH_WAIT 2000                         // время ожидания выполнения пакета, переданного через WEB, в мс
+#define C_KEY_SLOTS 256                           // размер таблицы совершенного хеша ключей команд и параметров WEB (степень 2)
+#define C_KEY_SEEDS 1024                          // сколько вариантов хеш-функции перебирается при компиляции в поисках варианта без коллизий
+#define C_KEY_CHANNEL_MARK '#'                    // место номера входа в имени ключа таблицы ключей
+#define C_JSON_DOC_SIZE (768 + 128 * C_INP_CHANNELS)   // размер буфера документов JSON команд и отчёта (растет с количеством входов, пакет команд и блок настроек - до C_MQTT_CMD_SIZE байт)
+#define C_REPORT_BUF_SIZE (128 + 96 * C_INP_CHANNELS)   // размер буфера текста отчёта в [STATUS]
+#define C_METRICS_BUF_SIZE 512                    // размер буфера для порционной отдачи страницы /metrics
+
+// размещение задач по ядрам: APP_CPU - счёт импульсов и обработка пропадания питания, PRO_CPU (ядро стека WiFi) - сетевые задачи
+// прерывания GPIO назначаются в loop(), который работает на APP_CPU - поэтому обработчики счётных входов живут на том же ядре, что и счёт
+#define C_TASK_COUNT_PRIO     5                   // приоритет задачи подсчёта импульсов и сохранения при пропадании питания 
+#define C_TASK_EVENTS_PRIO    3                   // приоритет задачи обработки команд и кнопок
+#define C_TASK_REPORT_PRIO    2                   // приоритет задачи отчётов в MQTT
+#define C_TASK_NET_PRIO       1                   // приоритет задач WiFi и WEB сервера
+#define C_TASK_TRACE_PRIO     (tskIDLE_PRIORITY + 1) // приоритет вывода трассировки в порт - ниже не бывает, медленный порт не задерживает сеть
+#define C_TASK_COUNT_STACK    4096                // размер стека задачи подсчёта (запись в EEPROM и публикация LWT при пропадании питания)
+#define C_TASK_EVENTS_STACK   6144                // размер стека задачи обработки событий (разбор JSON, запись в EEPROM, две копии конфигурации блока настроек)
+#define C_TASK_REPORT_STACK   (3456 + C_DIAG_BUF_SIZE)   // размер стека задачи отчётов (сборка JSON и буфер диагностики)
+#define C_TASK_WIFI_STACK     8192                // размер стека задачи поддержания WiFi соединения
+#define C_TASK_WEB_STACK      8192                // размер стека задачи WEB сервера (сборка страниц)
+#define C_TASK_UDP_STACK      4096                // размер стека задачи UDP протокола опроса
+#define C_TASK_MODBUS_STACK   4096                // размер стека задачи сервера Modbus TCP
+#define C_TASK_TRACE_STACK    3072                // размер стека задачи вывода трассировки в порт (DEBUG_LEVEL_PORT)
+#define C_STATIC_TASKS        10                  // блоков управления для постоянных задач (STATIC_ALLOCATION), стеки - по сумме размеров включенных задач
+
+// параметры UDP протокола опроса - кадры фиксированного размера, все поля little-endian
+#define C_UDP_PORT            4210                // UDP порт протокола опроса
+#define C_UDP_MAGIC_REQUEST   0x51544E43          // сигнатура запроса "CNTQ"
+#define C_UDP_MAGIC_RESPONSE  0x52544E43          // сигнатура ответа "CNTR"
+#define C_UDP_VERSION         1                   // версия протокола
+#define C_UDP_HMAC_SIZE       16                  // длина подписи кадра (усеченный HMAC-SHA256)
+#define C_UDP_DISCOVERY_JITTER 100                // разброс задержки ответа на широковещательный запрос в мс (чтобы ответы модулей не совпадали)
+#define C_UDP_RETRY_DELAY     1000                // пауза перед повторным открытием сокета при ошибке в мс
+#define C_UDP_PEERS           8                   // количество адресов, для которых помнится номер последнего подписанного запроса
+#define C_UDP_PENDING         4                   // количество отложенных ответов на широковещательный поиск
+
+// групповые команды и подписанные блоки настроек (см. описание формата рядом с SelectCommand)
+#define C_GROUP_TOPICS        3                   // максимальное количество групповых топиков команд
+#define C_SELECTOR_MARK       '@'                 // первый символ команды с условием выбора модулей
+#define C_PROV_SEQ_KEY        "prov_seq"          // ключ NVS номера последнего примененного блока настроек
+#define C_PROV_SIG_TAIL       ",\"sig\":\""         // подпись - последнее поле блока: ,"sig":"<64 hex>"}
+
+// параметры сервера Modbus TCP (MODBUS_SERVER)
+#define C_MODBUS_PORT         502                 // TCP порт сервера Modbus
+#define C_MODBUS_CLIENTS      4                   // количество одновременно подключенных мастеров
+#define C_MODBUS_IDLE_TIMEOUT 60000               // отключение мастера без запросов в мс
+#define C_MODBUS_ADU_SIZE     260                 // максимальный размер кадра Modbus TCP (MBAP + PDU)
+
+// параметры обновления прошивки по сети (OTA)
+#define C_OTA_BLOCK_SIZE      4096                // размер блока конвейера прием -> запись (равен сектору FLASH)
+#define C_OTA_BLOCKS          4                   // количество блоков конвейера: пока один блок пишется во FLASH, принимаются следующие
+#define C_OTA_BLOCK_TIMEOUT   10000               // ожидание свободного блока (FLASH не успевает) или следующего блока (сеть молчит) в мс
+#define C_OTA_TRIAL_BOOTS     3                   // сколько раз новая прошивка может загрузиться без подтверждения до возврата на прежнюю
+#define C_OTA_CONFIRM_TIME    60000               // новая прошивка подтверждается подключением к MQTT или после этого времени работы в мс
+#define C_OTA_HTTP_TIMEOUT    10000               // тайм-аут соединения и чтения при загрузке образа по ссылке в мс
+#define C_OTA_URL_SIZE        160                 // максимальная длина ссылки на образ
+#define C_OTA_TRIAL_KEY       "ota_boot"          // ключ NVS пробного режима новой прошивки (OtaTrial: раздел и счётчик загрузок)
+#define C_OTA_ROLLBACK_KEY    "ota_rollback"      // ключ NVS признака возврата на прежнюю прошивку (читается прежней прошивкой)
+#define C_TASK_OTA_PRIO       1                   // приоритет задач записи и загрузки образа
+#define C_TASK_OTA_STACK      4096                // размер стека задачи записи образа (SHA256, разбор дельты)
+#define C_TASK_OTA_FETCH_STACK 6144               // размер стека задачи загрузки образа по ссылке (HTTP клиент)
+
+// параметры имитации нагрузки (LOAD_SIMULATION)
+#define C_LOAD_PERIOD         100                 // период циклов нагрузки в мс
+#define C_LOAD_WEB_PAGES      4                   // количество "страниц" собираемых за цикл
+#define C_LOAD_MQTT_BURST     8                   // количество публикаций в MQTT за цикл
+
+// параметры генератора импульсов (PULSE_SIMULATOR)
+#define C_SIM_SEED            0x2545F491          // начальное значение генератора псевдослучайных чисел - одинаковое значение дает одинаковую последовательность
+#define C_SIM_PERIOD_CH1      200                 // средний период импульсов на входе 1 в мс
+#define C_SIM_PERIOD_CH2      330                 // средний период импульсов на входе 2 в мс
+#define C_SIM_JITTER          40                  // разброс периода импульсов +/- в мс
+#define C_SIM_WIDTH           80                  // длительность замыкания входа (импульса) в мс, должна быть больше минимального времени замыкания
+#define C_SIM_BOUNCE_EDGES    3                   // максимальное количество пар фронтов дребезга при замыкании и размыкании
+#define C_SIM_BOUNCE_SPAN     2                   // максимальный интервал между фронтами дребезга в мс
+#define C_SIM_GLITCH_PCT      5                   // доля коротких помех (короче окна подавления дребезга) в %, помехи не должны считаться
+#define C_SIM_FREQ_PERIOD_CH1 20000               // период прямоугольного сигнала на входе 1 в режиме частоты в мкс (50 Гц)
+#define C_SIM_FREQ_PERIOD_CH2 8333                // период прямоугольного сигнала на входе 2 в режиме частоты в мкс (~120 Гц)
+#define C_SIM_FREQ_DUTY       30                  // доля замкнутого состояния в периоде в режиме частоты в %
+#define C_SIM_CLOCK_STEP      5                   // максимальный шаг виртуальных часов фильтров в мс (задержка подсчёта импульса в режиме генератора)
+#define C_SIM_REPORT_DELAY    10000               // период вывода в порт сравнения засчитанных и сгенерированных импульсов в мс
+#define C_TASK_SIM_STACK      2048                // размер стека задачи генератора импульсов
+
+// параметры энергосбережения (POWER_SAVE_MODE)
+#define C_PM_MAX_FREQ_MHZ     240                 // максимальная частота CPU
+#define C_PM_MIN_FREQ_MHZ     80                  // минимальная частота CPU при простое (не ниже 80 МГц при работающем WiFi)
 
 // задержки в формировании MQTT отчета
 #define C_REPORT_DELAY  3600000                   // 1 час между репортами
+#define C_CFG_SLOTS 2                             // количество копий значений счётчиков в NVS (запись идет поочередно, при порче последней берется предыдущая)
+#define C_CFG_NAMESPACE "cntr"                    // пространство NVS для хранения конфигурации
+#define C_CFG_KEY "cfg"                           // ключ блока статических параметров
+#define C_CFG_FORMAT_VERSION 3                    // версия формата хранения (1 - блок EEPROM, 2 - две копии блока EEPROM и блок входов)
+#define C_FLASH_ENDURANCE 100000                  // ресурс сектора FLASH в циклах стирания
+#define C_NVS_FLASH_SIZE 0x5000                   // размер раздела NVS, в котором хранится конфигурация (по таблице разделов default)
+#define C_DIAG_REPORT_DELAY 0                     // период публикации диагностики в топик [STATUS]/diag в сек (0 - выключено, включается командой {"diag":N})
+#define C_DIAG_MIN_PERIOD 5                       // минимальный период публикации диагностики в сек
+// размер буфера диагностического отчёта - по наибольшей длине его частей (все числа максимальной длины)
+#define C_DIAG_BASE_SIZE 864                      // общая часть: память, FLASH, OTA, MQTT, задержки этапов и строка "other"
+#define C_DIAG_INPUT_SIZE 72                      // счётчики помех одного входа
+#define C_DIAG_TASK_SIZE 64                       // одна задача таблицы профилирования (имя до 8 символов) или загрузка одного ядра
+#define C_DIAG_BUF_SIZE (C_DIAG_BASE_SIZE + C_DIAG_INPUT_SIZE * C_INP_CHANNELS + C_DIAG_TASK_SIZE * C_PROF_SLOTS)
 
 // начальные параметры устройства для подключения к WiFi и MQTT
 #ifdef DEBUG_LEVEL_PORT
@@ -125,10 +349,25 @@ extern "C" {
 #define P_MQTT_HOST "192.168.1.1"                 // адрес нашего MQTT сервера
 #define P_MQTT_PORT 1883                          // порт нашего MQTT сервера
 #endif
+#ifndef P_MQTT_BACKUP
+#define P_MQTT_BACKUP ""                          // резервные MQTT серверы "host[:port],host[:port]" (пустая строка - без резервных)
+#endif
+#ifndef P_NTP_SERVER
+#define P_NTP_SERVER "pool.ntp.org"               // сервер SNTP для привязки меток времени импульсов к реальному времени
+#endif
+#ifndef P_UDP_KEY
+#define P_UDP_KEY ""                              // ключ HMAC для UDP протокола опроса (пустая строка - запросы без подписи)
+#endif
+#ifndef P_PROV_KEY
+#define P_PROV_KEY ""                             // ключ HMAC подписанных блоков настроек (пустая строка - блоки настроек не принимаются)
+#endif
+#ifndef P_GROUP_TOPICS
+#define P_GROUP_TOPICS ""                         // групповые топики команд "topic,topic" (пустая строка - только свой топик [SET])
+#endif
 #define DEF_WIFI_CHANNEL  13                      // канал WiFi по умолчанию
 
 #define C_MAX_WIFI_FAILED_TRYS 3                  // количество попыток повтора поднятия AP точки перед выключением WIFI
-#define C_MAX_MQTT_FAILED_TRYS 100                // количество попыток соединения с MQTT сервером перед тем как начать поднимать AP точку
+#define C_MAX_MQTT_FAILED_TRYS 100                // количество циклов попыток соединения со всеми MQTT серверами перед переходом в работу без MQTT
 
 // определяем топики для работы устройства по MQTT
 #define P_LWT_TOPIC    "diy/wtr_cntr01/LWT"         // топик публикации доступности устройства
@@ -144,20 +383,91 @@ extern "C" {
 
 // --- имена ключей ---
 #define jk_CLEAR          "clear"                 // ключ описания команды очистки (счётчиков или конфигурации)
-#define jk_SET_VALUE_01   "set_value_1"           // ключ описания установки значения счётчика 1
-#define jk_SET_VALUE_02   "set_value_2"           // ключ описания установки значения счётчика 2
-#define jk_COUNTER_01     "cnt01"                 // ключ описания значения счётчика 1
-#define jk_COUNTER_02     "cnt02"                 // ключ описания значения счётчика 2
+// ключи, относящиеся к входу, образуются из префикса и номера входа: команды - "set_value_1", состояние - "cnt01"
+#define jk_SET_VALUE      "set_value_"            // ключ описания установки значения счётчика N
+#define jk_COUNTER        "cnt"                   // ключ описания значения счётчика NN
 #define jk_COUNTER_RB     "cnt_reboot"            // ключ описания значения счётчика перезагрузок
 #define jk_IP             "ip"                    // ключ описания ip адреса
+#define jk_PULSE_AGE      "pulse_age"             // ключ описания возраста самого свежего засчитанного импульса в мс (от начала замыкания)
+#define jk_FLOW           "flow"                  // ключ описания расхода по входу NN в л/мин
+#define jk_DIAG           "diag"                  // ключ установки периода публикации диагностики
+#define jk_MODE           "mode_"                 // ключ установки режима входа N (count/freq)
+#define jk_GATE           "gate_"                 // ключ установки времени усреднения частоты по входу N в мс
+#define jk_FREQ           "freq"                  // ключ описания частоты по входу NN в Гц
+#define jk_DUTY           "duty"                  // ключ описания доли замкнутого состояния по входу NN в %
+#define jk_OTA            "ota"                   // ключ команды обновления прошивки (ссылка на образ или дельту)
+#define jk_SHA256         "sha256"                // ключ ожидаемой SHA256 полученной прошивки (hex)
+#define jk_TRACE          "trace"                 // ключ управления трассировкой (маска категорий или "dump" - выгрузка журнала)
+#define jk_PROVISION      "provision"             // ключ подписанного блока настроек (объект с полями как на странице конфигурации)
+#define jk_SEQ            "seq"                   // номер блока настроек (должен расти - повтор старого блока не принимается)
+#define jk_SIG            "sig"                   // подпись обновления прошивки HMAC-SHA256 (hex)
 
 // --- значения ключей и команд ---
 #define jv_ONLINE         "online"                // 
 #define jv_OFFLINE        "offline"               //
-#define jv_COUNTER_01     "cnt01"                 //
-#define jv_COUNTER_02     "cnt02"                 //
+#define jv_COUNTER        jk_COUNTER              // значение "cntNN" - сброс счётчика NN
 #define jv_COUNTER_RB     "reboot"                //
 #define jv_CONFIG         "config"                //
+#define jk_FILTER         "filter_"               // ключ установки параметров фильтра входа N (объект с полями low/high/hyst в мс)
+#define jk_LOW            "low"                   // минимальное время замыкания входа
+#define jk_HIGH           "high"                  // минимальное время размыкания входа
+#define jk_HYST           "hyst"                  // гистерезис фильтра входа
+#define jv_MODE_COUNT     "count"                 // режим входа - подсчёт импульсов
+#define jv_MODE_FREQ      "freq"                  // режим входа - измерение частоты
+#define jv_DUMP           "dump"                  // выгрузка журнала трассировки в топик [STATUS]/trace
+
+// --- таблица ключей ---
+// Команды MQTT и пакета, поля страницы конфигурации и блока настроек, параметры /get_data и /set_data разбираются по одной
+// таблице: номер ключа дает совершенная хеш-функция (FNV-1a с подобранным при компиляции начальным значением - без коллизий
+// в таблице из C_KEY_SLOTS ячеек) и одно сравнение строк, дальше - switch по номеру. Порядок ключей в команде значения не имеет.
+// Номер входа в имени ключа заменен на '#': "set_value_#" - это set_value_1, set_value_2 ... Новый ключ - строка в KeyId_t
+// и c_KeyNames и case в нужном обработчике; если подобрать хеш без коллизий не удается - сборка останавливается (static_assert).
+// Функции подбора написаны в стиле C++11 (constexpr - одно выражение) - так собирает фреймворк.
+enum KeyId_t : uint8_t {
+  KEY_NONE,                                       // неизвестный ключ (пустая ячейка таблицы)
+  KEY_REPORT, KEY_REBOOT, KEY_RESET, KEY_CLEAR, KEY_DIAG, KEY_TRACE, KEY_OTA, KEY_SHA256, KEY_PROVISION,     // команды MQTT
+  KEY_SET_VALUE, KEY_MODE, KEY_GATE, KEY_FILTER,  // команды входа N
+  KEY_COUNTER, KEY_CONFIG,                        // значения команды clear ("cntNN", "config"; "reboot" - KEY_REBOOT)
+  KEY_WIFI_SSID, KEY_WIFI_PWD, KEY_MQTT_HOST, KEY_MQTT_PORT, KEY_MQTT_BACKUP, KEY_MQTT_USER, KEY_MQTT_PWD,   // поля страницы конфигурации
+  KEY_COMMAND_TOPIC, KEY_REPORT_TOPIC, KEY_LWT_TOPIC, KEY_GROUP_TOPICS, KEY_TAGS, KEY_DEVICE_ID,
+  KEY_CH_MODE, KEY_CH_GATE, KEY_CH_LOW, KEY_CH_HIGH, KEY_CH_HYST,               // поля входа N на странице конфигурации
+  KEY_CNTR, KEY_VALUE, KEY_FLOW, KEY_FREQ, KEY_DUTY,                            // параметры /get_data и /set_data
+  KEY_COUNT
+};
+constexpr const char* c_KeyNames[] = {"",
+  jc_REPORT, jc_REBOOT, jc_RESET, jk_CLEAR, jk_DIAG, jk_TRACE, jk_OTA, jk_SHA256, jk_PROVISION,
+  jk_SET_VALUE "#", jk_MODE "#", jk_GATE "#", jk_FILTER "#",
+  jv_COUNTER "#", jv_CONFIG,
+  "wn", "wp", "mh", "ms", "mb", "mu", "mp",
+  "ts", "tr", "tl", "gt", "dt", "di",
+  "c#m", "c#g", "c#l", "c#h", "c#y",
+  "cntr", "value", jk_FLOW, jk_FREQ, jk_DUTY
+};
+static_assert(sizeof(c_KeyNames) / sizeof(c_KeyNames[0]) == KEY_COUNT, "c_KeyNames must follow KeyId_t");
+
+constexpr uint32_t KeyHashStep(uint32_t Hash, char Char) { return (Hash ^ (uint8_t)Char) * 16777619U; }                      // шаг FNV-1a
+constexpr uint32_t KeyHash(const char *Name, uint32_t Hash) { return *Name ? KeyHash(Name + 1, KeyHashStep(Hash, *Name)) : Hash; }
+constexpr uint32_t KeyHashBasis(uint32_t Seed) { return 2166136261U ^ (Seed * 0x9E3779B9U); }                                // начальное значение варианта Seed
+constexpr uint8_t  KeySlot(uint32_t Hash) { return (Hash ^ (Hash >> 16)) & (C_KEY_SLOTS - 1); }
+constexpr uint8_t  KeySlotOf(uint8_t Key, uint32_t Seed) { return KeySlot(KeyHash(c_KeyNames[Key], KeyHashBasis(Seed))); }
+constexpr bool KeyDiffers(uint8_t Key, uint8_t Other, uint32_t Seed) { // ячейка ключа Key не совпадает с ячейками ключей Other и следующих
+  return (Other >= KEY_COUNT) or ((KeySlotOf(Key, Seed) != KeySlotOf(Other, Seed)) and KeyDiffers(Key, Other + 1, Seed));
+}
+constexpr bool KeysUnique(uint8_t Key, uint32_t Seed) { return (Key >= KEY_COUNT) or (KeyDiffers(Key, Key + 1, Seed) and KeysUnique(Key + 1, Seed)); }
+constexpr uint32_t KeySeedSearch(uint32_t From, uint32_t To);
+constexpr uint32_t KeySeedNext(uint32_t Found, uint32_t From, uint32_t To) { return (Found < C_KEY_SEEDS) ? Found : KeySeedSearch(From, To); }
+constexpr uint32_t KeySeedSearch(uint32_t From, uint32_t To) { // первый вариант без коллизий в From..To (деление пополам - рекурсия неглубокая)
+  return (From == To) ? (KeysUnique(KEY_NONE + 1, From) ? From : C_KEY_SEEDS) :
+                        KeySeedNext(KeySeedSearch(From, (From + To) / 2), (From + To) / 2 + 1, To);
+}
+constexpr uint32_t c_KeySeed = KeySeedSearch(0, C_KEY_SEEDS - 1);
+static_assert(c_KeySeed < C_KEY_SEEDS, "no collision-free key hash - increase C_KEY_SLOTS or C_KEY_SEEDS");
+constexpr uint8_t KeyAtSlot(uint16_t Slot, uint8_t Key) { return (Key >= KEY_COUNT) ? KEY_NONE : (KeySlotOf(Key, c_KeySeed) == Slot) ? Key : KeyAtSlot(Slot, Key + 1); }
+template <uint16_t... Slot> struct KeySlotTable { static constexpr uint8_t key[sizeof...(Slot)] = {KeyAtSlot(Slot, KEY_NONE + 1)...}; };
+template <uint16_t... Slot> constexpr uint8_t KeySlotTable<Slot...>::key[sizeof...(Slot)];
+template <uint16_t N, uint16_t... Slot> struct KeySlotBuild : KeySlotBuild<N - 1, N - 1, Slot...> {};
+template <uint16_t... Slot> struct KeySlotBuild<0, Slot...> : KeySlotTable<Slot...> {};
+typedef KeySlotBuild<C_KEY_SLOTS> KeySlots;       // KeySlots::key[ячейка] - номер ключа (таблица во флеш)
 
 // тип описывающий режим работы WIFI - работа с самим WiFi и MQTT 
 enum WiFi_mode_t : uint8_t {
@@ -173,15 +483,13 @@ enum WiFi_mode_t : uint8_t {
 // перечислимый тип описания счётчиков
 enum Counters_t : uint8_t {
   CN_REBOOT = 0,                                  // счётчик перезагрузки
-  CN_CNT01,                                       // счётчик 01
-  CN_CNT02                                        // счётчик 02
+  CN_CNT01                                        // счётчик входа 1, счётчик входа N - CN_CNT01 + N - 1
 };
 
-// структура данных хранимых в EEPROM
+// структура данных конфигурации (хранится записями в NVS, см. ConfigRecord_t)
 struct GlobalParams {
 // параметры режима работы усилителя
-  uint32_t        counter_01;                     // значение счётчика №1
-  uint32_t        counter_02;                     // значение счётчика №2
+  uint32_t        counter[C_INP_CHANNELS];        // значения счётчиков по входам
   uint16_t        counter_reboot;                 // значение счётчика перезагрузок
 // параметры подключения к MQTT и WiFi  
   char            wifi_ssid[40];                  // строка SSID сети WiFi
@@ -190,38 +498,570 @@ struct GlobalParams {
   char            mqtt_pwd[40];                   // пароль к MQTT серверу
   char            mqtt_host_s[80];                // адрес сервера MQTT
   uint16_t        mqtt_port;                      // порт подключения к MQTT серверу
+  char            mqtt_backup[120];               // резервные MQTT серверы через запятую: host[:port] (порт по умолчанию - mqtt_port)
 // параметры очередей MQTT
   char            command_topic[80];              // топик получения команд
   char            report_topic[80];               // топик отправки текущего состояния устройства
   char            lwt_topic[80];                  // топик доступности устройства
-// контрольная сумма блока для EEPROM
-  uint16_t        simple_crc16;                   // контрольная сумма блока параметров
+// параметры групповых команд
+  char            group_topics[120];              // групповые топики команд через запятую (пустая строка - только свой топик)
+  char            tags[40];                       // метки модуля через запятую - для выбора модулей групповой командой
+  uint16_t        device_id;                      // номер модуля для выбора по диапазону номеров (0 - не задан)
+};
+
+// --- формат хранения конфигурации в NVS (версия 3) ---
+// Статические параметры (подключение, топики, параметры входов) хранятся блоком C_CFG_KEY: заголовок и последовательность записей
+// [номер][длина][данные]. Строки пишутся без хвоста из нулей, записи с неизвестными номерами пропускаются, отсутствующие в блоке
+// параметры остаются по умолчанию - поэтому новые параметры добавляются новыми номерами записей без сброса конфигурации.
+// Часто меняющиеся значения счётчиков хранятся отдельно, в C_CFG_SLOTS копиях "cnt0".."cntN" - запись счётчиков не трогает статический блок
+enum ConfigRecord_t : uint8_t {
+  CR_END = 0,                                     // конец записей (не пишется, зарезервирован)
+  CR_WIFI_SSID,                                   // SSID сети WiFi
+  CR_WIFI_PWD,                                    // пароль к WiFi сети
+  CR_MQTT_USER,                                   // имя пользователя MQTT сервера
+  CR_MQTT_PWD,                                    // пароль к MQTT серверу
+  CR_MQTT_HOST,                                   // адрес сервера MQTT
+  CR_MQTT_PORT,                                   // порт MQTT сервера
+  CR_COMMAND_TOPIC,                               // топик получения команд
+  CR_REPORT_TOPIC,                                // топик отправки состояния
+  CR_LWT_TOPIC,                                   // топик доступности
+  CR_CHANNEL,                                     // параметры входа (ChannelRecord), по записи на вход
+  CR_MQTT_BACKUP,                                 // резервные MQTT серверы
+  CR_GROUP_TOPICS,                                // групповые топики команд
+  CR_TAGS,                                        // метки модуля
+  CR_DEVICE_ID,                                   // номер модуля
+  CR_LAST                                         // следующий свободный номер записи (не пишется)
+};
+
+// что нужно сделать, чтобы изменение параметра вступило в силу без перезагрузки (битовые флаги, изменения нескольких полей объединяются)
+enum ConfigImpact_t : uint8_t {
+  CI_NONE  = 0,                                   // применяется сразу (топик отчётов, параметры входов)
+  CI_TOPIC = 1,                                   // переподписка на топик команд и публикация online в новый топик LWT
+  CI_MQTT  = 2,                                   // переподключение к MQTT серверу
+  CI_WIFI  = 4                                    // переподключение к WiFi сети (и затем к MQTT)
+};
+
+struct ConfigField {                              // описание записи, хранящей поле GlobalParams
+  uint8_t         id;                             // номер записи ConfigRecord_t
+  uint16_t        offset;                         // смещение поля в GlobalParams
+  uint8_t         size;                           // размер поля
+  bool            text;                           // строка - хранится без завершающих нулей
+  uint8_t         impact;                         // применение изменения (ConfigImpact_t)
+};
+
+struct StoredCounters {                           // последние сохраненные значения счётчиков (для сравнения перед записью)
+  uint32_t        counter[C_INP_CHANNELS];
+  uint16_t        counter_reboot;
+};
+
+#define C_CFG_STORE_SIZE (sizeof(ConfigHeader) + sizeof(GlobalParams) + 2 * CR_LAST + (sizeof(ChannelRecord) + 2) * C_INP_CHANNELS)   // максимальный размер статического блока
+#define C_CNT_STORE_SIZE (CounterSlotSize(C_INP_CHANNELS))                                                                                // размер копии счётчиков
+
+enum ConfigSource_t : uint8_t {                   // откуда загружена конфигурация при старте
+  CS_SLOT,                                        // последняя записанная копия
+  CS_BACKUP,                                      // последняя запись испорчена - загружена предыдущая копия
+  CS_LEGACY,                                      // перенесена из образа EEPROM прежней версии прошивки
+  CS_DEFAULTS                                     // ни одной целой копии - значения по умолчанию
+};
+
+enum ConfigPart_t : uint8_t {                     // части конфигурации в NVS (битовые флаги) - загружаются и восстанавливаются независимо
+  CP_NONE     = 0,
+  CP_STATIC   = 1,                                // статический блок C_CFG_KEY
+  CP_COUNTERS = 2,                                // значения счётчиков "cnt0".."cntN"
+  CP_ALL      = 3
+};
+
+// --- обновление прошивки по сети ---
+// Образ принимается блоками C_OTA_BLOCK_SIZE: принимающая задача (WEB сервер или загрузка по ссылке) заполняет свободный блок и передает
+// его задаче записи, которая считает SHA256 и пишет блок в неактивный раздел OTA - прием следующих блоков идет параллельно с записью.
+// Вместо полного образа можно передать дельту относительно работающей прошивки (tools/ota_delta.py), формат и разбор - в ota_stream.h.
+enum OtaState_t : uint8_t {
+  OS_IDLE,                                        // обновления не было
+  OS_RUNNING,                                     // идет прием и запись образа
+  OS_DONE,                                        // образ записан и проверен, ждет перезагрузки
+  OS_FAILED                                       // обновление прервано (причина в OtaError_t)
+};
+
+struct OtaBlockRef {                              // блок конвейера, переданный задаче записи
+  uint8_t         index;                          // номер блока в ota_Pool
+  uint16_t        length;                         // заполнено байт (0 - конец образа)
+};
+
+struct OtaSession {                               // состояние текущего (или последнего) обновления
+  OtaState_t      state;
+  OtaError_t      error;
+  bool            delta;                          // принимается дельта
+  bool            check_hash;                     // задана ожидаемая SHA256
+  uint8_t         expected_sha256[32];
+  uint32_t        received;                       // принято байт (размер передачи)
+  uint32_t        written;                        // записано байт прошивки
+  uint32_t        start_ms;                       // начало приема
+  uint32_t        time_ms;                        // длительность обновления до проверки образа
+  uint32_t        wait_ms;                        // сколько прием ждал свободного блока (FLASH медленнее сети)
+  char            source[8];                      // "http" или "mqtt"
+};
+
+// параметры входов (хранятся записями CR_CHANNEL статического блока)
+struct ChannelParams {
+  uint8_t         mode[C_INP_CHANNELS];           // режим входа ChannelMode_t
+  uint16_t        gate_ms[C_INP_CHANNELS];        // время усреднения частоты в мс
+  uint16_t        min_low_ms[C_INP_CHANNELS];     // минимальное время замыкания для засчитывания импульса в мс
+  uint16_t        min_high_ms[C_INP_CHANNELS];    // минимальное время размыкания перед следующим импульсом в мс
+  uint16_t        hyst_ms[C_INP_CHANNELS];        // гистерезис: изменение уровня короче этого времени не прерывает отсчет (дребезг) в мс
+};
+
+// ключи JSON состояния входа - строятся один раз при старте, чтобы при сборке отчёта не форматировать строки
+struct ChannelKeys {
+  char            counter[8];                     // "cnt01" - значение счётчика
+  char            flow[8];                        // "flow01"
+  char            freq[8];                        // "freq01"
+  char            duty[8];                        // "duty01"
+};
+
+// запись журнала импульсов: момент начала замыкания по монотонным часам esp_timer в мкс (48 бит - около 8.9 лет работы)
+struct PulseLogEntry {
+  uint32_t        time_lo;                        // младшие 32 бита метки времени
+  uint16_t        time_hi;                        // старшие 16 бит метки времени
+  uint8_t         channel;                        // индекс входа (0 - вход 1)
+  uint8_t         reserved;
+};
+
+// заголовок двоичной выгрузки журнала импульсов (/pulses?format=bin), за ним идут count записей PulseLogEntry, все поля little-endian
+struct __attribute__((packed)) PulseLogHeader {
+  uint32_t        magic;                          // сигнатура "PLOG"
+  uint8_t         version;                        // версия формата (C_PULSE_LOG_VERSION)
+  uint8_t         entry_size;                     // размер записи
+  uint8_t         channels;                       // количество входов
+  uint8_t         synced;                         // 1 - реальное время синхронизировано по SNTP и offset_us действителен
+  uint32_t        first_seq;                      // порядковый номер первой записи в выгрузке
+  uint32_t        count;                          // количество записей в выгрузке
+  uint32_t        next_seq;                       // номер следующей записи журнала (для запроса ?since= при следующей выгрузке)
+  int64_t         offset_us;                      // реальное время (мкс от 01.01.1970 UTC) = метка времени записи + offset_us
+};
+
+// журнал трассировки: события фиксированного формата вместо отладочного вывода в порт. Номер события - категория (старшие 4 бита)
+// и номер события в категории. Категории включаются маской во время работы (команда {"trace":маска} или /trace?mask=маска)
+enum TraceCategory_t : uint8_t {
+  TC_SYSTEM,                                      // загрузка, перезагрузка, питание
+  TC_WIFI,                                        // состояние WiFi
+  TC_MQTT,                                        // состояние MQTT и публикации
+  TC_COMMAND,                                     // команды MQTT
+  TC_CONFIG,                                      // запись конфигурации во FLASH
+  TC_INPUT,                                       // режимы и фильтры входов
+  TC_PULSE,                                       // каждый импульс и помеха (по умолчанию выключена)
+  TC_WEB,                                         // запросы WEB страниц
+  TC_OTA,                                         // обновление прошивки
+  TC_COUNT
+};
+#define TRACE_ID(Category, N) (((Category) << 4) | (N))
+#define C_TRACE_DEFAULT_MASK (((1UL << TC_COUNT) - 1) & ~(1UL << TC_PULSE))   // маска категорий после загрузки
+
+enum TraceEvent_t : uint8_t {                     // события трассировки и смысл аргументов arg0/arg1
+  TE_BOOT = TRACE_ID(TC_SYSTEM, 0),               // загрузка: причина сброса, счётчик перезагрузок
+  TE_REBOOT,                                      // перезагрузка по команде: -, время работы в с
+  TE_POWER_CUT,                                   // пропадание питания
+  TE_POWER_SAVED,                                 // счётчики сохранены при пропадании питания: -, длительность записи в мкс
+  TE_TRACE_MASK,                                  // изменена маска трассировки: -, новая маска
+  TE_DIAG_OVERFLOW,                               // диагностика не поместилась в буфер и не отдана: 1 - для MQTT (0 - страница /diag), размер буфера
+  TE_WIFI_CONNECT = TRACE_ID(TC_WIFI, 0),         // подключение к WiFi: номер попытки
+  TE_WIFI_UP,                                     // WiFi подключен: -, IP адрес
+  TE_WIFI_FAIL,                                   // WiFi не подключился за C_WIFI_CONNECT_TIMEOUT
+  TE_WIFI_LOST,                                   // соединение WiFi потеряно
+  TE_WIFI_OFF,                                    // WiFi выключен после C_MAX_WIFI_FAILED_TRYS попыток
+  TE_WIFI_AP,                                     // точка доступа: 1 - поднята, IP адрес
+  TE_WIFI_AP_CLIENTS,                             // изменилось количество клиентов точки доступа: количество
+  TE_MQTT_CONNECT = TRACE_ID(TC_MQTT, 0),         // подключение к MQTT: номер неудачной попытки, номер сервера
+  TE_MQTT_UP,                                     // подключились к MQTT: номер пакета подписки
+  TE_MQTT_DOWN,                                   // отключились от MQTT: причина (AsyncMqttClientDisconnectReason)
+  TE_MQTT_TIMEOUT,                                // MQTT не подключился за C_MQTT_CONNECT_TIMEOUT: номер неудачной попытки, номер сервера
+  TE_MQTT_LOST,                                   // соединение MQTT потеряно в рабочем режиме: номер сервера
+  TE_MQTT_SUBSCRIBED,                             // подписка подтверждена: номер пакета, QoS
+  TE_MQTT_PUBLISHED,                              // публикация подтверждена: номер пакета
+  TE_MQTT_PUBLISH_FAIL,                           // публикация не отправлена: -, длина
+  TE_MQTT_REPORT,                                 // опубликован отчёт в [STATUS]: длина, задержка от команды в мкс (0 - отчёт не по команде)
+  TE_MQTT_BROKER,                                 // подключились к другому серверу: номер сервера, перерыв связи в мс
+  TE_MQTT_DNS,                                    // адрес сервера получен от DNS: номер сервера, IP адрес
+  TE_MQTT_DNS_FAIL,                               // DNS не ответил: номер сервера, 1 - используется прежний адрес из кэша
+  TE_MQTT_FAILBACK,                               // более приоритетный сервер снова доступен: его номер, номер текущего сервера
+  TE_MQTT_REPORT_OVERFLOW,                        // отчёт в [STATUS] не поместился и не опубликован: 1 - переполнен документ JSON, нужная длина текста
+  TE_CMD_RECEIVED = TRACE_ID(TC_COMMAND, 0),      // команда принята в очередь: длина
+  TE_CMD_DROPPED,                                 // команда отброшена: длина, 1 - очередь заполнена
+  TE_CMD_PARSE_ERROR,                             // команда не разобрана как JSON: код ошибки DeserializationError
+  TE_CMD_DONE,                                    // команда выполнена: -, время от получения в мкс
+  TE_CMD_SET_COUNTER,                             // установка счётчика: номер (0 - перезагрузок), значение
+  TE_CMD_BAD_VALUE,                               // значение ключа команды не принято: номер ключа (KeyId_t), номер входа
+  TE_CMD_BATCH,                                   // выполнен пакет команд: количество команд, 1 - изменения применены
+  TE_CMD_SKIPPED,                                 // команда с условием выбора адресована другим модулям: длина
+  TE_CMD_PROVISION,                               // блок настроек: результат (ProvisionResult_t), номер блока
+  TE_CMD_NOT_ALLOWED,                             // команда из группового топика не выполнена - в ней есть не разрешенные ключи: длина
+  TE_CFG_STATIC_SAVED = TRACE_ID(TC_CONFIG, 0),   // запись статического блока: 1 - успешно, длина
+  TE_CFG_COUNTERS_SAVED,                          // запись копии счётчиков: 1 - успешно, номер записи
+  TE_CFG_FIELD,                                   // параметр изменен на WEB странице или блоком настроек: поле (ConfigRecord_t), номер входа
+  TE_CFG_DEFAULTS,                                // сброс конфигурации к начальной
+  TE_CFG_APPLY,                                   // изменения применяются без перезагрузки: что нужно сделать (ConfigImpact_t), состояние WiFi
+  TE_INP_MODE = TRACE_ID(TC_INPUT, 0),            // режим входа: номер входа, режим | время усреднения << 16
+  TE_INP_FILTER,                                  // фильтр входа: номер входа, мин. замыкание | мин. размыкание << 16 (в мс)
+  TE_INP_HYST,                                    // гистерезис фильтра входа: номер входа, гистерезис в мс
+  TE_INP_NO_CAPTURE,                              // канал таймера захвата не включен: номер входа
+  TE_PULSE = TRACE_ID(TC_PULSE, 0),               // засчитан импульс: номер входа, задержка подсчёта в мкс
+  TE_PULSE_GLITCH,                                // отброшена помеха: номер входа
+  TE_EDGE_OVERFLOW,                               // фронт не поместился в буфер фильтра: номер входа
+  TE_FREQ_GATE,                                   // окончено окно измерения частоты: номер входа, частота в мГц
+  TE_WEB_PAGE = TRACE_ID(TC_WEB, 0),              // запрос WEB страницы: страница (WebPage_t)
+  TE_OTA_BEGIN = TRACE_ID(TC_OTA, 0),             // начато обновление: 1 - по ссылке, адрес раздела
+  TE_OTA_END,                                     // обновление закончено: ошибка (OtaError_t), принято байт
+  TE_OTA_NOT_STARTED,                             // обновление не начато: ошибка (OtaError_t)
+  TE_OTA_ROLLBACK,                                // возврат на прежнюю прошивку
+  TE_OTA_CONFIRMED                                // новая прошивка подтверждена: загрузок без подтверждения
+};
+
+enum WebPage_t : uint8_t {                        // страницы WEB сервера для события TE_WEB_PAGE
+  WP_INDEX, WP_CONFIG, WP_APPLY, WP_REBOOT, WP_ALIVE, WP_GET_DATA, WP_SET_DATA, WP_METRICS, WP_DIAG, WP_PULSES, WP_TRACE, WP_UPDATE, WP_BATCH, WP_NOT_FOUND
+};
+
+// запись журнала трассировки. Пока запись заполняется, в seq стоит номер, который для этой ячейки кольца не бывает действительным
+struct TraceEntry {
+  uint32_t        seq;                            // порядковый номер события с момента загрузки
+  uint32_t        time_us;                        // момент события - младшие 32 бита micros()
+  uint8_t         id;                             // событие TraceEvent_t
+  uint8_t         core;                           // ядро, на котором возникло событие
+  uint16_t        arg0;                           // аргументы события
+  uint32_t        arg1;
+};
+
+// заголовок двоичной выгрузки журнала трассировки (/trace?format=bin и топик [STATUS]/trace), за ним идут count записей TraceEntry
+struct __attribute__((packed)) TraceHeader {
+  uint32_t        magic;                          // сигнатура "CTRC"
+  uint8_t         version;                        // версия формата (C_TRACE_VERSION)
+  uint8_t         entry_size;                     // размер записи
+  uint16_t        reserved;
+  uint32_t        mask;                           // маска включенных категорий
+  uint32_t        first_seq;                      // номер первой записи в выгрузке
+  uint32_t        count;                          // количество записей в выгрузке (по HTTP записей может прийти меньше - см. seq записей)
+  uint32_t        next_seq;                       // номер следующего события (для запроса ?since= при следующей выгрузке)
+  uint32_t        now_us;                         // младшие 32 бита micros() в момент выгрузки - для привязки time_us записей
 };
 
 // объявляем текущие переменные состояния
-bool s_EnableEEPROM = false;                    // глобальная переменная разрешения работы с EEPROM
+bool s_EnableEEPROM = false;                    // глобальная переменная разрешения работы с хранилищем конфигурации (NVS)
 WiFi_mode_t s_CurrentWIFIMode = WF_UNKNOWN;     // текущий режим работы WiFI
 uint8_t count_GetWiFiConfig = 0;                // счётчик повторов попыток соединения c WIFI точкой
-uint8_t count_GetMQTTConfig = 0;                // счётчик повторов попыток соединения с MQTT сервером
+uint8_t count_GetMQTTConfig = 0;                // счётчик циклов попыток соединения с MQTT серверами (цикл - неудача на каждом сервере списка)
+uint8_t mqtt_CycleFailed = 0;                   // маска серверов, к которым не подключились в текущем цикле попыток
 
 // временные моменты наступления контрольных событий в миллисекундах 
-uint32_t tm_LastFireInp01 = 0;                  // момент сработки входа №1
-uint32_t tm_LastFireInp02 = 0;                  // момент сработки входа №2
-uint32_t tm_LastBlink = 0;                      // момент последнего срабатывания переключения мигания
+uint32_t tm_LastButtonEdge = 0;                 // момент последнего изменения состояния кнопок
 uint32_t tm_LastReportToMQTT = 0;               // момент последнего отчета по MQTT
 
 // общие флаги программы - команды и изменения 
-bool f_Blinker = false;                         // флаг "мигания" - переключается с задержкой C_BLINKER_DELAY
 bool f_WEB_Server_Enable = false;               // флаг разрешения работы встроенного WEB сервера
 bool f_Has_WEB_Server_Connect = false;          // флаг обнаружения соединения с WEB страницей встроенного WEB сервера
-bool f_HasMQTTCommand = false;                  // флаг наличия команды по MQTT
 bool f_Has_Report = false;                      // флаг необходимости вывода отчета
-bool f_FireInp01 = false;                       // флаг не обработанного прерывания по входу 01
-bool f_FireInp02 = false;                       // флаг не обработанного прерывания по входу 02
 bool f_FireCutOff = false;                      // флаг сработки прерывания у сенсора пропажи питания
 
+// гистограмма задержек для статистики (границы корзин задаются внешним массивом)
+struct LatencyHistogram {
+  const uint32_t  *bounds_us;                     // верхние границы корзин в мкс (C_LAT_BUCKETS-1 значений, последняя корзина +Inf)
+  uint32_t        buckets[C_LAT_BUCKETS];         // количество попаданий в каждую корзину (не накопительно)
+  uint32_t        count;                          // общее количество измерений
+  uint64_t        sum_us;                         // сумма всех измерений в мкс
+};
+
+// границы корзин задержки подсчёта импульса (от окончания минимального времени замыкания) в мкс
+const uint32_t c_IsrToCountBounds_us[C_LAT_BUCKETS-1] = {500, 1000, 2000, 5000, 10000, 25000, 100000};
+// границы корзин задержки обработки команд MQTT в мкс
+const uint32_t c_CommandBounds_us[C_LAT_BUCKETS-1] = {1000, 2000, 5000, 10000, 20000, 50000, 100000};
+// границы корзин возраста значения счётчика в отчёте в мкс (от 10 мс до часа - период отчётов C_REPORT_DELAY)
+const uint32_t c_FreshnessBounds_us[C_LAT_BUCKETS-1] = {10000, 100000, 1000000, 10000000, 60000000, 600000000, 3600000000};
+// границы корзин перерыва связи с MQTT (от потери соединения до подключения к тому же или резервному серверу) в мкс
+const uint32_t c_OutageBounds_us[C_LAT_BUCKETS-1] = {250000, 500000, 1000000, 2000000, 5000000, 10000000, 30000000};
+
+enum OutageCause_t : uint8_t {                    // причина перерыва связи с MQTT (для гистограммы cntr_mqtt_outage_seconds)
+  OC_LOST,                                        // потеря соединения с сервером или WiFi
+  OC_FAILBACK,                                    // возврат на более приоритетный сервер
+  OC_BOOT,                                        // от загрузки до первого подключения (так же - перерыв при перезагрузке)
+  OC_CONFIG_TOPIC,                                // изменен топик команд: от применения до подтверждения подписки на новый топик
+  OC_CONFIG_MQTT,                                 // изменены параметры сервера: переподключение к MQTT
+  OC_CONFIG_WIFI,                                 // изменены параметры WiFi: переподключение к сети
+  OC_COUNT
+};
+const char *c_OutageCauses[OC_COUNT] = {"lost", "failback", "boot", "config_topic", "config_mqtt", "config_wifi"};
+
+// MQTT сервер из списка: основной (mqtt_host_s) и резервные (mqtt_backup) в порядке приоритета. Подключение идет к первому
+// исправному серверу, неудачи увеличивают паузу перед повтором и снижают оценку исправности. Адрес сервера кэшируется на C_DNS_TTL.
+struct MqttBroker {
+  char            host[80];                       // имя или IP адрес сервера
+  uint16_t        port;                           // порт сервера
+  bool            literal;                        // в host записан IP адрес - DNS не нужен
+  bool            resolved;                       // в ip есть адрес (возможно устаревший)
+  IPAddress       ip;                             // адрес сервера
+  uint32_t        tm_resolved;                    // момент получения адреса от DNS
+  uint32_t        tm_retry;                       // момент, раньше которого сервер не выбирается (пауза после неудачи)
+  uint8_t         score;                          // оценка исправности 0..100: неудача уменьшает вдвое, успех приближает к 100
+  uint8_t         failures;                       // неудачных подключений подряд
+  uint32_t        connects;                       // успешных подключений
+  uint32_t        errors;                         // неудачных подключений
+};
+
+// команда MQTT в очереди на обработку - обработчик сообщений MQTT только копирует ее и не ждет задачу обработки событий
+struct MQTTCommand {
+  uint32_t        received_us;                    // момент получения команды в мкс
+  bool            reply;                          // пакет получен через WEB (/batch) - результат ждет WEB сервер, а не топик [STATUS]/result
+  uint32_t        batch_id;                       // номер пакета WEB - результат с другим номером WEB сервер отбрасывает
+  bool            group;                          // команда получена из группового топика - выполняются только report, diag, trace и блок настроек
+  char            topic[sizeof(GlobalParams::command_topic)];  // топик, из которого получена команда (входит в подпись блока настроек)
+  char            payload[C_MQTT_CMD_SIZE];       // текст команды (с завершающим нулем)
+};
+
+// пакет команд: все команды сначала проверяются и применяются к копии параметров, при отсутствии ошибок копия применяется
+// целиком - одна запись конфигурации и один отчёт на весь пакет. При ошибке в любой команде не применяется ни одна.
+enum BatchResult_t : uint8_t {                    // результат проверки команды пакета
+  BR_OK,                                          // команда принята
+  BR_UNKNOWN,                                     // неизвестный ключ или элемент пакета - не объект
+  BR_BAD_VALUE,                                   // недопустимое значение
+  BR_NOT_ALLOWED                                  // команда выполняется только отдельно (сброс конфигурации, обновление прошивки)
+};
+const char* const c_BatchResults[] = {"ok", "unknown", "bad_value", "not_allowed"};
+
+#define BF_REPORT       0x01                      // в пакете запрошен отчёт
+#define BF_REBOOT       0x02                      // перезагрузка после выполнения пакета
+#define BF_DIAG         0x04                      // изменен период диагностики
+#define BF_TRACE        0x08                      // изменена маска трассировки
+#define BF_TRACE_DUMP   0x10                      // выгрузка журнала трассировки
+#define BF_CLEAR_CONFIG 0x20                      // сброс конфигурации (только отдельной командой)
+#define BF_OTA          0x40                      // обновление прошивки (только отдельной командой)
+#define BF_PROVISION    0x80                      // блок настроек (только отдельной командой)
+
+struct CommandBatch {
+  uint32_t        counter[C_INP_CHANNELS + 1];    // новые значения счётчиков (индекс CN_REBOOT или CN_CNT01 + номер входа)
+  bool            counter_set[C_INP_CHANNELS + 1];// счётчик устанавливается пакетом
+  ChannelParams   params;                         // копия параметров входов с изменениями пакета
+  uint32_t        diag_period;                    // новый период диагностики (BF_DIAG)
+  uint32_t        trace_mask;                     // новая маска трассировки (BF_TRACE)
+  uint8_t         flags;                          // флаги BF_*
+};
+
+// результат блока настроек {"provision":{...},"seq":N,"sig":"<hex>"} - публикуется в топик [STATUS]/result
+enum ProvisionResult_t : uint8_t {
+  PR_APPLIED,                                     // подпись верна, настройки применены
+  PR_DISABLED,                                    // ключ P_PROV_KEY не задан - блоки настроек не принимаются
+  PR_SIGNATURE,                                   // нет подписи или подпись неверна
+  PR_REPLAY,                                      // номер блока не больше номера последнего примененного
+  PR_BAD_VALUE,                                   // значение не строка и не целое число или не принято ни одно поле
+  PR_STORAGE                                      // номер блока не записан в NVS - без него блок можно было бы применить повторно
+};
+const char* const c_ProvisionResults[] = {"applied", "disabled", "signature", "replay", "bad_value", "storage"};
+
+// кадры UDP протокола опроса. Подпись (если задан ключ P_UDP_KEY) считается по всем полям кадра перед ней
+enum UdpFrame_t : uint8_t {
+  UF_QUERY = 1,                                   // запрос значений конкретного модуля
+  UF_DISCOVER = 2                                 // широковещательный поиск модулей (ответ такой же, как на запрос значений)
+};
+#define UDP_FLAG_HMAC 0x01                        // флаг наличия подписи в кадре
+
+struct __attribute__((packed)) UdpRequest {
+  uint32_t        magic;                          // сигнатура C_UDP_MAGIC_REQUEST
+  uint8_t         version;                        // версия протокола
+  uint8_t         type;                           // тип запроса UdpFrame_t
+  uint8_t         flags;                          // флаги кадра
+  uint8_t         reserved;
+  uint32_t        seq;                            // номер запроса - возвращается в ответе, подписанные запросы с одного адреса должны идти с растущими номерами
+  uint8_t         hmac[C_UDP_HMAC_SIZE];          // подпись (только при флаге UDP_FLAG_HMAC)
+};
+
+struct UdpPeer {                                  // номер последнего принятого подписанного запроса с адреса (защита от повтора перехваченного кадра)
+  uint32_t        ip;                             // адрес клиента (0 - запись свободна)
+  uint32_t        seq;                            // номер последнего принятого запроса
+  uint32_t        used;                           // момент последнего запроса в мс - вытесняется самая старая запись
+};
+
+struct UdpPending {                               // отложенный ответ на широковещательный поиск
+  bool            used;
+  uint32_t        due;                            // момент отправки в мс
+  uint32_t        seq;                            // номер запроса
+  sockaddr_in     addr;                           // адрес клиента
+  socklen_t       addr_len;
+};
+
+struct __attribute__((packed)) UdpResponse {
+  uint32_t        magic;                          // сигнатура C_UDP_MAGIC_RESPONSE
+  uint8_t         version;                        // версия протокола
+  uint8_t         type;                           // тип запроса, на который дан ответ
+  uint8_t         flags;                          // флаги кадра
+  uint8_t         reserved;
+  uint32_t        seq;                            // номер запроса
+  uint32_t        uptime;                         // время работы в секундах
+  uint32_t        counter_01;                     // значение счётчика входа 1
+  uint32_t        counter_02;                     // значение счётчика входа 2 (0, если вход один - кадр версии 1 несет только два счётчика)
+  uint32_t        counter_reboot;                 // значение счётчика перезагрузок
+  uint8_t         mac[6];                         // MAC адрес модуля
+  uint8_t         reserved2[2];
+  uint8_t         hmac[C_UDP_HMAC_SIZE];          // подпись (только при флаге UDP_FLAG_HMAC)
+};
+
+enum CommandStage_t : uint8_t {                   // этапы обработки команды MQTT для гистограмм задержки
+  CST_QUEUE,                                      // получение -> начало обработки
+  CST_PUBLISH,                                    // получение -> публикация отчёта в [STATUS]
+  CST_COUNT
+};
+
+enum ReportStage_t : uint8_t {                    // этапы доставки значения счётчика до сервера MQTT для гистограмм задержки (этап прерывание -> подсчёт - hist_IsrToCount)
+  RST_COUNT_TO_BUILD,                             // подсчёт импульса -> сборка отчёта (только отчёты, в которые попали новые импульсы)
+  RST_BUILD_TO_PUBLISH,                           // сборка отчёта -> передача клиенту MQTT
+  RST_PUBLISH_TO_ACK,                             // передача клиенту MQTT -> подтверждение сервера (PUBACK, отчёт публикуется с QoS 1)
+  RST_EDGE_TO_ACK,                                // начало замыкания -> подтверждение сервера (полный возраст значения, доставленного на сервер)
+  RST_COUNT
+};
+const char* const c_ReportStageNames[RST_COUNT] = {"count_to_build", "build_to_publish", "publish_to_ack", "edge_to_ack"};
+
+// внутренняя статистика работы прошивки (отдается на странице /metrics)
+uint32_t tmu_LastCount[C_INP_CHANNELS] = {0};               // момент последнего засчитанного импульса в мкс
+uint32_t tm_LastCount[C_INP_CHANNELS] = {0};                // момент последнего засчитанного импульса в мс (возраст значения в отчёте может быть больше периода micros())
+uint32_t val_LastEdgeDelay_us[C_INP_CHANNELS] = {0};        // задержка подсчёта последнего импульса от начала замыкания в мкс
+uint32_t count_Pulses[C_INP_CHANNELS] = {0};                // количество засчитанных импульсов с момента загрузки
+#ifdef PULSE_SIMULATOR
+volatile bool sim_InputClosed[C_INP_CHANNELS] = {false};   // уровень входов, выставляемый генератором импульсов
+uint32_t sim_Random = C_SIM_SEED;                           // состояние генератора псевдослучайных чисел
+volatile uint32_t sim_Clock_us = 0;                         // виртуальные часы генератора: все фронты до этого момента уже переданы фильтрам
+uint32_t count_SimPulses[C_INP_CHANNELS] = {0};             // количество сгенерированных импульсов (должны быть засчитаны)
+uint32_t count_SimGlitches[C_INP_CHANNELS] = {0};           // количество сгенерированных помех (должны быть отброшены)
+#endif
+InputFilter inp_Filters[C_INP_CHANNELS];                    // фильтры счётных входов
+uint32_t count_BounceEdges[C_INP_CHANNELS] = {0};           // количество кратковременных изменений уровня, поглощенных гистерезисом фильтра
+uint32_t count_DebounceReject[C_INP_CHANNELS] = {0};        // количество отброшенных помех (замыкание короче минимального времени)
+uint32_t count_EdgeOverflows[C_INP_CHANNELS] = {0};         // количество фронтов, не поместившихся в буфер фильтра
+RateEngine rate_Channels[C_INP_CHANNELS];                   // расчет скорости счёта по входам
+FreqMeter freq_Meters[C_INP_CHANNELS];                      // измерение частоты по входам (пишет обработчик захвата, окно закрывает задача подсчёта)
+portMUX_TYPE mux_Freq = portMUX_INITIALIZER_UNLOCKED;       // согласованный доступ к измерению частоты
+#ifdef POWER_SAVE_MODE
+#define C_WAKE_BUTTONS 0x80000000UL                         // бит запроса переключения уровня пробуждения кнопок (биты 0..N-1 - входы)
+static_assert(C_INP_CHANNELS < 31, "wakeup rearm mask holds one bit per input");
+volatile uint32_t s_WakeupRearm = 0;                        // входы, сменившие уровень: уровень пробуждения переключает задача подсчёта
+portMUX_TYPE mux_Wakeup = portMUX_INITIALIZER_UNLOCKED;     // согласованный доступ к s_WakeupRearm
+#endif
+uint32_t val_Freq_mHz[C_INP_CHANNELS] = {0};                // частота по последнему окну в мГц
+uint16_t val_Duty_pm[C_INP_CHANNELS] = {0};                 // доля замкнутого состояния по последнему окну в 1/1000
+uint32_t tm_NextGate[C_INP_CHANNELS] = {0};                 // момент окончания текущего окна измерения частоты
+bool s_CaptureEnabled[C_INP_CHANNELS] = {false};            // канал таймера захвата включен
+portMUX_TYPE mux_Rate = portMUX_INITIALIZER_UNLOCKED;       // согласованный доступ к расчету скорости (пишет задача подсчёта, читают отчёты)
+PulseLogEntry pulse_Log[C_PULSE_LOG_SIZE];                  // кольцевой журнал последних засчитанных импульсов
+PulseLogEntry pulse_LogSnapshot[C_PULSE_LOG_SIZE];          // копия журнала для выгрузки (только задача WEB)
+uint32_t count_PulseLog = 0;                                // порядковый номер следующей записи журнала (всего записей с момента загрузки)
+portMUX_TYPE mux_PulseLog = portMUX_INITIALIZER_UNLOCKED;   // согласованный доступ к журналу (пишет задача подсчёта, читает WEB сервер)
+TraceEntry trace_Ring[C_TRACE_SIZE];                        // кольцевой журнал трассировки
+uint32_t trace_Head = 0;                                    // номер следующего события трассировки (всего событий с момента загрузки)
+volatile uint32_t trace_Mask = C_TRACE_DEFAULT_MASK;        // включенные категории трассировки
+bool f_SntpStarted = false;                                 // синхронизация времени по SNTP запущена
+uint32_t count_FlashWrites = 0;                             // количество записей конфигурации во FLASH
+uint64_t count_FlashBytes = 0;                              // объем записанных во FLASH данных в байтах
+ConfigSource_t s_ConfigSource = CS_DEFAULTS;                // откуда загружена конфигурация при старте
+uint8_t cfg_ActiveSlot = 0;                                 // номер копии счётчиков с последней записью
+uint32_t cfg_Generation = 0;                                // номер последней записи счётчиков
+bool f_ConfigRewrite = false;                               // флаг необходимости записи копии счётчиков даже без изменений (загружена не последняя копия)
+StoredCounters cfg_SavedCounters = {};                      // значения счётчиков в последней записанной копии
+uint8_t cfg_Buffer[C_CFG_STORE_SIZE];                       // буфер кодирования статического блока (доступ под sem_EEPROM)
+uint8_t cfg_StaticSaved[C_CFG_STORE_SIZE];                  // копия записанного статического блока (доступ под sem_EEPROM)
+size_t cfg_StaticLen = 0;                                   // длина записанного статического блока (0 - блок не записан)
+Preferences cfg_Store;                                      // хранилище конфигурации в NVS
+LegacyLayout_t s_LegacyLayout = LL_NONE;                    // перенесенный при загрузке образ EEPROM
+uint8_t s_LegacyChannels = 0;                               // версия перенесенного блока параметров входов (0 - не было)
+OtaSession ota_Session = {};                                // состояние обновления прошивки
+uint8_t *ota_Pool = NULL;                                   // блоки конвейера приема (выделяются на время обновления)
+int8_t ota_FillBlock = -1;                                  // блок, который сейчас заполняет принимающая задача
+uint16_t ota_FillLength = 0;                                // заполнено байт в этом блоке
+esp_ota_handle_t ota_Handle = 0;                            // запись в неактивный раздел
+const esp_partition_t *ota_Partition = NULL;                // раздел, в который пишется новая прошивка
+TaskHandle_t ota_Waiter = NULL;                             // задача, ожидающая окончания записи образа
+char ota_Url[C_OTA_URL_SIZE];                               // ссылка на образ для загрузки по команде MQTT
+uint8_t val_OtaTrialBoots = 0;                              // загрузок новой прошивки без подтверждения (0 - прошивка подтверждена)
+uint32_t count_OtaUpdates = 0;                              // успешных обновлений с момента загрузки
+uint32_t count_OtaFailures = 0;                             // неудачных обновлений с момента загрузки
+bool f_OtaRolledBack = false;                               // прошлая прошивка не была подтверждена - выполнен возврат на эту
+bool f_OtaHttp = false;                                     // текущее обновление начато загрузкой через WEB сервер
+OtaError_t ota_HttpReject = OE_NONE;                         // загрузка через WEB сервер отклонена до начала (нет подписи)
+char ota_Sha256[65];                                        // ожидаемая SHA256 для загрузки по ссылке
+portMUX_TYPE mux_Ota = portMUX_INITIALIZER_UNLOCKED;        // захват обновления (WEB сервер и команда MQTT могут начать его одновременно)
+uint32_t count_MQTTReconnects = 0;                          // количество повторных подключений к MQTT серверу
+MqttBroker mqtt_Brokers[C_MQTT_BROKERS];                    // список MQTT серверов (меняет только задача WiFi)
+uint8_t mqtt_BrokerCount = 0;                               // количество серверов в списке
+int8_t mqtt_Active = -1;                                    // сервер, к которому подключаемся или подключены (-1 - еще не выбран)
+int8_t mqtt_LastConnected = -1;                             // сервер последнего успешного подключения
+volatile bool f_MQTTDown = false;                           // клиент MQTT сообщил об отключении (прерывает ожидание подключения)
+bool f_MQTTOutage = true;                                   // идет перерыв связи с MQTT (первый - от загрузки до первого подключения)
+uint8_t val_OutageCause = OC_BOOT;                          // причина текущего перерыва связи (OutageCause_t)
+uint32_t tm_MQTTLost = 0;                                   // момент начала перерыва связи
+char mqtt_CommandTopic[sizeof(GlobalParams::command_topic)];  // топик, на который сейчас подписан клиент
+char mqtt_LwtTopic[sizeof(GlobalParams::lwt_topic)];        // топик, в который опубликовано online
+char mqtt_GroupList[sizeof(GlobalParams::group_topics)];    // список групповых топиков, на которые сейчас подписан клиент
+char mqtt_GroupTopics[C_GROUP_TOPICS][sizeof(GlobalParams::command_topic)];    // групповые топики из списка по отдельности
+uint8_t mqtt_GroupCount = 0;                                // количество групповых топиков
+uint16_t val_ResubscribePacketId = 0;                       // номер пакета подписки на новый топик команд (0 - не ждем)
+volatile uint8_t val_ConfigApply = CI_NONE;                 // изменения конфигурации, которые должна применить задача WiFi (ConfigImpact_t)
+uint32_t tm_BrokerProbe = 0;                                // момент последней проверки более приоритетных серверов
+uint32_t val_LastOutage_ms = 0;                             // длительность последнего перерыва связи с MQTT
+uint32_t val_MaxOutage_ms = 0;                              // максимальный перерыв связи с MQTT после потери соединения
+uint32_t count_BrokerFailovers = 0;                         // подключений к другому серверу (в том числе возвратов на приоритетный)
+uint32_t count_BrokerFailbacks = 0;                         // возвратов на более приоритетный сервер
+uint32_t count_DNSLookups = 0;                              // запросов к DNS
+uint32_t count_DNSCacheHits = 0;                            // подключений с адресом из кэша
+uint32_t count_DNSFailures = 0;                             // неудачных запросов к DNS
+uint32_t count_MQTTPublishFails = 0;                        // количество неудачных публикаций в MQTT
+uint32_t count_ReportOverflows = 0;                         // количество отчётов, не поместившихся в буфер C_REPORT_BUF_SIZE (не опубликованы)
+uint32_t count_DiagOverflows = 0;                           // количество диагностических отчётов, не поместившихся в буфер C_DIAG_BUF_SIZE (не отданы)
+uint32_t count_MQTTCommands = 0;                            // количество принятых в очередь команд MQTT
+uint32_t count_MQTTCmdDrops = 0;                            // количество отброшенных команд MQTT (очередь заполнена или команда слишком длинная)
+uint32_t count_MQTTCmdErrors = 0;                           // количество команд MQTT, которые не удалось разобрать
+uint32_t count_UdpRequests = 0;                             // количество обработанных UDP запросов
+uint32_t count_UdpRejects = 0;                              // количество отброшенных UDP запросов (неверный формат или подпись)
+uint32_t count_UdpReplays = 0;                              // количество отброшенных повторов подписанных UDP запросов
+uint32_t count_ModbusRequests = 0;                          // количество обработанных запросов Modbus
+uint32_t count_ModbusErrors = 0;                            // количество запросов Modbus, завершенных исключением
+uint32_t tmu_CurrentCommand = 0;                            // момент получения обрабатываемой сейчас команды MQTT (0 - команды нет)
+uint32_t tmu_ReportRequest = 0;                             // момент получения команды, запросившей отчёт (0 - отчёт запрошен не командой)
+char cmd_BatchResult[C_BATCH_RESULT_SIZE];                  // результат последнего пакета команд в JSON (пишет задача обработки событий)
+bool f_BatchApplied = false;                                // последний пакет команд применен
+uint32_t val_BatchId = 0;                                   // номер последнего пакета, переданного через WEB (пишет WEB сервер)
+uint32_t val_BatchResultId = 0;                             // номер пакета WEB, результат которого в cmd_BatchResult
+uint32_t count_Batches = 0;                                 // количество выполненных пакетов команд
+uint32_t count_BatchRejects = 0;                            // количество пакетов, не примененных из-за ошибки в команде
+uint32_t count_GroupCommands = 0;                           // команд, полученных из групповых топиков
+uint32_t count_CmdSkipped = 0;                              // команд с условием выбора, адресованных другим модулям
+uint32_t count_GroupRejects = 0;                            // команд из групповых топиков, не выполненных из-за не разрешенных ключей
+uint32_t count_Provisions = 0;                              // примененных блоков настроек
+uint32_t count_ProvisionRejects = 0;                        // отклоненных блоков настроек
+uint32_t val_MaxIsrToCount_us[C_INP_CHANNELS] = {0};        // максимальная задержка от прерывания до подсчёта в мкс
+uint32_t val_HeapBlocks = 0;                                // занятых блоков кучи в точке последнего отчёта
+uint32_t val_HeapBaseBlocks = 0;                            // занятых блоков кучи в точке первого отчёта (начало установившегося режима)
+uint32_t count_Ticks[portNUM_PROCESSORS] = {0};             // количество тиков системного таймера по ядрам
+uint32_t count_OtherTicks[portNUM_PROCESSORS] = {0};        // количество тиков, пришедшихся на задачи не из таблицы профилирования (WiFi, TCP/IP и т.д.)
+TaskHandle_t th_Idle[portNUM_PROCESSORS] = {NULL};          // дескрипторы задач простоя по ядрам
+uint32_t val_DiagPeriod = C_DIAG_REPORT_DELAY;              // текущий период публикации диагностики в MQTT в сек (0 - выключено)
+uint32_t tm_LastDiagToMQTT = 0;                             // момент последней публикации диагностики
+bool f_MQTTWasConnected = false;                            // флаг того, что подключение к MQTT уже было
+LatencyHistogram hist_IsrToCount[C_INP_CHANNELS];           // гистограммы задержки от прерывания до подсчёта импульса (границы назначаются в setup)
+LatencyHistogram hist_Command[CST_COUNT] = {                // гистограммы задержки обработки команд MQTT по этапам
+  {c_CommandBounds_us}, {c_CommandBounds_us}
+};
+LatencyHistogram hist_Report[RST_COUNT] = {                 // гистограммы задержки доставки значения счётчика по этапам
+  {c_FreshnessBounds_us}, {c_CommandBounds_us}, {c_CommandBounds_us}, {c_FreshnessBounds_us}
+};
+LatencyHistogram hist_MQTTOutage[OC_COUNT] = {              // гистограммы перерывов связи с MQTT по причинам
+  {c_OutageBounds_us}, {c_OutageBounds_us}, {c_OutageBounds_us}, {c_OutageBounds_us}, {c_OutageBounds_us}, {c_OutageBounds_us}
+};
+uint32_t val_MaxReportStage_us[RST_COUNT] = {0};            // максимальная задержка по этапам доставки в мкс
+// подтверждение приходит в задаче клиента MQTT и может опередить запись номера пакета задачей отчётов - номер и моменты
+// читаются и пишутся вместе под mux_ReportAck, а подтверждение неизвестного пакета запоминается до записи номера
+portMUX_TYPE mux_ReportAck = portMUX_INITIALIZER_UNLOCKED;  // согласованный доступ к номеру и моментам отчёта, ожидающего подтверждения
+uint16_t val_ReportPacketId = 0;                            // номер пакета отчёта, ожидающего подтверждения сервера (0 - не ждем)
+uint32_t tmu_ReportPublish = 0;                             // момент передачи этого отчёта клиенту MQTT
+uint64_t val_ReportEdgeAge_us = 0;                          // возраст самого свежего импульса этого отчёта в момент передачи (0 - новых импульсов в отчёте нет)
+uint16_t val_EarlyAckPacketId = 0;                          // последнее подтверждение пакета, номер которого еще не записан (0 - нет)
+uint32_t tmu_EarlyAck = 0;                                  // момент этого подтверждения
+
 // создаем буфера и структуры данных
 GlobalParams   curConfig;                       // набор параметров управляющих текущей конфигурацией
+ChannelParams  chParams;                        // режимы входов
+ChannelKeys    ch_Keys[C_INP_CHANNELS];         // ключи JSON по входам (заполняются при старте из префиксов)
 
 // создаем и инициализируем объекты - кнопки
 GButton bttn_flash(BTN_FLASH_PIN, HIGH_PULL, NORM_OPEN);      // инициализируем кнопку FLASH
@@ -234,45 +1074,82 @@ AsyncMqttClient   mqttClient;                  // MQTT клиент
 WebServer WEB_Server;
 
 // создаем объект - JSON документ для приема/передачи данных через MQTT
-StaticJsonDocument<512> InputJSONdoc,          // создаем входящий json документ с буфером в 512 байт 
-                        OutputJSONdoc;         // создаем исходящий json документ с буфером в 512 байт 
+StaticJsonDocument<C_JSON_DOC_SIZE> InputJSONdoc,       // создаем входящий json документ (1024 байта для двух входов)
+                                    OutputJSONdoc;      // создаем исходящий json документ
+
+// очереди и семафоры: при STATIC_ALLOCATION память под них резервируется статически рядом с дескриптором
+#ifdef STATIC_ALLOCATION
+#define DEFINE_QUEUE(Name, Length, ItemSize) \
+  uint8_t Name##_Storage[(Length) * (ItemSize)]; StaticQueue_t Name##_Block; \
+  QueueHandle_t Name = xQueueCreateStatic(Length, ItemSize, Name##_Storage, &Name##_Block)
+#define DEFINE_MUTEX(Name) StaticSemaphore_t Name##_Block; SemaphoreHandle_t Name = xSemaphoreCreateMutexStatic(&Name##_Block)
+#define DEFINE_BINARY(Name) StaticSemaphore_t Name##_Block; SemaphoreHandle_t Name = xSemaphoreCreateBinaryStatic(&Name##_Block)
+#else
+#define DEFINE_QUEUE(Name, Length, ItemSize) QueueHandle_t Name = xQueueCreate(Length, ItemSize)
+#define DEFINE_MUTEX(Name) SemaphoreHandle_t Name = xSemaphoreCreateMutex()
+#define DEFINE_BINARY(Name) SemaphoreHandle_t Name = xSemaphoreCreateBinary()
+#endif
 
 // создаем мьютексы для синхронизации доступа к данным
-SemaphoreHandle_t sem_InputJSONdoc = xSemaphoreCreateBinary();                           // создаем двоичный семафор для доступа к JSON документу 
-SemaphoreHandle_t sem_CurConfigWrite = xSemaphoreCreateBinary();                         // создаем двоичный семафор для блокирования конфигурации при записи в EEPROM  
+DEFINE_QUEUE(q_MQTTCommands, C_MQTT_CMD_QUEUE, sizeof(MQTTCommand));                     // создаем очередь команд MQTT для задачи обработки событий
+DEFINE_QUEUE(q_OtaFree, C_OTA_BLOCKS, sizeof(uint8_t));                                  // свободные блоки конвейера OTA
+DEFINE_QUEUE(q_OtaFull, C_OTA_BLOCKS + 1, sizeof(OtaBlockRef));                          // заполненные блоки для записи (и признак конца образа)
+DEFINE_MUTEX(sem_EEPROM);                                                                // создаем мьютекс для записи копий конфигурации в EEPROM
+DEFINE_MUTEX(sem_ChannelParams);                                                         // изменение параметров входов: WEB сервер, пакет команд и блок настроек - по одному (до sem_EEPROM)
+DEFINE_BINARY(sem_BatchDone);                                                            // пакет команд из WEB выполнен - результат в cmd_BatchResult
+
+// согласованный доступ к curConfig (seqlock): писатели увеличивают номер версии до и после изменения (нечетный номер - идет запись),
+// читатели копируют блок и повторяют копирование, если номер версии изменился. Читатели никогда не блокируют задачу подсчёта.
+volatile uint32_t cfg_WriteSeq = 0;                                                      // номер версии curConfig
+portMUX_TYPE mux_CurConfigWrite = portMUX_INITIALIZER_UNLOCKED;                          // взаимоисключение писателей curConfig
+
+// дескрипторы задач (нужны для контроля стека)
+TaskHandle_t th_Events = NULL;                                                           // задача обработки событий
+TaskHandle_t th_Report = NULL;                                                           // задача отчётов
+TaskHandle_t th_Counting = NULL;                                                         // задача подсчёта импульсов
+TaskHandle_t th_WiFi = NULL;                                                             // задача поддержания WiFi соединения
+TaskHandle_t th_Web = NULL;                                                              // задача WEB сервера
+TaskHandle_t th_Load = NULL;                                                             // задача имитации нагрузки
+TaskHandle_t th_Sim = NULL;                                                              // задача генератора импульсов
+TaskHandle_t th_Udp = NULL;                                                              // задача UDP протокола опроса
+TaskHandle_t th_Modbus = NULL;                                                           // задача сервера Modbus TCP
+TaskHandle_t th_OtaWrite = NULL;                                                         // задача записи образа прошивки (на время обновления)
+TaskHandle_t th_OtaFetch = NULL;                                                         // задача загрузки образа по ссылке (на время обновления)
+TaskHandle_t th_Trace = NULL;                                                            // задача вывода трассировки в порт (DEBUG_LEVEL_PORT)
+
+// таблица профилирования задач: на каждом тике планировщика отмечаем, какая задача была активна. Таблица должна 
+// находиться в RAM, так как просматривается из прерывания тика. Задачи простоя идут первыми - по ним считается загрузка ядер.
+struct TaskProfile {
+  const char      *name;                          // имя задачи для отчётов
+  TaskHandle_t    *handle;                        // указатель на переменную с дескриптором задачи
+  uint32_t        ticks;                          // количество тиков, на которых задача была активна
+};
+
+#define C_PROF_SLOTS (portNUM_PROCESSORS + 12)      // количество задач в таблице профилирования
+TaskProfile prof_Tasks[C_PROF_SLOTS] = {
+  {"IDLE0", &th_Idle[0], 0},
+#if (portNUM_PROCESSORS > 1)
+  {"IDLE1", &th_Idle[1], 0},
+#endif
+  {"count", &th_Counting, 0}, {"events", &th_Events, 0}, {"report", &th_Report, 0},
+  {"wifi", &th_WiFi, 0}, {"web", &th_Web, 0}, {"load", &th_Load, 0}, {"sim", &th_Sim, 0},
+  {"udp", &th_Udp, 0}, {"modbus", &th_Modbus, 0}, {"ota", &th_OtaWrite, 0}, {"otaget", &th_OtaFetch, 0},
+  {"trace", &th_Trace, 0}
+};
+
+// окно измерения загрузки для отдельного потребителя диагностики (WEB страница, MQTT) - загрузка считается с момента прошлого отчёта
+struct DiagWindow {
+  uint32_t        task_ticks[C_PROF_SLOTS];       // тики задач на момент прошлого отчёта
+  uint32_t        other_ticks;                    // тики прочих задач на момент прошлого отчёта
+  uint32_t        core_ticks[portNUM_PROCESSORS]; // тики, отмеченные хуком тика ядра, на момент прошлого отчёта
+  uint32_t        os_ticks;                       // счётчик тиков планировщика на момент прошлого отчёта
+};
 
 // наименование 
 String ControllerName = "CNTR_";                                                         // имя нашего контроллера
 
 // =============================== общие процедуры и функции ==================================
 
-uint16_t GetCrc16Simple( uint8_t * data, uint16_t len ) { // процедура упрощенного расчета CRC16 для блока данных
-  uint8_t lo;
-  union // представляем crc как слово и как верхний и нижний байт
-  {
-    uint16_t value;
-    struct { uint8_t lo, hi; } bytes;
-  } crc;
- 
-  crc.value = 0xFFFF;  // начальное значение для расчета
-  while ( len-- )
-    {
-        lo = crc.bytes.lo;
-        crc.bytes.lo = crc.bytes.hi;
-        crc.bytes.hi = lo ^ *data++;   
-        uint8_t mask = 1;
-        if ( crc.bytes.hi & mask ) crc.value ^= 0x0240;
-        if ( crc.bytes.hi & ( mask << 1 ) ) crc.value ^= 0x0480;
-        if ( crc.bytes.hi & ( mask << 2 ) ) crc.bytes.hi ^= 0x09;
-        if ( crc.bytes.hi & ( mask << 3 ) ) crc.bytes.hi ^= 0x12;
-        if ( crc.bytes.hi & ( mask << 4 ) ) crc.bytes.hi ^= 0x24;
-        if ( crc.bytes.hi & ( mask << 5 ) ) crc.bytes.hi ^= 0x48;
-        if ( crc.bytes.hi & ( mask << 6 ) ) crc.bytes.hi ^= 0x90;
-        if ( crc.bytes.hi & ( mask << 7 ) ) crc.value ^= 0x2001;
-    }
-     return crc.value;
-}
-
 static void Halt(const char *msg) { //  процедура аварийного останова контроллера при критических ошибках в ходе выполнения
 #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
   Serial.println(msg);        // выводим сообщение
@@ -281,56 +1158,550 @@ static void Halt(const char *msg) { //  процедура аварийного
   esp_deep_sleep_start();     // останавливаем контроллер
 }
 
+void HistogramAdd(LatencyHistogram &hist, uint32_t value_us) { // добавление измерения в гистограмму задержек
+  uint8_t i = 0;
+  while ((i < C_LAT_BUCKETS-1) and (value_us > hist.bounds_us[i])) i++;  // ищем первую корзину, в которую попадает значение
+  hist.buckets[i]++;
+  hist.count++;
+  hist.sum_us += value_us;
+}
+
+void HeapCheckpoint() { // учёт занятых блоков кучи в установившемся режиме (вызывается в одной и той же точке цикла отчётов)
+  multi_heap_info_t _info;
+  heap_caps_get_info(&_info, MALLOC_CAP_8BIT);
+  val_HeapBlocks = _info.allocated_blocks;
+  if (val_HeapBaseBlocks == 0) val_HeapBaseBlocks = val_HeapBlocks;
+}
+
+void ReportStageAdd(ReportStage_t Stage, uint64_t Value_us) { // добавление измерения этапа доставки значения счётчика (возраст может быть больше 32 бит)
+  uint32_t _value = (Value_us > UINT32_MAX) ? UINT32_MAX : Value_us;
+  HistogramAdd(hist_Report[Stage], _value);
+  if (_value > val_MaxReportStage_us[Stage]) val_MaxReportStage_us[Stage] = _value;
+}
+
+bool GetNewestPulse(uint64_t &SinceCount_us, uint32_t &EdgeDelay_us) { // время с подсчёта самого свежего импульса по всем входам и его задержка от начала замыкания
+  bool _found = false;
+  uint32_t _now = millis();
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (count_Pulses[i] == 0) continue;
+    uint64_t _since = (uint64_t)(_now - tm_LastCount[i]) * 1000;
+    if (_found and (_since >= SinceCount_us)) continue;
+    SinceCount_us = _since;
+    EdgeDelay_us = val_LastEdgeDelay_us[i];
+    _found = true;
+  }
+  return _found;
+}
+
+void NotifyTask(TaskHandle_t Task) { // пробуждение задачи, ожидающей уведомления
+  if (Task != NULL) xTaskNotifyGive(Task);
+}
+
+void IRAM_ATTR NotifyTaskFromISR(TaskHandle_t Task) { // пробуждение задачи из обработчика прерывания
+  BaseType_t _woken = pdFALSE;
+  if (Task == NULL) return;
+  vTaskNotifyGiveFromISR(Task, &_woken);
+  if (_woken == pdTRUE) portYIELD_FROM_ISR();
+}
+
+// журнал трассировки пишется без блокировок: место в кольце занимается атомарным увеличением номера, поэтому события с обоих 
+// ядер и из прерываний не ждут друг друга. Выключенная категория стоит одной проверки маски
+void IRAM_ATTR TraceWrite(uint8_t Id, uint16_t Arg0, uint32_t Arg1) { // запись события в журнал трассировки (из любой задачи и прерывания)
+  uint32_t _seq = __atomic_fetch_add(&trace_Head, 1, __ATOMIC_RELAXED);
+  TraceEntry &_entry = trace_Ring[_seq % C_TRACE_SIZE];
+  __atomic_store_n(&_entry.seq, _seq + 1, __ATOMIC_RELAXED);               // номер соседней ячейки - запись пока не действительна
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  _entry.time_us = micros();
+  _entry.id = Id;
+  _entry.core = xPortGetCoreID();
+  _entry.arg0 = Arg0;
+  _entry.arg1 = Arg1;
+  __atomic_store_n(&_entry.seq, _seq, __ATOMIC_RELEASE);                   // запись заполнена
+}
+
+static inline __attribute__((always_inline)) void Trace(uint8_t Id, uint16_t Arg0 = 0, uint32_t Arg1 = 0) { // событие трассировки, если его категория включена
+  if (trace_Mask & (1UL << (Id >> 4))) TraceWrite(Id, Arg0, Arg1);
+}
+
+uint32_t TraceRead(uint32_t Seq, TraceEntry *Entries, uint32_t Count) { // копия записей журнала трассировки начиная с номера Seq, возвращает количество
+// копирование останавливается на записи, которая перезаписана или еще заполняется (номер в ней не совпадает до или после копирования)
+  uint32_t _count = 0;
+  for (; _count < Count; _count++) {
+    TraceEntry &_entry = trace_Ring[(Seq + _count) % C_TRACE_SIZE];
+    if (__atomic_load_n(&_entry.seq, __ATOMIC_ACQUIRE) != Seq + _count) break;
+    Entries[_count] = _entry;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&_entry.seq, __ATOMIC_RELAXED) != Seq + _count) break;
+  }
+  return _count;
+}
+
+uint32_t TraceOldest() { // номер самого старого события, которое еще есть в кольце
+  uint32_t _head = trace_Head;
+  return (_head > C_TRACE_SIZE) ? _head - C_TRACE_SIZE : 0;
+}
+
+void TraceSetMask(uint32_t Mask) { // включение категорий трассировки
+  trace_Mask = Mask & ((1UL << TC_COUNT) - 1);
+  TraceWrite(TE_TRACE_MASK, 0, trace_Mask);                                 // изменение маски попадает в журнал всегда
+}
+
+struct TraceName {
+  uint8_t         id;
+  const char      *name;
+};
+
+// имена событий для выгрузки NDJSON и вывода в порт (те же имена использует tools/trace_dump.py)
+const TraceName c_TraceNames[] = {
+  {TE_BOOT, "boot"}, {TE_REBOOT, "reboot"}, {TE_POWER_CUT, "power_cut"}, {TE_POWER_SAVED, "power_saved"}, {TE_TRACE_MASK, "trace_mask"},
+  {TE_DIAG_OVERFLOW, "diag_overflow"},
+  {TE_WIFI_CONNECT, "wifi_connect"}, {TE_WIFI_UP, "wifi_up"}, {TE_WIFI_FAIL, "wifi_fail"}, {TE_WIFI_LOST, "wifi_lost"}, {TE_WIFI_OFF, "wifi_off"},
+  {TE_WIFI_AP, "wifi_ap"}, {TE_WIFI_AP_CLIENTS, "wifi_ap_clients"},
+  {TE_MQTT_CONNECT, "mqtt_connect"}, {TE_MQTT_UP, "mqtt_up"}, {TE_MQTT_DOWN, "mqtt_down"}, {TE_MQTT_TIMEOUT, "mqtt_timeout"}, {TE_MQTT_LOST, "mqtt_lost"},
+  {TE_MQTT_SUBSCRIBED, "mqtt_subscribed"}, {TE_MQTT_PUBLISHED, "mqtt_published"}, {TE_MQTT_PUBLISH_FAIL, "mqtt_publish_fail"}, {TE_MQTT_REPORT, "mqtt_report"},
+  {TE_MQTT_BROKER, "mqtt_broker"}, {TE_MQTT_DNS, "mqtt_dns"}, {TE_MQTT_DNS_FAIL, "mqtt_dns_fail"}, {TE_MQTT_FAILBACK, "mqtt_failback"},
+  {TE_MQTT_REPORT_OVERFLOW, "mqtt_report_overflow"},
+  {TE_CMD_RECEIVED, "cmd_received"}, {TE_CMD_DROPPED, "cmd_dropped"}, {TE_CMD_PARSE_ERROR, "cmd_parse_error"}, {TE_CMD_DONE, "cmd_done"},
+  {TE_CMD_SET_COUNTER, "cmd_set_counter"}, {TE_CMD_BAD_VALUE, "cmd_bad_value"}, {TE_CMD_BATCH, "cmd_batch"},
+  {TE_CMD_SKIPPED, "cmd_skipped"}, {TE_CMD_PROVISION, "cmd_provision"}, {TE_CMD_NOT_ALLOWED, "cmd_not_allowed"},
+  {TE_CFG_STATIC_SAVED, "cfg_static_saved"}, {TE_CFG_COUNTERS_SAVED, "cfg_counters_saved"}, {TE_CFG_FIELD, "cfg_field"}, {TE_CFG_DEFAULTS, "cfg_defaults"},
+  {TE_CFG_APPLY, "cfg_apply"},
+  {TE_INP_MODE, "inp_mode"}, {TE_INP_FILTER, "inp_filter"}, {TE_INP_HYST, "inp_hyst"}, {TE_INP_NO_CAPTURE, "inp_no_capture"},
+  {TE_PULSE, "pulse"}, {TE_PULSE_GLITCH, "pulse_glitch"}, {TE_EDGE_OVERFLOW, "edge_overflow"}, {TE_FREQ_GATE, "freq_gate"},
+  {TE_WEB_PAGE, "web_page"},
+  {TE_OTA_BEGIN, "ota_begin"}, {TE_OTA_END, "ota_end"}, {TE_OTA_NOT_STARTED, "ota_not_started"}, {TE_OTA_ROLLBACK, "ota_rollback"}, {TE_OTA_CONFIRMED, "ota_confirmed"}
+};
+
+const char* TraceEventName(uint8_t Id) { // имя события трассировки
+  for (uint8_t i = 0; i < sizeof(c_TraceNames) / sizeof(c_TraceNames[0]); i++) if (c_TraceNames[i].id == Id) return c_TraceNames[i].name;
+  return "unknown";
+}
+
+#ifdef STATIC_ALLOCATION
+// стеки постоянных задач - один статический блок на сумму размеров задач, включенных в сборку (раздается при создании задач в setup)
+constexpr uint32_t c_StaticStackPool = C_TASK_COUNT_STACK + C_TASK_EVENTS_STACK + C_TASK_REPORT_STACK + C_TASK_WIFI_STACK + C_TASK_WEB_STACK + C_TASK_UDP_STACK
+#ifdef MODBUS_SERVER
+  + C_TASK_MODBUS_STACK
+#endif
+#ifdef LOAD_SIMULATION
+  + C_TASK_WEB_STACK
+#endif
+#ifdef DEBUG_LEVEL_PORT
+  + C_TASK_TRACE_STACK
+#endif
+#ifdef PULSE_SIMULATOR
+  + C_TASK_SIM_STACK
+#endif
+  ;
+StackType_t task_Stacks[c_StaticStackPool / sizeof(StackType_t)];                          // стеки постоянных задач
+StaticTask_t task_Blocks[C_STATIC_TASKS];                                                 // блоки управления постоянных задач
+uint32_t task_StackUsed = 0;                                                              // роздано байт стеков
+uint8_t task_BlocksUsed = 0;                                                              // роздано блоков управления
+#endif
+
+bool CreateTask(TaskFunction_t Task, const char *Name, uint32_t StackSize, UBaseType_t Priority, TaskHandle_t *Handle, BaseType_t Core, bool Permanent = true) { // создание задачи с привязкой к ядру
+// Permanent = false - временная задача (обновление прошивки), она удаляет себя сама и всегда создается в куче
+#ifdef STATIC_ALLOCATION
+  if (Permanent) {
+    if ((task_BlocksUsed >= C_STATIC_TASKS) or (task_StackUsed + StackSize > c_StaticStackPool)) return false;
+    #ifdef TASK_LAYOUT_UNPINNED
+    Core = tskNO_AFFINITY;
+    Priority = 1;
+    #endif
+    *Handle = xTaskCreateStaticPinnedToCore(Task, Name, StackSize, NULL, Priority, &task_Stacks[task_StackUsed / sizeof(StackType_t)], 
+                                            &task_Blocks[task_BlocksUsed], Core);
+    if (*Handle == NULL) return false;
+    task_StackUsed += StackSize;
+    task_BlocksUsed++;
+    return true;
+  }
+#endif
+#ifdef TASK_LAYOUT_UNPINNED
+  return (xTaskCreate(Task, Name, StackSize, NULL, 1, Handle) == pdPASS);                         // старое размещение - для сравнения задержек
+#else
+  return (xTaskCreatePinnedToCore(Task, Name, StackSize, NULL, Priority, Handle, Core) == pdPASS);
+#endif
+}
+
+bool CommitStore(const char *Key, const uint8_t *Data, size_t Len) { // запись блока конфигурации в NVS с учётом количества записей
+  count_FlashWrites++;
+  count_FlashBytes += ((Len + 31) / 32 + 1) * 32;                  // NVS пишет заголовок записи и данные блоками по 32 байта
+  return cfg_Store.putBytes(Key, Data, Len) == Len;
+}
+
+uint32_t GetFlashLifetimeHours() { // прогноз ресурса FLASH в часах при текущей частоте записи (0 - записей не было)
+  uint32_t _uptime = millis() / 1000;
+  if ((count_FlashBytes == 0) or (_uptime == 0)) return 0;
+  // NVS пишет записи по кругу во все страницы раздела кроме одной резервной, поэтому износ распределяется по разделу
+  uint64_t _capacity = (uint64_t)(C_NVS_FLASH_SIZE - 4096) * C_FLASH_ENDURANCE;
+  uint64_t _hours = _capacity * _uptime / (count_FlashBytes * 3600);
+  return (_hours > UINT32_MAX) ? UINT32_MAX : (uint32_t)_hours;
+}
+
+uint16_t PublishMQTT(const char* topic, bool retain, const char* payload, size_t length = 0, uint8_t qos = 0) { // публикация в MQTT с учётом неудачных попыток (length 0 - строка)
+  uint16_t packetId = mqttClient.publish(topic, qos, retain, payload, length);
+  if (packetId == 0) {                                          // при успешной отправке возвращается не 0 (для QoS 1 - номер пакета для подтверждения)
+    count_MQTTPublishFails++;
+    Trace(TE_MQTT_PUBLISH_FAIL, 0, (length > 0) ? length : strlen(payload));
+  }
+  return packetId;
+}
+
+void ConfigWriteBegin() { // начало изменения curConfig - писатели выполняются в критической секции, поэтому их изменения всегда короткие
+  portENTER_CRITICAL(&mux_CurConfigWrite);
+  SeqWriteBegin(cfg_WriteSeq);
+}
+
+void ConfigWriteEnd() { // окончание изменения curConfig
+  SeqWriteEnd(cfg_WriteSeq);
+  portEXIT_CRITICAL(&mux_CurConfigWrite);
+}
+
+void GetConfigSnapshot(GlobalParams &Config) { // получение согласованной копии curConfig без блокирования писателей
+  SeqReadCopy(cfg_WriteSeq, &Config, &curConfig, sizeof(Config));
+}
+
+void SetConfigString(char *Dest, size_t DestSize, const String &Value) { // присвоение строкового параметра конфигурации
+  ConfigWriteBegin();
+  strlcpy(Dest, Value.c_str(), DestSize);                           // строки длиннее поля обрезаются
+  ConfigWriteEnd();
+}
+
 void SetConfigByDefault() { // устанавливаем значения в блоке конфигурации по умолчанию
+      ConfigWriteBegin();
       memset((void*)&curConfig,0,sizeof(curConfig));    // обнуляем область памяти и заполняем ее значениями по умолчанию
-      curConfig.counter_01 = 0;                                                       // счётчик 1 = 0
-      curConfig.counter_02 = 0;                                                       // счётчик 2 = 0
+      for (uint8_t i = 0; i < C_INP_CHANNELS; i++) curConfig.counter[i] = 0;          // счётчики входов = 0
       curConfig.counter_reboot = 0;                                                   // счётчик перезагрузок = 0
       memcpy(curConfig.wifi_ssid,P_WIFI_SSID,sizeof(P_WIFI_SSID));                    // сохраняем имя WiFi сети по умолчанию      
       memcpy(curConfig.wifi_pwd,P_WIFI_PASSWORD,sizeof(P_WIFI_PASSWORD));             // сохраняем пароль к WiFi сети по умолчанию
       memcpy(curConfig.mqtt_usr,P_MQTT_USER,sizeof(P_MQTT_USER));                     // сохраняем имя пользователя MQTT сервера по умолчанию
       memcpy(curConfig.mqtt_pwd,P_MQTT_PWD,sizeof(P_MQTT_PWD));                       // сохраняем пароль к MQTT серверу по умолчанию
       memcpy(curConfig.mqtt_host_s,P_MQTT_HOST,sizeof(P_MQTT_HOST));                  // сохраняем наименование хоста MQTT
+      memcpy(curConfig.mqtt_backup,P_MQTT_BACKUP,sizeof(P_MQTT_BACKUP));              // и резервных серверов
       memcpy(curConfig.command_topic,P_SET_TOPIC,sizeof(P_SET_TOPIC));                // сохраняем наименование командного топика
       memcpy(curConfig.report_topic,P_STATE_TOPIC,sizeof(P_STATE_TOPIC));             // сохраняем наименование топика состояния
       memcpy(curConfig.lwt_topic,P_LWT_TOPIC,sizeof(P_LWT_TOPIC));                    // сохраняем наименование топика доступности
+      memcpy(curConfig.group_topics,P_GROUP_TOPICS,sizeof(P_GROUP_TOPICS));           // и групповых топиков команд
       curConfig.mqtt_port = P_MQTT_PORT;
-       // расчитываем контрольную сумму блока данных
-      curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);     // считаем CRC16      
+      ConfigWriteEnd();
+}
+
+// поля GlobalParams, которые хранятся записями статического блока (номера записей не меняются между версиями)
+const ConfigField c_ConfigFields[] = {
+  {CR_WIFI_SSID,     offsetof(GlobalParams, wifi_ssid),     sizeof(GlobalParams::wifi_ssid),     true,  CI_WIFI},
+  {CR_WIFI_PWD,      offsetof(GlobalParams, wifi_pwd),      sizeof(GlobalParams::wifi_pwd),      true,  CI_WIFI},
+  {CR_MQTT_USER,     offsetof(GlobalParams, mqtt_usr),      sizeof(GlobalParams::mqtt_usr),      true,  CI_MQTT},
+  {CR_MQTT_PWD,      offsetof(GlobalParams, mqtt_pwd),      sizeof(GlobalParams::mqtt_pwd),      true,  CI_MQTT},
+  {CR_MQTT_HOST,     offsetof(GlobalParams, mqtt_host_s),   sizeof(GlobalParams::mqtt_host_s),   true,  CI_MQTT},
+  {CR_MQTT_PORT,     offsetof(GlobalParams, mqtt_port),     sizeof(GlobalParams::mqtt_port),     false, CI_MQTT},
+  {CR_COMMAND_TOPIC, offsetof(GlobalParams, command_topic), sizeof(GlobalParams::command_topic), true,  CI_TOPIC},
+  {CR_REPORT_TOPIC,  offsetof(GlobalParams, report_topic),  sizeof(GlobalParams::report_topic),  true,  CI_NONE},
+  {CR_LWT_TOPIC,     offsetof(GlobalParams, lwt_topic),     sizeof(GlobalParams::lwt_topic),     true,  CI_TOPIC},
+  {CR_MQTT_BACKUP,   offsetof(GlobalParams, mqtt_backup),   sizeof(GlobalParams::mqtt_backup),   true,  CI_MQTT},
+  {CR_GROUP_TOPICS,  offsetof(GlobalParams, group_topics),  sizeof(GlobalParams::group_topics),  true,  CI_TOPIC},
+  {CR_TAGS,          offsetof(GlobalParams, tags),          sizeof(GlobalParams::tags),          true,  CI_NONE},
+  {CR_DEVICE_ID,     offsetof(GlobalParams, device_id),     sizeof(GlobalParams::device_id),     false, CI_NONE}
+};
+
+uint8_t GetConfigImpact(const GlobalParams &Old, const GlobalParams &New, bool *Changed = NULL) { // что нужно сделать для применения отличий New от Old (ConfigImpact_t)
+  uint8_t _impact = CI_NONE;
+  for (const ConfigField &_field : c_ConfigFields) {
+    const void *_old = (const uint8_t*)&Old + _field.offset;
+    const void *_new = (const uint8_t*)&New + _field.offset;
+    if (_field.text ? (strncmp((const char*)_old, (const char*)_new, _field.size) == 0) : (memcmp(_old, _new, _field.size) == 0)) continue;
+    _impact |= _field.impact;
+    if (Changed != NULL) *Changed = true;                             // изменены и поля, применяемые сразу
+  }
+  return _impact;
+}
+
+size_t EncodeStaticConfig(const GlobalParams &Config, const ChannelParams &Params, uint8_t *Buf) { // кодирование статического блока в Buf, возвращает длину
+  ConfigHeader  _header;
+  ChannelRecord _rec;
+  size_t        _len = sizeof(ConfigHeader);
+
+  for (const ConfigField &_field : c_ConfigFields) {
+    const uint8_t *_data = (const uint8_t*)&Config + _field.offset;
+    uint8_t _size = _field.text ? strnlen((const char*)_data, _field.size) : _field.size;   // строки - только значащие байты
+    Buf[_len++] = _field.id;
+    Buf[_len++] = _size;
+    memcpy(Buf + _len, _data, _size);
+    _len += _size;
+  }
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    _rec = {i, Params.mode[i], Params.gate_ms[i], Params.min_low_ms[i], Params.min_high_ms[i], Params.hyst_ms[i]};
+    Buf[_len++] = CR_CHANNEL;
+    Buf[_len++] = sizeof(_rec);
+    memcpy(Buf + _len, &_rec, sizeof(_rec));
+    _len += sizeof(_rec);
+  }
+  _header.magic = C_CFG_MAGIC;
+  _header.version = C_CFG_FORMAT_VERSION;
+  _header.reserved = 0;
+  _header.length = _len - sizeof(ConfigHeader);
+  _header.crc = GetCrc16Simple(Buf + sizeof(ConfigHeader), _header.length);
+  memcpy(Buf, &_header, sizeof(_header));
+  return _len;
+}
+
+bool DecodeStaticConfig(const uint8_t *Buf, size_t Len, GlobalParams &Config, ChannelParams &Params) { // разбор статического блока поверх текущих значений
+  ConfigHeader  _header;
+  ChannelRecord _rec;
+  size_t        _pos = sizeof(ConfigHeader);
+  uint8_t       _id, _size;
+  const uint8_t *_data;
+  int8_t        _next;
+
+  if (!CheckConfigBlock(Buf, Len, _header)) return false;
+  // блок более новой версии тоже читается - записи с неизвестными номерами пропускаются
+  while ((_next = NextConfigRecord(Buf, Len, _pos, _id, _size, _data)) > 0) {
+    if (_id == CR_CHANNEL) {                                               // параметры входа: короткая запись прежней версии дополняется текущими значениями
+      if ((_size == 0) or (_data[0] >= C_INP_CHANNELS)) continue;         // входа с таким индексом в этой сборке нет
+      uint8_t i = _data[0];
+      _rec = {i, Params.mode[i], Params.gate_ms[i], Params.min_low_ms[i], Params.min_high_ms[i], Params.hyst_ms[i]};
+      MergeChannelRecord(_data, _size, _rec);
+      Params.mode[i] = _rec.mode;
+      Params.gate_ms[i] = _rec.gate_ms;
+      Params.min_low_ms[i] = _rec.min_low_ms;
+      Params.min_high_ms[i] = _rec.min_high_ms;
+      Params.hyst_ms[i] = _rec.hyst_ms;
+      continue;
+    }
+    for (const ConfigField &_field : c_ConfigFields) {
+      if (_field.id != _id) continue;
+      uint8_t *_dest = (uint8_t*)&Config + _field.offset;
+      if (_field.text) {                                                   // строка длиннее поля обрезается
+        memset(_dest, 0, _field.size);
+        memcpy(_dest, _data, min(_size, (uint8_t)(_field.size - 1)));
+      } else if (_size == _field.size) memcpy(_dest, _data, _size);        // число другого размера - остается значение по умолчанию
+      break;
+    }
+  }
+  return _next == 0;                                                       // запись выходит за границу блока
+}
+
+bool ReadCounterSlot(uint8_t Slot, StoredCounters &Counters, uint32_t &Generation) { // чтение копии счётчиков с проверкой CRC (Generation - номер записи, если заголовок читается)
+  uint8_t _buf[CounterSlotSize(C_CNT_MAX_CHANNELS)];        // копия, записанная сборкой с любым допустимым количеством входов
+  char    _key[8];
+  size_t  _len;
+
+  Generation = 0;
+  snprintf(_key, sizeof(_key), "cnt%u", Slot);
+  _len = cfg_Store.getBytesLength(_key);
+  if ((_len == 0) or (_len > sizeof(_buf))) return false;
+  cfg_Store.getBytes(_key, _buf, _len);
+  memset((void*)&Counters, 0, sizeof(Counters));
+  return DecodeCounterSlot(_buf, _len, Counters.counter, C_INP_CHANNELS, Counters.counter_reboot, Generation);
+}
+
+bool WriteCounters(const GlobalParams &Config) { // запись счётчиков в следующую по очереди копию - предыдущая копия остается целой
+  uint8_t  _buf[C_CNT_STORE_SIZE];
+  char     _key[8];
+  bool     _result;
+  uint8_t  _next = NextCounterSlot(cfg_ActiveSlot, C_CFG_SLOTS);
+
+  xSemaphoreTake(sem_EEPROM, portMAX_DELAY);                               // запись копий выполняется из разных задач
+  snprintf(_key, sizeof(_key), "cnt%u", _next);
+  _result = CommitStore(_key, _buf, EncodeCounterSlot(Config.counter, C_INP_CHANNELS, Config.counter_reboot, C_CFG_FORMAT_VERSION, cfg_Generation + 1, _buf));
+  if (_result) {                                                           // копия записана - она становится последней
+    cfg_ActiveSlot = _next;
+    cfg_Generation++;
+    f_ConfigRewrite = false;
+    memcpy(cfg_SavedCounters.counter, Config.counter, sizeof(Config.counter));
+    cfg_SavedCounters.counter_reboot = Config.counter_reboot;
+  }
+  Trace(TE_CFG_COUNTERS_SAVED, _result, cfg_Generation);
+  xSemaphoreGive(sem_EEPROM);
+  return _result;
 }
 
-bool ReadEEPROMConfig (){ // чтение конфигурации из EEPROM в буфер curConfig
-  uint16_t tmp_CRC;
+bool WriteStaticConfig(const GlobalParams &Config) { // запись статического блока, если он отличается от записанного
+  ChannelParams _params = chParams;
+  size_t        _len;
+  bool          _result = true;
+
+  xSemaphoreTake(sem_EEPROM, portMAX_DELAY);
+  _len = EncodeStaticConfig(Config, _params, cfg_Buffer);
+  // сравниваем сам блок, а не CRC: при совпадении 16-битных CRC разных блоков изменение было бы потеряно
+  if ((_len != cfg_StaticLen) or (memcmp(cfg_Buffer, cfg_StaticSaved, _len) != 0)) {
+    _result = CommitStore(C_CFG_KEY, cfg_Buffer, _len);
+    if (_result) {
+      memcpy(cfg_StaticSaved, cfg_Buffer, _len);
+      cfg_StaticLen = _len;
+    }
+    Trace(TE_CFG_STATIC_SAVED, _result, _len);
+  }
+  xSemaphoreGive(sem_EEPROM);
+  return _result;
+}
 
-  EEPROM.get(0,curConfig);                                                 // читаем блок конфигурации из EEPROM
-  tmp_CRC = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);     // считаем CRC16
-  return (tmp_CRC==curConfig.simple_crc16);                                // возвращаем сошлась ли CRC16 
+void SaveConfigSnapshot(GlobalParams &Config) { // запись согласованной копии счётчиков (без сравнения с сохраненной)
+  WriteCounters(Config);
 }
 
 void CheckAndUpdateEEPROM() { // проверяем конфигурацию и в случае необходимости - записываем новую
-  GlobalParams  oldConfig;        // это старый сохраненный конфиг
-  uint16_t cur_CRC, old_CRC;      // это переменные для рассчета CRC сохраненного и текущего конфига
-
-  if (!s_EnableEEPROM) return;    // если работаем без EEPROM - выходим сразу
-  // иначе читаем старый конфиг в oldConfig, сравниваем его с текущим curConfig и если нужно, записываем в EEPROM
-  EEPROM.get(0,oldConfig);                                                  // читаем блок конфигурации из EEPROM
-  old_CRC = GetCrc16Simple((uint8_t*)&oldConfig, sizeof(oldConfig)-4);      // считаем CRC16 для него
-  cur_CRC = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);      // считаем CRC16 для текущих параметров
-  curConfig.simple_crc16 = cur_CRC;                                         // сохраняем CRC16 текущего блока параметров  
-#ifdef DEBUG_LEVEL_PORT                
-  if (cur_CRC != old_CRC) { //  если конфигурации отличаются - сохраняем новую
-      EEPROM.put(0,curConfig);     
-      if (EEPROM.commit()) Serial.println("EPPROM update successful.");
-         else Serial.println("Error for update configuration in EPPROM.");
-    } else { 
-        Serial.println(" EPPROM is not need to updated."); 
-      }
-#else
-  if (cur_CRC != old_CRC) { //  если конфигурации отличаются - сохраняем новую
-      EEPROM.put(0,curConfig);     
-      EEPROM.commit();
+  GlobalParams  newConfig;        // это согласованная копия текущего конфига
+  bool          _counters;        // счётчики изменились с последней записи
+
+  if (!s_EnableEEPROM) return;    // если работаем без хранилища - выходим сразу
+  // иначе сравниваем копию текущего curConfig с последними записанными значениями и если нужно, записываем
+  GetConfigSnapshot(newConfig);                                             // получаем согласованную копию текущих параметров
+  _counters = f_ConfigRewrite or (newConfig.counter_reboot != cfg_SavedCounters.counter_reboot) or
+              (memcmp(newConfig.counter, cfg_SavedCounters.counter, sizeof(newConfig.counter)) != 0);
+  WriteStaticConfig(newConfig);                                             // статический блок пишется только при изменении
+  if (_counters) { //  если счётчики отличаются или загружена не последняя копия - сохраняем новую
+      WriteCounters(newConfig);
   }    
-#endif      
+}
+
+void SetChannelParamsByDefault() { // параметры входов по умолчанию - все входы считают импульсы
+  memset((void*)&chParams, 0, sizeof(chParams));
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    chParams.mode[i] = CM_COUNT;
+    chParams.gate_ms[i] = C_GATE_DEFAULT;
+    chParams.min_low_ms[i] = C_COUNTER_DELAY;
+    chParams.min_high_ms[i] = C_FILTER_HIGH_DEFAULT;
+    chParams.hyst_ms[i] = C_FILTER_HYST_DEFAULT;
+  }
+}
+
+void CheckChannelParams(ChannelParams &Params) { // приведение параметров входов к допустимым значениям
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if ((Params.mode[i] > CM_FREQUENCY) or (i >= C_CAPTURE_CHANNELS)) Params.mode[i] = CM_COUNT;
+    Params.gate_ms[i] = constrain(Params.gate_ms[i], (uint16_t)C_GATE_MIN, (uint16_t)C_GATE_MAX);
+    Params.min_low_ms[i] = min(Params.min_low_ms[i], (uint16_t)C_FILTER_MAX);
+    Params.min_high_ms[i] = min(Params.min_high_ms[i], (uint16_t)C_FILTER_MAX);
+    Params.hyst_ms[i] = min(Params.hyst_ms[i], (uint16_t)C_FILTER_MAX);
+  }
+}
+
+bool SaveChannelParams() { // запись параметров входов (входят в статический блок), если они отличаются от сохраненных
+  GlobalParams _cfg;
+  if (!s_EnableEEPROM) return false;
+  GetConfigSnapshot(_cfg);
+  return WriteStaticConfig(_cfg);
+}
+
+uint8_t ReadConfigStore() { // чтение конфигурации из NVS поверх значений по умолчанию, возвращает загруженные части (ConfigPart_t)
+  // статический блок и копии счётчиков читаются независимо - испорченный блок не отменяет загрузку целых счётчиков и наоборот
+  GlobalParams   _cfg, _static;
+  ChannelParams  _params = chParams, _decoded = chParams;
+  StoredCounters _slots[C_CFG_SLOTS];
+  uint32_t       _gen[C_CFG_SLOTS];
+  bool           _valid[C_CFG_SLOTS];
+  bool           _interrupted;
+  int8_t         _best;
+  ConfigHeader   _header;
+  size_t         _len;
+  uint8_t        _loaded = CP_NONE;
+
+  GetConfigSnapshot(_cfg);
+  _static = _cfg;
+  _len = cfg_Store.getBytesLength(C_CFG_KEY);
+  if ((_len > 0) and (_len <= sizeof(cfg_Buffer))) {
+    cfg_Store.getBytes(C_CFG_KEY, cfg_Buffer, _len);
+    if (DecodeStaticConfig(cfg_Buffer, _len, _static, _decoded)) {         // разбор идет в копии - при ошибке остаются значения по умолчанию
+      _cfg = _static;
+      _params = _decoded;
+      memcpy(&_header, cfg_Buffer, sizeof(_header));
+      // блок прежней версии формата перезаписываем в текущей при первой проверке
+      cfg_StaticLen = (_header.version == C_CFG_FORMAT_VERSION) ? _len : 0;
+      memcpy(cfg_StaticSaved, cfg_Buffer, cfg_StaticLen);
+      CheckChannelParams(_params);
+      _loaded |= CP_STATIC;
+    }
+  }
+
+  for (uint8_t i = 0; i < C_CFG_SLOTS; i++) _valid[i] = ReadCounterSlot(i, _slots[i], _gen[i]);
+  _best = SelectCounterSlot(_valid, _gen, C_CFG_SLOTS, _interrupted);
+  if (_best < 0) {                                                         // целых копий счётчиков нет - счётчики с нуля
+    s_ConfigSource = CS_DEFAULTS;
+    f_ConfigRewrite = true;
+  } else {
+    memcpy(_cfg.counter, _slots[_best].counter, sizeof(_cfg.counter));
+    _cfg.counter_reboot = _slots[_best].counter_reboot;
+    cfg_SavedCounters = _slots[_best];
+    cfg_ActiveSlot = _best;
+    cfg_Generation = _gen[_best];
+    s_ConfigSource = _interrupted ? CS_BACKUP : CS_SLOT;                   // следующая запись была начата, но не завершена - работаем с предыдущей копией
+    f_ConfigRewrite = (s_ConfigSource == CS_BACKUP);                       // испорченную копию перезаписываем при первой проверке
+    _loaded |= CP_COUNTERS;
+  }
+  ConfigWriteBegin();
+  memcpy((void*)&curConfig, &_cfg, sizeof(_cfg));
+  ConfigWriteEnd();
+  chParams = _params;
+  return _loaded;
+}
+
+bool HasLegacyEEPROM() { // есть ли образ EEPROM прежней версии прошивки (открытие только на чтение не создает записей в NVS)
+  Preferences _legacy;
+  bool        _result;
+  if (!_legacy.begin("eeprom", true)) return false;
+  _result = _legacy.isKey("eeprom");
+  _legacy.end();
+  return _result;
+}
+
+void RemoveLegacyEEPROM() { // удаление образа EEPROM прежней версии после переноса
+  Preferences _legacy;
+  if (!HasLegacyEEPROM() or !_legacy.begin("eeprom", false)) return;
+  _legacy.remove("eeprom");
+  _legacy.end();
+}
+
+uint8_t ReadLegacyEEPROM(uint8_t Loaded) { // перенос из образа EEPROM прежней версии частей конфигурации, которых нет в NVS, возвращает перенесенные части
+  LegacyParams     _legacy;
+  LegacyChannelsV2 _ch;
+  GlobalParams     _cfg;
+  ChannelParams    _params = chParams;
+  uint8_t          _moved = CP_NONE;
+
+  if (!HasLegacyEEPROM() or !EEPROM.begin(C_LEGACY_EEPROM_SIZE)) return CP_NONE;
+  // разбор всех известных раскладок - в config_store.h, здесь только чтение образа
+  memset(&_ch, 0, sizeof(_ch));
+  for (uint8_t i = 0; i < min((uint8_t)C_LEGACY_CHANNELS, C_INP_CHANNELS); i++) {   // блок версии 1 не меняет параметры фильтра
+    _ch.min_low_ms[i] = _params.min_low_ms[i];
+    _ch.min_high_ms[i] = _params.min_high_ms[i];
+    _ch.hyst_ms[i] = _params.hyst_ms[i];
+  }
+  s_LegacyLayout = DecodeLegacyConfig(EEPROM.getDataPtr(), EEPROM.length(), _legacy);
+  s_LegacyChannels = DecodeLegacyChannels(EEPROM.getDataPtr(), EEPROM.length(), _ch);
+  EEPROM.end();
+  if (s_LegacyLayout == LL_NONE) return CP_NONE;
+
+  GetConfigSnapshot(_cfg);
+  if (!(Loaded & CP_STATIC)) {
+    strlcpy(_cfg.wifi_ssid, _legacy.wifi_ssid, sizeof(_cfg.wifi_ssid));
+    strlcpy(_cfg.wifi_pwd, _legacy.wifi_pwd, sizeof(_cfg.wifi_pwd));
+    strlcpy(_cfg.mqtt_usr, _legacy.mqtt_usr, sizeof(_cfg.mqtt_usr));
+    strlcpy(_cfg.mqtt_pwd, _legacy.mqtt_pwd, sizeof(_cfg.mqtt_pwd));
+    strlcpy(_cfg.mqtt_host_s, _legacy.mqtt_host_s, sizeof(_cfg.mqtt_host_s));
+    _cfg.mqtt_port = _legacy.mqtt_port;
+    strlcpy(_cfg.command_topic, _legacy.command_topic, sizeof(_cfg.command_topic));
+    strlcpy(_cfg.report_topic, _legacy.report_topic, sizeof(_cfg.report_topic));
+    strlcpy(_cfg.lwt_topic, _legacy.lwt_topic, sizeof(_cfg.lwt_topic));
+    for (uint8_t i = 0; (s_LegacyChannels > 0) and (i < min((uint8_t)C_LEGACY_CHANNELS, C_INP_CHANNELS)); i++) {
+      _params.mode[i] = _ch.mode[i];
+      _params.gate_ms[i] = _ch.gate_ms[i];
+      _params.min_low_ms[i] = _ch.min_low_ms[i];
+      _params.min_high_ms[i] = _ch.min_high_ms[i];
+      _params.hyst_ms[i] = _ch.hyst_ms[i];
+    }
+    CheckChannelParams(_params);
+    _moved |= CP_STATIC;
+  }
+  if (!(Loaded & CP_COUNTERS)) {                                           // запись счётчиков в новом формате прервалась - берем их из образа
+    for (uint8_t i = 0; i < min((uint8_t)C_LEGACY_CHANNELS, C_INP_CHANNELS); i++) _cfg.counter[i] = _legacy.counter[i];
+    _cfg.counter_reboot = _legacy.counter_reboot;
+    _moved |= CP_COUNTERS;
+  }
+  ConfigWriteBegin();
+  memcpy((void*)&curConfig, &_cfg, sizeof(_cfg));
+  ConfigWriteEnd();
+  chParams = _params;
+  s_ConfigSource = CS_LEGACY;
+  return _moved;
 }
 
 bool isNumeric(String str, bool isInt) { // проверка, что строка содержит числo
@@ -357,74 +1728,627 @@ bool isNumeric(String str, bool isInt) { // проверка, что строк
 
 // ------------------------ команды, которые обрабатываются в рамках получения событий ---------------------
 
+void RequestReport() { // запрос немедленного формирования отчёта
+  if ((tmu_CurrentCommand != 0) and (tmu_ReportRequest == 0)) tmu_ReportRequest = tmu_CurrentCommand;   // для измерения задержки команда -> отчёт
+  f_Has_Report = true;
+  NotifyTask(th_Report);
+}
+
+void SetWebServerEnable(bool Enable) { // разрешение/запрет работы WEB сервера с пробуждением его задачи
+  if (f_WEB_Server_Enable == Enable) return;
+  f_WEB_Server_Enable = Enable;
+  NotifyTask(th_Web);
+}
+
+void RequestConfigApply(uint8_t Impact) { // передача изменений конфигурации задаче WiFi для применения без перезагрузки (ConfigImpact_t)
+  if (Impact == CI_NONE) return;
+  __atomic_or_fetch(&val_ConfigApply, Impact, __ATOMIC_RELEASE);
+  NotifyTask(th_WiFi);
+}
+
 void cmdReset() { // команда сброса конфигурации до состояния по умолчанию и перезагрузка
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("!!! Start rebooting process !!!");
-  #endif    
+  Trace(TE_REBOOT, 0, millis() / 1000);
   CheckAndUpdateEEPROM();                                                                    // проверяем конфигурацию и в случае необходимости - записываем новую
-  if (mqttClient.connected()) mqttClient.publish(curConfig.lwt_topic, 0, true, jv_OFFLINE);  // публикуем в топик LWT_TOPIC событие об отключении
+  if (mqttClient.connected()) PublishMQTT(curConfig.lwt_topic, true, jv_OFFLINE);             // публикуем в топик LWT_TOPIC событие об отключении
   vTaskDelay(pdMS_TO_TICKS(500));                                                            // задержка для публикации  
   ESP.restart();                                                                             // перезагружаемся  
 }
 
 void cmdClearConfig_Reset() { // команда сброса конфигурации до состояния по умолчанию и перезагрузка
+  Trace(TE_CFG_DEFAULTS);
   if (s_EnableEEPROM) { // если EEPROM разрешен и есть             
       SetConfigByDefault();                                                                   // в конфигурацию записываем значения по умолчанию
-      curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);     // считаем CRC16 для конфигурации
   }  
   cmdReset();                                                                                 // перезагружаемся  
 }
 
-void cmdSetCounterValue(const Counters_t Cntr, uint32_t CntrValue) { // функция принудительной установки значения счётчика
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.printf("Set counter [%u] = [%u] \n",(uint8_t)Cntr,CntrValue);
-  #endif   
-  switch (Cntr) {
-  case CN_REBOOT:
-    curConfig.counter_reboot = CntrValue;    
-    break;
-  case CN_CNT01:
-    curConfig.counter_01 = CntrValue;    
-    break;
-  case CN_CNT02:
-    curConfig.counter_02 = CntrValue;    
-    break;
-  }
-  curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);     // считаем CRC16 для текущих параметров  
-  f_Has_Report = true; 
+void cmdSetCounterValue(uint8_t Cntr, uint32_t CntrValue) { // функция принудительной установки значения счётчика (CN_REBOOT или CN_CNT01 + индекс входа)
+  Trace(TE_CMD_SET_COUNTER, Cntr, CntrValue);
+  if (Cntr > C_INP_CHANNELS) return;
+  ConfigWriteBegin();
+  if (Cntr == CN_REBOOT) curConfig.counter_reboot = CntrValue;
+    else curConfig.counter[Cntr - CN_CNT01] = CntrValue;
+  ConfigWriteEnd();                                                                        // CRC16 считается при сохранении копии конфигурации
+  RequestReport(); 
 }
 
-// ------------------------- обработка событий по генерации страниц WEB сервера -------------------------------
-
-void handleRootPage() { // процедура генерации основной страницы сервера
-  String tmpStr; 
-  String out_http_text = CSW_PAGE_TITLE;
-  out_http_text += ControllerName + " values</title>" + CSW_PAGE_STYLE + R"=====(<script> function wl(f){window.addEventListener('load',f);}function gv(count_num) {var xhttp = new XMLHttpRequest();	xhttp.onreadystatechange = function() {
- if (this.readyState == 4 && this.status == 200){	document.getElementById("in"+count_num).value = this.responseText;}};	xhttp.open("GET", "get_data?cntr="+count_num, true); xhttp.send();}			
- function sv(count_num) {var xhttp = new XMLHttpRequest(); xhttp.onreadystatechange = function() { if (this.readyState == 4 && this.status == 200) { if (this.responseText.length == 0) {	alert ("Wrong value for counter!"); window.location='/'; }
- else { if (this.responseText.startsWith("Error")) { alert (this.responseText); window.location='/'; } else document.getElementById("in"+count_num).value = this.responseText;}}}; 
- xhttp.open("GET", "set_data?cntr="+count_num+"&value="+document.getElementById("in"+count_num).value, true);	xhttp.send();} function jd(){ var t=0, i=document.querySelectorAll('input,button,textarea,select');	while(i.length>=t){ 
- if(i[t]){ i[t]['name']=(i[t].hasAttribute('id')&&(!i[t].hasAttribute('name')))?i[t]['id']:i[t]['name'];} t++;}} wl(jd);</script></head>
- <body><div style="text-align:left;display:inline-block;color:#eaeaff;min-width:340px;"><div style="text-align:center;color:#eaeaea;"><noscript>To use this page, please enable JavaScript<br></noscript><h3>Signal counting module:</h3><h2>)=====";
-  out_http_text += ControllerName + R"=====(</h2><h4 style="color: #8f8f8f;">firmware )=====" + FW_VERSION + R"=====(</h4></div><fieldset><legend><b>&nbsp;Counter values&nbsp;</b></legend><p><b>Counter for input #1</b><br><input id="in1" placeholder=" " value=")=====";
-  tmpStr = String(curConfig.counter_01);
-  out_http_text += tmpStr + R"=====(" name="in1"><div/> <button style="width:48%;" name="" onclick="gv(1)">Load current</button> <button class="button bgrn" style="width:48%;" name="" onclick="sv(1)">Set value</button><hr></p><p>
- <b>Counter for input #2</b><br><input id="in2" placeholder=" " value=")=====";
-  tmpStr = String(curConfig.counter_02);
-  out_http_text += tmpStr + R"=====(" name="in2"><div/> <button style="width:48%;" name="" onclick="gv(2)">Load current</button> <button class="button bgrn" style="width:48%;" name="" onclick="sv(2)">Set value</button><hr></p><p>
- <b>Reboot counter</b><br><input id="in0" placeholder=" " value=")=====";
-  tmpStr = String(curConfig.counter_reboot);
-  out_http_text += tmpStr + R"=====(" name="in0"><div/><button class="button bgrn" style="width:100%;" name="" onclick="sv(0)">Set value</button></p></fieldset><div></div><p></p><form action="config" method="get">
- <button style="width:100%;">Configuration</button> <div></div></form><hr><form action="reboot" method="get"><div></div> <button class="button bred" name="">Reset</button>)=====" + CSW_PAGE_FOOTER;
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("WEB >>> index page");    
-  #endif  
-  WEB_Server.send ( 200, "text/html", out_http_text );
-  f_Has_WEB_Server_Connect = true;                                            // взводим флаг наличия изменений
+void BuildChannelKeys(uint8_t Channel, ChannelKeys &Keys) { // ключи JSON состояния входа - префикс + номер из двух цифр (ключи команд - по таблице ключей)
+  snprintf(Keys.counter, sizeof(Keys.counter), "%s%02u", jk_COUNTER, Channel + 1);
+  snprintf(Keys.flow, sizeof(Keys.flow), "%s%02u", jk_FLOW, Channel + 1);
+  snprintf(Keys.freq, sizeof(Keys.freq), "%s%02u", jk_FREQ, Channel + 1);
+  snprintf(Keys.duty, sizeof(Keys.duty), "%s%02u", jk_DUTY, Channel + 1);
 }
 
-void handleConfigPage() { // процедура генерации страницы с конфигурацией 
-  String tmpStr; 
+uint8_t LookupKey(const char *Name, uint8_t &Channel) { // номер ключа по таблице ключей (KEY_NONE - неизвестный), Channel - индекс входа из имени
+  uint32_t _hash = KeyHashBasis(c_KeySeed);
+  uint32_t _num = 0;
+  uint8_t  _runs = 0;
+  uint8_t  _key = KeySlots::key[KeySlot(KeyHash(Name, _hash))];           // сначала - имя целиком (ключи без номера входа)
+  Channel = 0;
+  if ((_key != KEY_NONE) and (strcmp(c_KeyNames[_key], Name) == 0) and !strchr(Name, C_KEY_CHANNEL_MARK)) return _key;
+  for (const char *_p = Name; *_p; _p++) {                                // затем - с номером входа: цифры имени заменяются на '#'
+    if (!isdigit((uint8_t)*_p)) {
+      _hash = KeyHashStep(_hash, *_p);
+      continue;
+    }
+    if ((_p == Name) or !isdigit((uint8_t)_p[-1])) {
+      _hash = KeyHashStep(_hash, C_KEY_CHANNEL_MARK);
+      _runs++;
+    }
+    _num = _num * 10 + (*_p - '0');
+    if (_num > C_INP_CHANNELS) return KEY_NONE;                           // номера такого входа нет
+  }
+  if ((_runs != 1) or (_num == 0)) return KEY_NONE;
+  _key = KeySlots::key[KeySlot(_hash)];
+  if (_key == KEY_NONE) return KEY_NONE;
+  const char *_p = Name;
+  for (const char *_k = c_KeyNames[_key]; *_k; _k++) {                   // имя должно совпасть с ключом таблицы с точностью до номера
+    if (*_k == C_KEY_CHANNEL_MARK) {
+      if (!isdigit((uint8_t)*_p)) return KEY_NONE;
+      while (isdigit((uint8_t)*_p)) _p++;
+    }
+    else if (*_k != *_p++) return KEY_NONE;
+  }
+  if (*_p != '\0') return KEY_NONE;
+  Channel = _num - 1;
+  return _key;
+}
+
+// ----------------------------------- расчет скорости счёта и расхода ----------------------------------------
+
+void RateUpdate(uint8_t Channel, uint32_t Now_us) { // учёт засчитанного импульса в расчете скорости (вызывается задачей подсчёта)
+  portENTER_CRITICAL(&mux_Rate);
+  RateAdd(rate_Channels[Channel], Now_us);
+  portEXIT_CRITICAL(&mux_Rate);
+}
+
+void GetFlowRates(uint8_t Channel, FlowRates &Rates) { // расчет скоростей счёта по входу на текущий момент
+  RateEngine _rate;
+  if (chParams.mode[Channel] == CM_FREQUENCY) {                                // в режиме частоты скорость счёта - это измеренная частота
+    uint64_t _rate_freq = (uint64_t)val_Freq_mHz[Channel] * 60;
+    Rates.instant = Rates.ewma = Rates.window = (_rate_freq > UINT32_MAX) ? UINT32_MAX : (uint32_t)_rate_freq;
+    return;
+  }
+  portENTER_CRITICAL(&mux_Rate);
+  _rate = rate_Channels[Channel];
+  portEXIT_CRITICAL(&mux_Rate);
+  RateCompute(_rate, micros(), Rates);
+}
+
+uint32_t GetPulseRate_ppm100(uint8_t Channel) { // скорость счёта в импульсах в минуту * 100 по последнему интервалу между импульсами
+  FlowRates _rates;
+  GetFlowRates(Channel, _rates);
+  return _rates.instant / 10;
+}
+
+// значения в буфер (без String) - для отчёта в [STATUS], который собирается без выделения памяти из кучи
+void PrintFlow(char *Buf, size_t Size, uint8_t Channel, uint32_t Rate) { // расход в л/мин с тремя знаками после запятой по скорости счёта
+  uint32_t _ml = (uint64_t)Rate * c_Inputs[Channel].volume_ml / 1000;                              // мл в минуту
+  snprintf(Buf, Size, "%u.%03u", _ml / 1000, _ml % 1000);
+}
+
+void PrintCurrentFlow(char *Buf, size_t Size, uint8_t Channel) { // текущий сглаженный расход по входу в л/мин
+  FlowRates _rates;
+  GetFlowRates(Channel, _rates);
+  PrintFlow(Buf, Size, Channel, _rates.ewma);
+}
+
+void PrintFreq(char *Buf, size_t Size, uint8_t Channel) { // частота по входу за последнее окно в Гц с тремя знаками после запятой
+  uint32_t _freq = val_Freq_mHz[Channel];
+  snprintf(Buf, Size, "%u.%03u", _freq / 1000, _freq % 1000);
+}
+
+void PrintDuty(char *Buf, size_t Size, uint8_t Channel) { // доля замкнутого состояния входа за последнее окно в %
+  uint16_t _duty = val_Duty_pm[Channel];
+  snprintf(Buf, Size, "%u.%u", _duty / 10, _duty % 10);
+}
+
+String FormatFlow(uint8_t Channel, uint32_t Rate) { // расход в л/мин по скорости счёта (для WEB страниц)
+  char _buf[16];
+  PrintFlow(_buf, sizeof(_buf), Channel, Rate);
+  return String(_buf);
+}
+
+String GetFlowString(uint8_t Channel) { // текущий сглаженный расход по входу в л/мин
+  char _buf[16];
+  PrintCurrentFlow(_buf, sizeof(_buf), Channel);
+  return String(_buf);
+}
+
+String GetFreqString(uint8_t Channel) { // частота по входу за последнее окно в Гц
+  char _buf[16];
+  PrintFreq(_buf, sizeof(_buf), Channel);
+  return String(_buf);
+}
+
+String GetDutyString(uint8_t Channel) { // доля замкнутого состояния входа за последнее окно в %
+  char _buf[8];
+  PrintDuty(_buf, sizeof(_buf), Channel);
+  return String(_buf);
+}
+
+// ------------------------------ журнал импульсов и привязка к реальному времени ----------------------------------
+// метки времени входов - младшие 32 бита монотонных часов esp_timer (micros() возвращает то же значение), в журнал пишется полная 
+// 64-битная метка. Реальное время не хранится: смещение между монотонными часами и временем SNTP считается в момент выгрузки
+
+int64_t ExpandTime_us(uint32_t Time_us) { // восстановление полной метки времени esp_timer по младшим 32 битам (не старше 71 минуты)
+  int64_t _now = esp_timer_get_time();
+  return _now - (uint32_t)((uint32_t)_now - Time_us);
+}
+
+bool GetWallClockOffset(int64_t &Offset_us) { // смещение реального времени относительно esp_timer, false - время еще не синхронизировано
+  struct timeval _tv;
+  gettimeofday(&_tv, NULL);
+  int64_t _mono = esp_timer_get_time();
+  Offset_us = (int64_t)_tv.tv_sec * 1000000 + _tv.tv_usec - _mono;
+  return (_tv.tv_sec >= C_TIME_VALID_EPOCH);
+}
+
+void PulseLogAdd(uint8_t Channel, uint32_t Start_us) { // запись засчитанного импульса в журнал (вызывается задачей подсчёта)
+  uint64_t _time = ExpandTime_us(Start_us);
+  portENTER_CRITICAL(&mux_PulseLog);
+  PulseLogEntry &_entry = pulse_Log[count_PulseLog % C_PULSE_LOG_SIZE];
+  _entry.time_lo = (uint32_t)_time;
+  _entry.time_hi = (uint16_t)(_time >> 32);
+  _entry.channel = Channel;
+  _entry.reserved = 0;
+  count_PulseLog++;
+  portEXIT_CRITICAL(&mux_PulseLog);
+}
+
+uint32_t PulseLogSnapshot(const uint32_t *Since, uint32_t &First, uint32_t &Next) { // копия записей журнала с номера *Since (NULL - с самой старой) в pulse_LogSnapshot
+// диапазон и записи берутся одновременно, поэтому количество записей в заголовке выгрузки совпадает с выгруженными. Возвращает количество
+  portENTER_CRITICAL(&mux_PulseLog);
+  Next = count_PulseLog;
+  First = (Next > C_PULSE_LOG_SIZE) ? Next - C_PULSE_LOG_SIZE : 0;
+  if ((Since != NULL) and ((int32_t)(*Since - First) > 0)) First = ((int32_t)(*Since - Next) < 0) ? *Since : Next;
+  for (uint32_t _seq = First; _seq != Next; _seq++) pulse_LogSnapshot[_seq - First] = pulse_Log[_seq % C_PULSE_LOG_SIZE];
+  portEXIT_CRITICAL(&mux_PulseLog);
+  return Next - First;
+}
+
+void StartTimeSync() { // запуск синхронизации реального времени по SNTP (после первого подключения к WiFi, дальше lwIP обновляет время сам)
+  if (f_SntpStarted) return;
+  configTime(0, 0, P_NTP_SERVER);                                             // метки времени выгружаются в UTC
+  f_SntpStarted = true;
+}
+
+void PublishResult(const char *Result) { // публикация результата пакета команд или блока настроек из [SET] или отказа в обновлении прошивки в топик [STATUS]/result
+  char _topic[sizeof(curConfig.report_topic) + 8];
+  if (!mqttClient.connected()) return;
+  snprintf(_topic, sizeof(_topic), "%s/result", curConfig.report_topic);
+  PublishMQTT(_topic, false, Result);
+}
+
+// ------------------------------------- обновление прошивки по сети ------------------------------------------
+// Запись идет в неактивный раздел OTA с поэтапным стиранием секторов (OTA_WITH_SEQUENTIAL_WRITES), поэтому стирание тоже идет 
+// параллельно с приемом. Новая прошивка загружается в пробном режиме: если она C_OTA_TRIAL_BOOTS раз перезагрузилась, не дойдя 
+// до подтверждения (подключение к MQTT или C_OTA_CONFIRM_TIME работы), загрузка возвращается на прежнюю прошивку.
+
+const char* const c_OtaStates[] = {"idle", "running", "done", "failed"};
+const char* const c_OtaErrors[] = {"", "busy", "no memory", "partition", "write", "format", "base", "hash", "image", "timeout", "download", "aborted",
+                                   "signature", "url"};
+
+void OtaSetError(OtaError_t Error) { // фиксируем причину прерывания обновления (первая ошибка - основная)
+  if (ota_Session.error == OE_NONE) ota_Session.error = Error;
+}
+
+size_t BuildOtaStatus(char *Buf, size_t Size) { // состояние последнего обновления в JSON (ответ WEB, топик [STATUS]/ota, /diag)
+  uint32_t _time = (ota_Session.state == OS_RUNNING) ? millis() - ota_Session.start_ms : ota_Session.time_ms;
+  uint32_t _rate = (_time > 0) ? (uint64_t)ota_Session.received * 1000 / _time : 0;
+  int _len = snprintf(Buf, Size, "{\"state\":\"%s\",\"error\":\"%s\",\"source\":\"%s\",\"delta\":%s,\"received\":%u,\"written\":%u,"
+                      "\"time_ms\":%u,\"wait_ms\":%u,\"rate_bps\":%u,\"trial_boots\":%u,\"rolled_back\":%s}",
+                      c_OtaStates[ota_Session.state], c_OtaErrors[ota_Session.error], ota_Session.source, ota_Session.delta ? "true" : "false",
+                      ota_Session.received, ota_Session.written, _time, ota_Session.wait_ms, _rate, val_OtaTrialBoots, f_OtaRolledBack ? "true" : "false");
+  return (_len < 0) ? 0 : min((size_t)_len, Size - 1);
+}
+
+void PublishOtaStatus() { // публикация результата обновления в топик [STATUS]/ota
+  GlobalParams _cfg;
+  char _buf[320];
+  char _topic[sizeof(_cfg.report_topic) + 8];
+  Trace(TE_OTA_END, ota_Session.error, ota_Session.received);
+  if (!mqttClient.connected()) return;
+  GetConfigSnapshot(_cfg);
+  BuildOtaStatus(_buf, sizeof(_buf));
+  snprintf(_topic, sizeof(_topic), "%s/ota", _cfg.report_topic);
+  PublishMQTT(_topic, false, _buf);
+}
+
+bool ParseSha256(const char *Hex, uint8_t *Hash) { // разбор SHA256 из 64 hex символов
+  if ((Hex == NULL) or (strlen(Hex) != 64)) return false;
+  for (uint8_t i = 0; i < 64; i++) if (!isxdigit(Hex[i])) return false;
+  for (uint8_t i = 0; i < 32; i++) {
+    char _byte[3] = {Hex[i*2], Hex[i*2+1], 0};
+    Hash[i] = strtoul(_byte, NULL, 16);
+  }
+  return true;
+}
+
+bool CheckProvisionHmac(const uint8_t *Data, size_t Len, const char *SigHex, const char *Prefix = "") { // проверка подписи HMAC-SHA256 ключом P_PROV_KEY (64 hex символа) по тексту Prefix + Data
+  mbedtls_md_context_t _ctx;
+  uint8_t _sig[32];
+  uint8_t _hmac[32];
+  uint8_t _diff = 0;
+  if ((strlen(P_PROV_KEY) == 0) or !ParseSha256(SigHex, _sig)) return false;
+  mbedtls_md_init(&_ctx);
+  if (mbedtls_md_setup(&_ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0) {
+    mbedtls_md_free(&_ctx);
+    return false;
+  }
+  mbedtls_md_hmac_starts(&_ctx, (const uint8_t*)P_PROV_KEY, strlen(P_PROV_KEY));
+  mbedtls_md_hmac_update(&_ctx, (const uint8_t*)Prefix, strlen(Prefix));
+  mbedtls_md_hmac_update(&_ctx, Data, Len);
+  mbedtls_md_hmac_finish(&_ctx, _hmac);
+  mbedtls_md_free(&_ctx);
+  for (uint8_t i = 0; i < sizeof(_hmac); i++) _diff |= _hmac[i] ^ _sig[i];       // сравнение без раннего выхода
+  return (_diff == 0);
+}
+
+// Обновление принимается только с подписью ключом P_PROV_KEY по тексту "ota|<ссылка>|<sha256>" (для загрузки через WEB ссылка пустая).
+// SHA256 новой прошивки при этом обязательна - подпись закрепляет и источник, и сам образ (tools/ota_delta.py sign).
+// Сборка с OTA_UNSIGNED принимает обновление без подписи.
+OtaError_t OtaAuthorize(const char *Url, const char *Sha256, const char *Sig) { // проверка права на обновление
+  #ifdef OTA_UNSIGNED
+  return OE_NONE;
+  #else
+  char    _text[C_OTA_URL_SIZE + 72];
+  uint8_t _hash[32];
+  int     _len;
+  if (!ParseSha256(Sha256, _hash)) return OE_SIGNATURE;
+  _len = snprintf(_text, sizeof(_text), "ota|%s|%s", Url, Sha256);
+  if ((_len < 0) or ((size_t)_len >= sizeof(_text))) return OE_URL;
+  return CheckProvisionHmac((const uint8_t*)_text, _len, Sig) ? OE_NONE : OE_SIGNATURE;
+  #endif
+}
+
+struct OtaFlashIo {                               // ввод-вывод шаблонов ota_stream.h: раздел OTA, работающая прошивка и NVS
+  mbedtls_md_context_t *sha;                      // SHA256 записанной прошивки (NULL - записи нет, только переключение разделов)
+  const esp_partition_t *boot;                    // раздел, который может быть выбран для загрузки
+
+  bool Output(const uint8_t *Data, size_t Len) { // запись очередной порции новой прошивки
+    mbedtls_md_update(sha, Data, Len);
+    return esp_ota_write(ota_Handle, Data, Len) == ESP_OK;
+  }
+
+  bool ReadBase(uint32_t Offset, uint8_t *Buf, size_t Len) { // чтение работающей прошивки
+    return esp_partition_read(esp_ota_get_running_partition(), Offset, Buf, Len) == ESP_OK;
+  }
+
+  bool CheckBase(const OtaDeltaHeader &Header) { // проверка, что дельта построена от работающей прошивки
+    const esp_partition_t *_running = esp_ota_get_running_partition();
+    mbedtls_md_context_t _sha;
+    uint8_t _buf[C_OTA_COPY_SIZE];
+    uint8_t _hash[32];
+    bool    _result = true;
+
+    if ((_running == NULL) or (Header.base_size > _running->size)) return false;
+    mbedtls_md_init(&_sha);
+    mbedtls_md_setup(&_sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&_sha);
+    for (uint32_t _pos = 0; _result and (_pos < Header.base_size); _pos += sizeof(_buf)) {
+      uint32_t _n = min((uint32_t)sizeof(_buf), Header.base_size - _pos);
+      _result = (esp_partition_read(_running, _pos, _buf, _n) == ESP_OK);
+      mbedtls_md_update(&_sha, _buf, _n);
+    }
+    mbedtls_md_finish(&_sha, _hash);
+    mbedtls_md_free(&_sha);
+    return _result and (memcmp(_hash, Header.base_sha256, sizeof(_hash)) == 0);
+  }
+
+  bool End() { // проверка записанного образа загрузчиком
+    return esp_ota_end(ota_Handle) == ESP_OK;
+  }
+
+  bool SetBoot(uint32_t Address) {
+    return (boot != NULL) and (boot->address == Address) and (esp_ota_set_boot_partition(boot) == ESP_OK);
+  }
+
+  bool PutTrial(const OtaTrial &Trial) { // NVS пишется и задачей записи образа, и при сохранении конфигурации - под sem_EEPROM
+    bool _result;
+    if (!s_EnableEEPROM) return false;
+    xSemaphoreTake(sem_EEPROM, portMAX_DELAY);
+    _result = (cfg_Store.putBytes(C_OTA_TRIAL_KEY, &Trial, sizeof(Trial)) == sizeof(Trial));
+    xSemaphoreGive(sem_EEPROM);
+    return _result;
+  }
+
+  bool GetTrial(OtaTrial &Trial) {
+    return s_EnableEEPROM and (cfg_Store.getBytesLength(C_OTA_TRIAL_KEY) == sizeof(Trial)) and 
+           (cfg_Store.getBytes(C_OTA_TRIAL_KEY, &Trial, sizeof(Trial)) == sizeof(Trial));
+  }
+
+  void RemoveTrial() {
+    if (!s_EnableEEPROM) return;
+    xSemaphoreTake(sem_EEPROM, portMAX_DELAY);
+    cfg_Store.remove(C_OTA_TRIAL_KEY);
+    xSemaphoreGive(sem_EEPROM);
+  }
+
+  void PutRolledBack() {
+    if (s_EnableEEPROM) cfg_Store.putUChar(C_OTA_ROLLBACK_KEY, 1);
+  }
+};
+
+void otaWriteTask(void *pvParam) { // задача записи образа: разбор дельты, SHA256 и запись принятых блоков в неактивный раздел
+  mbedtls_md_context_t _sha;
+  OtaFlashIo  _io = {&_sha, ota_Partition};
+  OtaDecoder  _dec;
+  OtaBlockRef _ref;
+  uint8_t     _hash[32];
+
+  OtaDecodeStart(_dec, ota_Session.check_hash ? ota_Session.expected_sha256 : NULL);
+  mbedtls_md_init(&_sha);
+  mbedtls_md_setup(&_sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+  mbedtls_md_starts(&_sha);
+  while (true) {
+    if (xQueueReceive(q_OtaFull, &_ref, pdMS_TO_TICKS(C_OTA_BLOCK_TIMEOUT)) != pdTRUE) {
+      OtaSetError(OE_TIMEOUT);                                               // принимающая задача пропала
+      break;
+    }
+    if (_ref.length == 0) break;                                             // конец образа
+    if (ota_Session.error == OE_NONE) {
+      OtaDecode(_dec, _io, ota_Pool + _ref.index * C_OTA_BLOCK_SIZE, _ref.length);
+      ota_Session.delta = _dec.delta;
+      ota_Session.written = _dec.written;
+      if (_dec.error != OE_NONE) OtaSetError(_dec.error);
+    }
+    xQueueSend(q_OtaFree, &_ref.index, 0);                                   // после ошибки блоки возвращаются без записи до конца приема
+  }
+  mbedtls_md_finish(&_sha, _hash);
+  mbedtls_md_free(&_sha);
+  if (ota_Session.error == OE_NONE) OtaSetError(OtaDecodeEnd(_dec, _hash));
+  // новая прошивка загрузится в пробном режиме: запись пробного режима в NVS - до переключения раздела загрузки
+  if (ota_Session.error == OE_NONE) OtaSetError(OtaCommit(_io, ota_Partition->address));
+    else esp_ota_abort(ota_Handle);
+  ota_Session.time_ms = millis() - ota_Session.start_ms;
+  if (ota_Session.error == OE_NONE) count_OtaUpdates++;
+    else count_OtaFailures++;
+  ota_Session.state = (ota_Session.error == OE_NONE) ? OS_DONE : OS_FAILED;
+  NotifyTask(ota_Waiter);
+  th_OtaWrite = NULL;
+  vTaskDelete(NULL);
+}
+
+OtaError_t OtaBegin(const char *Source, const char *Sha256) { // начало обновления: раздел, блоки конвейера и задача записи
+  bool _busy;
+  portENTER_CRITICAL(&mux_Ota);
+  _busy = (ota_Session.state == OS_RUNNING);
+  if (!_busy) ota_Session.state = OS_RUNNING;
+  portEXIT_CRITICAL(&mux_Ota);
+  if (_busy) return OE_BUSY;
+
+  memset(ota_Session.expected_sha256, 0, sizeof(ota_Session.expected_sha256));
+  ota_Session.error = OE_NONE;
+  ota_Session.delta = false;
+  ota_Session.received = 0;
+  ota_Session.written = 0;
+  ota_Session.wait_ms = 0;
+  ota_Session.time_ms = 0;
+  ota_Session.start_ms = millis();
+  strlcpy(ota_Session.source, Source, sizeof(ota_Session.source));
+  ota_Session.check_hash = (Sha256 != NULL) and (*Sha256 != 0);
+  ota_FillBlock = -1;
+  ota_FillLength = 0;
+  ota_Waiter = NULL;
+  if (ota_Session.check_hash and !ParseSha256(Sha256, ota_Session.expected_sha256)) OtaSetError(OE_FORMAT);
+  if (ota_Session.error == OE_NONE) {
+    ota_Partition = esp_ota_get_next_update_partition(NULL);
+    if ((ota_Partition == NULL) or (esp_ota_begin(ota_Partition, OTA_WITH_SEQUENTIAL_WRITES, &ota_Handle) != ESP_OK)) OtaSetError(OE_PARTITION);
+  }
+  if (ota_Session.error == OE_NONE) {
+    ota_Pool = (uint8_t*)malloc(C_OTA_BLOCKS * C_OTA_BLOCK_SIZE);
+    xQueueReset(q_OtaFree);
+    xQueueReset(q_OtaFull);
+    for (uint8_t i = 0; i < C_OTA_BLOCKS; i++) xQueueSend(q_OtaFree, &i, 0);
+    if ((ota_Pool == NULL) or !CreateTask(otaWriteTask, "ota", C_TASK_OTA_STACK, C_TASK_OTA_PRIO, &th_OtaWrite, PRO_CPU_NUM, false)) {
+      OtaSetError(OE_NO_MEMORY);
+      esp_ota_abort(ota_Handle);
+    }
+  }
+  if (ota_Session.error != OE_NONE) {
+    free(ota_Pool);
+    ota_Pool = NULL;
+    count_OtaFailures++;
+    ota_Session.state = OS_FAILED;
+    PublishOtaStatus();
+    return ota_Session.error;
+  }
+  Trace(TE_OTA_BEGIN, strcmp(Source, "mqtt") == 0, ota_Partition->address);
+  return OE_NONE;
+}
+
+void OtaPushBlock() { // передача заполненного блока задаче записи
+  OtaBlockRef _ref = {(uint8_t)ota_FillBlock, ota_FillLength};
+  xQueueSend(q_OtaFull, &_ref, portMAX_DELAY);                              // в очереди есть место для всех блоков и признака конца
+  ota_FillBlock = -1;
+  ota_FillLength = 0;
+}
+
+bool OtaWrite(const uint8_t *Data, size_t Len) { // прием очередной порции образа (вызывается принимающей задачей), false - обновление прервано
+  while (Len > 0) {
+    if (ota_Session.error != OE_NONE) return false;
+    if (ota_FillBlock < 0) {                                                 // берем свободный блок - если все блоки пишутся, ждем FLASH
+      uint8_t  _index;
+      uint32_t _start = millis();
+      if (xQueueReceive(q_OtaFree, &_index, pdMS_TO_TICKS(C_OTA_BLOCK_TIMEOUT)) != pdTRUE) {
+        OtaSetError(OE_TIMEOUT);
+        return false;
+      }
+      ota_Session.wait_ms += millis() - _start;
+      ota_FillBlock = _index;
+    }
+    size_t _n = min(Len, (size_t)(C_OTA_BLOCK_SIZE - ota_FillLength));
+    memcpy(ota_Pool + ota_FillBlock * C_OTA_BLOCK_SIZE + ota_FillLength, Data, _n);
+    ota_FillLength += _n;
+    ota_Session.received += _n;
+    Data += _n;
+    Len -= _n;
+    if (ota_FillLength == C_OTA_BLOCK_SIZE) OtaPushBlock();
+  }
+  return true;
+}
+
+OtaError_t OtaEnd(bool Complete) { // окончание приема: дожидаемся записи и проверки образа (Complete = false - прием прерван)
+  OtaBlockRef _end = {0, 0};
+  if (!Complete) OtaSetError(OE_ABORTED);
+  if ((ota_FillBlock >= 0) and (ota_FillLength > 0)) OtaPushBlock();
+  ota_Waiter = xTaskGetCurrentTaskHandle();
+  xQueueSend(q_OtaFull, &_end, portMAX_DELAY);
+  while (ota_Session.state == OS_RUNNING) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+  free(ota_Pool);                                                            // задача записи завершена - блоки больше не нужны
+  ota_Pool = NULL;
+  PublishOtaStatus();
+  return ota_Session.error;
+}
+
+void otaFetchTask(void *pvParam) { // задача загрузки образа по ссылке из команды MQTT {"ota":"http://..."}
+  HTTPClient  _http;
+  uint8_t     _buf[1024];
+  OtaError_t  _result = OtaBegin("mqtt", ota_Sha256);
+
+  if (_result == OE_NONE) {
+    int32_t _left = -1;
+    _http.setConnectTimeout(C_OTA_HTTP_TIMEOUT);
+    _http.setTimeout(C_OTA_HTTP_TIMEOUT);
+    if (_http.begin(String(ota_Url)) and (_http.GET() == HTTP_CODE_OK)) _left = _http.getSize();   // длина нужна - ответ chunked не принимается
+    if (_left <= 0) OtaSetError(OE_DOWNLOAD);
+      else {
+      WiFiClient *_stream = _http.getStreamPtr();
+      uint32_t    _last = millis();
+      while ((_left > 0) and (millis() - _last < C_OTA_HTTP_TIMEOUT)) {
+        int _n = _stream->available();
+        if (_n <= 0) {
+          if (!_http.connected()) break;
+          vTaskDelay(pdMS_TO_TICKS(5));
+          continue;
+        }
+        _n = _stream->read(_buf, min((int32_t)sizeof(_buf), min((int32_t)_n, _left)));
+        if (_n <= 0) continue;
+        if (!OtaWrite(_buf, _n)) break;
+        _left -= _n;
+        _last = millis();
+      }
+      if (_left > 0) OtaSetError(OE_DOWNLOAD);
+    }
+    _http.end();
+    _result = OtaEnd(_left == 0);
+    if (_result == OE_NONE) {                                                // прошивка записана - перезагружаемся в нее
+      vTaskDelay(pdMS_TO_TICKS(500));
+      cmdReset();
+    }
+  }
+  else Trace(TE_OTA_NOT_STARTED, _result);
+  th_OtaFetch = NULL;
+  vTaskDelete(NULL);
+}
+
+void cmdStartOta(const char *Url, const char *Sha256, const char *Sig) { // команда обновления прошивки по ссылке (загрузка в отдельной задаче)
+  OtaError_t _error = OE_NONE;
+  char       _text[64];
+  if ((th_OtaFetch != NULL) or (ota_Session.state == OS_RUNNING)) _error = OE_BUSY;
+    else if (strlen(Url) >= sizeof(ota_Url)) _error = OE_URL;
+    else _error = OtaAuthorize(Url, Sha256, Sig);
+  if (_error == OE_NONE) {
+    strlcpy(ota_Url, Url, sizeof(ota_Url));
+    strlcpy(ota_Sha256, Sha256, sizeof(ota_Sha256));
+    if (!CreateTask(otaFetchTask, "otaget", C_TASK_OTA_FETCH_STACK, C_TASK_OTA_PRIO, &th_OtaFetch, PRO_CPU_NUM, false)) _error = OE_NO_MEMORY;
+  }
+  if (_error == OE_NONE) return;
+  // обновление не начато - причина в [STATUS]/result (состояние последнего обновления в [STATUS]/ota не меняется)
+  Trace(TE_OTA_NOT_STARTED, _error);
+  snprintf(_text, sizeof(_text), "{\"ota\":\"rejected\",\"error\":\"%s\"}", c_OtaErrors[_error]);
+  PublishResult(_text);
+}
+
+void OtaCheckTrial() { // при загрузке: учёт загрузок не подтвержденной прошивки, после C_OTA_TRIAL_BOOTS - возврат на прежнюю
+  const esp_partition_t *_running = esp_ota_get_running_partition();
+  const esp_partition_t *_previous = esp_ota_get_next_update_partition(NULL);
+  OtaFlashIo _io = {NULL, _previous};
+  uint8_t    _boots;
+
+  if (!s_EnableEEPROM or (_running == NULL)) return;
+  f_OtaRolledBack = (cfg_Store.getUChar(C_OTA_ROLLBACK_KEY, 0) != 0);
+  if (f_OtaRolledBack) cfg_Store.remove(C_OTA_ROLLBACK_KEY);
+  switch (OtaBootCheck(_io, _running->address, (_previous != NULL) ? _previous->address : _running->address, C_OTA_TRIAL_BOOTS, _boots)) {
+    case OB_ROLLBACK:
+      Trace(TE_OTA_ROLLBACK);
+      ESP.restart();
+      break;
+    case OB_TRIAL:
+      val_OtaTrialBoots = _boots;
+      break;
+    default:
+      break;
+  }
+}
+
+void OtaConfirm() { // подтверждение работающей прошивки - возврата на прежнюю больше не будет
+  OtaFlashIo _io = {NULL, NULL};
+  if (val_OtaTrialBoots == 0) return;
+  _io.RemoveTrial();
+  esp_ota_mark_app_valid_cancel_rollback();                                  // если загрузчик собран с откатом - подтверждаем и для него
+  Trace(TE_OTA_CONFIRMED, val_OtaTrialBoots);
+  val_OtaTrialBoots = 0;
+}
+
+// ------------------------- обработка событий по генерации страниц WEB сервера -------------------------------
+
+void handleRootPage() { // процедура генерации основной страницы сервера
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);                                                    // работаем с согласованной копией конфигурации
+  String tmpStr; 
+  String out_http_text = CSW_PAGE_TITLE;
+  out_http_text += ControllerName + " values</title>" + CSW_PAGE_STYLE + R"=====(<script> function wl(f){window.addEventListener('load',f);}function gv(count_num) {var xhttp = new XMLHttpRequest();	xhttp.onreadystatechange = function() {
+ if (this.readyState == 4 && this.status == 200){	document.getElementById("in"+count_num).value = this.responseText;}};	xhttp.open("GET", "get_data?cntr="+count_num, true); xhttp.send();}
+ function gf(n) {var x = new XMLHttpRequest(); x.onreadystatechange = function() { if (this.readyState == 4 && this.status == 200) document.getElementById("fl"+n).value = this.responseText;}; x.open("GET", "get_data?flow="+n, true); x.send();}
+ wl(function(){setInterval(function(){for(var n=1;n<=)=====" + String(C_INP_CHANNELS) + R"=====(;n++)gf(n);},5000);});			
+ function sv(count_num) {var xhttp = new XMLHttpRequest(); xhttp.onreadystatechange = function() { if (this.readyState == 4 && this.status == 200) { if (this.responseText.length == 0) {	alert ("Wrong value for counter!"); window.location='/'; }
+ else { if (this.responseText.startsWith("Error")) { alert (this.responseText); window.location='/'; } else document.getElementById("in"+count_num).value = this.responseText;}}}; 
+ xhttp.open("GET", "set_data?cntr="+count_num+"&value="+document.getElementById("in"+count_num).value, true);	xhttp.send();} function jd(){ var t=0, i=document.querySelectorAll('input,button,textarea,select');	while(i.length>=t){ 
+ if(i[t]){ i[t]['name']=(i[t].hasAttribute('id')&&(!i[t].hasAttribute('name')))?i[t]['id']:i[t]['name'];} t++;}} wl(jd);</script></head>
+ <body><div style="text-align:left;display:inline-block;color:#eaeaff;min-width:340px;"><div style="text-align:center;color:#eaeaea;"><noscript>To use this page, please enable JavaScript<br></noscript><h3>Signal counting module:</h3><h2>)=====";
+  out_http_text += ControllerName + R"=====(</h2><h4 style="color: #8f8f8f;">firmware )=====" + FW_VERSION + R"=====(</h4></div><fieldset><legend><b>&nbsp;Counter values&nbsp;</b></legend>)=====";
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {                              // блок значений для каждого входа из таблицы
+    tmpStr = String(i + 1);
+    out_http_text += R"=====(<p><b>Counter for input #)=====" + tmpStr + R"=====(</b><br><input id="in)=====" + tmpStr + R"=====(" placeholder=" " value=")=====" + String(_cfg.counter[i]);
+    out_http_text += R"=====(" name="in)=====" + tmpStr + R"=====("><div/> <button style="width:48%;" name="" onclick="gv()=====" + tmpStr + R"=====()">Load current</button> <button class="button bgrn" style="width:48%;" name="" onclick="sv()=====" + tmpStr + R"=====()">Set value</button><br><b>Flow #)=====" + tmpStr;
+    out_http_text += R"=====(, l/min</b><br><input id="fl)=====" + tmpStr + R"=====(" readonly value=")=====" + GetFlowString(i) + R"=====("><hr></p>)=====";
+  }
+  out_http_text += R"=====(<p>
+ <b>Reboot counter</b><br><input id="in0" placeholder=" " value=")=====";
+  tmpStr = String(_cfg.counter_reboot);
+  out_http_text += tmpStr + R"=====(" name="in0"><div/><button class="button bgrn" style="width:100%;" name="" onclick="sv(0)">Set value</button></p></fieldset><div></div><p></p><form action="config" method="get">
+ <button style="width:100%;">Configuration</button> <div></div></form><hr><form action="reboot" method="get"><div></div> <button class="button bred" name="">Reset</button>)=====" + CSW_PAGE_FOOTER;
+  Trace(TE_WEB_PAGE, WP_INDEX);
+  WEB_Server.send ( 200, "text/html", out_http_text );
+  f_Has_WEB_Server_Connect = true;                                            // взводим флаг наличия изменений
+}
+
+void handleConfigPage() { // процедура генерации страницы с конфигурацией 
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);                                                    // работаем с согласованной копией конфигурации
+  String tmpStr; 
   String out_http_text = CSW_PAGE_TITLE;
   out_http_text += ControllerName +
  R"=====( config</title><script> var x=null,lt,to,tp,pc='';function eb(s){return document.getElementById(s);}function qs(s){return document.querySelector(s);}
@@ -435,61 +2359,78 @@ void handleConfigPage() { // процедура генерации страни
   out_http_text += ControllerName +
  R"=====(</h2></div><fieldset><legend><b>&nbsp;Network parameters&nbsp;</b></legend>
  <form method="get" action="applay"><p><b>WiFi SSID</b> [)=====";
-  tmpStr = String(curConfig.wifi_ssid);
+  tmpStr = String(_cfg.wifi_ssid);
   out_http_text += tmpStr +
  R"=====(]<br><input id="wn" placeholder=" " value=")=====";
   out_http_text += tmpStr +
  R"=====(" name="wn"></p><p><b>WiFi password</b><input type="checkbox" onclick="sp(&quot;wp&quot;)" name=""><br>
  <input id="wp" type="password" placeholder="Password" value="****" name="wp"></p><p><b>IP for MQTT host</b> [)=====";
-  tmpStr = String(curConfig.mqtt_host_s);
+  tmpStr = String(_cfg.mqtt_host_s);
   out_http_text += tmpStr + R"=====(]<br><input id="mh" placeholder=" " value=")=====";
   out_http_text += tmpStr + R"=====(" name="mh"></p><p><b>Port</b> [)=====";
-  tmpStr = String(curConfig.mqtt_port);
+  tmpStr = String(_cfg.mqtt_port);
   out_http_text += tmpStr + R"=====(]<br><input id="ms" placeholder=")=====";
   out_http_text += tmpStr + R"=====(" value=")=====";
-  out_http_text += tmpStr + R"=====(" name="ms"></p><p><b>MQTT User</b> [)=====";
-  tmpStr = String(curConfig.mqtt_usr);
+  out_http_text += tmpStr + R"=====(" name="ms"></p><p><b>Backup MQTT hosts</b> (host[:port],...)<br><input id="mb" placeholder="none" value=")=====";
+  out_http_text += String(_cfg.mqtt_backup) + R"=====(" name="mb"></p><p><b>MQTT User</b> [)=====";
+  tmpStr = String(_cfg.mqtt_usr);
   out_http_text += tmpStr + R"=====(]<br><input id="mu" placeholder="MQTT_USER" value=")=====";
   out_http_text += tmpStr + R"=====(" name="mu"></p><p><b>MQTT user password</b><input type="checkbox" onclick="sp(&quot;mp&quot;)" name=""><br>
  <input id="mp" type="password" placeholder="Password" value="****" name="mp"></p><p><b>Set topic</b> [)=====";
-  tmpStr = String(curConfig.command_topic);
+  tmpStr = String(_cfg.command_topic);
   out_http_text += tmpStr + R"=====(]<br><input id="ts" placeholder=")=====";
   out_http_text += tmpStr + R"=====(" value=")=====";
   out_http_text += tmpStr + R"=====(" name="ts"></p><p><b>State topic</b> [)=====";
-  tmpStr = String(curConfig.report_topic);
+  tmpStr = String(_cfg.report_topic);
   out_http_text += tmpStr + R"=====(]<br><input id="tr" placeholder=")=====";
   out_http_text += tmpStr + R"=====(" value=")=====";
   out_http_text += tmpStr + R"=====(" name="tr"></p><p><b>LWT topic</b> [)=====";
-  tmpStr = String(curConfig.lwt_topic);
+  tmpStr = String(_cfg.lwt_topic);
   out_http_text += tmpStr + R"=====(]<br><input id="tl" placeholder=")=====";
   out_http_text += tmpStr + R"=====(" value=")=====";
-  out_http_text += tmpStr + R"=====(" name="tl"></p><br><button name="save" type="submit" class="button bgrn">Save</button></form></fieldset> 
+  out_http_text += tmpStr + R"=====(" name="tl"></p><p><b>Group topics</b> (topic,...)<br><input id="gt" placeholder="none" value=")=====";
+  out_http_text += String(_cfg.group_topics) + R"=====(" name="gt"></p><p><b>Device tags</b> (tag,...)<br><input id="dt" placeholder="none" value=")=====";
+  out_http_text += String(_cfg.tags) + R"=====(" name="dt"></p><p><b>Device ID</b> [)=====";
+  tmpStr = String(_cfg.device_id);
+  out_http_text += tmpStr + R"=====(]<br><input id="di" placeholder="0 - none" value=")=====";
+  out_http_text += tmpStr + R"=====(" name="di"></p>)=====";
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {                              // режимы входов: c<N>m - режим, c<N>g - время усреднения частоты
+    String _id = "c" + String(i+1);
+    tmpStr = String(chParams.gate_ms[i]);
+    out_http_text += "<p><b>Input #" + String(i+1) + " mode</b><br><select id=\"" + _id + "m\" name=\"" + _id + "m\"><option value=\"0\"" +
+                     ((chParams.mode[i] == CM_COUNT) ? " selected" : "") + ">pulse count</option><option value=\"1\"" +
+                     ((chParams.mode[i] == CM_FREQUENCY) ? " selected" : "") + ">frequency</option></select></p><p><b>Input #" + String(i+1) + 
+                     " frequency gate, ms</b> [" + tmpStr + "]<br><input id=\"" + _id + "g\" placeholder=\"" + tmpStr + "\" value=\"" + tmpStr + "\" name=\"" + _id + "g\"></p>";
+    out_http_text += "<p><b>Input #" + String(i+1) + " filter: min low / min high / hysteresis, ms</b><br><input id=\"" + _id + "l\" style=\"width:30%;\" value=\"" + 
+                     String(chParams.min_low_ms[i]) + "\" name=\"" + _id + "l\"> <input id=\"" + _id + "h\" style=\"width:30%;\" value=\"" + 
+                     String(chParams.min_high_ms[i]) + "\" name=\"" + _id + "h\"> <input id=\"" + _id + "y\" style=\"width:30%;\" value=\"" + 
+                     String(chParams.hyst_ms[i]) + "\" name=\"" + _id + "y\"></p>";
+  }
+  out_http_text += R"=====(<br><button name="save" type="submit" class="button bgrn">Save</button></form></fieldset> 
  <p></p><form action="config" method="get"><div></div><button name="">Reload current</button></form><div></div><form action="/" method="get">
- <button name="">Main page</button><div></div></form><hr><form action="reboot" method="get"><div></div><button class="button bred" name="">Reset</button>
+ <button name="">Main page</button><div></div></form><hr><form action="update" method="post" enctype="multipart/form-data" onsubmit="this.action='update?sha256='+this.sha256.value+'&sig='+this.sig.value"><p><b>Firmware image or delta</b>
+ <input type="file" name="image"></p><p><b>SHA256</b><input name="sha256"></p><p><b>Signature</b><input name="sig"></p><button name="">Update firmware</button></form><hr><form action="reboot" method="get"><div></div><button class="button bred" name="">Reset</button>
   )=====" + CSW_PAGE_FOOTER;
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("WEB >>> config page");    
-  #endif  
+  Trace(TE_WEB_PAGE, WP_CONFIG);
   WEB_Server.send ( 200, "text/html", out_http_text );
   f_Has_WEB_Server_Connect = true;                                            // взводим флаг наличия изменений
 }
 
-void handleRebootPage() { // процедура обработки страницы c ожидания
-  String message_str = " Please wait for restart...";
+void SendWaitPage(const String &Message) { // страница ожидания: опрашивает /alive и переходит на основную страницу, когда модуль отвечает
   String out_http_text = CSW_PAGE_TITLE;  
   out_http_text += ControllerName + " reboot</title>" + CSW_PAGE_STYLE +
  R"=====(<script>setInterval(function(){getData();},1000);function getData() {var xhttp = new XMLHttpRequest(); xhttp.onreadystatechange=function() {if (this.readyState == 4 && this.status == 200) {
  if (this.responseText=="alive"){window.location='/';}}};xhttp.open("GET","alive",true);xhttp.send();}</script>	
  </head><body><div style='text-align:left;display:inline-block;color:#eaeaea;min-width:340px;'><div style="text-align:center;color:#eaeaea;"><h3>Signal counting module:</h3><h2>)=====";
   out_http_text += ControllerName + R"=====(</h2><br><noscript>To use this page, please enable JavaScript<br></noscript><br><div><a id="blink">)=====";
-  if (f_ApplayChanges) out_http_text += "Changes applied." + message_str; 
-    else out_http_text += "Reset and reboot." + message_str; 
+  out_http_text += Message;
   out_http_text += R"=====(</a></div><br><div></div><p><form action='/' method='get'><button>Main page</button>)=====" + CSW_PAGE_FOOTER;
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("WEB >>> reboot page");    
-  #endif  
-  f_ApplayChanges = false;
   WEB_Server.send(200, "text/html", out_http_text);
+}
+
+void handleRebootPage() { // процедура обработки страницы c ожидания перезагрузки
+  Trace(TE_WEB_PAGE, WP_REBOOT);
+  SendWaitPage("Reset and reboot. Please wait for restart...");
   vTaskDelay(pdMS_TO_TICKS(500));                                   // делаем задержку перед перезагрузкой чтобы сервер успел отправить страницы
   cmdReset();
 } 
@@ -501,270 +2442,1416 @@ void handleNotFoundPage() { // процедура генерации стран
  <div style="text-align:center;color:#eaeaea;"><h3>Signal counting module:</h3><h2>)=====";
   out_http_text += ControllerName + R"=====(</h2><div><a id="blink" style="font-size:2em" > 404! Page not found...</a>
  </div><br><div></div><p><form action='/' method='get'><button>Main page</button>)=====" + CSW_PAGE_FOOTER;
-   #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("WEB >>> not found page");    
-  #endif  
+  Trace(TE_WEB_PAGE, WP_NOT_FOUND);
   WEB_Server.send ( 404, "text/html", out_http_text );
 }
 
-void handleApplayPage() { // обработка страницы с приемом данных в контроллер со страницы клиента
-  String ArgName  = "";
+bool SetConfigField(const char *Name, String Value, ChannelParams &Params) { // параметр со страницы конфигурации или из блока настроек, false - неизвестное имя или значение не принято
+  long     _Int = 0;
+  uint8_t  _ch;                                                                 // индекс входа для полей c<N>
+  uint8_t  _key = LookupKey(Name, _ch);
+  switch (_key) {
+  // Аргумент [wn] >> SSID WiFi сети
+  case KEY_WIFI_SSID:
+    if (!Value.isEmpty()) {                                                     // валидно не пустое значение
+      SetConfigString(curConfig.wifi_ssid, sizeof(curConfig.wifi_ssid), Value); // присваиваем новый SSID сети
+      Trace(TE_CFG_FIELD, CR_WIFI_SSID);
+      return true;
+    }
+    return false;
+  // Аргумент [wp] >> пароль для WiFi сети
+  case KEY_WIFI_PWD:
+    if (!Value.equals("****")) {                                                // проверяем на то, что в поле есть актуальное значение отличное от [****] 
+      SetConfigString(curConfig.wifi_pwd, sizeof(curConfig.wifi_pwd), Value);   // присваиваем новый пароль сети
+      Trace(TE_CFG_FIELD, CR_WIFI_PWD);
+      return true;
+    }
+    return false;
+  // Аргумент [mh] >> хост для доступа к MQTT серверу
+  case KEY_MQTT_HOST:
+    if (!Value.isEmpty()) {                                                     // валидно не пустое значение
+      SetConfigString(curConfig.mqtt_host_s, sizeof(curConfig.mqtt_host_s), Value); // присваиваем имя MQTT хоста
+      Trace(TE_CFG_FIELD, CR_MQTT_HOST);
+      return true;
+    }
+    return false;
+  // Аргумент [ms] >> порт для доступа к MQTT
+  case KEY_MQTT_PORT:
+    _Int = Value.toInt();
+    if (isNumeric(Value, true) and _Int>1 and _Int < 0xFFFF) {                  // если это валидное значение порта, то присваиваем конфигурации
+      ConfigWriteBegin();
+      curConfig.mqtt_port = _Int;                           
+      ConfigWriteEnd();
+      Trace(TE_CFG_FIELD, CR_MQTT_PORT);
+      return true;
+    }
+    return false;
+  // Аргумент [mb] >> резервные MQTT серверы (пустое значение - без резервных)
+  case KEY_MQTT_BACKUP:
+    SetConfigString(curConfig.mqtt_backup, sizeof(curConfig.mqtt_backup), Value); // присваиваем список резервных серверов
+    Trace(TE_CFG_FIELD, CR_MQTT_BACKUP);
+    return true;
+  // Аргумент [mu] >> MQTT user
+  case KEY_MQTT_USER:
+    if (!Value.isEmpty()) {                                                     // валидно не пустое значение
+      SetConfigString(curConfig.mqtt_usr, sizeof(curConfig.mqtt_usr), Value);   // присваиваем новое имя MQTT пользователя
+      Trace(TE_CFG_FIELD, CR_MQTT_USER);
+      return true;
+    }
+    return false;
+  // Аргумент [mp] >> пароль для MQTT сервера
+  case KEY_MQTT_PWD:
+    if (!Value.equals("****")) {                                                // проверяем на то, что в поле есть актуальное значение отличное от [****] 
+      SetConfigString(curConfig.mqtt_pwd, sizeof(curConfig.mqtt_pwd), Value);   // присваиваем новый пароль MQTT пользователю
+      Trace(TE_CFG_FIELD, CR_MQTT_PWD);
+      return true;
+    }
+    return false;
+  // Аргумент [ts] >> MQTT топик для приема команд
+  case KEY_COMMAND_TOPIC:
+    if (!Value.isEmpty()) {                                                     // проверяем на то, что в поле есть актуальное значение
+      if (Value.endsWith("/")) Value.remove(Value.length()-1,1);                // если есть обратная косая черта - удаляем
+      SetConfigString(curConfig.command_topic, sizeof(curConfig.command_topic), Value); // присваиваем значение переменной 
+      Trace(TE_CFG_FIELD, CR_COMMAND_TOPIC);
+      return true;
+    }
+    return false;
+  // Аргумент [tr] >> MQTT топик для основного отчета
+  case KEY_REPORT_TOPIC:
+    if (!Value.isEmpty()) {                                                     // проверяем на то, что в поле есть актуальное значение
+      if (Value.endsWith("/")) Value.remove(Value.length()-1,1);                // если есть обратная косая черта - удаляем
+      SetConfigString(curConfig.report_topic, sizeof(curConfig.report_topic), Value); // присваиваем значение переменной 
+      Trace(TE_CFG_FIELD, CR_REPORT_TOPIC);
+      return true;
+    }
+    return false;
+  // Аргумент [tl] >> MQTT топик для LWT
+  case KEY_LWT_TOPIC:
+    if (!Value.isEmpty()) {                                                     // проверяем на то, что в поле есть актуальное значение     
+      if (Value.endsWith("/")) Value.remove(Value.length()-1,1);                // если есть обратная косая черта - удаляем
+      SetConfigString(curConfig.lwt_topic, sizeof(curConfig.lwt_topic), Value); // присваиваем значение переменной 
+      Trace(TE_CFG_FIELD, CR_LWT_TOPIC);
+      return true;
+    }
+    return false;
+  // Аргумент [gt] >> групповые топики команд (пустое значение - только свой топик)
+  case KEY_GROUP_TOPICS:
+    SetConfigString(curConfig.group_topics, sizeof(curConfig.group_topics), Value); // присваиваем список групповых топиков
+    Trace(TE_CFG_FIELD, CR_GROUP_TOPICS);
+    return true;
+  // Аргумент [dt] >> метки модуля для выбора групповыми командами
+  case KEY_TAGS:
+    SetConfigString(curConfig.tags, sizeof(curConfig.tags), Value);             // присваиваем список меток
+    Trace(TE_CFG_FIELD, CR_TAGS);
+    return true;
+  // Аргумент [di] >> номер модуля для выбора групповыми командами (0 - не задан)
+  case KEY_DEVICE_ID:
+    if (isNumeric(Value, true) and (Value.toInt() >= 0) and (Value.toInt() <= 0xFFFF)) {   // номер 0..65535
+      ConfigWriteBegin();
+      curConfig.device_id = Value.toInt();
+      ConfigWriteEnd();
+      Trace(TE_CFG_FIELD, CR_DEVICE_ID);
+      return true;
+    }
+    return false;
+  // Аргументы [c<N>m], [c<N>g], [c<N>l], [c<N>h], [c<N>y] >> режим входа N, время усреднения частоты и параметры фильтра
+  case KEY_CH_MODE: case KEY_CH_GATE: case KEY_CH_LOW: case KEY_CH_HIGH: case KEY_CH_HYST:
+    if (isNumeric(Value,true)) {
+      if (_key == KEY_CH_MODE) {
+        if ((Value.toInt() == CM_FREQUENCY) and (_ch < C_CAPTURE_CHANNELS)) Params.mode[_ch] = CM_FREQUENCY;
+          else if (Value.toInt() == CM_COUNT) Params.mode[_ch] = CM_COUNT;
+          else return false;                                                    // неизвестный режим или частота на входе без блока захвата
+      }
+      if (_key == KEY_CH_GATE) Params.gate_ms[_ch] = constrain(Value.toInt(), (long)C_GATE_MIN, (long)C_GATE_MAX);   // ограничиваем до приведения к uint16_t
+      if (_key == KEY_CH_LOW)  Params.min_low_ms[_ch] = min((uint32_t)Value.toInt(), (uint32_t)C_FILTER_MAX);
+      if (_key == KEY_CH_HIGH) Params.min_high_ms[_ch] = min((uint32_t)Value.toInt(), (uint32_t)C_FILTER_MAX);
+      if (_key == KEY_CH_HYST) Params.hyst_ms[_ch] = min((uint32_t)Value.toInt(), (uint32_t)C_FILTER_MAX);
+      Trace(TE_CFG_FIELD, CR_CHANNEL, _ch + 1);
+      return true;
+    }
+    return false;
+  default:
+    return false;                                                               // неизвестное имя (кнопки формы, ключи команд)
+  }
+}
+
+bool ApplyChannelParams(const ChannelParams &Params);             // применение параметров входов - определена рядом с переключением режима входов
+
+void handleApplayPage() { // обработка страницы с приемом данных в контроллер со страницы клиента - изменения применяются без перезагрузки
   String ArgValue = "";
-  uint16_t _Int = 0;
+  String Message  = "No changes.";
+  uint8_t _impact = CI_NONE;
+  bool _changed = false;
+  GlobalParams _old, _new;
+  ChannelParams _params;                                                        // параметры входов меняются на копии и применяются разом
   if (WEB_Server.args() > 0) {                                                  // если параметры переданы - то занимаемся их обработкой  
+    xSemaphoreTake(sem_ChannelParams, portMAX_DELAY);                           // входы меняет и задача обработки событий - копия не должна устареть
+    _params = chParams;
+    GetConfigSnapshot(_old);
     for (size_t i = 0; i < WEB_Server.args(); i++) {                            // идем по списку переданных на страницу значений и обрабатываем их 
-      ArgName = WEB_Server.argName(i);                                          // имя текущего параметра        
       ArgValue = WEB_Server.arg(i);                                             // значение текущего параметра  
       ArgValue.trim();                                                          // чистим от пробелов     
-      // Аргумент [wn] >> SSID WiFi сети
-      if (ArgName.equals("wn") and !ArgValue.isEmpty()) {                       // валидно не пустое значение
-        strcpy(curConfig.wifi_ssid, ArgValue.c_str());                          // присваиваем новый SSID сети
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.wifi_ssid = [%s]\n",ArgName, curConfig.wifi_ssid);
-        #endif  
-      }
-      // Аргумент [wp] >> пароль для WiFi сети
-      if (ArgName.equals("wp") and !ArgValue.equals("****")) {                  // проверяем на то, что в поле есть актуальное значение отличное от [****] 
-        strcpy(curConfig.wifi_pwd, ArgValue.c_str());                           // присваиваем новый пароль сети
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.wifi_pwd = [%s]\n",ArgName, curConfig.wifi_pwd);
-        #endif  
-      }
-      // Аргумент [mh] >> хост для доступа к MQTT серверу
-      if (ArgName.equals("mh") and !ArgValue.isEmpty()) {                       // валидно не пустое значение
-        strcpy(curConfig.mqtt_host_s, ArgValue.c_str());                        // присваиваем имя MQTT хоста
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.mqtt_host_s = [%s]\n",ArgName, curConfig.mqtt_host_s);
-        #endif  
-      }
-      // Аргумент [ms] >> порт для доступа к MQTT
-      if (ArgName.equals("ms") and !ArgValue.isEmpty()) {                       // проверяем на то, что в поле есть актуальное значение от 1..0xFFFF
-        _Int = ArgValue.toInt();
-        if (_Int>1 and _Int < 0xFFFF) {                                         // если это валидное значение порта, то присваиваем конфигурации
-          curConfig.mqtt_port = _Int;                           
-          #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-          Serial.printf("Argument [%s] >> curConfig.mqtt_port = [%u]\n",ArgName, curConfig.mqtt_port);
-          #endif  
-        }
-      }
-      // Аргумент [mu] >> MQTT user
-      if (ArgName.equals("mu") and !ArgValue.isEmpty()) {                       // валидно не пустое значение
-        strcpy(curConfig.mqtt_usr, ArgValue.c_str());                           // присваиваем новое имя MQTT пользователя
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.mqtt_usr = [%s]\n",ArgName, curConfig.mqtt_usr);
-        #endif  
-      }
-      // Аргумент [mp] >> пароль для MQTT сервера
-      if (ArgName.equals("mp") and !ArgValue.equals("****")) {                  // проверяем на то, что в поле есть актуальное значение отличное от [****] 
-        strcpy(curConfig.mqtt_pwd, ArgValue.c_str());                           // присваиваем новый пароль MQTT пользователю
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.mqtt_pwd = [%s]\n",ArgName, curConfig.mqtt_pwd);
-        #endif  
-      }
-      // Аргумент [ts] >> MQTT топик для приема команд
-      if (ArgName.equals("ts") and !ArgValue.isEmpty()) {                       // проверяем на то, что в поле есть актуальное значение от 1..0xFFFF      
-        if (ArgValue.endsWith("/")) ArgValue.remove(ArgValue.length()-1,1);     // если есть обратная косая черта - удаляем
-        strcpy(curConfig.command_topic, ArgValue.c_str());                      // присваиваем значение переменной 
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.command_topic = [%s]\n",ArgName, curConfig.command_topic);
-        #endif  
-      }
-      // Аргумент [tr] >> MQTT топик для основного отчета
-      if (ArgName.equals("tr") and !ArgValue.isEmpty()) {                       // проверяем на то, что в поле есть актуальное значение
-        if (ArgValue.endsWith("/")) ArgValue.remove(ArgValue.length()-1,1);     // если есть обратная косая черта - удаляем
-        strcpy(curConfig.report_topic, ArgValue.c_str());                       // присваиваем значение переменной 
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.report_topic = [%s]\n",ArgName, curConfig.report_topic);
-        #endif  
-      }
-      // Аргумент [tl] >> MQTT топик для LWT
-      if (ArgName.equals("tl") and !ArgValue.isEmpty()) {                       // проверяем на то, что в поле есть актуальное значение     
-        if (ArgValue.endsWith("/")) ArgValue.remove(ArgValue.length()-1,1);     // если есть обратная косая черта - удаляем
-        strcpy(curConfig.lwt_topic, ArgValue.c_str());                          // присваиваем значение переменной 
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.printf("Argument [%s] >> curConfig.lwt_topic = [%s]\n",ArgName, curConfig.lwt_topic);
-        #endif  
-      }
+      SetConfigField(WEB_Server.argName(i).c_str(), ArgValue, _params);                 // неизвестные параметры (кнопки формы) пропускаются
     }  
+    GetConfigSnapshot(_new);
+    _impact = GetConfigImpact(_old, _new, &_changed);           // что нужно сделать для применения изменений
+    CheckChannelParams(_params);
+    _changed |= ApplyChannelParams(_params);                    // параметры входов применяются сразу
     CheckAndUpdateEEPROM();                                     // проверяем конфигурацию и в случае необходимости - записываем новую
-    f_ApplayChanges = true;                                     // взводим флаг изменений для правильного вывода сообщения на странице перезагрузки
+    SaveChannelParams();                                        // и параметры входов
+    xSemaphoreGive(sem_ChannelParams);
+    if (_impact & CI_WIFI) Message = "Changes applied. Reconnecting to WiFi network " + String(_new.wifi_ssid) + " - the module address may change...";
+      else if (_impact & CI_MQTT) Message = "Changes applied. Reconnecting to MQTT broker...";
+      else if (_changed) Message = "Changes applied.";
   }
-  #ifdef DEBUG_LEVEL_PORT                                       // вывод в порт при отладке кода 
-  Serial.println("WEB <<< Get and applay changes...");    
-  #endif  
-  handleRebootPage();                                           // отражаем страницу перезагрузки и перегружаем устройство
+  Trace(TE_WEB_PAGE, WP_APPLY);
+  SendWaitPage(Message);                                        // страница ожидания вернется на основную, как только модуль ответит
+  if (_impact & CI_WIFI) vTaskDelay(pdMS_TO_TICKS(500));        // страница должна уйти до отключения от WiFi
+  RequestConfigApply(_impact);                                  // подключения меняет задача WiFi
+  RequestReport();                                              // состояние - в новый топик отчётов
 }
 
 void handleCheckAlivePage() { // процедура проверки статуса контроллера и возврат данных на страницу ожидания (reboot и applay)
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.println("WEB >>> Send alive status");
-  #endif
+  Trace(TE_WEB_PAGE, WP_ALIVE);
   WEB_Server.send(200, "text/plane", "alive");
 }
 
 void handleGetDataPage() { // получения данных счётчика через WEB
-  // передать данные о счётчике номер которого указан в строке запроса
-  String ArgName  = "";
-  String ArgValue = "";
-  String CntrResult = String(curConfig.counter_reboot);
-  uint8_t _Int = 0;
-  if (WEB_Server.args() > 0) {                                                // если параметры переданы - то занимаемся их обработкой  
-    ArgName = WEB_Server.argName(0);                                          // имя первого параметра        
-    ArgValue = WEB_Server.arg(0);                                             // значение первого параметра  
-    if (ArgName.equals("cntr") and !ArgValue.isEmpty()) {                     // проверяем на то, что в поле есть актуальное значение
-      _Int = ArgValue.toInt();
-      switch (_Int) {
-        case 1:
-          CntrResult = String(curConfig.counter_01);
-          break;        
-        case 2:
-          CntrResult = String(curConfig.counter_02);        
-          break;        
-      } 
-    }  
+  // передать данные о счётчике, номер которого указан в строке запроса: ?cntr=N, ?flow=N, ?freq=N или ?duty=N (первый известный параметр)
+  uint8_t _ch;
+  long _num = 0;
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);                                                    // работаем с согласованной копией конфигурации
+  String CntrResult = String(_cfg.counter_reboot);
+  for (size_t i = 0; i < WEB_Server.args(); i++) {                            // параметры - в любом порядке, неизвестные пропускаются
+    uint8_t _key = LookupKey(WEB_Server.argName(i).c_str(), _ch);
+    if ((_key != KEY_CNTR) and (_key != KEY_FLOW) and (_key != KEY_FREQ) and (_key != KEY_DUTY)) continue;
+    _num = WEB_Server.arg(i).toInt();
+    if ((_num >= 1) and (_num <= C_INP_CHANNELS)) {                           // 0 или неверный номер - счётчик перезагрузок
+      switch (_key) {
+        case KEY_CNTR: CntrResult = String(_cfg.counter[_num - 1]); break;
+        case KEY_FLOW: CntrResult = GetFlowString(_num - 1); break;           // текущий расход по входу
+        case KEY_FREQ: CntrResult = GetFreqString(_num - 1); break;           // частота по входу (0 - вход не в режиме частоты)
+        case KEY_DUTY: CntrResult = GetDutyString(_num - 1); break;           // доля замкнутого состояния по входу
+      }
+    }
+    break;
   }
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.printf("WEB >>> Get by name [%s=%s] value = [%s]\n",ArgName,ArgValue,CntrResult);
-  #endif
+  Trace(TE_WEB_PAGE, WP_GET_DATA);
   WEB_Server.send(200, "text/plane", CntrResult);
 }
 
+void handleBatchPage() { // пакет команд через WEB: POST /batch, в теле - JSON массив команд (как в топике [SET]), ответ - результат по командам
+  // пакет выполняется задачей обработки событий по очереди с командами MQTT - как одна транзакция с одной записью конфигурации
+  MQTTCommand _cmd;
+  const String &_body = WEB_Server.arg("plain");
+  Trace(TE_WEB_PAGE, WP_BATCH);
+  if ((_body.length() == 0) or (_body.length() >= sizeof(_cmd.payload))) {
+    WEB_Server.send(413, "application/json", "{\"error\":\"size\"}");
+    return;
+  }
+  _cmd.received_us = micros();
+  _cmd.reply = true;
+  _cmd.batch_id = ++val_BatchId;
+  _cmd.group = false;
+  _cmd.topic[0] = '\0';
+  memcpy(_cmd.payload, _body.c_str(), _body.length() + 1);
+  if (xQueueSend(q_MQTTCommands, &_cmd, 0) != pdTRUE) {
+    WEB_Server.send(503, "application/json", "{\"error\":\"busy\"}");
+    return;
+  }
+  NotifyTask(th_Events);
+  TickType_t _start = xTaskGetTickCount();
+  do {                                                                        // результаты пакетов, ответа на которые не дождались, пропускаем
+    TickType_t _spent = xTaskGetTickCount() - _start;
+    if ((_spent >= pdMS_TO_TICKS(C_BATCH_WAIT)) or (xSemaphoreTake(sem_BatchDone, pdMS_TO_TICKS(C_BATCH_WAIT) - _spent) != pdTRUE)) {
+      WEB_Server.send(504, "application/json", "{\"error\":\"timeout\"}");
+      return;
+    }
+  } while (val_BatchResultId != _cmd.batch_id);
+  WEB_Server.send(f_BatchApplied ? 200 : 400, "application/json", cmd_BatchResult);
+}
+
 void handleSetDataPage() { // установить значение счётчика через WEB
-  // установить значение счётчика номер которого указан в строке запроса 
-  String ArgName  = "";
+  // установить значение счётчика номер которого указан в строке запроса: ?cntr=N&value=V (параметры - в любом порядке)
   String ArgValue = "";
-  uint8_t _CntrNum = 0;
-  uint32_t _CntrValue = 0;
   String ResultValue = "";
-  if (WEB_Server.args() > 1) {                                                // если параметры переданы - то занимаемся их обработкой  
-    ArgName = WEB_Server.argName(0);                                          // имя первого параметра - "cntr"
-    ArgValue = WEB_Server.arg(0);                                             // значение первого параметра - это номер счётчика        
+  long _CntrNum = -1;                                                         // -1 - номер счётчика не передан
+  uint32_t _CntrValue = 0;
+  bool _value = false;                                                        // значение передано
+  uint8_t _ch;
+  for (size_t i = 0; i < WEB_Server.args(); i++) {
+    ArgValue = WEB_Server.arg(i);
     ArgValue.trim();                                                          // чистим от пробелов
-    if (ArgName.equals("cntr") and isNumeric(ArgValue,true)) {                // проверяем на то, что в поле есть актуальное значение
-      _CntrNum = ArgValue.toInt();
-      ArgName = WEB_Server.argName(1);                                        // второй параметр это должно быть - "value"
-      ArgValue = WEB_Server.arg(1);                                           // а это значение, которое нужно присвоить
-      ArgValue.trim();           
-      if (ArgName.equals("value") and isNumeric(ArgValue,true)) {             // если имя аргумента совпало и значение его - число, то 
-        _CntrValue = ArgValue.toInt();                                        // собственно запоминаем нужное значение
-        // и присваиваем его нужному счётчику
-        switch (_CntrNum) {
-          case 0:
-            cmdSetCounterValue(CN_REBOOT, _CntrValue);            
-            break;        
-          case 1:
-            cmdSetCounterValue(CN_CNT01, _CntrValue);
-            break;        
-          case 2:
-            cmdSetCounterValue(CN_CNT02, _CntrValue);            
-            break;        
-          default:
-          ResultValue = "Error !!! Can't assign value ["+ArgValue+"] to counter ["+String(_CntrNum)+"].";            
-        } 
-        // если результирующая строка пуста - присвоение прошло успешно
-        if (ResultValue.isEmpty()) {
-          ResultValue = String(_CntrValue);
-          CheckAndUpdateEEPROM();                                     // проверяем конфигурацию и записываем новые значения
-          #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-          Serial.printf("Set counter [%u] = [%u]\n",_CntrNum, _CntrValue);
-          #endif  
-        }
-      }  
+    if (!isNumeric(ArgValue,true)) continue;                                  // параметр без актуального значения не учитываем
+    switch (LookupKey(WEB_Server.argName(i).c_str(), _ch)) {
+      case KEY_CNTR:  _CntrNum = ArgValue.toInt(); break;                     // номер счётчика
+      case KEY_VALUE: _CntrValue = ArgValue.toInt(); _value = true; break;    // значение, которое нужно присвоить
+      default: break;
     }
   }
-  #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-  Serial.printf("WEB <<< Set counter. Result = [%s] \n",ResultValue);
-  #endif
+  if ((_CntrNum >= 0) and _value) {                                           // если оба параметра переданы
+    // присваиваем значение нужному счётчику: 0 - счётчик перезагрузок, 1..N - счётчики входов
+    if (_CntrNum <= C_INP_CHANNELS) cmdSetCounterValue(_CntrNum, _CntrValue);
+      else ResultValue = "Error !!! Can't assign value ["+String(_CntrValue)+"] to counter ["+String(_CntrNum)+"].";
+    // если результирующая строка пуста - присвоение прошло успешно
+    if (ResultValue.isEmpty()) {
+      ResultValue = String(_CntrValue);
+      CheckAndUpdateEEPROM();                                                 // проверяем конфигурацию и записываем новые значения
+    }
+  }
+  Trace(TE_WEB_PAGE, WP_SET_DATA);
   WEB_Server.send(200, "text/plane", ResultValue);
 }
 
-// -------------------------- описание call-back функции MQTT клиента ------------------------------------
+// ------------------------- страница /metrics - внутренняя статистика в формате Prometheus -------------------------------
+// страница отдается порциями через chunked передачу, чтобы не собирать весь ответ в одну String
+
+char   MetricsBuf[C_METRICS_BUF_SIZE];                                          // буфер для порционной отдачи страницы
+
+void MetricsSend(const char *Data, size_t Len) { // отправка порции клиенту WEB сервера
+  WEB_Server.sendContent(Data, Len);
+}
+
+MetricsOut metrics_Out = {MetricsBuf, sizeof(MetricsBuf), 0, MetricsSend};   // вывод страницы через буфер MetricsBuf
+
+void MetricsFlush() { // отправка накопленной порции клиенту
+  MetricsOutFlush(metrics_Out);
+}
+
+void MetricsPrintf(const char *fmt, ...) { // добавление строки в буфер страницы /metrics с отправкой при переполнении
+  va_list args;
+  va_start(args, fmt);
+  MetricsOutVPrintf(metrics_Out, fmt, args);                                   // строка длиннее буфера не выводится - обрезанная испортила бы страницу
+  va_end(args);
+}
+
+void MetricsHeader(const char *name, const char *type, const char *help) { // вывод описания метрики - отдельными строками # HELP и # TYPE
+  MetricsOutHeader(metrics_Out, name, type, help);
+}
+
+void MetricsHistogram(const char *name, const char *labels, const LatencyHistogram &hist) { // вывод гистограммы в секундах
+  uint32_t _cumulative = 0;
+  for (uint8_t i = 0; i < C_LAT_BUCKETS-1; i++) {
+    _cumulative += hist.buckets[i];
+    MetricsPrintf("%s_bucket{%s,le=\"%u.%06u\"} %u\n", name, labels, hist.bounds_us[i] / 1000000, hist.bounds_us[i] % 1000000, _cumulative);
+  }
+  MetricsPrintf("%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, hist.count);
+  MetricsPrintf("%s_sum{%s} %llu.%06llu\n", name, labels, hist.sum_us / 1000000, hist.sum_us % 1000000);
+  MetricsPrintf("%s_count{%s} %u\n", name, labels, hist.count);
+}
+
+void handleMetricsPage() { // процедура генерации страницы /metrics
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);                                                      // работаем с согласованной копией конфигурации
+  char _labels[32];
+
+  metrics_Out.len = 0;
+  WEB_Server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  WEB_Server.send(200, "text/plain; version=0.0.4", "");
+  // значения счётчиков
+  MetricsHeader("cntr_counter_value", "gauge", "Current counter value (may be set or cleared by user).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_counter_value{channel=\"%u\"} %u\n", i+1, _cfg.counter[i]);
+  MetricsHeader("cntr_pulses_total", "counter", "Pulses counted since boot.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_pulses_total{channel=\"%u\"} %u\n", i+1, count_Pulses[i]);
+  #ifdef PULSE_SIMULATOR
+  MetricsHeader("cntr_sim_pulses_total", "counter", "Pulses generated by the pulse simulator (expected count).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_sim_pulses_total{channel=\"%u\"} %u\n", i+1, count_SimPulses[i]);
+  MetricsHeader("cntr_sim_glitches_total", "counter", "Short glitches generated by the pulse simulator (expected to be rejected).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_sim_glitches_total{channel=\"%u\"} %u\n", i+1, count_SimGlitches[i]);
+  #endif
+  MetricsHeader("cntr_pulse_rate_per_minute", "gauge", "Pulse rate by last inter-pulse interval.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    uint32_t _rate = GetPulseRate_ppm100(i);
+    MetricsPrintf("cntr_pulse_rate_per_minute{channel=\"%u\"} %u.%02u\n", i+1, _rate / 100, _rate % 100);
+  }
+  MetricsHeader("cntr_flow_liters_per_minute", "gauge", "Flow rate: last interval (instant), smoothed (ewma), sliding window (window).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    FlowRates _rates;
+    GetFlowRates(i, _rates);
+    MetricsPrintf("cntr_flow_liters_per_minute{channel=\"%u\",method=\"instant\"} %s\n", i+1, FormatFlow(i, _rates.instant).c_str());
+    MetricsPrintf("cntr_flow_liters_per_minute{channel=\"%u\",method=\"ewma\"} %s\n", i+1, FormatFlow(i, _rates.ewma).c_str());
+    MetricsPrintf("cntr_flow_liters_per_minute{channel=\"%u\",method=\"window\"} %s\n", i+1, FormatFlow(i, _rates.window).c_str());
+  }
+  MetricsHeader("cntr_channel_mode", "gauge", "Input mode: 0 - pulse count, 1 - frequency measurement.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_channel_mode{channel=\"%u\"} %u\n", i+1, chParams.mode[i]);
+  MetricsHeader("cntr_frequency_hertz", "gauge", "Input frequency over the last gate (frequency mode only).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (chParams.mode[i] == CM_FREQUENCY) MetricsPrintf("cntr_frequency_hertz{channel=\"%u\"} %s\n", i+1, GetFreqString(i).c_str());
+  }
+  MetricsHeader("cntr_duty_cycle_ratio", "gauge", "Share of the period the input is closed over the last gate (frequency mode only).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (chParams.mode[i] == CM_FREQUENCY) MetricsPrintf("cntr_duty_cycle_ratio{channel=\"%u\"} %u.%03u\n", i+1, val_Duty_pm[i] / 1000, val_Duty_pm[i] % 1000);
+  }
+  MetricsHeader("cntr_input_filter_seconds", "gauge", "Input filter: minimum closed (low) and open (high) time, hysteresis (hyst).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    MetricsPrintf("cntr_input_filter_seconds{channel=\"%u\",param=\"low\"} %u.%03u\n", i+1, chParams.min_low_ms[i] / 1000, chParams.min_low_ms[i] % 1000);
+    MetricsPrintf("cntr_input_filter_seconds{channel=\"%u\",param=\"high\"} %u.%03u\n", i+1, chParams.min_high_ms[i] / 1000, chParams.min_high_ms[i] % 1000);
+    MetricsPrintf("cntr_input_filter_seconds{channel=\"%u\",param=\"hyst\"} %u.%03u\n", i+1, chParams.hyst_ms[i] / 1000, chParams.hyst_ms[i] % 1000);
+  }
+  MetricsHeader("cntr_bounce_edges_total", "counter", "Short level changes absorbed by the input filter hysteresis (contact bounce).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_bounce_edges_total{channel=\"%u\"} %u\n", i+1, count_BounceEdges[i]);
+  MetricsHeader("cntr_debounce_rejects_total", "counter", "Closures shorter than the minimum closed time (rejected glitches).");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_debounce_rejects_total{channel=\"%u\"} %u\n", i+1, count_DebounceReject[i]);
+  MetricsHeader("cntr_edge_overflows_total", "counter", "Input edges lost because the filter edge buffer was full.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_edge_overflows_total{channel=\"%u\"} %u\n", i+1, count_EdgeOverflows[i]);
+  MetricsHeader("cntr_pulse_log_records_total", "counter", "Pulses written to the timestamped pulse log (ring of the last records).");
+  MetricsPrintf("cntr_pulse_log_records_total %u\n", count_PulseLog);
+  MetricsHeader("cntr_trace_events_total", "counter", "Events written to the trace ring since boot.");
+  MetricsPrintf("cntr_trace_events_total %u\n", trace_Head);
+  MetricsHeader("cntr_trace_mask", "gauge", "Enabled trace categories (bit per category).");
+  MetricsPrintf("cntr_trace_mask %u\n", trace_Mask);
+  int64_t _offset;
+  MetricsHeader("cntr_wallclock_synced", "gauge", "Wall-clock time is synchronized by SNTP (pulse log has unix timestamps).");
+  MetricsPrintf("cntr_wallclock_synced %u\n", GetWallClockOffset(_offset) ? 1 : 0);
+  MetricsHeader("cntr_isr_to_count_seconds", "histogram", "Latency from the end of the minimum closed time to the counted pulse.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    snprintf(_labels, sizeof(_labels), "channel=\"%u\"", i+1);
+    MetricsHistogram("cntr_isr_to_count_seconds", _labels, hist_IsrToCount[i]);
+  }
+  MetricsHeader("cntr_isr_to_count_max_seconds", "gauge", "Maximum latency from the end of the minimum closed time to the counted pulse.");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) MetricsPrintf("cntr_isr_to_count_max_seconds{channel=\"%u\"} %u.%06u\n", i+1, val_MaxIsrToCount_us[i] / 1000000, val_MaxIsrToCount_us[i] % 1000000);
+  MetricsHeader("cntr_reboot_counter", "gauge", "Stored reboot counter.");
+  MetricsPrintf("cntr_reboot_counter %u\n", _cfg.counter_reboot);
+  // FLASH и MQTT
+  MetricsHeader("cntr_flash_writes_total", "counter", "Configuration commits to flash since boot.");
+  MetricsPrintf("cntr_flash_writes_total %u\n", count_FlashWrites);
+  MetricsHeader("cntr_flash_bytes_written_total", "counter", "Bytes committed to flash since boot.");
+  MetricsPrintf("cntr_flash_bytes_written_total %llu\n", count_FlashBytes);
+  MetricsHeader("cntr_flash_lifetime_hours", "gauge", "Projected flash lifetime at the current write rate (0 - no writes yet).");
+  MetricsPrintf("cntr_flash_lifetime_hours %u\n", GetFlashLifetimeHours());
+  MetricsHeader("cntr_config_generation", "gauge", "Generation number of the last stored configuration copy.");
+  MetricsPrintf("cntr_config_generation %u\n", cfg_Generation);
+  MetricsHeader("cntr_config_boot_source", "gauge", "Configuration source at boot (0..3, see Readme).");
+  MetricsPrintf("cntr_config_boot_source %u\n", s_ConfigSource);
+  MetricsHeader("cntr_config_migrated_layout", "gauge", "Old EEPROM image migrated at boot: 0 - none, 1 - single block, 2 - two copies.");
+  MetricsPrintf("cntr_config_migrated_layout %u\n", s_LegacyLayout);
+  MetricsHeader("cntr_config_migrated_channels", "gauge", "Version of the migrated input parameters block (0 - none).");
+  MetricsPrintf("cntr_config_migrated_channels %u\n", s_LegacyChannels);
+  MetricsHeader("cntr_ota_updates_total", "counter", "Firmware updates written and verified since boot.");
+  MetricsPrintf("cntr_ota_updates_total %u\n", count_OtaUpdates);
+  MetricsHeader("cntr_ota_failures_total", "counter", "Firmware updates aborted since boot.");
+  MetricsPrintf("cntr_ota_failures_total %u\n", count_OtaFailures);
+  MetricsHeader("cntr_ota_last_received_bytes", "gauge", "Bytes received by the last firmware update (image or delta).");
+  MetricsPrintf("cntr_ota_last_received_bytes %u\n", ota_Session.received);
+  MetricsHeader("cntr_ota_last_written_bytes", "gauge", "Firmware bytes written by the last update.");
+  MetricsPrintf("cntr_ota_last_written_bytes %u\n", ota_Session.written);
+  MetricsHeader("cntr_ota_last_duration_seconds", "gauge", "Duration of the last firmware update (first byte to verified image).");
+  MetricsPrintf("cntr_ota_last_duration_seconds %u.%03u\n", ota_Session.time_ms / 1000, ota_Session.time_ms % 1000);
+  MetricsHeader("cntr_ota_last_flash_wait_seconds", "gauge", "Time the last firmware update waited for flash writes.");
+  MetricsPrintf("cntr_ota_last_flash_wait_seconds %u.%03u\n", ota_Session.wait_ms / 1000, ota_Session.wait_ms % 1000);
+  MetricsHeader("cntr_ota_trial_boots", "gauge", "Boots of a not yet confirmed firmware (0 - confirmed).");
+  MetricsPrintf("cntr_ota_trial_boots %u\n", val_OtaTrialBoots);
+  MetricsHeader("cntr_ota_rolled_back", "gauge", "The previous firmware was not confirmed and the boot was returned to this one.");
+  MetricsPrintf("cntr_ota_rolled_back %u\n", f_OtaRolledBack ? 1 : 0);
+  MetricsHeader("cntr_mqtt_connected", "gauge", "MQTT connection state.");
+  MetricsPrintf("cntr_mqtt_connected %u\n", mqttClient.connected() ? 1 : 0);
+  MetricsHeader("cntr_mqtt_reconnects_total", "counter", "MQTT reconnects since boot.");
+  MetricsPrintf("cntr_mqtt_reconnects_total %u\n", count_MQTTReconnects);
+  MetricsHeader("cntr_mqtt_broker_active", "gauge", "Index of the MQTT broker in use (0 - primary, -1 - not selected yet).");
+  MetricsPrintf("cntr_mqtt_broker_active %d\n", mqtt_Active);
+  MetricsHeader("cntr_mqtt_broker_score", "gauge", "Health score of the MQTT broker (0..100).");
+  for (uint8_t i = 0; i < mqtt_BrokerCount; i++) MetricsPrintf("cntr_mqtt_broker_score{broker=\"%u\"} %u\n", i, mqtt_Brokers[i].score);
+  MetricsHeader("cntr_mqtt_broker_connects_total", "counter", "Successful connects to the MQTT broker.");
+  for (uint8_t i = 0; i < mqtt_BrokerCount; i++) MetricsPrintf("cntr_mqtt_broker_connects_total{broker=\"%u\"} %u\n", i, mqtt_Brokers[i].connects);
+  MetricsHeader("cntr_mqtt_broker_failures_total", "counter", "Failed connects to the MQTT broker and lost connections.");
+  for (uint8_t i = 0; i < mqtt_BrokerCount; i++) MetricsPrintf("cntr_mqtt_broker_failures_total{broker=\"%u\"} %u\n", i, mqtt_Brokers[i].errors);
+  MetricsHeader("cntr_mqtt_failovers_total", "counter", "Connects to a different MQTT broker than the previous one.");
+  MetricsPrintf("cntr_mqtt_failovers_total %u\n", count_BrokerFailovers);
+  MetricsHeader("cntr_mqtt_failbacks_total", "counter", "Returns from a backup broker to a higher priority one.");
+  MetricsPrintf("cntr_mqtt_failbacks_total %u\n", count_BrokerFailbacks);
+  MetricsHeader("cntr_mqtt_outage_seconds", "histogram", "MQTT outage duration by cause (causes described in the Readme).");
+  for (uint8_t i = 0; i < OC_COUNT; i++) {
+    snprintf(_labels, sizeof(_labels), "cause=\"%s\"", c_OutageCauses[i]);
+    MetricsHistogram("cntr_mqtt_outage_seconds", _labels, hist_MQTTOutage[i]);
+  }
+  MetricsHeader("cntr_mqtt_outage_max_seconds", "gauge", "Longest MQTT outage after a connection loss since boot.");
+  MetricsPrintf("cntr_mqtt_outage_max_seconds %.3f\n", val_MaxOutage_ms / 1e3);
+  MetricsHeader("cntr_dns_lookups_total", "counter", "DNS lookups of MQTT broker names.");
+  MetricsPrintf("cntr_dns_lookups_total %u\n", count_DNSLookups);
+  MetricsHeader("cntr_dns_cache_hits_total", "counter", "MQTT connects that used a cached broker address.");
+  MetricsPrintf("cntr_dns_cache_hits_total %u\n", count_DNSCacheHits);
+  MetricsHeader("cntr_dns_failures_total", "counter", "Failed DNS lookups of MQTT broker names.");
+  MetricsPrintf("cntr_dns_failures_total %u\n", count_DNSFailures);
+  MetricsHeader("cntr_mqtt_publish_failures_total", "counter", "Failed MQTT publishes since boot.");
+  MetricsPrintf("cntr_mqtt_publish_failures_total %u\n", count_MQTTPublishFails);
+  MetricsHeader("cntr_report_overflows_total", "counter", "State reports dropped because they did not fit the report buffer.");
+  MetricsPrintf("cntr_report_overflows_total %u\n", count_ReportOverflows);
+  MetricsHeader("cntr_diag_overflows_total", "counter", "Diagnostic reports dropped because they did not fit the diag buffer.");
+  MetricsPrintf("cntr_diag_overflows_total %u\n", count_DiagOverflows);
+  MetricsHeader("cntr_udp_requests_total", "counter", "UDP query protocol requests answered.");
+  MetricsPrintf("cntr_udp_requests_total %u\n", count_UdpRequests);
+  MetricsHeader("cntr_udp_rejects_total", "counter", "UDP query protocol requests rejected (bad frame or signature).");
+  MetricsPrintf("cntr_udp_rejects_total %u\n", count_UdpRejects);
+  MetricsHeader("cntr_udp_replays_total", "counter", "Signed UDP requests rejected as replays.");
+  MetricsPrintf("cntr_udp_replays_total %u\n", count_UdpReplays);
+  #ifdef MODBUS_SERVER
+  MetricsHeader("cntr_modbus_requests_total", "counter", "Modbus TCP requests processed.");
+  MetricsPrintf("cntr_modbus_requests_total %u\n", count_ModbusRequests);
+  MetricsHeader("cntr_modbus_exceptions_total", "counter", "Modbus TCP requests answered with an exception.");
+  MetricsPrintf("cntr_modbus_exceptions_total %u\n", count_ModbusErrors);
+  #endif
+  MetricsHeader("cntr_mqtt_commands_total", "counter", "MQTT commands accepted into the command queue.");
+  MetricsPrintf("cntr_mqtt_commands_total %u\n", count_MQTTCommands);
+  MetricsHeader("cntr_mqtt_command_drops_total", "counter", "MQTT commands dropped (queue full or command too long).");
+  MetricsPrintf("cntr_mqtt_command_drops_total %u\n", count_MQTTCmdDrops);
+  MetricsHeader("cntr_mqtt_command_errors_total", "counter", "MQTT commands that could not be parsed.");
+  MetricsPrintf("cntr_mqtt_command_errors_total %u\n", count_MQTTCmdErrors);
+  MetricsHeader("cntr_command_batches_total", "counter", "Command batches executed (JSON array in [SET] or POST /batch).");
+  MetricsPrintf("cntr_command_batches_total %u\n", count_Batches);
+  MetricsHeader("cntr_command_batch_rejects_total", "counter", "Command batches not applied because a command was invalid.");
+  MetricsPrintf("cntr_command_batch_rejects_total %u\n", count_BatchRejects);
+  MetricsHeader("cntr_group_commands_total", "counter", "MQTT commands received from group topics.");
+  MetricsPrintf("cntr_group_commands_total %u\n", count_GroupCommands);
+  MetricsHeader("cntr_commands_skipped_total", "counter", "MQTT commands whose selector addressed other modules.");
+  MetricsPrintf("cntr_commands_skipped_total %u\n", count_CmdSkipped);
+  MetricsHeader("cntr_group_command_rejects_total", "counter", "Group topic commands rejected (keys other than report, diag, trace).");
+  MetricsPrintf("cntr_group_command_rejects_total %u\n", count_GroupRejects);
+  MetricsHeader("cntr_provisions_total", "counter", "Signed configuration blocks applied.");
+  MetricsPrintf("cntr_provisions_total %u\n", count_Provisions);
+  MetricsHeader("cntr_provision_rejects_total", "counter", "Signed configuration blocks rejected (reason in [STATUS]/result).");
+  MetricsPrintf("cntr_provision_rejects_total %u\n", count_ProvisionRejects);
+  MetricsHeader("cntr_mqtt_command_queue_length", "gauge", "MQTT commands waiting in the queue.");
+  MetricsPrintf("cntr_mqtt_command_queue_length %u\n", uxQueueMessagesWaiting(q_MQTTCommands));
+  MetricsHeader("cntr_mqtt_command_seconds", "histogram", "MQTT command latency from receipt to processing (queue) and to the publish.");
+  MetricsHistogram("cntr_mqtt_command_seconds", "stage=\"queue\"", hist_Command[CST_QUEUE]);
+  MetricsHistogram("cntr_mqtt_command_seconds", "stage=\"publish\"", hist_Command[CST_PUBLISH]);
+  MetricsHeader("cntr_report_stage_seconds", "histogram", "Counter value delivery latency by stage (stages described in the Readme).");
+  for (uint8_t i = 0; i < RST_COUNT; i++) {
+    snprintf(_labels, sizeof(_labels), "stage=\"%s\"", c_ReportStageNames[i]);
+    MetricsHistogram("cntr_report_stage_seconds", _labels, hist_Report[i]);
+  }
+  MetricsHeader("cntr_report_stage_max_seconds", "gauge", "Maximum counter value delivery latency by stage.");
+  for (uint8_t i = 0; i < RST_COUNT; i++) MetricsPrintf("cntr_report_stage_max_seconds{stage=\"%s\"} %u.%06u\n", c_ReportStageNames[i], val_MaxReportStage_us[i] / 1000000, val_MaxReportStage_us[i] % 1000000);
+  uint64_t _since_count_us;
+  uint32_t _edge_delay_us;
+  if (GetNewestPulse(_since_count_us, _edge_delay_us)) {
+    MetricsHeader("cntr_pulse_age_seconds", "gauge", "Age of the newest counted pulse (from the start of the closure).");
+    MetricsPrintf("cntr_pulse_age_seconds %llu.%03llu\n", (_since_count_us + _edge_delay_us) / 1000000, (_since_count_us + _edge_delay_us) / 1000 % 1000);
+  }
+  // память и задачи
+  MetricsHeader("cntr_heap_free_bytes", "gauge", "Free heap.");
+  MetricsPrintf("cntr_heap_free_bytes %u\n", ESP.getFreeHeap());
+  MetricsHeader("cntr_heap_largest_free_block_bytes", "gauge", "Largest allocatable heap block.");
+  MetricsPrintf("cntr_heap_largest_free_block_bytes %u\n", ESP.getMaxAllocHeap());
+  MetricsHeader("cntr_heap_min_free_bytes", "gauge", "Minimum free heap since boot.");
+  MetricsPrintf("cntr_heap_min_free_bytes %u\n", ESP.getMinFreeHeap());
+  MetricsHeader("cntr_heap_allocated_blocks", "gauge", "Allocated heap blocks at the last [STATUS] report.");
+  MetricsPrintf("cntr_heap_allocated_blocks %u\n", val_HeapBlocks);
+  MetricsHeader("cntr_heap_block_growth", "gauge", "Heap blocks at the last report minus the first report (0 in steady state).");
+  MetricsPrintf("cntr_heap_block_growth %d\n", (int32_t)(val_HeapBlocks - val_HeapBaseBlocks));
+  #ifdef STATIC_ALLOCATION
+  MetricsHeader("cntr_static_stack_bytes", "gauge", "Statically reserved task stacks: used and pool size.");
+  MetricsPrintf("cntr_static_stack_bytes{kind=\"used\"} %u\n", task_StackUsed);
+  MetricsPrintf("cntr_static_stack_bytes{kind=\"pool\"} %u\n", c_StaticStackPool);
+  #endif
+  MetricsHeader("cntr_task_stack_free_min_bytes", "gauge", "Task stack high-water mark (minimum ever free).");
+  for (uint8_t i = portNUM_PROCESSORS; i < C_PROF_SLOTS; i++) {
+    if (*prof_Tasks[i].handle != NULL) MetricsPrintf("cntr_task_stack_free_min_bytes{task=\"%s\"} %u\n", prof_Tasks[i].name, uxTaskGetStackHighWaterMark(*prof_Tasks[i].handle));
+  }
+  MetricsHeader("cntr_task_cpu_ticks_total", "counter", "Scheduler ticks that found the task running.");
+  for (uint8_t i = portNUM_PROCESSORS; i < C_PROF_SLOTS; i++) {
+    if (*prof_Tasks[i].handle != NULL) MetricsPrintf("cntr_task_cpu_ticks_total{task=\"%s\"} %u\n", prof_Tasks[i].name, prof_Tasks[i].ticks);
+  }
+  MetricsHeader("cntr_cpu_ticks_total", "counter", "Scheduler ticks per core.");
+  for (uint8_t i = 0; i < portNUM_PROCESSORS; i++) MetricsPrintf("cntr_cpu_ticks_total{core=\"%u\"} %u\n", i, count_Ticks[i]);
+  MetricsHeader("cntr_cpu_idle_ticks_total", "counter", "Scheduler ticks that found the core idle.");
+  for (uint8_t i = 0; i < portNUM_PROCESSORS; i++) MetricsPrintf("cntr_cpu_idle_ticks_total{core=\"%u\"} %u\n", i, prof_Tasks[i].ticks);
+  MetricsHeader("cntr_uptime_seconds", "counter", "Time since boot.");
+  MetricsPrintf("cntr_uptime_seconds %lu\n", millis() / 1000);
+  MetricsFlush();
+  WEB_Server.sendContent("");                                                   // завершаем chunked передачу
+  Trace(TE_WEB_PAGE, WP_METRICS);
+}
+
+// ------------------------- диагностика: загрузка задач, стек и состояние памяти -------------------------------
+// отчёт собирается только по запросу (страница /diag или период публикации в MQTT), без запроса затраты - только счёт тиков
+
+size_t BufPrintf(char *Buf, size_t Size, size_t Len, const char *fmt, ...) { // добавление форматированной строки в буфер, возвращает новую длину (Size - текст обрезан)
+  if (Len >= Size) return Size;
+  va_list args;
+  va_start(args, fmt);
+  int _add = vsnprintf(Buf + Len, Size - Len, fmt, args);
+  va_end(args);
+  if (_add < 0) return Len;
+  return (Len + _add < Size) ? Len + _add : Size;                               // при переполнении строка обрезается
+}
+
+size_t BuildDiagReport(char *Buf, size_t Size, DiagWindow &Window) { // сборка диагностического отчёта в JSON, 0 - отчёт не поместился в буфер
+  // длительность окна - по счётчику тиков планировщика: в light sleep (tickless idle) хук тика не вызывается, а счётчик
+  // после сна досчитывается - пропущенные хуком тики ядро спало, они учитываются как простой
+  uint32_t _core_ticks = xTaskGetTickCount() - Window.os_ticks;
+  uint32_t _other = 0;
+  uint32_t _free = ESP.getFreeHeap();
+  uint32_t _largest = ESP.getMaxAllocHeap();
+  size_t   _len = 0;
+
+  for (uint8_t i = 0; i < portNUM_PROCESSORS; i++) _other += count_OtherTicks[i];
+  if (_core_ticks == 0) _core_ticks = 1;
+  _len = BufPrintf(Buf, Size, _len, "{\"uptime\":%lu,\"heap\":{\"free\":%u,\"largest\":%u,\"min_free\":%u,\"frag\":%u,\"blocks\":%u,\"growth\":%d},\"cpu_busy\":[", 
+                   millis() / 1000, _free, _largest, ESP.getMinFreeHeap(), (_free > 0) ? 100 - (uint32_t)((uint64_t)_largest * 100 / _free) : 0,
+                   val_HeapBlocks, (int32_t)(val_HeapBlocks - val_HeapBaseBlocks));
+  for (uint8_t i = 0; i < portNUM_PROCESSORS; i++) {                            // загрузка ядер = 100% - доля задачи простоя
+    uint32_t _hooked = count_Ticks[i] - Window.core_ticks[i];
+    uint32_t _idle = prof_Tasks[i].ticks - Window.task_ticks[i] + ((_hooked < _core_ticks) ? _core_ticks - _hooked : 0);
+    _len = BufPrintf(Buf, Size, _len, "%s%u", (i > 0) ? "," : "", (_idle < _core_ticks) ? 100 - _idle * 100 / _core_ticks : 0);
+  }
+  _len = BufPrintf(Buf, Size, _len, "],\"flash\":{\"writes\":%u,\"generation\":%u,\"boot_source\":%u,\"lifetime_h\":%u}", 
+                   count_FlashWrites, cfg_Generation, s_ConfigSource, GetFlashLifetimeHours());
+  _len = BufPrintf(Buf, Size, _len, ",\"ota\":{\"state\":\"%s\",\"updates\":%u,\"failures\":%u,\"trial_boots\":%u}", 
+                   c_OtaStates[ota_Session.state], count_OtaUpdates, count_OtaFailures, val_OtaTrialBoots);
+  _len = BufPrintf(Buf, Size, _len, ",\"mqtt\":{\"commands\":%u,\"drops\":%u,\"errors\":%u,\"queue\":%u,\"publish_fails\":%u", 
+                   count_MQTTCommands, count_MQTTCmdDrops, count_MQTTCmdErrors, uxQueueMessagesWaiting(q_MQTTCommands), count_MQTTPublishFails);
+  _len = BufPrintf(Buf, Size, _len, ",\"broker\":%d,\"failovers\":%u,\"failbacks\":%u,\"outage_ms\":%u,\"max_outage_ms\":%u,\"dns_hits\":%u,\"dns_lookups\":%u}", 
+                   mqtt_Active, count_BrokerFailovers, count_BrokerFailbacks, val_LastOutage_ms, val_MaxOutage_ms, count_DNSCacheHits, count_DNSLookups);
+  uint64_t _since_count_us;
+  uint32_t _edge_delay_us;
+  _len = BufPrintf(Buf, Size, _len, ",\"freshness\":{\"pulse_age\":%lld", 
+                   GetNewestPulse(_since_count_us, _edge_delay_us) ? (int64_t)((_since_count_us + _edge_delay_us) / 1000) : -1LL);
+  for (uint8_t i = 0; i < RST_COUNT; i++) {                                     // максимальные задержки этапов доставки значения счётчика в мс
+    _len = BufPrintf(Buf, Size, _len, ",\"%s\":%u", c_ReportStageNames[i], val_MaxReportStage_us[i] / 1000);
+  }
+  _len = BufPrintf(Buf, Size, _len, "},\"inputs\":[");
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {                                // отброшенные помехи и дребезг по входам - для подбора параметров фильтра
+    _len = BufPrintf(Buf, Size, _len, "%s{\"glitches\":%u,\"bounces\":%u,\"overflows\":%u}", (i > 0) ? "," : "", 
+                     count_DebounceReject[i], count_BounceEdges[i], count_EdgeOverflows[i]);
+  }
+  _len = BufPrintf(Buf, Size, _len, "],\"tasks\":[");
+  for (uint8_t i = portNUM_PROCESSORS; i < C_PROF_SLOTS; i++) {                 // доля одного ядра для каждой задачи и минимальный свободный стек
+    TaskHandle_t _handle = *prof_Tasks[i].handle;
+    if (_handle == NULL) continue;
+    uint32_t _ticks = prof_Tasks[i].ticks - Window.task_ticks[i];
+    _len = BufPrintf(Buf, Size, _len, "{\"name\":\"%s\",\"cpu\":%u.%u,\"stack_free\":%u},", prof_Tasks[i].name,
+                     _ticks * 100 / _core_ticks, (_ticks * 1000 / _core_ticks) % 10, uxTaskGetStackHighWaterMark(_handle));
+  }
+  uint32_t _other_ticks = _other - Window.other_ticks;
+  _len = BufPrintf(Buf, Size, _len, "{\"name\":\"other\",\"cpu\":%u.%u}]}", _other_ticks * 100 / _core_ticks, (_other_ticks * 1000 / _core_ticks) % 10);
+  // запоминаем начало следующего окна
+  for (uint8_t i = 0; i < C_PROF_SLOTS; i++) Window.task_ticks[i] = prof_Tasks[i].ticks;
+  Window.other_ticks = _other;
+  for (uint8_t i = 0; i < portNUM_PROCESSORS; i++) Window.core_ticks[i] = count_Ticks[i];
+  Window.os_ticks = xTaskGetTickCount();
+  if (_len >= Size) {                                                           // обрезанный JSON не отдаем (окно загрузки все равно начато заново)
+    count_DiagOverflows++;
+    return 0;
+  }
+  return _len;
+}
+
+void handleUpdateUpload() { // прием образа прошивки или дельты: POST /update?sha256=<hex>&sig=<hex> (форма или curl -F image=@firmware.bin)
+  HTTPUpload &_upload = WEB_Server.upload();
+  switch (_upload.status) {
+    case UPLOAD_FILE_START:
+      ota_HttpReject = OtaAuthorize("", WEB_Server.arg(jk_SHA256).c_str(), WEB_Server.arg(jk_SIG).c_str());
+      f_OtaHttp = (ota_HttpReject == OE_NONE) and (OtaBegin("http", WEB_Server.arg(jk_SHA256).c_str()) == OE_NONE);
+      break;
+    case UPLOAD_FILE_WRITE:
+      if (f_OtaHttp) OtaWrite(_upload.buf, _upload.currentSize);
+      break;
+    case UPLOAD_FILE_END:
+      if (f_OtaHttp) OtaEnd(true);
+      break;
+    case UPLOAD_FILE_ABORTED:
+      if (f_OtaHttp) OtaEnd(false);
+      break;
+  }
+}
+
+void handleUpdatePage() { // ответ на загрузку прошивки: состояние обновления, после успешной записи - перезагрузка
+  char _buf[320];
+  bool _owner = f_OtaHttp;
+  f_OtaHttp = false;
+  Trace(TE_WEB_PAGE, WP_UPDATE);
+  if (ota_HttpReject != OE_NONE) {                                            // нет подписи - образ не принимался
+    snprintf(_buf, sizeof(_buf), "{\"state\":\"rejected\",\"error\":\"%s\"}", c_OtaErrors[ota_HttpReject]);
+    ota_HttpReject = OE_NONE;
+    WEB_Server.send(403, "application/json", _buf);
+    return;
+  }
+  BuildOtaStatus(_buf, sizeof(_buf));
+  if (!_owner) {                                                              // образа в запросе не было или идет другое обновление
+    WEB_Server.send((ota_Session.state == OS_RUNNING) ? 409 : 400, "application/json", _buf);
+    return;
+  }
+  WEB_Server.send((ota_Session.state == OS_DONE) ? 200 : 500, "application/json", _buf);
+  if (ota_Session.state == OS_DONE) {
+    vTaskDelay(pdMS_TO_TICKS(500));                                           // делаем задержку перед перезагрузкой чтобы сервер успел отправить ответ
+    cmdReset();
+  }
+}
+
+void handlePulseLogPage() { // процедура выгрузки журнала импульсов: /pulses?format=bin|ndjson&since=N
+// since - номер первой нужной записи (next_seq прошлой выгрузки), записи, уже вытесненные из кольца, пропускаются
+  int64_t  _offset = 0;
+  bool     _synced = GetWallClockOffset(_offset);
+  bool     _binary = WEB_Server.arg("format").equals("bin");
+  uint32_t _first, _next;
+  uint32_t _since = strtoul(WEB_Server.arg("since").c_str(), NULL, 10);
+  // журнал пополняется во время выгрузки - отдаем копию, снятую на момент запроса
+  uint32_t _count = PulseLogSnapshot(WEB_Server.hasArg("since") ? &_since : NULL, _first, _next);
+  metrics_Out.len = 0;
+  WEB_Server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  if (_binary) {
+    PulseLogHeader _header = {0x474F4C50, C_PULSE_LOG_VERSION, sizeof(PulseLogEntry), C_INP_CHANNELS, _synced, _first, _count, _next, _synced ? _offset : 0};
+    WEB_Server.send(200, "application/octet-stream", "");
+    WEB_Server.sendContent((const char*)&_header, sizeof(_header));
+    if (_count > 0) WEB_Server.sendContent((const char*)pulse_LogSnapshot, _count * sizeof(PulseLogEntry));
+  }
+  else {
+    WEB_Server.send(200, "application/x-ndjson", "");
+    MetricsPrintf("{\"first_seq\":%u,\"next_seq\":%u,\"synced\":%s}\n", _first, _next, _synced ? "true" : "false");
+    for (uint32_t i = 0; i < _count; i++) {
+      PulseLogEntry &_entry = pulse_LogSnapshot[i];
+      int64_t _time = ((int64_t)_entry.time_hi << 32) | _entry.time_lo;
+      if (_synced) MetricsPrintf("{\"seq\":%u,\"ch\":%u,\"mono_us\":%lld,\"unix_us\":%lld}\n", _first + i, _entry.channel + 1, _time, _time + _offset);
+        else MetricsPrintf("{\"seq\":%u,\"ch\":%u,\"mono_us\":%lld}\n", _first + i, _entry.channel + 1, _time);
+    }
+  }
+  MetricsFlush();
+  WEB_Server.sendContent("");                                                 // конец chunked ответа
+  Trace(TE_WEB_PAGE, WP_PULSES);
+}
+
+// ------------------------- журнал трассировки: выгрузка по HTTP и в топик [STATUS]/trace -------------------------------
+
+void TraceFillHeader(TraceHeader &Header, uint32_t First, uint32_t Count, uint32_t Next) { // заголовок двоичной выгрузки журнала трассировки
+  Header = {0x43525443, C_TRACE_VERSION, sizeof(TraceEntry), 0, trace_Mask, First, Count, Next, (uint32_t)micros()};
+}
+
+void handleTracePage() { // процедура выгрузки журнала трассировки: /trace?format=bin|ndjson&since=N, /trace?mask=M - включение категорий
+// since - номер первого нужного события (next_seq прошлой выгрузки), маска - десятичная или 0x...
+  TraceEntry  _chunk[16];
+  TraceHeader _header;
+  bool        _binary = WEB_Server.arg("format").equals("bin");
+  if (WEB_Server.hasArg("mask")) TraceSetMask(strtoul(WEB_Server.arg("mask").c_str(), NULL, 0));
+  Trace(TE_WEB_PAGE, WP_TRACE);
+  uint32_t _next = trace_Head;                                                // журнал пополняется во время выгрузки - отдаем события до этого номера
+  uint32_t _first = TraceOldest();
+  if (WEB_Server.hasArg("since")) {
+    uint32_t _since = strtoul(WEB_Server.arg("since").c_str(), NULL, 10);
+    if ((int32_t)(_since - _first) > 0) _first = ((int32_t)(_since - _next) < 0) ? _since : _next;
+  }
+  metrics_Out.len = 0;
+  WEB_Server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  if (_binary) {
+    TraceFillHeader(_header, _first, _next - _first, _next);
+    WEB_Server.send(200, "application/octet-stream", "");
+    WEB_Server.sendContent((const char*)&_header, sizeof(_header));
+  }
+  else {
+    WEB_Server.send(200, "application/x-ndjson", "");
+    MetricsPrintf("{\"first_seq\":%u,\"next_seq\":%u,\"mask\":%u,\"now_us\":%u}\n", _first, _next, trace_Mask, (uint32_t)micros());
+  }
+  // события, перезаписанные до выгрузки или еще не заполненные, пропускаются - номера seq в выгрузке идут с пропуском
+  for (uint32_t _seq = _first; (int32_t)(_seq - _next) < 0; ) {
+    uint32_t _oldest = TraceOldest();
+    if ((int32_t)(_seq - _oldest) < 0) _seq = _oldest;
+    if ((int32_t)(_seq - _next) >= 0) break;
+    uint32_t _count = TraceRead(_seq, _chunk, min((uint32_t)(sizeof(_chunk) / sizeof(_chunk[0])), _next - _seq));
+    if (_count == 0) {
+      _seq++;
+      continue;
+    }
+    if (_binary) WEB_Server.sendContent((const char*)_chunk, _count * sizeof(TraceEntry));
+    else for (uint32_t i = 0; i < _count; i++) {
+      MetricsPrintf("{\"seq\":%u,\"us\":%u,\"core\":%u,\"ev\":\"%s\",\"a0\":%u,\"a1\":%u}\n", _chunk[i].seq, _chunk[i].time_us, _chunk[i].core, 
+                    TraceEventName(_chunk[i].id), _chunk[i].arg0, _chunk[i].arg1);
+    }
+    _seq += _count;
+  }
+  MetricsFlush();
+  WEB_Server.sendContent("");                                                 // конец chunked ответа
+}
+
+void PublishTrace() { // выгрузка журнала трассировки в топик [STATUS]/trace: порции из заголовка TraceHeader и до C_TRACE_MQTT_CHUNK записей
+  GlobalParams _cfg;
+  char         _topic[sizeof(_cfg.report_topic) + 8];
+  uint32_t     _buf[(sizeof(TraceHeader) + C_TRACE_MQTT_CHUNK * sizeof(TraceEntry)) / sizeof(uint32_t)];
+  TraceHeader  _header;
+  TraceEntry   *_entries = (TraceEntry*)((uint8_t*)_buf + sizeof(TraceHeader));
+  static_assert(sizeof(TraceHeader) % sizeof(uint32_t) == 0, "записи порции должны быть выровнены");
+
+  if (!mqttClient.connected()) return;
+  GetConfigSnapshot(_cfg);
+  snprintf(_topic, sizeof(_topic), "%s/trace", _cfg.report_topic);
+  uint32_t _next = trace_Head;
+  for (uint32_t _seq = TraceOldest(); (int32_t)(_seq - _next) < 0; ) {
+    uint32_t _oldest = TraceOldest();
+    if ((int32_t)(_seq - _oldest) < 0) _seq = _oldest;
+    if ((int32_t)(_seq - _next) >= 0) break;
+    uint32_t _count = TraceRead(_seq, _entries, min((uint32_t)C_TRACE_MQTT_CHUNK, _next - _seq));
+    if (_count == 0) {
+      _seq++;
+      continue;
+    }
+    TraceFillHeader(_header, _seq, _count, _next);
+    memcpy(_buf, &_header, sizeof(_header));
+    uint8_t _try = 0;
+    while (PublishMQTT(_topic, false, (const char*)_buf, sizeof(TraceHeader) + _count * sizeof(TraceEntry)) == 0) {
+      if (++_try >= C_TRACE_MQTT_RETRY) return;                               // буфер отправки не освобождается - выгрузку прекращаем
+      vTaskDelay(pdMS_TO_TICKS(50));
+    }
+    _seq += _count;
+  }
+}
+
+void handleDiagPage() { // процедура генерации страницы /diag - диагностика с момента прошлого запроса страницы
+  static DiagWindow _window = {};
+  char _buf[C_DIAG_BUF_SIZE];
+  size_t _len = BuildDiagReport(_buf, sizeof(_buf), _window);
+  if (_len == 0) {
+    Trace(TE_DIAG_OVERFLOW, 0, sizeof(_buf));
+    WEB_Server.send(500, "application/json", "{\"error\":\"overflow\"}");
+    return;
+  }
+  WEB_Server.setContentLength(_len);
+  WEB_Server.send(200, "application/json", "");
+  WEB_Server.sendContent(_buf, _len);
+  Trace(TE_WEB_PAGE, WP_DIAG);
+}
+
+// ------------------------- список MQTT серверов: выбор, оценка исправности и кэш DNS -------------------------------
+
+void AddBroker(const char *Host, size_t Length, uint16_t Port) { // добавление сервера в конец списка
+  if ((Length == 0) or (mqtt_BrokerCount >= C_MQTT_BROKERS)) return;
+  MqttBroker &_b = mqtt_Brokers[mqtt_BrokerCount++];
+  memset((void*)&_b, 0, sizeof(_b));
+  memcpy(_b.host, Host, min(Length, sizeof(_b.host) - 1));
+  _b.port = Port;
+  _b.literal = _b.ip.fromString(_b.host);                            // IP адрес не требует DNS и не устаревает
+  _b.resolved = _b.literal;
+  _b.score = 100;                                                    // до первой неудачи все серверы считаются исправными
+}
+
+void LoadBrokerList(const GlobalParams &Cfg) { // построение списка серверов из конфигурации: основной, затем резервные "host[:port],..."
+  const char *_p = Cfg.mqtt_backup;
+  mqtt_BrokerCount = 0;
+  mqtt_CycleFailed = 0;
+  mqtt_Active = -1;
+  mqtt_LastConnected = -1;
+  AddBroker(Cfg.mqtt_host_s, strlen(Cfg.mqtt_host_s), Cfg.mqtt_port);
+  while (*_p) {
+    while ((*_p == ',') or (*_p == ';') or (*_p == ' ')) _p++;      // разделители и пробелы между серверами
+    size_t _len = strcspn(_p, ",; ");
+    if (_len == 0) break;
+    const char *_colon = (const char*)memchr(_p, ':', _len);
+    uint16_t _port = Cfg.mqtt_port;                                  // без порта - порт основного сервера
+    if (_colon != NULL) {
+      long _value = atol(_colon + 1);
+      if ((_value > 0) and (_value <= 0xFFFF)) _port = _value;
+    }
+    AddBroker(_p, (_colon != NULL) ? (size_t)(_colon - _p) : _len, _port);
+    _p += _len;
+  }
+}
+
+bool ResolveBroker(uint8_t Index) { // адрес сервера: из кэша, пока не истек C_DNS_TTL, иначе запрос к DNS
+  MqttBroker &_b = mqtt_Brokers[Index];
+  IPAddress _ip;
+  if (_b.literal) return true;
+  if (_b.resolved and (millis() - _b.tm_resolved < C_DNS_TTL)) {
+    count_DNSCacheHits++;
+    return true;
+  }
+  count_DNSLookups++;
+  if ((WiFi.hostByName(_b.host, _ip) == 1) and ((uint32_t)_ip != 0)) {
+    _b.ip = _ip;
+    _b.resolved = true;
+    _b.tm_resolved = millis();
+    Trace(TE_MQTT_DNS, Index, (uint32_t)_ip);
+    return true;
+  }
+  // DNS недоступен - подключаемся по прежнему адресу: сервер скорее всего не сменил адрес, а без кэша связи не будет совсем
+  count_DNSFailures++;
+  Trace(TE_MQTT_DNS_FAIL, Index, _b.resolved);
+  return _b.resolved;
+}
+
+void BrokerResult(uint8_t Index, bool Success) { // учет результата подключения к серверу: оценка исправности и пауза перед повтором
+  MqttBroker &_b = mqtt_Brokers[Index];
+  if (Success) {
+    _b.connects++;
+    _b.failures = 0;
+    _b.score += (101 - _b.score) / 2;
+    _b.tm_retry = millis();
+    return;
+  }
+  _b.errors++;
+  if (_b.failures < 0xFF) _b.failures++;
+  _b.score /= 2;
+  _b.tm_retry = millis() + min((uint32_t)C_MQTT_BACKOFF_MIN << min(_b.failures - 1, 6), (uint32_t)C_MQTT_BACKOFF_MAX);
+  if ((_b.failures % C_DNS_REFRESH_FAILS) == 0) _b.tm_resolved = millis() - C_DNS_TTL;   // сервер мог сменить адрес - следующая попытка спросит DNS
+}
+
+int8_t SelectBroker(uint32_t &Wait_ms) { // выбор сервера для подключения: первый исправный по порядку, иначе самый исправный из доступных
+  uint32_t _now = millis();
+  int8_t   _best = -1;
+  Wait_ms = C_MQTT_BACKOFF_MAX;
+  for (uint8_t i = 0; i < mqtt_BrokerCount; i++) {
+    int32_t _left = (int32_t)(mqtt_Brokers[i].tm_retry - _now);
+    if (_left > 0) {                                                 // пауза после неудачи еще не прошла
+      Wait_ms = min(Wait_ms, (uint32_t)_left);
+      continue;
+    }
+    if (mqtt_Brokers[i].score >= C_MQTT_HEALTHY) return i;
+    if ((_best < 0) or (mqtt_Brokers[i].score > mqtt_Brokers[_best].score)) _best = i;
+  }
+  return _best;
+}
+
+size_t MqttPutString(uint8_t *Buf, size_t Pos, const char *Text) { // строка MQTT: длина (2 байта, старший первым) и текст
+  size_t _len = strlen(Text);
+  Buf[Pos++] = _len >> 8;
+  Buf[Pos++] = _len & 0xFF;
+  memcpy(Buf + Pos, Text, _len);
+  return Pos + _len;
+}
+
+bool ProbeBroker(uint8_t Index) { // проверка сервера сеансом MQTT: CONNECT с теми же учетными данными, ответ CONNACK "принято", DISCONNECT
+  // одного TCP соединения мало - "зависший" сервер принимает соединения, но не отвечает MQTT, и модуль уходил бы на него и обратно
+  const uint8_t c_Connect[10] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02, 0x00, 10};   // MQTT 3.1.1, чистый сеанс, keepalive 10 сек
+  const uint8_t c_Disconnect[2] = {0xE0, 0x00};
+  GlobalParams _cfg;
+  WiFiClient   _client;
+  char         _id[48];
+  uint8_t      _pkt[3 + sizeof(c_Connect) + 6 + sizeof(_id) + sizeof(_cfg.mqtt_usr) + sizeof(_cfg.mqtt_pwd)];
+  uint8_t      _ack[4];
+  size_t       _len = 3;                                             // тело пакета - после места под тип и длину (до 2 байт)
+  uint8_t      _start;
+
+  if (!ResolveBroker(Index)) return false;
+  GetConfigSnapshot(_cfg);
+  snprintf(_id, sizeof(_id), "%s-probe", ControllerName.c_str());     // другой идентификатор - основной сеанс модуля не вытесняется
+  memcpy(_pkt + _len, c_Connect, sizeof(c_Connect));
+  _len = MqttPutString(_pkt, _len + sizeof(c_Connect), _id);
+  if (_cfg.mqtt_usr[0] != '\0') {
+    _pkt[3 + 7] |= 0x80;                                             // флаги: есть имя пользователя
+    _len = MqttPutString(_pkt, _len, _cfg.mqtt_usr);
+    if (_cfg.mqtt_pwd[0] != '\0') {
+      _pkt[3 + 7] |= 0x40;                                           // есть пароль
+      _len = MqttPutString(_pkt, _len, _cfg.mqtt_pwd);
+    }
+  }
+  if (_len - 3 < 128) {                                              // длина тела - наименьшим числом байт
+    _start = 1;
+    _pkt[2] = _len - 3;
+  } else {
+    _start = 0;
+    _pkt[1] = ((_len - 3) & 0x7F) | 0x80;
+    _pkt[2] = (_len - 3) >> 7;
+  }
+  _pkt[_start] = 0x10;                                               // CONNECT
+  if (!_client.connect(mqtt_Brokers[Index].ip, mqtt_Brokers[Index].port, C_MQTT_PROBE_TIMEOUT)) return false;
+  bool     _sent = (_client.write(_pkt + _start, _len - _start) == _len - _start);
+  uint32_t _begin_ms = millis();
+  size_t   _got = 0;
+  while (_sent and (_got < sizeof(_ack)) and (millis() - _begin_ms < C_MQTT_PROBE_TIMEOUT) and _client.connected()) {   // ждем CONNACK
+    if (_client.available() > 0) _ack[_got++] = _client.read();
+      else vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  bool _ok = (_got == sizeof(_ack)) and (_ack[0] == 0x20) and (_ack[1] == 0x02) and (_ack[3] == 0x00);   // CONNACK, код 0 - принято
+  if (_ok) _client.write(c_Disconnect, sizeof(c_Disconnect));
+  _client.stop();
+  return _ok;
+}
+
+void OutageBegin(uint8_t Cause) { // начало перерыва связи с MQTT (если перерыв уже идет - остается его начало и причина)
+  if (f_MQTTOutage) return;
+  val_OutageCause = Cause;
+  tm_MQTTLost = millis();
+  f_MQTTOutage = true;
+}
+
+uint32_t OutageEnd() { // конец перерыва связи: длительность в гистограмму по причине, возвращает длительность в мс
+  if (!f_MQTTOutage) return 0;
+  uint32_t _outage_ms = millis() - tm_MQTTLost;
+  f_MQTTOutage = false;
+  val_LastOutage_ms = _outage_ms;
+  if ((val_OutageCause == OC_LOST) and (_outage_ms > val_MaxOutage_ms)) val_MaxOutage_ms = _outage_ms;
+  HistogramAdd(hist_MQTTOutage[val_OutageCause], min(_outage_ms, (uint32_t)(UINT32_MAX / 1000)) * 1000);
+  return _outage_ms;
+}
+
+void BrokerConnected(uint8_t Index) { // подключение к серверу установлено: замер перерыва связи
+  uint32_t _outage_ms = OutageEnd();
+  BrokerResult(Index, true);
+  if ((mqtt_LastConnected >= 0) and (mqtt_LastConnected != Index)) {
+    count_BrokerFailovers++;
+    Trace(TE_MQTT_BROKER, Index, _outage_ms);
+  }
+  mqtt_LastConnected = Index;
+}
+
+void LoadGroupTopics(const char *List) { // разбор списка групповых топиков "topic,topic" (топики с символами подстановки пропускаются)
+  const char *_p = List;
+  strlcpy(mqtt_GroupList, List, sizeof(mqtt_GroupList));
+  mqtt_GroupCount = 0;
+  while (*_p and (mqtt_GroupCount < C_GROUP_TOPICS)) {
+    while ((*_p == ',') or (*_p == ';') or (*_p == ' ')) _p++;      // разделители и пробелы между топиками
+    size_t _len = strcspn(_p, ",; ");
+    if (_len == 0) break;
+    if ((_len < sizeof(mqtt_GroupTopics[0])) and (strcspn(_p, "+#") >= _len)) {
+      memcpy(mqtt_GroupTopics[mqtt_GroupCount], _p, _len);
+      mqtt_GroupTopics[mqtt_GroupCount++][_len] = '\0';
+    }
+    _p += _len;
+  }
+}
+
+void SubscribeGroupTopics(bool Subscribe) { // подписка на групповые топики или отписка от них
+  for (uint8_t i = 0; i < mqtt_GroupCount; i++) {
+    if (Subscribe) mqttClient.subscribe(mqtt_GroupTopics[i], 0);
+      else mqttClient.unsubscribe(mqtt_GroupTopics[i]);
+  }
+}
+
+bool IsGroupTopic(const char *Topic) { // сообщение пришло в групповой топик
+  for (uint8_t i = 0; i < mqtt_GroupCount; i++) {
+    if (strcmp(Topic, mqtt_GroupTopics[i]) == 0) return true;
+  }
+  return false;
+}
+
+void ApplyConnectionChanges(uint8_t Impact) { // применение изменений конфигурации в задаче WiFi: переподписка, переподключение к MQTT или к WiFi
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);
+  Trace(TE_CFG_APPLY, Impact, s_CurrentWIFIMode);
+  if (Impact & (CI_WIFI | CI_MQTT)) {
+    if (mqttClient.connected()) {                                   // уходим с сервера штатно - без срабатывания LWT
+      PublishMQTT(mqtt_LwtTopic, true, jv_OFFLINE);
+      mqttClient.disconnect();
+      for (uint8_t w = 0; (w < 10) and mqttClient.connected(); w++) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+    }
+    OutageBegin((Impact & CI_WIFI) ? OC_CONFIG_WIFI : OC_CONFIG_MQTT);
+    LoadBrokerList(_cfg);                                           // новый список серверов, оценки и кэш DNS - с начала
+    count_GetWiFiConfig = 0;                                        // с новыми параметрами - новый отсчёт попыток
+    count_GetMQTTConfig = 0;
+    if ((Impact & CI_WIFI) or !WiFi.isConnected() or (s_CurrentWIFIMode == WF_AP) or (s_CurrentWIFIMode == WF_OFF)) s_CurrentWIFIMode = WF_UNKNOWN;
+      else s_CurrentWIFIMode = WF_CLIENT;                           // WiFi не трогаем - только подключение к MQTT
+    return;
+  }
+  if (!mqttClient.connected()) return;                              // топики применятся при подключении
+  if (strcmp(mqtt_CommandTopic, _cfg.command_topic) != 0) {
+    OutageBegin(OC_CONFIG_TOPIC);                                   // команды не принимаются до подтверждения подписки на новый топик
+    mqttClient.unsubscribe(mqtt_CommandTopic);
+    strlcpy(mqtt_CommandTopic, _cfg.command_topic, sizeof(mqtt_CommandTopic));
+    val_ResubscribePacketId = mqttClient.subscribe(mqtt_CommandTopic, 0);
+  }
+  if (strcmp(mqtt_LwtTopic, _cfg.lwt_topic) != 0) {
+    PublishMQTT(mqtt_LwtTopic, true, jv_OFFLINE);                   // старый топик доступности больше не обновляется
+    strlcpy(mqtt_LwtTopic, _cfg.lwt_topic, sizeof(mqtt_LwtTopic));
+    PublishMQTT(mqtt_LwtTopic, true, jv_ONLINE);
+  }
+  if (strcmp(mqtt_GroupList, _cfg.group_topics) != 0) {
+    SubscribeGroupTopics(false);
+    LoadGroupTopics(_cfg.group_topics);
+    SubscribeGroupTopics(true);
+  }
+}
+
+// -------------------------- описание call-back функции MQTT клиента ------------------------------------
+
+void onMqttConnect(bool sessionPresent) { // обработчик подключения к MQTT
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);
+  if (f_MQTTWasConnected) count_MQTTReconnects++;                         // считаем повторные подключения к серверу
+  f_MQTTWasConnected = true;
+  // топики запоминаем - при их изменении на лету нужно отписаться от старого топика команд и снять online со старого LWT
+  strlcpy(mqtt_CommandTopic, _cfg.command_topic, sizeof(mqtt_CommandTopic));
+  strlcpy(mqtt_LwtTopic, _cfg.lwt_topic, sizeof(mqtt_LwtTopic));
+  // далее подписываем ESP32 на набор необходимых для управления топиков:
+  uint16_t packetIdSub = mqttClient.subscribe(mqtt_CommandTopic, 0);      // подписываем ESP32 на топик SET_TOPIC
+  LoadGroupTopics(_cfg.group_topics);
+  SubscribeGroupTopics(true);                                             // и на групповые топики
+  Trace(TE_MQTT_UP, packetIdSub);
+  // сразу публикуем событие о своей активности
+  PublishMQTT(mqtt_LwtTopic, true, jv_ONLINE);                           // публикуем в топик LWT_TOPIC событие о своей жизнеспособности
+}
+
+void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) { // обработчик отключения от MQTT
+  Trace(TE_MQTT_DOWN, (uint16_t)reason);
+  f_MQTTDown = true;                                                // переподключение (к тому же или резервному серверу) решает задача WiFi
+  NotifyTask(th_WiFi);                                              // будим ее
+}
+
+void onMqttSubscribe(uint16_t packetId, uint8_t qos) { // обработка подтверждения подписки на топик
+  Trace(TE_MQTT_SUBSCRIBED, packetId, qos);
+  if ((packetId != 0) and (packetId == val_ResubscribePacketId)) {        // подписка на новый топик команд - команды снова принимаются
+    val_ResubscribePacketId = 0;
+    OutageEnd();
+  }
+}
+
+void onMqttUnsubscribe(uint16_t packetId) { // обработка подтверждения отписки от топика
+}
+
+void ReportAcked(uint32_t Ack_us, uint64_t EdgeAge_us) { // подтверждение сервером отчёта, переданного Ack_us назад
+  ReportStageAdd(RST_PUBLISH_TO_ACK, Ack_us);
+  if (EdgeAge_us != 0) ReportStageAdd(RST_EDGE_TO_ACK, EdgeAge_us + Ack_us);
+}
+
+void onMqttPublish(uint16_t packetId) { // обработка подтверждения публикации
+  uint32_t _now_us = micros();
+  uint32_t _publish_us = 0;
+  uint64_t _edge_age_us = 0;
+  bool     _report = false;
+  Trace(TE_MQTT_PUBLISHED, packetId);
+  if (packetId == 0) return;
+  portENTER_CRITICAL(&mux_ReportAck);
+  if (packetId == val_ReportPacketId) {                                     // подтверждаются только публикации отчёта (QoS 1)
+    _report = true;
+    _publish_us = tmu_ReportPublish;
+    _edge_age_us = val_ReportEdgeAge_us;
+    val_ReportPacketId = 0;
+  } else {                                                                  // возможно, номер отчёта еще не записан
+    val_EarlyAckPacketId = packetId;
+    tmu_EarlyAck = _now_us;
+  }
+  portEXIT_CRITICAL(&mux_ReportAck);
+  if (_report) ReportAcked(_now_us - _publish_us, _edge_age_us);
+}
+
+void onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) { // в этой функции обрабатываем события получения данных в управляющем топике SET_TOPIC
+  MQTTCommand _cmd;
+  bool _group = IsGroupTopic(topic);
+  // проверяем, что мы получили MQTT сообщение в командном топике (своем или групповом)
+  if (_group or (strcmp(topic, mqtt_CommandTopic) == 0)) {
+    // копируем команду в очередь - разбор и выполнение идут в задаче обработки событий, клиент MQTT не ждет их окончания
+    if ((index != 0) or (len != total) or (len >= sizeof(_cmd.payload))) {                  // команды, пришедшие частями или слишком длинные, не принимаем
+      count_MQTTCmdDrops++;
+      Trace(TE_CMD_DROPPED, min(total, (size_t)UINT16_MAX), 0);
+      return;
+    }
+    _cmd.received_us = micros();
+    _cmd.reply = false;
+    _cmd.batch_id = 0;
+    _cmd.group = _group;
+    strlcpy(_cmd.topic, topic, sizeof(_cmd.topic));                                          // топики длиннее на подписку не попадают
+    memcpy(_cmd.payload, payload, len);
+    _cmd.payload[len] = '\0';
+    if (xQueueSend(q_MQTTCommands, &_cmd, 0) == pdTRUE) {
+      count_MQTTCommands++;
+      if (_group) count_GroupCommands++;
+      Trace(TE_CMD_RECEIVED, len);
+      NotifyTask(th_Events);                                                                 // будим задачу обработки команд
+    }
+    else {                                                                                   // очередь заполнена - команда отброшена
+      count_MQTTCmdDrops++;
+      Trace(TE_CMD_DROPPED, len, 1);
+    }
+  }
+}
+
+bool ParseMQTTCommand(const char *Payload) { // разбор команды MQTT в документ InputJSONdoc
+  DeserializationError err = deserializeJson(InputJSONdoc, Payload);
+  if (!err) return true;
+  Trace(TE_CMD_PARSE_ERROR, err.code());
+  if (err == DeserializationError::NoMemory) return false;               // это JSON (например, пакет команд), не поместившийся в документ - короткие команды в нем не ищем
+  // далее проверяем, если это короткие сообщения - то сами достраиваем объект документ
+  InputJSONdoc.clear();
+  if (strstr(Payload,jc_REPORT) != NULL) InputJSONdoc[jc_REPORT] = true;
+  if (strstr(Payload,jc_REBOOT) != NULL) InputJSONdoc[jc_REBOOT] = true;
+  if (strstr(Payload,jc_RESET) != NULL) InputJSONdoc[jc_REBOOT] = true;
+  return (InputJSONdoc.size() > 0);
+}
+
+// ========================= коммуникационные задачи времени выполнения ==================================
+
+void UdpSign(const void *Frame, size_t Len, uint8_t *Hmac) { // подпись кадра UDP протокола (усеченный HMAC-SHA256)
+  uint8_t _full[32];
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)P_UDP_KEY, strlen(P_UDP_KEY), 
+                  (const uint8_t*)Frame, Len, _full);
+  memcpy(Hmac, _full, C_UDP_HMAC_SIZE);
+}
+
+bool UdpCheckRequest(const UdpRequest &Request, int Len) { // проверка формата и подписи запроса
+  uint8_t _hmac[C_UDP_HMAC_SIZE];
+  if ((Len < (int)offsetof(UdpRequest, hmac)) or (Request.magic != C_UDP_MAGIC_REQUEST) or (Request.version != C_UDP_VERSION)) return false;
+  if ((Request.type != UF_QUERY) and (Request.type != UF_DISCOVER)) return false;
+  if (strlen(P_UDP_KEY) == 0) return true;                                     // ключ не задан - подпись не проверяем
+  if (!(Request.flags & UDP_FLAG_HMAC) or (Len != sizeof(UdpRequest))) return false;
+  UdpSign(&Request, offsetof(UdpRequest, hmac), _hmac);
+  uint8_t _diff = 0;                                                           // сравнение за постоянное время
+  for (uint8_t i = 0; i < C_UDP_HMAC_SIZE; i++) _diff |= _hmac[i] ^ Request.hmac[i];
+  return (_diff == 0);
+}
+
+bool UdpCheckReplay(UdpPeer *Peers, uint32_t Ip, uint32_t Seq) { // номер подписанного запроса должен быть больше последнего принятого с этого адреса
+// клиент нумерует запросы по времени (tools/udp_poll.py - в единицах 10 мс), поэтому номера растут и между запусками клиента
+  UdpPeer *_peer = NULL;
+  UdpPeer *_oldest = &Peers[0];
+  for (uint8_t i = 0; i < C_UDP_PEERS; i++) {
+    if (Peers[i].ip == Ip) _peer = &Peers[i];
+    if ((int32_t)(Peers[i].used - _oldest->used) < 0) _oldest = &Peers[i];
+  }
+  if (_peer == NULL) {                                                         // новый адрес - занимаем самую старую запись
+    _peer = _oldest;
+    _peer->ip = Ip;
+  }
+  else if ((int32_t)(Seq - _peer->seq) <= 0) return false;
+  _peer->seq = Seq;
+  _peer->used = millis();
+  return true;
+}
+
+void UdpSendResponse(int Sock, uint8_t Type, uint32_t Seq, const sockaddr_in &Addr, socklen_t AddrLen, const uint8_t *Mac) { // ответ со значениями на момент отправки
+  UdpResponse  _response;
+  GlobalParams _cfg;
+  GetConfigSnapshot(_cfg);
+  memset(&_response, 0, sizeof(_response));
+  _response.magic = C_UDP_MAGIC_RESPONSE;
+  _response.version = C_UDP_VERSION;
+  _response.type = Type;
+  _response.seq = Seq;
+  _response.uptime = millis() / 1000;
+  _response.counter_01 = _cfg.counter[0];
+  _response.counter_02 = (C_INP_CHANNELS > 1) ? _cfg.counter[1] : 0;          // кадр версии 1 несет только первые два счётчика
+  _response.counter_reboot = _cfg.counter_reboot;
+  memcpy(_response.mac, Mac, sizeof(_response.mac));
+  size_t _resp_len = offsetof(UdpResponse, hmac);
+  if (strlen(P_UDP_KEY) > 0) {
+    _response.flags = UDP_FLAG_HMAC;
+    UdpSign(&_response, _resp_len, _response.hmac);
+    _resp_len = sizeof(_response);
+  }
+  sendto(Sock, &_response, _resp_len, 0, (const sockaddr*)&Addr, AddrLen);
+}
+
+void udpTask(void *pvParam) { // задача UDP протокола опроса: один кадр запроса - один кадр ответа, без соединения и разбора текста
+  UdpRequest  _request;
+  UdpPeer     _peers[C_UDP_PEERS] = {};
+  UdpPending  _pending[C_UDP_PENDING] = {};
+  sockaddr_in _addr;
+  socklen_t   _addr_len;
+  uint8_t     _mac[6];
+  int         _sock = -1;
+
+  esp_read_mac(_mac, ESP_MAC_WIFI_STA);
+  while (true) {
+    if (_sock < 0) {                                                           // открываем сокет на всех интерфейсах (STA и AP)
+      _sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      memset(&_addr, 0, sizeof(_addr));
+      _addr.sin_family = AF_INET;
+      _addr.sin_port = htons(C_UDP_PORT);
+      _addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      if ((_sock >= 0) and (bind(_sock, (sockaddr*)&_addr, sizeof(_addr)) != 0)) {
+        close(_sock);
+        _sock = -1;
+      }
+      if (_sock < 0) {
+        vTaskDelay(pdMS_TO_TICKS(C_UDP_RETRY_DELAY));
+        continue;
+      }
+    }
+    // отложенные ответы на поиск, время которых наступило, и время до ближайшего из них
+    int32_t _wait = -1;
+    for (uint8_t i = 0; i < C_UDP_PENDING; i++) {
+      if (!_pending[i].used) continue;
+      int32_t _left = _pending[i].due - millis();
+      if (_left <= 0) {
+        UdpSendResponse(_sock, UF_DISCOVER, _pending[i].seq, _pending[i].addr, _pending[i].addr_len, _mac);
+        _pending[i].used = false;
+      }
+      else if ((_wait < 0) or (_left < _wait)) _wait = _left;
+    }
+    // задача спит до прихода запроса или до отправки ближайшего отложенного ответа
+    fd_set _fds;
+    timeval _tv = {_wait / 1000, (_wait % 1000) * 1000};
+    FD_ZERO(&_fds);
+    FD_SET(_sock, &_fds);
+    int _ready = select(_sock + 1, &_fds, NULL, NULL, (_wait < 0) ? NULL : &_tv);
+    if (_ready == 0) continue;                                                 // время отложенного ответа
+    _addr_len = sizeof(_addr);
+    int _len = (_ready > 0) ? recvfrom(_sock, &_request, sizeof(_request), 0, (sockaddr*)&_addr, &_addr_len) : -1;
+    if (_len < 0) {                                                            // ошибка сокета - открываем заново
+      close(_sock);
+      _sock = -1;
+      continue;
+    }
+    if (!UdpCheckRequest(_request, _len)) {
+      count_UdpRejects++;
+      continue;
+    }
+    if ((strlen(P_UDP_KEY) > 0) and !UdpCheckReplay(_peers, _addr.sin_addr.s_addr, _request.seq)) {
+      count_UdpReplays++;
+      continue;
+    }
+    count_UdpRequests++;
+    if (_request.type != UF_DISCOVER) {
+      UdpSendResponse(_sock, _request.type, _request.seq, _addr, _addr_len, _mac);
+      continue;
+    }
+    // на широковещательный поиск отвечаем с задержкой, зависящей от MAC - ответы сотен модулей не приходят одновременно.
+    // Ответ откладывается с моментом отправки, а задача продолжает отвечать на запросы
+    for (uint8_t i = 0; i < C_UDP_PENDING; i++) {
+      if (_pending[i].used) continue;
+      _pending[i] = {true, (uint32_t)(millis() + ((_mac[4] << 8) | _mac[5]) % C_UDP_DISCOVERY_JITTER), _request.seq, _addr, _addr_len};
+      break;
+    }
+  }
+}
+
 
-void onMqttConnect(bool sessionPresent) { // обработчик подключения к MQTT
-  #ifdef DEBUG_LEVEL_PORT                                    
-    Serial.println("Connected to MQTT.");  //  "Подключились по MQTT."
-  #endif                
-  // далее подписываем ESP32 на набор необходимых для управления топиков:
-  uint16_t packetIdSub = mqttClient.subscribe(curConfig.command_topic, 0);  // подписываем ESP32 на топик SET_TOPIC
-  #ifdef DEBUG_LEVEL_PORT                                      
-    Serial.printf("Subscribing at QoS 0, packetId: %d on topic :[%s]\n", packetIdSub, curConfig.command_topic);
-  #endif                  
-  // сразу публикуем событие о своей активности
-  mqttClient.publish(curConfig.lwt_topic, 0, true, jv_ONLINE);           // публикуем в топик LWT_TOPIC событие о своей жизнеспособности
-  #ifdef DEBUG_LEVEL_PORT                                      
-    Serial.printf("Publishing LWT state in [%s]. QoS 0. ", curConfig.lwt_topic); 
-  #endif                     
-}
+#ifdef MODBUS_SERVER
+// карта регистров Modbus: 32-битные значения занимают два регистра, старшее слово первым. Input (FC4) и holding (FC3) регистры 
+// совпадают, запись (только FC16 целыми парами регистров) разрешена только в регистры счётчиков и выполняется так же, как установка 
+// значения счётчика через WEB/MQTT. Разбор кадров и проверки запросов - в modbus_frame.h.
+// Группы регистров идут по входам из таблицы c_Inputs - для двух входов адреса совпадают с прежней фиксированной картой
+enum ModbusRegister_t : uint16_t {
+  MR_COUNTER = 0,                                               // значения счётчиков входов
+  MR_COUNTER_RB = MR_COUNTER + C_INP_CHANNELS * 2,              // значение счётчика перезагрузок
+  MR_RATE = MR_COUNTER_RB + 2,                                  // скорость счёта по входам в импульсах в минуту * 100
+  MR_UPTIME = MR_RATE + C_INP_CHANNELS * 2,                     // время работы в секундах
+  MR_PULSE_AGE = MR_UPTIME + 2,                                 // время с последнего импульса по входам в секундах (0xFFFFFFFF - импульсов не было)
+  MR_COUNT = MR_PULSE_AGE + C_INP_CHANNELS * 2                  // количество регистров
+};
+#define MR_WRITABLE_END MR_RATE                   // регистры до этого адреса доступны для записи
 
-void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) { // обработчик отключения от MQTT
-  #ifdef DEBUG_LEVEL_PORT                                                                           
-    Serial.println("Disconnected from MQTT.");                      // если отключились от MQTT
-  #endif         
-  s_CurrentWIFIMode = WF_UNKNOWN;                                   // переходим в режим полного реконнекта по WiFi
+struct ModbusClient {
+  int             sock;                           // сокет подключения мастера (-1 - слот свободен)
+  uint32_t        last_request;                   // момент последнего запроса (для отключения по таймауту)
+  uint16_t        fill;                           // количество принятых байт кадра
+  uint8_t         adu[C_MODBUS_ADU_SIZE];         // буфер приема и ответа
+};
+
+void ModbusBuildRegisters(uint16_t *Regs) { // заполнение карты регистров из согласованной копии конфигурации
+  GlobalParams _cfg;
+  uint32_t _values[MR_COUNT / 2];
+  GetConfigSnapshot(_cfg);
+  _values[MR_COUNTER_RB / 2] = _cfg.counter_reboot;
+  _values[MR_UPTIME / 2] = millis() / 1000;
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    _values[MR_COUNTER / 2 + i] = _cfg.counter[i];
+    _values[MR_RATE / 2 + i] = GetPulseRate_ppm100(i);
+    _values[MR_PULSE_AGE / 2 + i] = (count_Pulses[i] > 0) ? (micros() - tmu_LastCount[i]) / 1000000 : 0xFFFFFFFF;
+  }
+  for (uint8_t i = 0; i < MR_COUNT / 2; i++) {
+    Regs[i * 2] = _values[i] >> 16;
+    Regs[i * 2 + 1] = _values[i] & 0xFFFF;
+  }
 }
 
-void onMqttSubscribe(uint16_t packetId, uint8_t qos) { // обработка подтверждения подписки на топик
-  #ifdef DEBUG_LEVEL_PORT   
-    Serial.printf("Subscribe acknowledged. \n  packetId: %d\n  qos: %d\n", packetId, qos);  
-  #endif         
+struct ModbusCounters { // карта регистров прошивки для ModbusHandleFrame
+  uint16_t Count() { return MR_COUNT; }
+  uint16_t WritableEnd() { return MR_WRITABLE_END; }
+  void Read(uint16_t Address, uint16_t Count, uint16_t *Regs) {
+    uint16_t _regs[MR_COUNT];
+    ModbusBuildRegisters(_regs);
+    memcpy(Regs, _regs + Address, Count * sizeof(uint16_t));
+  }
+  uint8_t Write(uint16_t Address, uint16_t Count, const uint8_t *Data) { // запись пар регистров счётчиков, возвращает код исключения (0 - успешно)
+    for (uint16_t i = 0; i < Count / 2; i++) {
+      if ((Address + i * 2 == MR_COUNTER_RB) and (ModbusGet32(Data, i) > 0xFFFF)) return MB_EX_ILLEGAL_VALUE;   // счётчик перезагрузок 16-битный
+    }
+    for (uint16_t i = 0; i < Count / 2; i++) {
+      uint16_t _r = Address + i * 2;
+      cmdSetCounterValue((_r == MR_COUNTER_RB) ? CN_REBOOT : CN_CNT01 + (_r - MR_COUNTER) / 2, ModbusGet32(Data, i));
+    }
+    CheckAndUpdateEEPROM();                                                     // как и при установке через WEB - сразу сохраняем
+    return 0;
+  }
+};
+
+uint16_t ModbusProcess(uint8_t *Adu, uint16_t Len) { // обработка кадра Modbus TCP в том же буфере, возвращает длину ответа
+  ModbusCounters _map;
+  uint16_t _resp_len = ModbusHandleFrame(Adu, Len, _map);
+  if (Adu[C_MB_MBAP_SIZE] & 0x80) count_ModbusErrors++;                         // ответ - исключение
+  count_ModbusRequests++;
+  return _resp_len;
 }
 
-void onMqttUnsubscribe(uint16_t packetId) { // обработка подтверждения отписки от топика
-  #ifdef DEBUG_LEVEL_PORT     
-    Serial.printf("Unsubscribe acknowledged.\n  packetId: %d\n", packetId); 
-  #endif                     
+void ModbusCloseClient(ModbusClient &Client) { // отключение мастера и освобождение слота
+  close(Client.sock);
+  Client.sock = -1;
+  Client.fill = 0;
 }
 
-void onMqttPublish(uint16_t packetId) { // обработка подтверждения публикации
-  #ifdef DEBUG_LEVEL_PORT     
-    Serial.printf("Publish acknowledged.\n  packetId: %d\n", packetId);   
-  #endif                     
+void ModbusReceive(ModbusClient &Client) { // прием данных от мастера и обработка всех полностью принятых кадров
+  int _len = recv(Client.sock, Client.adu + Client.fill, sizeof(Client.adu) - Client.fill, 0);
+  if (_len <= 0) {                                                              // мастер отключился или ошибка сокета
+    ModbusCloseClient(Client);
+    return;
+  }
+  Client.fill += _len;
+  Client.last_request = millis();
+  while (true) {
+    int32_t _frame = ModbusFrameLength(Client.adu, Client.fill, sizeof(Client.adu));   // полная длина кадра по заголовку MBAP
+    if (_frame < 0) {                                                           // это не Modbus - отключаем
+      ModbusCloseClient(Client);
+      return;
+    }
+    if ((_frame == 0) or (Client.fill < _frame)) return;                        // ждем оставшуюся часть кадра
+    uint8_t _response[C_MODBUS_ADU_SIZE];
+    memcpy(_response, Client.adu, _frame);
+    uint16_t _resp_len = ModbusProcess(_response, _frame);
+    if (send(Client.sock, _response, _resp_len, 0) != _resp_len) {
+      ModbusCloseClient(Client);
+      return;
+    }
+    Client.fill -= _frame;                                                      // следующий кадр мог прийти в том же пакете
+    memmove(Client.adu, Client.adu + _frame, Client.fill);
+  }
 }
 
-void onMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) { // в этой функции обрабатываем события получения данных в управляющем топике SET_TOPIC
-  String messageTemp;
-  
-  for (int i = 0; i < len; i++) {                       // преобразуем полученные в сообщении данные в строку при этом выкидываем символы кавычек
-      messageTemp += (char)payload[i];
-  }
-  messageTemp[len] = '\0';  
-  // проверяем, что мы получили MQTT сообщение в командном топике
-  if (strcmp(topic, curConfig.command_topic) == 0) {
-    // разбираем MQTT сообщение и подготавливаем буфер с изменениями для формирования команд    
-    // для этого получаем семафор обработки входного JSON документа
-    while ( xSemaphoreTake(sem_InputJSONdoc,(TickType_t) 10) != pdTRUE ) vTaskDelay(1/portTICK_PERIOD_MS);         
-    DeserializationError err = deserializeJson(InputJSONdoc, messageTemp);                    // десерилизуем сообщение и взводим признак готовности к обработке
-    if (err) {
-      #ifdef DEBUG_LEVEL_PORT         
-      Serial.print(F("Error of deserializeJson(): "));
-      Serial.println(err.c_str());
-      #endif
-      f_HasMQTTCommand = false;                                                              // сбрасываем флаг получения команды по MQTT
-      // далее проверяем, если это короткие сообщения - то сами достраиваем объект документ
-      if (strstr(payload,jc_REPORT) != NULL ) {
-        InputJSONdoc[jc_REPORT] = true;
-        f_HasMQTTCommand = true;                                                              
-      }  
-      if (strstr(payload,jc_REBOOT) != NULL ) {
-        InputJSONdoc[jc_REBOOT] = true;
-        f_HasMQTTCommand = true;                                                              
-      }  
-      if (strstr(payload,jc_RESET) != NULL ) {
-        InputJSONdoc[jc_REBOOT] = true;
-        f_HasMQTTCommand = true;                                                              
-      }  
-      if (!f_HasMQTTCommand) xSemaphoreGive ( sem_InputJSONdoc );                            // отдаем семафор, если MQTT обработки не будет
+void modbusTask(void *pvParam) { // задача сервера Modbus TCP - несколько мастеров обслуживаются через select()
+  ModbusClient _clients[C_MODBUS_CLIENTS];
+  sockaddr_in  _addr;
+  int          _server = -1;
+
+  for (uint8_t i = 0; i < C_MODBUS_CLIENTS; i++) _clients[i].sock = -1;
+  while (true) {
+    if (_server < 0) {                                                          // открываем слушающий сокет на всех интерфейсах
+      _server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      memset(&_addr, 0, sizeof(_addr));
+      _addr.sin_family = AF_INET;
+      _addr.sin_port = htons(C_MODBUS_PORT);
+      _addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      if ((_server >= 0) and ((bind(_server, (sockaddr*)&_addr, sizeof(_addr)) != 0) or (listen(_server, C_MODBUS_CLIENTS) != 0))) {
+        close(_server);
+        _server = -1;
+      }
+      if (_server < 0) {
+        vTaskDelay(pdMS_TO_TICKS(C_UDP_RETRY_DELAY));
+        continue;
+      }
+    }
+    // ждем новых подключений или запросов - таймаут нужен только для отключения молчащих мастеров
+    fd_set  _read;
+    int     _max = _server;
+    timeval _timeout = {C_MODBUS_IDLE_TIMEOUT / 1000, 0};
+    FD_ZERO(&_read);
+    FD_SET(_server, &_read);
+    for (uint8_t i = 0; i < C_MODBUS_CLIENTS; i++) {
+      if (_clients[i].sock < 0) continue;
+      FD_SET(_clients[i].sock, &_read);
+      _max = max(_max, _clients[i].sock);
+    }
+    if (select(_max + 1, &_read, NULL, NULL, &_timeout) < 0) {                 // ошибка слушающего сокета - открываем заново
+      close(_server);
+      _server = -1;
+      continue;
+    }
+    for (uint8_t i = 0; i < C_MODBUS_CLIENTS; i++) {
+      if (_clients[i].sock < 0) continue;
+      if (FD_ISSET(_clients[i].sock, &_read)) ModbusReceive(_clients[i]);
+        else if (millis() - _clients[i].last_request > C_MODBUS_IDLE_TIMEOUT) ModbusCloseClient(_clients[i]);
+    }
+    if (FD_ISSET(_server, &_read)) {                                            // новый мастер - занимаем свободный слот или отказываем
+      int _sock = accept(_server, NULL, NULL);
+      if (_sock < 0) continue;
+      uint8_t i = 0;
+      while ((i < C_MODBUS_CLIENTS) and (_clients[i].sock >= 0)) i++;
+      if (i == C_MODBUS_CLIENTS) {
+        close(_sock);
+        continue;
       }
-    else f_HasMQTTCommand = true;                                                            // взводим флаг получения команды по MQTT
-    // отдадим семафор обработки документа только после преобразования JSON документа в команды
+      _clients[i].sock = _sock;
+      _clients[i].fill = 0;
+      _clients[i].last_request = millis();
+    }
   }
-  #ifdef DEBUG_LEVEL_PORT         
-  Serial.printf("Publish received.\n  topic: %s\n  message: [", topic);
-  Serial.print(messageTemp); Serial.println("]");
-  #endif
 }
-
-// ========================= коммуникационные задачи времени выполнения ==================================
+#endif
 
 void webServerTask(void *pvParam) { // задача по обслуживанию WEB сервера модуля
 // присваиваем ресурсы (страницы) нашему WEB серверу - страницы объявлены заранее и являются статическими
@@ -775,6 +3862,12 @@ void webServerTask(void *pvParam) { // задача по обслуживани
   WEB_Server.on("/alive",handleCheckAlivePage);                       // страница для проверки стстуса контроллера и перенаправления на основную страницу
   WEB_Server.on("/get_data",handleGetDataPage);                       // передать данные о счётчике номер которого указан в строке запроса
   WEB_Server.on("/set_data",handleSetDataPage);                       // установить значение счётчика номер которого указан в строке запроса  
+  WEB_Server.on("/metrics",handleMetricsPage);                        // внутренняя статистика прошивки в формате Prometheus
+  WEB_Server.on("/diag",handleDiagPage);                              // загрузка задач, стек и состояние памяти
+  WEB_Server.on("/pulses",handlePulseLogPage);                        // журнал последних импульсов с метками времени (NDJSON или двоичный)
+  WEB_Server.on("/trace",handleTracePage);                            // журнал трассировки событий (NDJSON или двоичный) и маска категорий
+  WEB_Server.on("/batch", HTTP_POST, handleBatchPage);                 // пакет команд одной транзакцией (JSON массив в теле запроса)
+  WEB_Server.on("/update", HTTP_POST, handleUpdatePage, handleUpdateUpload);   // загрузка прошивки или дельты с перезагрузкой в нее
   WEB_Server.onNotFound(handleNotFoundPage);		                      // страница с 404-й ошибкой   
 
   bool _FirstTime = true;
@@ -786,12 +3879,13 @@ void webServerTask(void *pvParam) { // задача по обслуживани
           _FirstTime = false;
       }    
       WEB_Server.handleClient();
+      vTaskDelay(pdMS_TO_TICKS(C_WEB_POLL_DELAY));                          // WebServer не умеет ждать соединения - опрашиваем с периодом C_WEB_POLL_DELAY
       } 
     else {
+      if (!_FirstTime) WEB_Server.close();  
       _FirstTime = true;
-      WEB_Server.close();  
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);                              // ждем разрешения работы сервера (SetWebServerEnable)
     }
-    vTaskDelay(1/portTICK_PERIOD_MS);                              // делаем задержку в чтении следующего цикла
   }
 }
 
@@ -799,115 +3893,152 @@ void wifiTask(void *pvParam) { // задача установления и по
   uint32_t  StartWiFiCycle = 0;                                     // стартовый момент цикла в обработчике WiFi
   uint32_t  StartMQTTCycle = 0;                                     // стартовый момент цикла подключения к MQTT
   uint8_t   APClientCount   = 0;                                    // количество подключенных клиентов в режиме AP
+  int8_t    _broker = -1;                                           // выбранный MQTT сервер
+  uint32_t  _wait_ms = 0;                                           // время до окончания паузы ближайшего сервера
+  bool      _connected = false;                                     // результат подключения к MQTT серверу
+  uint8_t   _apply = CI_NONE;                                       // изменения конфигурации для применения (ConfigImpact_t)
   WiFi.hostname(ControllerName);
   s_CurrentWIFIMode = WF_UNKNOWN;
   while (true) {    
+    // изменения параметров подключения применяются здесь, без перезагрузки
+    _apply = __atomic_exchange_n(&val_ConfigApply, (uint8_t)CI_NONE, __ATOMIC_ACQ_REL);
+    if (_apply != CI_NONE) ApplyConnectionChanges(_apply);
     switch (s_CurrentWIFIMode) {
     case WF_UNKNOWN:
       // начальное подключение WiFi - сброс всех соединений и новый цикл их поднятия 
-      f_WEB_Server_Enable = false;                                  // WEB сервер не доступен  
+      SetWebServerEnable(false);                                    // WEB сервер не доступен  
       f_Has_WEB_Server_Connect = false;                             // и коннектов к нему нет    
       count_GetWiFiConfig++;                                        // инкрементируем счётчик попыток 
       mqttClient.disconnect(true);                                  // принудительно отсоединяемся от MQTT       
       WiFi.persistent(false);
       WiFi.mode(WIFI_STA);
       WiFi.disconnect();
-      #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-      Serial.printf("Try to connect WiFi: %s[",curConfig.wifi_ssid);
-      #endif
+      Trace(TE_WIFI_CONNECT, count_GetWiFiConfig);
       StartWiFiCycle = millis();
       // изначально пытаемся подключится в качестве клиента к существующей сети с грантами из конфигурации
       WiFi.begin(curConfig.wifi_ssid,curConfig.wifi_pwd);
       while ((! WiFi.isConnected()) && (millis() - StartWiFiCycle < C_WIFI_CONNECT_TIMEOUT)) { // ожидаем соединения с необходимой WiFi сеткой
-        vTaskDelay(pdMS_TO_TICKS(1000)); // рисуем точку каждую секунду
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-        Serial.print(".");
-        #endif
+        vTaskDelay(pdMS_TO_TICKS(1000)); // проверяем каждую секунду
       } 
-      #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-      Serial.println("]");
-      #endif    
       // цикл окончен, проверяем соеденились или нет
       if (WiFi.isConnected()) {
           s_CurrentWIFIMode = WF_CLIENT;                          // если да - мы соеденились в режиме клиента
-          f_WEB_Server_Enable = true;                             // WEB сервер становится доступен      
+          SetWebServerEnable(true);                               // WEB сервер становится доступен      
+          StartTimeSync();                                        // реальное время для журнала импульсов
+          Trace(TE_WIFI_UP, 0, (uint32_t)WiFi.localIP());
         } 
-      else s_CurrentWIFIMode = WF_AP;                             // соеденится как клиент не смогли - нужно поднимать точку доступа
-      #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-      if (WiFi.isConnected()) {
-          Serial.print("Connected with IP: ");
-          Serial.println(WiFi.localIP());
-        }
-        else Serial.println("Fail.");
-      #endif    
+      else {
+        s_CurrentWIFIMode = WF_AP;                                // соеденится как клиент не смогли - нужно поднимать точку доступа
+        Trace(TE_WIFI_FAIL);
+      }
       break;
     case WF_OFF:   
       // WiFi принудительно выключен при получении ошибок при работе с WIFI 
       if (count_GetWiFiConfig == C_MAX_WIFI_FAILED_TRYS) {          // если превышено количество попыток соединения (делаем это действие 1 раз)
-           f_WEB_Server_Enable = false;                             // WEB сервер не доступен            
+           SetWebServerEnable(false);                               // WEB сервер не доступен            
            mqttClient.disconnect(true);                             // принудительно отсоединяемся от MQTT 
            WiFi.persistent(false);                                  // принудительно отсоединяемся от WiFi 
            WiFi.disconnect();
            count_GetWiFiConfig++;                                   // это для того, чтобы код условия выполнился один раз
-           #ifdef DEBUG_LEVEL_PORT                                            
-           Serial.println("!!! WiFi module is OFF !!!");
-           #endif
+           Trace(TE_WIFI_OFF);
         }   
       vTaskDelay(pdMS_TO_TICKS(C_WIFI_CYCLE_WAIT));                 // ждем цикл перед еще одной проверкой           
       break;    
     case WF_CLIENT:
-      // включение WIFI в режиме клиента 
-      #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-      Serial.printf("Try to connect MQTT: %s \n", curConfig.mqtt_host_s); 
-      #endif     
+      // включение WIFI в режиме клиента - выбор MQTT сервера из списка
+      if (!WiFi.isConnected()) {
+        Trace(TE_WIFI_LOST);
+        s_CurrentWIFIMode = WF_UNKNOWN;
+        break;
+      }
+      _broker = SelectBroker(_wait_ms);
+      if (_broker < 0) {                                              // все серверы на паузе после неудач - ждем ближайший
+        vTaskDelay(pdMS_TO_TICKS(min(_wait_ms, (uint32_t)C_WIFI_CHECK_DELAY)) + 1);
+        break;
+      }
+      mqtt_Active = _broker;
+      Trace(TE_MQTT_CONNECT, count_GetMQTTConfig, _broker);
       s_CurrentWIFIMode = WF_MQTT;
       break;    
     case WF_MQTT:
-      // соединение с MQTT сервером
+      // соединение с MQTT сервером: адрес из кэша DNS, при отказе сервера - быстрый переход к следующему из списка
       StartMQTTCycle = millis();
-      // пытаемся подключится к MQTT серверу в качестве клиента
-      mqttClient.connect();
-      while ((!mqttClient.connected()) && (millis()-StartMQTTCycle < C_MQTT_CONNECT_TIMEOUT)) { // ожидаем соединения с MQTT сервером
-        vTaskDelay(pdMS_TO_TICKS(500)); 
-      } 
+      _connected = ResolveBroker(mqtt_Active);
+      if (_connected) {
+        // пытаемся подключится к MQTT серверу в качестве клиента
+        mqttClient.setServer(mqtt_Brokers[mqtt_Active].ip, mqtt_Brokers[mqtt_Active].port);
+        f_MQTTDown = false;
+        mqttClient.connect();
+        while ((!mqttClient.connected()) && (!f_MQTTDown) && (millis()-StartMQTTCycle < ((mqtt_BrokerCount > 1) ? C_MQTT_FAILOVER_TIMEOUT : C_MQTT_CONNECT_TIMEOUT))) {
+          ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(500));               // ожидаем соединения с MQTT сервером или сообщения об отказе
+        } 
+        _connected = mqttClient.connected();
+        if (!_connected) mqttClient.disconnect(true);                 // прерываем незаконченное подключение перед сменой сервера
+      }
       // цикл окончен, проверяем есть ли соединение с MQTT
-      if (mqttClient.connected()) {                                   // если да - то переходим в режим нормальной работы
+      if (_connected) {                                               // если да - то переходим в режим нормальной работы
           s_CurrentWIFIMode = WF_IN_WORK;  
-          f_Has_Report = true;                                        // рапортуем в MQTT текущим состоянием
+          BrokerConnected(mqtt_Active);
+          tm_BrokerProbe = millis();
+          RequestReport();                                            // рапортуем в MQTT текущим состоянием
           count_GetMQTTConfig = 0;                                    // обнуляем количество попыток неуспешного доступа к MQTT
+          mqtt_CycleFailed = 0;
         }  
         else {
           // код дальше заставляет сделать C_MAX_MQTT_FAILED_TRYS попыток соеденится с MQTT. При этом модуль доступен по адресу в указанной WiFi сети как WEB сервер, и можно 
           // поменять конфигурацию на его странице. Если это не получается - уходим в работу без MQTT.
-          if (!f_Has_WEB_Server_Connect) count_GetMQTTConfig++;  
-          #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-          Serial.printf("count_GetMQTTConfig = %u of %u \n",count_GetMQTTConfig,C_MAX_MQTT_FAILED_TRYS);
-          #endif    
+          BrokerResult(mqtt_Active, false);                           // сервер на паузу - следующая попытка пойдет на следующий исправный
+          mqtt_CycleFailed |= 1 << mqtt_Active;
+          if (mqtt_CycleFailed == (1 << mqtt_BrokerCount) - 1) {      // считаем циклы по всем серверам, а не отдельные попытки - с резервными
+            mqtt_CycleFailed = 0;                                     // серверами попытка короче (C_MQTT_FAILOVER_TIMEOUT), но их больше
+            if (!f_Has_WEB_Server_Connect) count_GetMQTTConfig++;
+          }
+          Trace(TE_MQTT_TIMEOUT, count_GetMQTTConfig, mqtt_Active);
           if (count_GetMQTTConfig==C_MAX_MQTT_FAILED_TRYS) s_CurrentWIFIMode = WF_WITHOUT_MQTT;        // если есть проблема c ответом MQTT - переходим в работу без него
             else s_CurrentWIFIMode = WF_CLIENT;                       // иначе - уходим на еще один цикл подключения к MQTT
                                                                       // либо - нужно менять конфигурацию, либо ожидать поднятия MQTT сервера                                                                      
-          #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-          Serial.println("MQTT connection timeout..."); 
-          #endif    
         }  
       break;    
     case WF_IN_WORK:  // состояние в котором ничего не делаем, так как все нужные соединения установлены
       count_GetWiFiConfig = 0;                                           // при успешном соединении сбрасываем счётчик попыток повтора 
-      if (!mqttClient.connected() or !WiFi.isConnected()) {              // проверяем, что соединения всё еще есть. Если они пропали, делаем таймаут на цикл C_WIFI_CYCLE_WAIT и переустанавливаем соединение
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-        if (!mqttClient.connected()) Serial.println("MQTT conneсtion lost.");
-        if (!WiFi.isConnected()) Serial.println("WiFi conneсtion lost.");
-        #endif
+      if (!WiFi.isConnected()) {                                         // проверяем, что соединения всё еще есть. Если пропал WiFi, делаем таймаут на цикл C_WIFI_CYCLE_WAIT и переустанавливаем соединение
+        if (!mqttClient.connected()) Trace(TE_MQTT_LOST, mqtt_Active);
+        Trace(TE_WIFI_LOST);
+        OutageBegin(OC_LOST);
         vTaskDelay(pdMS_TO_TICKS(C_WIFI_CYCLE_WAIT)); 
         s_CurrentWIFIMode = WF_UNKNOWN;                                  // уходим на пересоединение с WIFI
       }
+      else if (!mqttClient.connected()) {                                // WiFi есть, пропал MQTT сервер - сразу переподключаемся без переустановки WiFi
+        Trace(TE_MQTT_LOST, mqtt_Active);
+        OutageBegin(OC_LOST);
+        BrokerResult(mqtt_Active, false);
+        s_CurrentWIFIMode = WF_CLIENT;
+      }
+      else if ((mqtt_Active > 0) and (millis() - tm_BrokerProbe >= C_MQTT_FAILBACK_PERIOD)) {
+        // работаем через резервный сервер - проверяем, не поднялся ли более приоритетный
+        for (uint8_t i = 0; i < mqtt_Active; i++) {
+          if ((int32_t)(mqtt_Brokers[i].tm_retry - millis()) > 0) continue;   // пауза после неудачи еще не прошла
+          if (!ProbeBroker(i)) continue;
+          Trace(TE_MQTT_FAILBACK, i, mqtt_Active);
+          count_BrokerFailbacks++;
+          // сервер принял сеанс MQTT - выбираем его, но счётчик неудач подряд не сбрасываем: его сбросит только рабочее подключение,
+          // а если оно не получится, пауза перед следующим возвратом будет вдвое длиннее - модуль не мечется между серверами
+          mqtt_Brokers[i].tm_retry = millis();
+          mqtt_Brokers[i].score = max(mqtt_Brokers[i].score, (uint8_t)C_MQTT_HEALTHY);
+          PublishMQTT(curConfig.lwt_topic, true, jv_OFFLINE);            // уходим с резервного сервера штатно - без срабатывания LWT
+          mqttClient.disconnect();
+          for (uint8_t w = 0; (w < 10) and mqttClient.connected(); w++) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+          OutageBegin(OC_FAILBACK);                                      // перерыв связи при возврате тоже замеряется
+          s_CurrentWIFIMode = WF_CLIENT;
+          break;
+        }
+        tm_BrokerProbe = millis();
+      }
       break;    
     case WF_WITHOUT_MQTT:  // состояние в котором ничего не делаем, MQTT отсутсвует, и работаем без него
       count_GetWiFiConfig = 0;                                           // при успешном соединении сбрасываем счётчик попыток повтора 
       if (!WiFi.isConnected()) {                                         // проверяем, что соединение c WiFi еще есть. Если нет, делаем таймаут на цикл C_WIFI_CYCLE_WAIT и переустанавливаем соединение
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода
-        if (!WiFi.isConnected()) Serial.println("WiFi conneсtion lost.");
-        #endif
+        Trace(TE_WIFI_LOST);
         vTaskDelay(pdMS_TO_TICKS(C_WIFI_CYCLE_WAIT)); 
         s_CurrentWIFIMode = WF_UNKNOWN;                                  // уходим на пересоединение с WIFI
       }
@@ -918,247 +4049,1024 @@ void wifiTask(void *pvParam) { // задача установления и по
       WiFi.persistent(false);
       WiFi.mode(WIFI_AP);
       WiFi.disconnect();      
-      #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-      Serial.printf("Create AP with SSID: %s\n", ControllerName);
-      #endif    
       if (WiFi.softAP(ControllerName,"",DEF_WIFI_CHANNEL)) {     // собственно создаем точку доступа на дефолтном канале 
-        #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-        Serial.print("AP created with IP: ");
-        Serial.println(WiFi.softAPIP());
-        #endif 
+        Trace(TE_WIFI_AP, 1, (uint32_t)WiFi.softAPIP());
         StartWiFiCycle = millis();                          // даем отсечку по времени для поднятия точки доступа        
         APClientCount = 0;
         f_Has_WEB_Server_Connect = false;                   // сбрасываем флаг коннектов к WEB серверу
-        // если точку доступа удалось поднять, то даем ей работать до тех пор пока не кончился таймаут C_WIFI_AP_WAIT, или есть коннекты к точке доступа       
-        while ((WiFi.softAPgetStationNum()>0) or ((millis()-StartWiFiCycle < C_WIFI_AP_WAIT))) {
+        // если точку доступа удалось поднять, то даем ей работать до тех пор пока не кончился таймаут C_WIFI_AP_WAIT, или есть коннекты к точке доступа
+        // (новые параметры подключения, заданные на странице конфигурации, прерывают работу точки доступа)
+        while (((WiFi.softAPgetStationNum()>0) or ((millis()-StartWiFiCycle < C_WIFI_AP_WAIT))) and (val_ConfigApply == CI_NONE)) {
           // В цикле только выводим количество подключенных к AP клиентов. Основная работа по обслуживанию запросов идет по ой цикл пуст, так как 
-          f_WEB_Server_Enable = true;                       // поднимаем флаг доступности WEB сервера
+          SetWebServerEnable(true);                         // поднимаем флаг доступности WEB сервера
           if (APClientCount!=WiFi.softAPgetStationNum()) {
             APClientCount = WiFi.softAPgetStationNum();
-            #ifdef DEBUG_LEVEL_PORT       // вывод в порт при отладке кода 
-            Serial.printf("К точке доступа [%s] подключено: %d клиентов \n", ControllerName,APClientCount);            
-            #endif 
+            Trace(TE_WIFI_AP_CLIENTS, APClientCount);
           }
           vTaskDelay(pdMS_TO_TICKS(500));                   // отдаем управление и ждем 0.5 секунды перед следующей проверкой
         }
       }
+      else Trace(TE_WIFI_AP, 0);
       if (count_GetWiFiConfig == C_MAX_WIFI_FAILED_TRYS) s_CurrentWIFIMode = WF_OFF;       // если достигнуто количество попыток соединения для получения конфигурации по WIFi - выключаем WIFI
         else s_CurrentWIFIMode = WF_UNKNOWN;                                          // если нет - переключаемся в режим попытки установления связи с роутером
       break; 
     }
+    // новая прошивка подтверждается после подключения к MQTT или C_OTA_CONFIRM_TIME работы без перезагрузки
+    if ((val_OtaTrialBoots > 0) and ((s_CurrentWIFIMode == WF_IN_WORK) or (millis() > C_OTA_CONFIRM_TIME))) OtaConfirm();
     // запоминаем точку конца цикла
     StartWiFiCycle = millis();
-    vTaskDelay(1/portTICK_PERIOD_MS); 
+    if ((s_CurrentWIFIMode == WF_IN_WORK) or (s_CurrentWIFIMode == WF_WITHOUT_MQTT)) 
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(C_WIFI_CHECK_DELAY));  // в рабочем режиме ждем уведомления об отключении или периода проверки соединений
+    else vTaskDelay(1/portTICK_PERIOD_MS); 
   }  
 }
 
 // ====================== обработчики прерываний для счётчиков и сенсора питания =========================
 
-void IRAM_ATTR ISR_handler_counter01() { // описание обработчика прерывания для счётчика 01
-// срабатывание происходит при переходе с высокого на низкий уровень (замыкание внешнего контакта)
-  if (!f_FireInp01 and !f_FireCutOff) {   // если это новое срабатывание до снятия флага обработки и это не момент снятия питания
-    tm_LastFireInp01 = millis();          // запоминаем время сработки 
-    f_FireInp01 = true;                   // взводим флаг необходимости обработки
+#ifdef POWER_SAVE_MODE
+void ArmInputWakeup(uint8_t Pin, bool Closed) { // пробуждение из light sleep по изменению уровня на входе
+  gpio_wakeup_enable((gpio_num_t)Pin, Closed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);   // ждем противоположный текущему уровень
+}
+
+void IRAM_ATTR RequestWakeupRearm(uint32_t Mask) { // запрос переключения уровня пробуждения из прерывания
+// gpio_wakeup_enable берет спинлок драйвера и не предназначена для ISR - уровень переключает задача подсчёта (RearmWakeups).
+// До переключения уровень на входе совпадает с уровнем пробуждения - light sleep просто не наступает
+  portENTER_CRITICAL_ISR(&mux_Wakeup);
+  s_WakeupRearm |= Mask;
+  portEXIT_CRITICAL_ISR(&mux_Wakeup);
+}
+
+void RearmWakeups() { // переключение уровня пробуждения входов и кнопок, сменивших уровень (задача подсчёта)
+  portENTER_CRITICAL(&mux_Wakeup);
+  uint32_t _mask = s_WakeupRearm;
+  s_WakeupRearm = 0;
+  portEXIT_CRITICAL(&mux_Wakeup);
+  if (_mask == 0) return;
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (_mask & (1UL << i)) ArmInputWakeup(c_Inputs[i].pin, !digitalRead(c_Inputs[i].pin));
   }
+  if (_mask & C_WAKE_BUTTONS) {
+    ArmInputWakeup(BTN_CLEAR_PIN, !digitalRead(BTN_CLEAR_PIN));
+    ArmInputWakeup(BTN_FLASH_PIN, !digitalRead(BTN_FLASH_PIN));
+  }
+}
+#endif
+
+bool IRAM_ATTR ReadCounterInput(uint8_t Channel) { // текущее состояние входа счётчика: true - внешний контакт замкнут
+  #ifdef PULSE_SIMULATOR
+  return sim_InputClosed[Channel];
+  #else
+  return !digitalRead(c_Inputs[Channel].pin);
+  #endif
 }
 
-void IRAM_ATTR ISR_handler_counter02() { // описание обработчика прерывания для счётчика 02
-// срабатывание происходит при переходе с высокого на низкий уровень (замыкание внешнего контакта)
-  if (!f_FireInp02 and !f_FireCutOff) {   // если это новое срабатывание до снятия флага обработки и это не момент снятия питания
-    tm_LastFireInp02 = millis();          // запоминаем время сработки 
-    f_FireInp02 = true;                   // взводим флаг необходимости обработки
+bool IRAM_ATTR CounterInputChanged(uint8_t Channel, uint32_t Now_us) { // обработка изменения уровня на входе счётчика
+// светодиод повторяет состояние входа, а фронт с меткой времени передается в буфер фильтра входа - сам фильтр ведет задача подсчёта.
+// Момент изменения передается параметром, чтобы ту же обработку мог вызывать генератор импульсов. 
+// Возвращает true, если нужно разбудить задачу подсчёта
+  bool _closed = ReadCounterInput(Channel);
+  if (c_Inputs[Channel].led != C_PIN_NONE) digitalWrite(c_Inputs[Channel].led, _closed);     // индикация замыкания входа
+  #ifdef POWER_SAVE_MODE
+  RequestWakeupRearm(1UL << Channel);                                     // задача подсчёта будится в любом случае
+  #endif
+  if (f_FireCutOff) return false;                                         // питание пропало - новые импульсы уже не считаем
+  if (!FilterPushEdge(inp_Filters[Channel], _closed, Now_us)) {          // буфер заполнен - фронт теряется
+    count_EdgeOverflows[Channel]++;
+    Trace(TE_EDGE_OVERFLOW, Channel);
   }
- }
+  return true;
+}
+
+void IRAM_ATTR ISR_handler_counter(void *Arg) { // общий обработчик прерывания счётных входов, параметр - индекс входа в таблице c_Inputs
+  if (CounterInputChanged((uintptr_t)Arg, esp_timer_get_time())) NotifyTaskFromISR(th_Counting);   // будим задачу подсчёта (метка - младшие 32 бита esp_timer)
+}
+
+void IRAM_ATTR FreqEdge(uint8_t Channel, bool Closed, uint32_t Timestamp) { // учёт фронта на входе в режиме частоты (метка времени в тактах C_CAPTURE_CLOCK)
+  portENTER_CRITICAL_ISR(&mux_Freq);
+  FreqMeterEdge(freq_Meters[Channel], Closed, Timestamp);
+  portEXIT_CRITICAL_ISR(&mux_Freq);
+}
+
+bool IRAM_ATTR CaptureCallback(mcpwm_unit_t Unit, mcpwm_capture_channel_id_t Capture, const cap_event_data_t *Event, void *Arg) { // обработчик таймера захвата MCPWM
+  uint8_t _channel = (uintptr_t)Arg;
+  bool _closed = (Event->cap_edge == MCPWM_NEG_EDGE);                     // вход активен низким уровнем
+  if (c_Inputs[_channel].led != C_PIN_NONE) digitalWrite(c_Inputs[_channel].led, _closed);    // индикация замыкания входа
+  FreqEdge(_channel, _closed, Event->cap_value);
+  return false;                                                           // задача подсчёта просыпается по окончанию окна, а не по фронтам
+}
 
 void IRAM_ATTR ISR_handler_cutoff_sensor() { // описание обработчика прерывания для датчика пропадания питания
   // срабатывание происходит при переходе с низкого на высокий уровень
   f_FireCutOff = true;
+  NotifyTaskFromISR(th_Counting);         // сохранение выполняет задача подсчёта
 }
 
-// ================================== основные задачи времени выполнения =================================
+void IRAM_ATTR ISR_handler_buttons() { // описание обработчика прерывания для кнопок CLEAR и FLASH
+  // любое изменение состояния кнопок запускает их опрос в задаче обработки событий
+  #ifdef POWER_SAVE_MODE
+  RequestWakeupRearm(C_WAKE_BUTTONS);
+  NotifyTaskFromISR(th_Counting);
+  #endif
+  tm_LastButtonEdge = millis();
+  NotifyTaskFromISR(th_Events);
+}
 
-void countingTask(void *pvParam) { // задача основной обработки по подсчёту импульсов с подавлением дребезга и сохранением данных при потере питания
-  while (true) {
-    // обработка входа 01
-    if (f_FireInp01 and ((millis()-C_COUNTER_DELAY)>tm_LastFireInp01)) { // обработка импульса по входу 01 с подавлением дребезга выше 20Гц
-      if (!digitalRead(PIN_INP_CH1)) {                                   // если сигнал на входе в низком уровне - фиксируем импульс
-        curConfig.counter_01 ++;
-        curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);      // считаем CRC
+// ------------------------------- переключение режима счётных входов ------------------------------------
+#if defined(POWER_SAVE_MODE) && defined(CONFIG_PM_ENABLE)
+esp_pm_lock_handle_t pm_CaptureLock = NULL;     // таймер захвата тактируется от APB и не работает в light sleep - пока он включен, держим APB на максимуме
+#endif
+
+void ApplyChannelMode(uint8_t Channel) { // включение на входе подсчёта по прерыванию или измерения частоты по таймеру захвата
+// вход N использует канал захвата N % 3 блока MCPWM N / 3 - режим частоты доступен первым C_CAPTURE_CHANNELS входам таблицы
+  uint8_t _pin = c_Inputs[Channel].pin;
+  mcpwm_unit_t _unit = (mcpwm_unit_t)(Channel / 3);
+  mcpwm_capture_channel_id_t _capture = (mcpwm_capture_channel_id_t)(MCPWM_SELECT_CAP0 + Channel % 3);
+  portENTER_CRITICAL(&mux_Freq);
+  FreqMeterReset(freq_Meters[Channel], ReadCounterInput(Channel));        // измерение начинается заново
+  portEXIT_CRITICAL(&mux_Freq);
+  val_Freq_mHz[Channel] = 0;
+  val_Duty_pm[Channel] = 0;
+  tm_NextGate[Channel] = millis() + chParams.gate_ms[Channel];
+  inp_Filters[Channel].tail = inp_Filters[Channel].head;                  // фильтр начинает с текущего уровня (уже замкнутый вход импульсом не считается)
+  inp_Filters[Channel].core.state = ReadCounterInput(Channel) ? FS_CLOSED : FS_OPEN;
+  #ifndef PULSE_SIMULATOR                                                 // при работе генератора импульсов реальные входы не используются
+  if (chParams.mode[Channel] == CM_FREQUENCY) {
+    detachInterrupt(_pin);
+    if (!s_CaptureEnabled[Channel]) {
+      mcpwm_capture_config_t _config = {};
+      _config.cap_edge = MCPWM_BOTH_EDGE;                                 // оба фронта - для расчета скважности
+      _config.cap_prescale = 1;
+      _config.capture_cb = CaptureCallback;
+      _config.user_data = (void*)(uintptr_t)Channel;
+      mcpwm_gpio_init(_unit, (mcpwm_io_signals_t)(MCPWM_CAP_0 + Channel % 3), _pin);
+      s_CaptureEnabled[Channel] = (mcpwm_capture_enable_channel(_unit, _capture, &_config) == ESP_OK);
+      #if defined(POWER_SAVE_MODE) && defined(CONFIG_PM_ENABLE)
+      if (s_CaptureEnabled[Channel] and (pm_CaptureLock != NULL)) esp_pm_lock_acquire(pm_CaptureLock);
+      #endif
+    }
+    if (!s_CaptureEnabled[Channel]) Trace(TE_INP_NO_CAPTURE, Channel);
+  }
+  else {
+    if (s_CaptureEnabled[Channel]) {
+      mcpwm_capture_disable_channel(_unit, _capture);
+      s_CaptureEnabled[Channel] = false;
+      #if defined(POWER_SAVE_MODE) && defined(CONFIG_PM_ENABLE)
+      if (pm_CaptureLock != NULL) esp_pm_lock_release(pm_CaptureLock);
+      #endif
+    }
+    attachInterruptArg(_pin, ISR_handler_counter, (void*)(uintptr_t)Channel, CHANGE);    // подсчёт по замыканию и индикация
+  }
+  #endif
+  NotifyTask(th_Counting);                                                // задача подсчёта пересчитывает время ожидания окон
+}
+
+// ------------------------------ пакет команд - одна транзакция, одна запись, один отчёт ------------------------------
+
+BatchResult_t BatchSetCounter(CommandBatch &Batch, uint8_t Cntr, uint32_t Value) { // установка счётчика в копии пакета
+  Batch.counter[Cntr] = Value;
+  Batch.counter_set[Cntr] = true;
+  return BR_OK;
+}
+
+BatchResult_t StageCommandKey(CommandBatch &Batch, const char *Key, JsonVariantConst Value) { // проверка ключа команды и применение его к копии пакета
+  uint8_t _ch;                                                            // индекс входа для ключей с номером
+  uint8_t _value;
+  switch (LookupKey(Key, _ch)) {
+    case KEY_REPORT:
+      if (Value.as<bool>()) Batch.flags |= BF_REPORT;
+      return BR_OK;
+    case KEY_REBOOT:
+    case KEY_RESET:
+      if (Value.as<bool>()) Batch.flags |= BF_REBOOT;                     // перезагрузка - после записи и ответа по пакету
+      return BR_OK;
+    case KEY_CLEAR:
+      _value = Value.is<const char*>() ? LookupKey(Value.as<const char*>(), _ch) : KEY_NONE;
+      if (_value == KEY_REBOOT) return BatchSetCounter(Batch, CN_REBOOT, 0);
+      if (_value == KEY_COUNTER) return BatchSetCounter(Batch, CN_CNT01 + _ch, 0);
+      if (_value != KEY_CONFIG) return BR_BAD_VALUE;
+      Batch.flags |= BF_CLEAR_CONFIG;
+      return BR_NOT_ALLOWED;                                              // сброс конфигурации с перезагрузкой - только отдельной командой
+    case KEY_DIAG: {
+      if (!Value.is<uint32_t>()) return BR_BAD_VALUE;
+      uint32_t _period = Value;
+      Batch.diag_period = (_period == 0) ? 0 : max(_period, (uint32_t)C_DIAG_MIN_PERIOD);
+      Batch.flags |= BF_DIAG;
+      return BR_OK;
+    }
+    case KEY_TRACE:
+      if (Value == jv_DUMP) Batch.flags |= BF_TRACE_DUMP;
+      else if (Value.is<uint32_t>()) {
+        Batch.trace_mask = Value;
+        Batch.flags |= BF_TRACE;
+      }
+      else return BR_BAD_VALUE;
+      return BR_OK;
+    case KEY_OTA:                                                         // обновление прошивки - только отдельной командой
+      if (Value.is<const char*>()) Batch.flags |= BF_OTA;
+      return BR_NOT_ALLOWED;
+    case KEY_SHA256:
+      return BR_NOT_ALLOWED;
+    case KEY_PROVISION:                                                   // блок настроек - только отдельной командой (подпись по сообщению)
+      if (Value.is<JsonObjectConst>()) Batch.flags |= BF_PROVISION;
+      return BR_NOT_ALLOWED;
+    case KEY_SET_VALUE:
+      if (!Value.is<uint32_t>()) return BR_BAD_VALUE;
+      return BatchSetCounter(Batch, CN_CNT01 + _ch, Value.as<uint32_t>());
+    case KEY_MODE:
+      if (Value == jv_MODE_COUNT) Batch.params.mode[_ch] = CM_COUNT;
+      else if ((Value == jv_MODE_FREQ) and (_ch < C_CAPTURE_CHANNELS)) Batch.params.mode[_ch] = CM_FREQUENCY;
+      else return BR_BAD_VALUE;                                           // в том числе частота на входе без блока захвата
+      return BR_OK;
+    case KEY_GATE:
+      if (!Value.is<uint16_t>() or (Value.as<uint16_t>() < C_GATE_MIN) or (Value.as<uint16_t>() > C_GATE_MAX)) return BR_BAD_VALUE;
+      Batch.params.gate_ms[_ch] = Value;
+      return BR_OK;
+    case KEY_FILTER:                                                      // значения не приводятся к допустимым - ошибка отклоняет пакет
+      if (!Value.is<JsonObjectConst>() or (Value.size() == 0)) return BR_BAD_VALUE;
+      for (JsonPairConst _kv : Value.as<JsonObjectConst>()) {
+        const char *_key = _kv.key().c_str();
+        uint16_t *_param = (strcmp(_key, jk_LOW) == 0) ? &Batch.params.min_low_ms[_ch] :
+                           (strcmp(_key, jk_HIGH) == 0) ? &Batch.params.min_high_ms[_ch] :
+                           (strcmp(_key, jk_HYST) == 0) ? &Batch.params.hyst_ms[_ch] : NULL;
+        if ((_param == NULL) or !_kv.value().is<uint16_t>() or (_kv.value().as<uint16_t>() > C_FILTER_MAX)) return BR_BAD_VALUE;
+        *_param = _kv.value();
       }
-      f_FireInp01 = false;
+      return BR_OK;
+    default:
+      return BR_UNKNOWN;                                                  // в том числе поля страницы конфигурации - они меняются блоком настроек
+  }
+}
+
+bool ApplyChannelParams(const ChannelParams &Params) { // применение проверенных параметров входов на лету (под sem_ChannelParams), возвращает true, если что-то изменилось
+  bool _changed = false;
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    bool _mode = (chParams.mode[i] != Params.mode[i]) or 
+                 ((Params.mode[i] == CM_FREQUENCY) and (chParams.gate_ms[i] != Params.gate_ms[i]));    // новое время окна применяем с нового окна
+    bool _filter = (chParams.min_low_ms[i] != Params.min_low_ms[i]) or (chParams.min_high_ms[i] != Params.min_high_ms[i]) or
+                   (chParams.hyst_ms[i] != Params.hyst_ms[i]);
+    _changed |= _mode or _filter or (chParams.gate_ms[i] != Params.gate_ms[i]);
+    chParams.mode[i] = Params.mode[i];
+    chParams.gate_ms[i] = Params.gate_ms[i];
+    chParams.min_low_ms[i] = Params.min_low_ms[i];                       // фильтр читает параметры при каждом переходе - применяются сразу
+    chParams.min_high_ms[i] = Params.min_high_ms[i];
+    chParams.hyst_ms[i] = Params.hyst_ms[i];
+    if (_mode) {
+      Trace(TE_INP_MODE, i, chParams.mode[i] | ((uint32_t)chParams.gate_ms[i] << 16));
+      ApplyChannelMode(i);
+    }
+    if (_filter) {
+      Trace(TE_INP_FILTER, i, chParams.min_low_ms[i] | ((uint32_t)chParams.min_high_ms[i] << 16));
+      Trace(TE_INP_HYST, i, chParams.hyst_ms[i]);
+      NotifyTask(th_Counting);                                            // пересчитываем время ожидания фильтра
     }
-    // обработка входа 02    
-    if (f_FireInp02 and ((millis()-C_COUNTER_DELAY)>tm_LastFireInp02)) { // обработка импульса по входу 02 с подавлением дребезга выше 20Гц
-      if (!digitalRead(PIN_INP_CH2)) {                                   // если сигнал на входе в низком уровне - фиксируем импульс
-        curConfig.counter_02 ++;
-        curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);      // считаем CRC
+  }
+  return _changed;
+}
+
+void CommitBatch(CommandBatch &Batch) { // применение проверенного пакета: счётчики - одним изменением curConfig, одна запись и один отчёт
+  bool _changed = false;
+  ConfigWriteBegin();
+  if (Batch.counter_set[CN_REBOOT]) curConfig.counter_reboot = Batch.counter[CN_REBOOT];
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (Batch.counter_set[CN_CNT01 + i]) curConfig.counter[i] = Batch.counter[CN_CNT01 + i];
+  }
+  ConfigWriteEnd();                                                       // CRC16 считается при сохранении копии конфигурации
+  for (uint8_t i = 0; i <= C_INP_CHANNELS; i++) {
+    if (!Batch.counter_set[i]) continue;
+    Trace(TE_CMD_SET_COUNTER, i, Batch.counter[i]);
+    _changed = true;
+  }
+  CheckChannelParams(Batch.params);
+  _changed |= ApplyChannelParams(Batch.params);
+  if (_changed) CheckAndUpdateEEPROM();                                   // одна запись на весь пакет: статический блок и копия счётчиков
+  if (Batch.flags & BF_DIAG) {
+    val_DiagPeriod = Batch.diag_period;
+    tm_LastDiagToMQTT = millis() - val_DiagPeriod * 1000;                 // первый отчёт - сразу
+    NotifyTask(th_Report);
+  }
+  if (Batch.flags & BF_TRACE) TraceSetMask(Batch.trace_mask);
+  if (Batch.flags & BF_TRACE_DUMP) PublishTrace();
+  if (_changed or (Batch.flags & BF_REPORT)) RequestReport();             // один отчёт на весь пакет
+}
+
+bool ExecuteBatch(JsonVariantConst Commands, bool &Reboot) { // выполнение пакета команд (JSON массив или один объект), результат по командам - в cmd_BatchResult
+  CommandBatch  _batch = {};
+  BatchResult_t _results[C_BATCH_MAX];
+  bool   _array = Commands.is<JsonArrayConst>();
+  size_t _count = _array ? Commands.size() : 1;
+  bool   _valid = (_count > 0) and (_count <= C_BATCH_MAX);
+  size_t _len = 0;
+
+  xSemaphoreTake(sem_ChannelParams, portMAX_DELAY);                       // от копии параметров входов до их применения WEB сервер их не меняет
+  _batch.params = chParams;
+  for (uint8_t i = 0; _valid and (i < _count); i++) {                     // проверяем все команды, изменения копятся в копии
+    JsonVariantConst _cmd = _array ? Commands[i] : Commands;
+    _results[i] = (_cmd.is<JsonObjectConst>() and (_cmd.size() > 0)) ? BR_OK : BR_UNKNOWN;
+    if (_results[i] == BR_OK) {
+      for (JsonPairConst _kv : _cmd.as<JsonObjectConst>()) {
+        _results[i] = StageCommandKey(_batch, _kv.key().c_str(), _kv.value());
+        if (_results[i] != BR_OK) break;
       }
-      f_FireInp02 = false;
     }
+  }
+  for (uint8_t i = 0; _valid and (i < _count); i++) _valid = (_results[i] == BR_OK);
+  if (_valid) CommitBatch(_batch);
+    else count_BatchRejects++;
+  xSemaphoreGive(sem_ChannelParams);
+  count_Batches++;
+  Reboot = _valid and (_batch.flags & BF_REBOOT);
+  f_BatchApplied = _valid;
+  Trace(TE_CMD_BATCH, _count, _valid);
+  // результат: {"batch":N,"applied":true|false,"results":["ok",...]} (для пакета больше C_BATCH_MAX команд результатов нет)
+  _len = BufPrintf(cmd_BatchResult, sizeof(cmd_BatchResult), _len, "{\"batch\":%u,\"applied\":%s,\"results\":[", (uint32_t)_count, _valid ? "true" : "false");
+  for (uint8_t i = 0; (_count <= C_BATCH_MAX) and (i < _count); i++) {
+    _len = BufPrintf(cmd_BatchResult, sizeof(cmd_BatchResult), _len, "%s\"%s\"", (i > 0) ? "," : "", c_BatchResults[_results[i]]);
+  }
+  BufPrintf(cmd_BatchResult, sizeof(cmd_BatchResult), _len, "]}");
+  return _valid;
+}
+
+// ------------------------- групповые команды и подписанные блоки настроек ----------------------------
+// Кроме своего топика [SET] модуль подписан на групповые топики (поле "Group topics"). Команда в любом топике может начинаться
+// с условия выбора модулей:   @<условие>[,<условие>...] <команда>
+// Команду выполняет модуль, для которого выполнено хотя бы одно условие. Условие - выражения через '+', выполняться должны все:
+//   *              - любой модуль;
+//   id:N, id:N-M   - номер модуля (поле "Device ID") равен N или лежит в диапазоне N..M (модуль с номером 0 по номеру не выбирается);
+//   tag:<метка>    - у модуля есть метка (поле "Device tags", метки через запятую).
+// Например: @tag:water+id:1-50,id:200 {"report"}. Команда без условия выполняется всеми модулями, получившими ее.
+// Блок настроек {"provision":{<поле>:<значение>,...},"seq":N,"sig":"<hex>"} задает параметры с именами полей страницы конфигурации
+// (wn, wp, mh, ms, mb, mu, mp, ts, tr, tl, gt, dt, di, c<N>m/g/l/h/y) и применяется так же, как изменения на странице - без перезагрузки.
+// Подпись - HMAC-SHA256 с ключом P_PROV_KEY (64 hex символа) по тексту "<топик>|<сообщение>": топик, в который блок опубликован,
+// и сообщение целиком, вместе с условием выбора, до ,"sig": - поэтому поле "sig" последнее. Блок, подписанный для группового топика,
+// не примет модуль, не подписанный на этот топик, а блок для топика [SET] - другой модуль. Номер блока должен быть больше номера
+// последнего примененного (записывается в NVS до применения), поэтому перехваченный блок нельзя применить повторно. Результат -
+// в топик [STATUS]/result (см. tools/provision.py).
+// Из групповых топиков выполняются только команды, которые ничего не меняют (report, diag, trace), и подписанный блок настроек -
+// команда с любым другим ключом не выполняется целиком (результат {"result":"not_allowed"}).
+
+bool HasTag(const char *Tags, const char *Tag, size_t Len) { // есть ли метка Tag (Len символов) в списке меток модуля
+  const char *_p = Tags;
+  while (*_p) {
+    while ((*_p == ',') or (*_p == ';') or (*_p == ' ')) _p++;      // разделители и пробелы между метками
+    size_t _len = strcspn(_p, ",; ");
+    if ((_len > 0) and (_len == Len) and (strncmp(_p, Tag, Len) == 0)) return true;
+    _p += _len;
+  }
+  return false;
+}
+
+bool MatchSelector(const char *Expr, size_t Len, const GlobalParams &Cfg) { // выполняется ли для модуля выражение условия выбора
+  char  _range[16];
+  char *_end;
+  if ((Len == 1) and (*Expr == '*')) return true;
+  if ((Len > 4) and (strncmp(Expr, "tag:", 4) == 0)) return HasTag(Cfg.tags, Expr + 4, Len - 4);
+  if ((Len <= 3) or (Len - 3 >= sizeof(_range)) or (strncmp(Expr, "id:", 3) != 0) or !isdigit(Expr[3])) return false;   // неизвестное выражение - модуль не выбран
+  memcpy(_range, Expr + 3, Len - 3);
+  _range[Len - 3] = '\0';
+  uint32_t _from = strtoul(_range, &_end, 10);
+  uint32_t _to = _from;
+  if ((*_end == '-') and isdigit(_end[1])) _to = strtoul(_end + 1, &_end, 10);
+  if (*_end != '\0') return false;
+  return (Cfg.device_id != 0) and (Cfg.device_id >= _from) and (Cfg.device_id <= _to);
+}
+
+const char *SelectCommand(const char *Payload) { // проверка условия выбора модулей: текст команды без условия или NULL - команда для других модулей
+  GlobalParams _cfg;
+  if (Payload[0] != C_SELECTOR_MARK) return Payload;                      // без условия - для всех получивших команду
+  const char *_p = Payload + 1;
+  const char *_cmd = _p + strcspn(_p, " \t\r\n");                         // условие - до первого пробела
+  bool _selected = false;
+  GetConfigSnapshot(_cfg);
+  while ((_p < _cmd) and !_selected) {                                    // условия через запятую - достаточно одного
+    size_t _term = min(strcspn(_p, ","), (size_t)(_cmd - _p));
+    _selected = (_term > 0);
+    for (const char *_e = _p; _selected and (_e < _p + _term); ) {       // выражения через '+' - нужны все
+      size_t _expr = min(strcspn(_e, "+"), (size_t)(_p + _term - _e));
+      _selected = MatchSelector(_e, _expr, _cfg);
+      _e += _expr + 1;
+    }
+    _p += _term + 1;
+  }
+  if (!_selected) return NULL;
+  while (isspace((uint8_t)*_cmd)) _cmd++;
+  return _cmd;
+}
+
+bool GroupCommandAllowed(JsonVariantConst Commands) { // можно ли выполнять команду (или пакет) из группового топика
+  bool    _array = Commands.is<JsonArrayConst>();
+  uint8_t _ch;
+  for (size_t i = 0; i < (_array ? Commands.size() : 1); i++) {
+    JsonVariantConst _cmd = _array ? Commands[i] : Commands;
+    bool _signed = !_array and _cmd.containsKey(jk_PROVISION);            // блок настроек - только отдельной командой
+    for (JsonPairConst _kv : _cmd.as<JsonObjectConst>()) {
+      uint8_t _key = LookupKey(_kv.key().c_str(), _ch);
+      if ((_key == KEY_REPORT) or (_key == KEY_DIAG) or (_key == KEY_TRACE)) continue;
+      if (_signed and ((_key == KEY_PROVISION) or (strcmp(_kv.key().c_str(), jk_SEQ) == 0) or (strcmp(_kv.key().c_str(), jk_SIG) == 0))) continue;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProvisionSigned(const char *Topic, const char *Message) { // проверка подписи блока настроек: HMAC-SHA256 текста "<топик>|" и сообщения до ,"sig":"<64 hex>"}
+  const size_t _mark = strlen(C_PROV_SIG_TAIL);
+  size_t  _len = strlen(Message);
+  char    _hex[65];
+  char    _prefix[sizeof(MQTTCommand::topic) + 1];
+  while ((_len > 0) and isspace((uint8_t)Message[_len - 1])) _len--;     // перевод строки в конце сообщения (mosquitto_pub -f)
+  if (_len < _mark + 64 + 2) return false;
+  const char *_tail = Message + _len - (_mark + 64 + 2);
+  if ((strncmp(_tail, C_PROV_SIG_TAIL, _mark) != 0) or (strncmp(_tail + _mark + 64, "\"}", 2) != 0)) return false;
+  memcpy(_hex, _tail + _mark, 64);
+  _hex[64] = '\0';
+  if (strlen(Topic) == 0) return false;                                   // блок не из MQTT
+  snprintf(_prefix, sizeof(_prefix), "%s|", Topic);
+  return CheckProvisionHmac((const uint8_t*)Message, _tail - Message, _hex, _prefix);
+}
+
+bool ProvisionValuesValid(JsonVariantConst Fields) { // значения блока настроек - только строки и целые числа
+  // другой тип (true, null, дробное число) превратился бы в пустую строку - и, например, стер бы пароль
+  if (!Fields.is<JsonObjectConst>()) return false;
+  for (JsonPairConst _kv : Fields.as<JsonObjectConst>()) {
+    if (!_kv.value().is<const char*>() and !_kv.value().is<long>()) return false;
+  }
+  return true;
+}
+
+ProvisionResult_t ClaimProvisionSeq(uint32_t Seq) { // запись номера блока в NVS до применения: этот и более старые блоки больше не принимаются
+  ProvisionResult_t _result = PR_APPLIED;
+  if (!s_EnableEEPROM) return PR_STORAGE;                                 // без хранилища повтор блока не отличить от нового
+  xSemaphoreTake(sem_EEPROM, portMAX_DELAY);                              // NVS пишут и другие задачи
+  if (Seq <= cfg_Store.getUInt(C_PROV_SEQ_KEY, 0)) _result = PR_REPLAY;
+    else if (cfg_Store.putUInt(C_PROV_SEQ_KEY, Seq) != sizeof(uint32_t)) _result = PR_STORAGE;
+  xSemaphoreGive(sem_EEPROM);
+  return _result;
+}
+
+void cmdProvision(const char *Topic, const char *Message) { // команда применения подписанного блока настроек (Topic - топик получения, Message - сообщение целиком, с условием выбора)
+  ProvisionResult_t _result = PR_APPLIED;
+  uint32_t _seq = InputJSONdoc[jk_SEQ].as<uint32_t>();
+  uint8_t  _fields = 0;
+  uint8_t  _ignored = 0;
+  uint8_t  _impact = CI_NONE;
+  char     _text[96];
+  GlobalParams  _old, _new;
+  ChannelParams _params;                                                  // параметры входов меняются на копии и применяются разом
+  xSemaphoreTake(sem_ChannelParams, portMAX_DELAY);                       // одновременно с изменениями со страницы WEB
+  _params = chParams;
+  if (strlen(P_PROV_KEY) == 0) _result = PR_DISABLED;
+    else if (!ProvisionSigned(Topic, Message)) _result = PR_SIGNATURE;
+    else if (!ProvisionValuesValid(InputJSONdoc[jk_PROVISION])) _result = PR_BAD_VALUE;
+    else _result = ClaimProvisionSeq(_seq);
+  if (_result == PR_APPLIED) {
+    GetConfigSnapshot(_old);
+    for (JsonPairConst _kv : InputJSONdoc[jk_PROVISION].as<JsonObjectConst>()) {
+      String _value = _kv.value().is<const char*>() ? String(_kv.value().as<const char*>()) : String(_kv.value().as<long>());
+      _value.trim();
+      if (SetConfigField(_kv.key().c_str(), _value, _params)) _fields++;
+        else _ignored++;                                                  // неизвестные поля (например, из более новой прошивки) и не принятые значения пропускаются
+    }
+    if (_fields == 0) _result = PR_BAD_VALUE;
+  }
+  if (_result == PR_APPLIED) {
+    GetConfigSnapshot(_new);
+    _impact = GetConfigImpact(_old, _new);
+    CheckChannelParams(_params);
+    ApplyChannelParams(_params);
+    CheckAndUpdateEEPROM();
+    SaveChannelParams();
+    count_Provisions++;
+  }
+  else count_ProvisionRejects++;
+  xSemaphoreGive(sem_ChannelParams);
+  Trace(TE_CMD_PROVISION, _result, _seq);
+  // результат: {"provision":N,"result":"applied","fields":N,"ignored":N} - публикуется до переподключения
+  snprintf(_text, sizeof(_text), "{\"provision\":%u,\"result\":\"%s\",\"fields\":%u,\"ignored\":%u}", _seq, c_ProvisionResults[_result], _fields, _ignored);
+  PublishResult(_text);
+  if (_result != PR_APPLIED) return;
+  RequestConfigApply(_impact);                                            // подключения меняет задача WiFi
+  RequestReport();
+}
+
+// ================================= учёт загрузки CPU по тикам планировщика =================================
+
+void IRAM_ATTR ProfileTick(uint8_t Core) { // отмечаем задачу, активную на текущем тике ядра
+  TaskHandle_t _current = xTaskGetCurrentTaskHandle();
+  count_Ticks[Core]++;
+  for (uint8_t i = 0; i < C_PROF_SLOTS; i++) {
+    if (*prof_Tasks[i].handle == _current) {
+      prof_Tasks[i].ticks++;
+      return;
+    }
+  }
+  count_OtherTicks[Core]++;
+}
+
+void IRAM_ATTR TickHookCPU0() { // хук тика ядра 0
+  ProfileTick(0);
+}
+
+#if (portNUM_PROCESSORS > 1)
+void IRAM_ATTR TickHookCPU1() { // хук тика ядра 1
+  ProfileTick(1);
+}
+#endif
+
+// ================================== основные задачи времени выполнения =================================
+
+void RegisterPulse(uint8_t Channel, uint32_t Start_us) { // учёт засчитанного импульса (начало замыкания - Start_us) во внутренней статистике
+  uint32_t _now_us = micros();
+  int32_t  _latency = _now_us - Start_us - (uint32_t)chParams.min_low_ms[Channel] * 1000;
+  if (_latency < 0) _latency = 0;
+  HistogramAdd(hist_IsrToCount[Channel], _latency);                           // задержка от окончания минимального времени замыкания до подсчёта
+  if ((uint32_t)_latency > val_MaxIsrToCount_us[Channel]) val_MaxIsrToCount_us[Channel] = _latency;
+  RateUpdate(Channel, Start_us);                                              // скорость - по моментам замыкания, задержка обработки на нее не влияет
+  tmu_LastCount[Channel] = _now_us;
+  tm_LastCount[Channel] = millis();
+  val_LastEdgeDelay_us[Channel] = _now_us - Start_us;
+  count_Pulses[Channel]++;
+  Trace(TE_PULSE, Channel, _latency);
+}
+
+void CountPulse(uint8_t Channel, uint32_t Start_us) { // засчитываем импульс по входу
+  ConfigWriteBegin();
+  curConfig.counter[Channel]++;                                               // CRC считается при сохранении копии конфигурации
+  ConfigWriteEnd();
+  RegisterPulse(Channel, Start_us);
+  PulseLogAdd(Channel, Start_us);
+}
+
+FilterTiming GetFilterTiming(uint8_t Channel) { // параметры фильтра входа в мкс
+  return {(uint32_t)chParams.min_low_ms[Channel] * 1000, (uint32_t)chParams.min_high_ms[Channel] * 1000, (uint32_t)chParams.hyst_ms[Channel] * 1000};
+}
+
+uint32_t FilterClock() { // текущий момент для переходов фильтра по времени
+  #ifdef PULSE_SIMULATOR
+  return sim_Clock_us;                                                        // виртуальные часы генератора - результат не зависит от загрузки задач
+  #else
+  return micros();
+  #endif
+}
+
+struct CountingPort {                             // платформа прохода задачи подсчёта (counting_task.h)
+  uint8_t Channels() { return C_INP_CHANNELS; }
+  uint8_t Mode(uint8_t Channel) { return chParams.mode[Channel]; }
+  InputFilter &Filter(uint8_t Channel) { return inp_Filters[Channel]; }
+  FilterTiming Timing(uint8_t Channel) { return GetFilterTiming(Channel); }
+  uint32_t FilterNow() { return FilterClock(); }
+  uint32_t Millis() { return millis(); }
+  uint32_t &NextGate(uint8_t Channel) { return tm_NextGate[Channel]; }
+  uint16_t Gate(uint8_t Channel) { return chParams.gate_ms[Channel]; }
+
+  FreqMeter CloseWindow(uint8_t Channel) {        // таймер захвата переполняется за 53 с - окно не длиннее C_GATE_MAX
+    FreqMeter _m;
+    portENTER_CRITICAL(&mux_Freq);
+    _m = FreqMeterClose(freq_Meters[Channel]);
+    portEXIT_CRITICAL(&mux_Freq);
+    return _m;
+  }
+
+  void Pulse(uint8_t Channel, uint32_t Start_us) {
+    CountPulse(Channel, Start_us);
+  }
+
+  void Bounce(uint8_t Channel) {
+    count_BounceEdges[Channel]++;
+  }
+
+  void Glitch(uint8_t Channel) {
+    count_DebounceReject[Channel]++;
+    Trace(TE_PULSE_GLITCH, Channel);
+  }
+
+  void Window(uint8_t Channel, const FreqMeter &Window) { // расчет частоты и скважности, замыкания за окно - в счётчик
+    FreqResult _result = FreqMeterResult(Window, C_CAPTURE_CLOCK);
+    val_Freq_mHz[Channel] = _result.freq_mhz;
+    val_Duty_pm[Channel] = _result.duty_pm;
+    if (Window.pulses > 0) {
+      ConfigWriteBegin();
+      curConfig.counter[Channel] += Window.pulses;                        // CRC считается при сохранении копии конфигурации
+      ConfigWriteEnd();
+      count_Pulses[Channel] += Window.pulses;
+      tmu_LastCount[Channel] = micros();
+      tm_LastCount[Channel] = millis();
+      val_LastEdgeDelay_us[Channel] = 0;                                  // импульсы окна засчитываются по его окончании - задержку от фронта не разделяем
+    }
+    Trace(TE_FREQ_GATE, Channel, val_Freq_mHz[Channel]);
+  }
+};
+
+void countingTask(void *pvParam) { // задача основной обработки по подсчёту импульсов с подавлением дребезга и сохранением данных при потере питания
+  TickType_t _wait = portMAX_DELAY;                                      // время ожидания следующего события
+  uint32_t _wait_us;                                                     // время до ближайшего перехода фильтра или окончания окна в мкс
+  CountingPort _port;                                                    // входы, часы и счётчики прошивки для прохода задачи
+  GlobalParams _cfg;                                                     // копия конфигурации для сохранения при пропадании питания
+  while (true) {
+    // ждем фронтов на входах или наступления перехода фильтра по времени
+    ulTaskNotifyTake(pdTRUE, _wait);
+    #ifdef POWER_SAVE_MODE
+    RearmWakeups();                                                      // уровни пробуждения входов, сменивших состояние
+    #endif
+    // фронты входов в режиме подсчёта импульсов и окончание окон измерения частоты
+    CountingStep(_port);
     // обработка сигнала пропадания питания Cut-Off
     if (f_FireCutOff) {  
-      #ifdef DEBUG_LEVEL_PORT
-      Serial.println("Power cut-off detected. Save values."); 
-      #endif   
+      uint32_t _start_us = micros();
+      Trace(TE_POWER_CUT);
+      CountingFlush(_port);                                                                    // замыкания незакрытых окон частоты - в счётчики
       if (s_EnableEEPROM) {                                                                    // если EEPROM разрешен - просто его записываем
-        EEPROM.put(0,curConfig);                                                               // пишем EEPROM
-        EEPROM.commit();                                                                       // коммитим изменения 
+        GetConfigSnapshot(_cfg);                                                               // берем согласованную копию конфигурации
+        SaveConfigSnapshot(_cfg);                                                              // пишем EEPROM и коммитим изменения 
       }    
-      #ifdef DEBUG_LEVEL_PORT
-      Serial.println("Save & commit complete."); 
-      #endif 
+      Trace(TE_POWER_SAVED, 0, micros() - _start_us);
  	    // публикуем событие о том, что мы померли
       if (mqttClient.connected()) {
-        mqttClient.publish(curConfig.lwt_topic, 0, true, jv_OFFLINE);                          // публикуем в топик LWT_TOPIC событие о своей смерти
-        #ifdef DEBUG_LEVEL_PORT                                      
-        Serial.printf("Publishing LWT offline state in [%s]. QoS 0. \n", curConfig.lwt_topic); 
-        #endif                     
+        PublishMQTT(curConfig.lwt_topic, true, jv_OFFLINE);                                    // публикуем в топик LWT_TOPIC событие о своей смерти
       }  
       vTaskDelay(C_REPORT_DELAY);                                                             // вгоняем чип в задержку до конца питания      
       ESP.restart();                                                                          // и если мы еще живы, когда дошли до этого места - перезагружаемся (защита от дребезга по 220v -
                                                                                               // возможен вариант потери полупериода-периода питания, датчик сработает, а питание восстановится)
     }
-    vTaskDelay(1/portTICK_PERIOD_MS);     
+    // считаем время до ближайшего перехода фильтра или окончания окна измерения частоты, если их нет - ждем прерывания
+    _wait_us = CountingWait_us(_port);
+    if (_wait_us == C_WAIT_FOREVER) _wait = portMAX_DELAY;
+      else _wait = (_wait_us > 0) ? pdMS_TO_TICKS((_wait_us + 999) / 1000) + 1 : 0;
   }
 }
 
 void eventHandlerTask (void *pvParam) { // задача обработки событий получения команды от датчика, таймера, MQTT, OneWire, кнопок
-  uint8_t         new_light_mode = 0;                       // новый режим работы подсветки индикатора    
+  TickType_t _wait = portMAX_DELAY;                         // время ожидания следующего события
+  MQTTCommand _cmd;                                         // команда MQTT из очереди
   while (true) {
-    //-------------------- обработка команд задержки и таймера ---------------------------------------
-    // обработка флага мигания
-    if (millis()-tm_LastBlink > C_BLINKER_DELAY) {  // переключаем блинкер по задержке 
-      f_Blinker = !f_Blinker;
-      tm_LastBlink = millis();
-    } 
+    // ждем команды по MQTT или изменения состояния кнопок
+    ulTaskNotifyTake(pdTRUE, _wait);
     //-------------------- обработка событий получения MQTT команд в приложение ----------------------
-    if ( f_HasMQTTCommand ) {                                         // превращаем события MQTT в команды для отработки приложением    
-      // защищаем секцию работы с Static JSON DOC с помощью мьютекса
-      // MQTT: report
-      if (InputJSONdoc.containsKey(jc_REPORT) and InputJSONdoc[jc_REPORT])  {   // послана команда принудительного отчета
-        f_Has_Report = true;                                         // взводим флаг, что отчёт нужен сейчас
+    while (xQueueReceive(q_MQTTCommands, &_cmd, 0) == pdTRUE) {      // превращаем события MQTT в команды для отработки приложением - все накопленные по порядку
+      HistogramAdd(hist_Command[CST_QUEUE], micros() - _cmd.received_us);
+      const char *_text = _cmd.reply ? _cmd.payload : SelectCommand(_cmd.payload);    // условие выбора модулей - только у команд MQTT
+      if (_text == NULL) {                                           // групповая команда для других модулей
+        count_CmdSkipped++;
+        Trace(TE_CMD_SKIPPED, strlen(_cmd.payload));
+        continue;
       }
-      // MQTT: reboot
-      if (InputJSONdoc.containsKey(jc_REBOOT) and InputJSONdoc[jc_REBOOT])  {   // послана команда принудительной перезагрузки
-        CheckAndUpdateEEPROM();
-        cmdReset();
+      if (!ParseMQTTCommand(_text)) {
+        count_MQTTCmdErrors++;
+        if (_cmd.reply) {                                            // WEB сервер ждет ответа - сообщаем, что пакет не разобран
+          f_BatchApplied = false;
+          strcpy(cmd_BatchResult, "{\"batch\":0,\"applied\":false,\"results\":[]}");
+          val_BatchResultId = _cmd.batch_id;
+          xSemaphoreGive(sem_BatchDone);
+        }
+        continue;
       }
-      // MQTT: сброс конфигурации/значения счётчиков
-      if (InputJSONdoc.containsKey(jk_CLEAR))  {   // послана команда сброса
-        if (InputJSONdoc[jk_CLEAR] == jv_COUNTER_01) cmdSetCounterValue(CN_CNT01,0);          // команда сброса счётчика 1
-        if (InputJSONdoc[jk_CLEAR] == jv_COUNTER_02) cmdSetCounterValue(CN_CNT02,0);          // команда сброса счётчика 2
-        if (InputJSONdoc[jk_CLEAR] == jv_COUNTER_RB) cmdSetCounterValue(CN_REBOOT,0);         // команда сброса счётчика перезагрузок
-        if (InputJSONdoc[jk_CLEAR] == jv_CONFIG)     cmdClearConfig_Reset();                  // команда сброса конфигурации и обнуления счётчиков
+      if (_cmd.group and !GroupCommandAllowed(InputJSONdoc.as<JsonVariantConst>())) {   // из группового топика - только то, что ничего не меняет
+        count_GroupRejects++;
+        Trace(TE_CMD_NOT_ALLOWED, strlen(_text));
+        PublishResult("{\"result\":\"not_allowed\"}");
+        continue;
       }
-      // MQTT: установка значений счётчиков - 1
-      if (InputJSONdoc.containsKey(jk_SET_VALUE_01))  {   // послана команда установки значения счётчика
-        uint32_t _cntr_value1 = 0;
-        if (InputJSONdoc[jk_SET_VALUE_01].is<int32_t>()) {
-          _cntr_value1 = InputJSONdoc[jk_SET_VALUE_01];
-          cmdSetCounterValue(CN_CNT01,_cntr_value1);        // устанавливаем значение для счётчика 1
-        }  
-        else {
-          #ifdef DEBUG_LEVEL_PORT                                            
-          Serial.printf("!!! Value can't be assigned for counter 01 !!!\n");
-          #endif
+      tmu_CurrentCommand = _cmd.received_us;                         // запросы отчёта от этой команды измеряются от момента ее получения
+      // пакет команд (JSON массив в [SET] или любая команда из WEB) - одна транзакция с ответом по каждой команде
+      if (_cmd.reply or InputJSONdoc.is<JsonArray>()) {
+        bool _reboot = false;
+        ExecuteBatch(InputJSONdoc.as<JsonVariantConst>(), _reboot);
+        if (_cmd.reply) {
+          val_BatchResultId = _cmd.batch_id;
+          xSemaphoreGive(sem_BatchDone);
         }
-      }
-      // MQTT: установка значений счётчиков - 2
-      if (InputJSONdoc.containsKey(jk_SET_VALUE_02))  {   // послана команда установки значения счётчика
-        uint32_t _cntr_value2 = 0;
-        if (InputJSONdoc[jk_SET_VALUE_02].is<int32_t>()) {
-          _cntr_value2 = InputJSONdoc[jk_SET_VALUE_02];
-          cmdSetCounterValue(CN_CNT02,_cntr_value2);        // устанавливаем значение для счётчика 1
-        }  
-        else {
-          #ifdef DEBUG_LEVEL_PORT                                            
-          Serial.printf("!!! Value can't be assigned for counter 02 !!!\n");
-          #endif
+          else PublishResult(cmd_BatchResult);
+        Trace(TE_CMD_DONE, 0, micros() - _cmd.received_us);
+        tmu_CurrentCommand = 0;
+        if (_reboot) {
+          vTaskDelay(pdMS_TO_TICKS(500));                            // даем отправить ответ на пакет
+          cmdReset();
         }
+        continue;
+      }
+      // одиночная команда (объект) - ключи разбираются тем же StageCommandKey, что и у пакета, в любом порядке, но неизвестные ключи
+      // и ключи с недопустимым значением пропускаются. Команды, выполняемые только отдельно, - после применения остальных:
+      // сброс конфигурации {"clear":"config"}, обновление прошивки {"ota":"http://...","sha256":"<hex>"} (загрузка в отдельной задаче),
+      // подписанный блок настроек {"provision":{...},"seq":N,"sig":"<hex>"} (подпись проверяется по тексту сообщения) и перезагрузка
+      CommandBatch _single = {};
+      _single.params = chParams;
+      for (JsonPairConst _kv : InputJSONdoc.as<JsonObjectConst>()) {
+        if (StageCommandKey(_single, _kv.key().c_str(), _kv.value()) != BR_BAD_VALUE) continue;
+        uint8_t _ch;
+        Trace(TE_CMD_BAD_VALUE, LookupKey(_kv.key().c_str(), _ch), _ch + 1);
       }
-      // обработка входного JSON закончена - отпускаем семафор
-      f_HasMQTTCommand = false;                                       // сбрасываем флаг наличия изменений через MQTT 
-      xSemaphoreGive(sem_InputJSONdoc);                               // отпускаем семафор обработки входного сообщения
+      CommitBatch(_single);
+      if (_single.flags & BF_CLEAR_CONFIG) cmdClearConfig_Reset();
+      if (_single.flags & BF_OTA) cmdStartOta(InputJSONdoc[jk_OTA], InputJSONdoc[jk_SHA256] | "", InputJSONdoc[jk_SIG] | "");
+      if (_single.flags & BF_PROVISION) cmdProvision(_cmd.topic, _cmd.payload);
+      if (_single.flags & BF_REBOOT) cmdReset();
+      // обработка входного JSON закончена
+      Trace(TE_CMD_DONE, 0, micros() - _cmd.received_us);
+      tmu_CurrentCommand = 0;
     }
     //--------------------- опрос кнопок - получение команд ------------------------
     bttn_clear.tick();                                                // опрашиваем кнопку CLEAR
     bttn_flash.tick();                                                // опрашиваем кнопку FLASH
-    // однократное нажатие на кнопку CLEAR - обнуление счётчика №1
-    if (bttn_clear.isClick()) {        
-        cmdSetCounterValue(CN_CNT01,0);
-    }
-    // двухкратное нажатие на кнопку CLEAR - обнуление счётчика №2
-    if (bttn_clear.isDouble()) {        
-        cmdSetCounterValue(CN_CNT02,0);
+    // N-кратное нажатие на кнопку CLEAR - обнуление счётчика входа N (одно нажатие - вход 1, двойное - вход 2 ...)
+    if (bttn_clear.hasClicks()) {        
+        uint8_t _clicks = bttn_clear.getClicks();
+        if ((_clicks >= 1) and (_clicks <= C_INP_CHANNELS)) cmdSetCounterValue(CN_CNT01 + _clicks - 1,0);
     }
     // одновременное нажатие и удержание кнопок CLEAR и FLASH - команда сброса конфигурации до заводских параметров и перезагрузка
     if (bttn_clear.isHold() and bttn_flash.isHold()) {        
         cmdClearConfig_Reset();
     }
-    // отдаем управление ядру FreeRT OS
-    vTaskDelay(1/portTICK_PERIOD_MS); 
+    // пока кнопки нажаты или недавно менялись - опрашиваем их периодически (для отработки кликов и удержания), иначе - ждем событий
+    if (bttn_clear.state() or bttn_flash.state() or (millis()-tm_LastButtonEdge < C_BUTTON_ACTIVE_TIME)) _wait = pdMS_TO_TICKS(C_BUTTON_POLL_DELAY);
+      else _wait = portMAX_DELAY;
   }
 }
 
-void applayChangesTask (void *pvParam) { // применяем изменения состояния
-// здесь отражаются внутренние изменения, команды выполняются в процедуре обработки команд eventHandlerTask
-  while (true) {
-
-  // TODO: включаем/выключаем индикацию
-    digitalWrite(LED_RED_PIN,!digitalRead(PIN_INP_CH1));
-    digitalWrite(LED_BLUE_PIN,!digitalRead(PIN_INP_CH2));
-
-
-    vTaskDelay(1/portTICK_PERIOD_MS); 
-  }
+uint32_t TicksUntil(uint32_t Since, uint32_t Period) { // сколько тиков осталось до наступления периодического события
+  uint32_t _elapsed = millis() - Since;
+  return (_elapsed >= Period) ? 0 : pdMS_TO_TICKS(Period - _elapsed);
 }
 
 void reportTask (void *pvParam) { // репортим о текущем состоянии в MQTT и если отладка то и в Serial
+  TickType_t _wait;
+  GlobalParams _cfg;                                                      // согласованная копия конфигурации для отчёта
+  DiagWindow _diag_window = {};                                           // окно измерения загрузки для публикации диагностики
+  uint32_t _reported_pulses = 0;                                          // импульсов засчитано к последнему опубликованному отчёту
   while (true) {
-    if (((millis()-tm_LastReportToMQTT)>C_REPORT_DELAY) || f_Has_Report) {  // если наступило время отчёта или взведен флаг наличия отчета
+    // ждем запроса отчёта (RequestReport) или наступления времени периодического отчёта или диагностики
+    _wait = TicksUntil(tm_LastReportToMQTT, C_REPORT_DELAY);
+    if (val_DiagPeriod > 0) _wait = min(_wait, (TickType_t)TicksUntil(tm_LastDiagToMQTT, val_DiagPeriod * 1000));
+    ulTaskNotifyTake(pdTRUE, _wait);
+    GetConfigSnapshot(_cfg);
+    // публикуем диагностику в топик [STATUS]/diag
+    if ((val_DiagPeriod > 0) and (millis()-tm_LastDiagToMQTT >= val_DiagPeriod * 1000)) {
+      if (mqttClient.connected()) {
+        char _buf[C_DIAG_BUF_SIZE];
+        char _topic[sizeof(_cfg.report_topic) + 8];
+        snprintf(_topic, sizeof(_topic), "%s/diag", _cfg.report_topic);
+        if (BuildDiagReport(_buf, sizeof(_buf), _diag_window) > 0) PublishMQTT(_topic, false, _buf);
+          else Trace(TE_DIAG_OVERFLOW, 1, sizeof(_buf));
+      }
+      tm_LastDiagToMQTT = millis();
+    }
+    if (((millis()-tm_LastReportToMQTT)>=C_REPORT_DELAY) || f_Has_Report) {  // если наступило время отчёта или взведен флаг наличия отчета
+      uint32_t _request_us = tmu_ReportRequest;                           // отчёт запрошен командой MQTT - измеряем задержку до публикации
+      tmu_ReportRequest = 0;
       if (mqttClient.connected()) {  // если есть связь с MQTT - репорт в топик
         // ---------------------------------------------------------------------------------
         // рапортуем в главный топик статуса [curConfig.report_topic]
+        uint32_t _build_us = micros();
+        uint32_t _pulses = 0;
+        uint64_t _since_count_us = 0;
+        uint32_t _edge_delay_us = 0;
+        bool     _has_pulse = GetNewestPulse(_since_count_us, _edge_delay_us);
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) _pulses += count_Pulses[i];
         // чистим документ
         OutputJSONdoc.clear(); 
         // добавляем поля в документ
-        OutputJSONdoc[jk_COUNTER_01] = curConfig.counter_01;                                        // значение счётчика 1
-        OutputJSONdoc[jk_COUNTER_02] = curConfig.counter_02;                                        // значение счётчика 2
-        OutputJSONdoc[jk_COUNTER_RB] = curConfig.counter_reboot;                                    // значение счётчика перезагрузок
-        OutputJSONdoc[jk_IP] = WiFi.localIP().toString();                                           // выводим значение IP адреса подключения
-        // серилизуем в строку
-        String tmpPayload;
-        serializeJson(OutputJSONdoc, tmpPayload);
-        // публикуем в топик P_STATE_TOPIC серилизованный json через буфер buffer
-        char buffer1[ tmpPayload.length()+1 ];
-        tmpPayload.toCharArray(buffer1, sizeof(buffer1));   
-        mqttClient.publish(curConfig.report_topic, 0, true, buffer1 );
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) OutputJSONdoc[ch_Keys[i].counter] = _cfg.counter[i];    // значения счётчиков
+        OutputJSONdoc[jk_COUNTER_RB] = _cfg.counter_reboot;                                         // значение счётчика перезагрузок
+        char _value[16];                                                                            // значения копируются в документ (serialized от char*)
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+          PrintCurrentFlow(_value, sizeof(_value), i);
+          OutputJSONdoc[ch_Keys[i].flow] = serialized((char*)_value);                               // текущий расход в л/мин
+        }
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+          if (chParams.mode[i] != CM_FREQUENCY) continue;
+          PrintFreq(_value, sizeof(_value), i);
+          OutputJSONdoc[ch_Keys[i].freq] = serialized((char*)_value);                               // частота по входу в Гц
+          PrintDuty(_value, sizeof(_value), i);
+          OutputJSONdoc[ch_Keys[i].duty] = serialized((char*)_value);                               // доля замкнутого состояния в %
+        }
+        IPAddress _ip = WiFi.localIP();
+        snprintf(_value, sizeof(_value), "%u.%u.%u.%u", _ip[0], _ip[1], _ip[2], _ip[3]);
+        OutputJSONdoc[jk_IP] = (char*)_value;                                                       // выводим значение IP адреса подключения
+        if (_has_pulse) OutputJSONdoc[jk_PULSE_AGE] = (_since_count_us + _edge_delay_us) / 1000;   // возраст самого свежего импульса в мс
+        // серилизуем в буфер и публикуем в топик P_STATE_TOPIC
+        char buffer1[C_REPORT_BUF_SIZE];
+        size_t   _report_need = measureJson(OutputJSONdoc);
+        size_t   _report_len = (_report_need < sizeof(buffer1)) ? serializeJson(OutputJSONdoc, buffer1, sizeof(buffer1)) : 0;
+        uint16_t _packet = 0;
+        uint32_t _publish_us = 0;
+        if (OutputJSONdoc.overflowed() or (_report_len != _report_need)) {  // отчёт не поместился в документ или буфер - обрезанный JSON не публикуем
+          count_ReportOverflows++;
+          Trace(TE_MQTT_REPORT_OVERFLOW, OutputJSONdoc.overflowed(), _report_need);
+        } else {
+          portENTER_CRITICAL(&mux_ReportAck);
+          val_EarlyAckPacketId = 0;                                         // подтверждения прежних пакетов (номера повторяются) не учитываем
+          portEXIT_CRITICAL(&mux_ReportAck);
+          _publish_us = micros();                                           // до передачи - подтверждение может прийти раньше возврата из publish
+          _packet = PublishMQTT(_cfg.report_topic, true, buffer1, 0, 1);   // QoS 1 - подтверждение сервера замыкает измерение возраста значения
+        }
+        if (_packet != 0) {
+          uint32_t _latency = (_request_us != 0) ? _publish_us - _request_us : 0;
+          bool     _fresh = _has_pulse and (_pulses != _reported_pulses);    // в отчёт попали импульсы, которых не было в прошлом
+          if (_request_us != 0) HistogramAdd(hist_Command[CST_PUBLISH], _latency);
+          if (_fresh) ReportStageAdd(RST_COUNT_TO_BUILD, _since_count_us);
+          ReportStageAdd(RST_BUILD_TO_PUBLISH, _publish_us - _build_us);
+          uint64_t _edge_age_us = _fresh ? _since_count_us + _edge_delay_us + (_publish_us - _build_us) : 0;
+          bool     _acked;
+          uint32_t _ack_us = 0;
+          portENTER_CRITICAL(&mux_ReportAck);
+          _acked = (val_EarlyAckPacketId == _packet);                        // подтверждение пришло раньше записи номера
+          if (_acked) {
+            _ack_us = tmu_EarlyAck - _publish_us;
+            val_EarlyAckPacketId = 0;
+          } else {
+            val_ReportPacketId = _packet;
+            tmu_ReportPublish = _publish_us;
+            val_ReportEdgeAge_us = _edge_age_us;
+          }
+          portEXIT_CRITICAL(&mux_ReportAck);
+          if (_acked) ReportAcked(_ack_us, _edge_age_us);
+          _reported_pulses = _pulses;
+          Trace(TE_MQTT_REPORT, _report_len, _latency);
+          HeapCheckpoint();                                                  // одна и та же точка каждого отчёта - рост числа блоков кучи виден между отчётами
+        }
       }
       #ifdef DEBUG_LEVEL_PORT 
         Serial.println();
         Serial.println("<<<< Current state report >>>>");
-        Serial.printf("%s : %u\n", jk_COUNTER_01, curConfig.counter_01);
-        Serial.printf("%s : %u\n", jk_COUNTER_02, curConfig.counter_02);
-        Serial.printf("%s : %u\n", jk_COUNTER_RB, curConfig.counter_reboot);    
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) Serial.printf("%s : %u\n", ch_Keys[i].counter, _cfg.counter[i]);
+        Serial.printf("%s : %u\n", jk_COUNTER_RB, _cfg.counter_reboot);    
         Serial.println("---");            
-        Serial.printf("inp1 : %u\n", digitalRead(PIN_INP_CH1));
-        Serial.printf("inp2 : %u\n", digitalRead(PIN_INP_CH2));
+        for (uint8_t i = 0; i < C_INP_CHANNELS; i++) Serial.printf("inp%u : %u\n", i+1, digitalRead(c_Inputs[i].pin));
         Serial.printf("cut-off : %u\n", digitalRead(PIN_INP_AC_CUTOFF));
         Serial.println("<<<< End of current report >>>>");
       #endif                
       tm_LastReportToMQTT = millis();           // взводим интервал отсчёта
       f_Has_Report = false;                     // сбрасываем флаг
     }
-    vTaskDelay(1/portTICK_PERIOD_MS);         
   }
 }
 
+#ifdef DEBUG_LEVEL_PORT
+void traceTask(void *pvParam) { // вывод новых событий трассировки в порт при отладке - медленный вывод в порт идет только в этой задаче
+  TraceEntry _chunk[8];
+  uint32_t   _seq = 0;
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(C_TRACE_PRINT_DELAY));
+    uint32_t _next = trace_Head;
+    while ((int32_t)(_seq - _next) < 0) {
+      uint32_t _oldest = TraceOldest();
+      if ((int32_t)(_seq - _oldest) < 0) {                               // порт не успевает за событиями - часть перезаписана
+        Serial.printf("--- %u trace events lost\n", _oldest - _seq);
+        _seq = _oldest;
+        continue;
+      }
+      uint32_t _count = TraceRead(_seq, _chunk, min((uint32_t)(sizeof(_chunk) / sizeof(_chunk[0])), _next - _seq));
+      if (_count == 0) break;                                             // событие еще заполняется - выведем в следующий раз
+      for (uint32_t i = 0; i < _count; i++) Serial.printf("[%10u] %u %-18s %u %u\n", _chunk[i].time_us, _chunk[i].core, 
+                                                          TraceEventName(_chunk[i].id), _chunk[i].arg0, _chunk[i].arg1);
+      _seq += _count;
+    }
+  }
+}
+#endif
+
+#ifdef LOAD_SIMULATION
+void loadSimTask (void *pvParam) { // имитация нагрузки от WEB сервера и MQTT для измерения задержки обработки импульсов
+  String  _page;
+  String  _topic = String(curConfig.report_topic) + "/load";
+  char    _payload[64];
+  uint32_t _cycle = 0;
+  while (true) {
+    // имитируем сборку WEB страниц - так же как это делают обработчики страниц
+    for (uint8_t i = 0; i < C_LOAD_WEB_PAGES; i++) {
+      _page = CSW_PAGE_TITLE;
+      _page += ControllerName + " load</title>" + CSW_PAGE_STYLE + String(curConfig.counter[0]) + String(curConfig.counter_reboot) + CSW_PAGE_FOOTER;  // здесь согласованность не важна
+    }
+    // имитируем серию публикаций в MQTT
+    if (mqttClient.connected()) {
+      for (uint8_t i = 0; i < C_LOAD_MQTT_BURST; i++) {
+        snprintf(_payload, sizeof(_payload), "{\"cycle\":%u,\"n\":%u}", _cycle, i);
+        PublishMQTT(_topic.c_str(), false, _payload);
+      }
+    }
+    _cycle++;
+    vTaskDelay(pdMS_TO_TICKS(C_LOAD_PERIOD));
+  }
+}
+#endif
+
+#ifdef PULSE_SIMULATOR
+// генератор импульсов (input_filter.h): форма сигнала строится по виртуальным часам от детерминированного генератора
+// псевдослучайных чисел и не зависит от загрузки процессора. Каждый фронт передается в обработку входа с моментом, 
+// в который он должен был случиться, а фильтры входов считают время по тем же виртуальным часам (FilterClock) - 
+// часы продвигаются только после передачи всех фронтов до этого момента. Поэтому при одинаковом C_SIM_SEED и 
+// одинаковых параметрах фильтра результат подсчёта в режиме импульсов повторяется при любой загрузке задач.
+// Для входа в режиме частоты фронты передаются с метками времени в тактах таймера захвата - так проверяется расчет 
+// частоты без генератора сигналов (окна измерения частоты идут по реальным часам).
+SimWave GetSimWave(uint8_t Channel) { // параметры сигнала генератора для входа
+  SimWave _wave;
+  _wave.period_ms = C_SIM_PERIOD_CH1 + Channel * (C_SIM_PERIOD_CH2 - C_SIM_PERIOD_CH1);    // периоды следующих входов продолжают разницу между первыми двумя
+  _wave.jitter_ms = C_SIM_JITTER;
+  _wave.width_ms = C_SIM_WIDTH;
+  _wave.bounce_edges = C_SIM_BOUNCE_EDGES;
+  _wave.bounce_span_ms = C_SIM_BOUNCE_SPAN;
+  _wave.glitch_pct = C_SIM_GLITCH_PCT;
+  _wave.glitch_max_us = chParams.min_low_ms[Channel] * 500;                // помеха короче половины минимального времени замыкания
+  _wave.freq_period_us = C_SIM_FREQ_PERIOD_CH1 + Channel * (C_SIM_FREQ_PERIOD_CH2 - C_SIM_FREQ_PERIOD_CH1);
+  _wave.freq_duty_pct = C_SIM_FREQ_DUTY;
+  _wave.frequency = (chParams.mode[Channel] == CM_FREQUENCY);
+  return _wave;
+}
+
+void pulseSimTask (void *pvParam) { // генератор импульсов с дребезгом и помехами на входах счётчиков
+  SimChannel _channels[C_INP_CHANNELS];
+  uint32_t _start = millis();                                             // начало виртуальных часов
+  uint32_t _start_us = micros();
+  #ifdef DEBUG_LEVEL_PORT
+  uint32_t _counted_start[C_INP_CHANNELS];                                // засчитанные импульсы на момент старта генератора
+  uint32_t _last_report = 0;
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) _counted_start[i] = count_Pulses[i];
+  #endif
+  sim_Clock_us = _start_us;
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    SimStart(_channels[i], GetSimWave(i));
+    _channels[i].closed = sim_InputClosed[i];
+    count_SimPulses[i] = _channels[i].pulses;
+  }
+  while (true) {
+    uint32_t _now = (millis() - _start) * 1000;                           // виртуальные часы идут в мкс, а задача просыпается по тикам
+    uint32_t _next = UINT32_MAX;
+    for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+      SimWave _wave = GetSimWave(i);
+      // выполняем все наступившие фронты - каждый с его собственным моментом по виртуальным часам
+      while ((int32_t)(_now - _channels[i].next_edge) >= 0) {
+        uint32_t _edge = _channels[i].next_edge;
+        SimEdge(_channels[i], _wave, sim_Random);
+        sim_InputClosed[i] = _channels[i].closed;
+        if (_wave.frequency) FreqEdge(i, sim_InputClosed[i], (_start_us + _edge) * (C_CAPTURE_CLOCK / 1000000));
+          else CounterInputChanged(i, _start_us + _edge);
+      }
+      count_SimPulses[i] = _channels[i].pulses;
+      count_SimGlitches[i] = _channels[i].glitches;
+      _next = min(_next, _channels[i].next_edge);
+    }
+    __sync_synchronize();
+    sim_Clock_us = _start_us + _now;                                      // все фронты до этого момента уже в буферах фильтров
+    NotifyTask(th_Counting);                                              // переходы фильтров по времени считаются от виртуальных часов
+    #ifdef DEBUG_LEVEL_PORT
+    if (_now - _last_report >= (uint32_t)C_SIM_REPORT_DELAY * 1000) {
+      for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+        Serial.printf("SIM ch%u: generated %u, counted %u, glitches %u, bounce edges %u\n", i+1, count_SimPulses[i], 
+                      count_Pulses[i] - _counted_start[i], count_SimGlitches[i], count_BounceEdges[i]);
+        if (chParams.mode[i] == CM_FREQUENCY) {
+          uint32_t _expected = 1000000000UL / GetSimWave(i).freq_period_us;      // частота генератора в мГц
+          Serial.printf("SIM ch%u: frequency %s Hz (expected %u.%03u), duty %s%% (expected %u%%)\n", i+1, GetFreqString(i).c_str(), 
+                        _expected / 1000, _expected % 1000, GetDutyString(i).c_str(), C_SIM_FREQ_DUTY);
+        }
+      }
+      _last_report = _now;
+    }
+    #endif
+    vTaskDelay(pdMS_TO_TICKS(min((_next - _now) / 1000, (uint32_t)C_SIM_CLOCK_STEP)) + 1);   // спим до ближайшего фронта, но часы фильтров двигаем не реже шага
+  }
+}
+#endif
+
+void SetupPowerManagement() { // учёт загрузки CPU и настройка энергосбережения
+  // загрузку ядер считаем по тикам планировщика - это работает без включения статистики времени выполнения FreeRTOS
+  th_Idle[0] = xTaskGetIdleTaskHandleForCPU(0);
+  esp_register_freertos_tick_hook_for_cpu(TickHookCPU0, 0);
+  #if (portNUM_PROCESSORS > 1)
+  th_Idle[1] = xTaskGetIdleTaskHandleForCPU(1);
+  esp_register_freertos_tick_hook_for_cpu(TickHookCPU1, 1);
+  #endif
+#if defined(POWER_SAVE_MODE) && defined(CONFIG_PM_ENABLE)
+  // все задачи ждут событий, поэтому CPU может снижать частоту, а при наличии tickless idle - уходить в light sleep
+  esp_pm_config_esp32_t _pm_config;
+  _pm_config.max_freq_mhz = C_PM_MAX_FREQ_MHZ;
+  _pm_config.min_freq_mhz = C_PM_MIN_FREQ_MHZ;
+  #if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  _pm_config.light_sleep_enable = true;
+  // просыпаемся по изменению уровня на входах - уровень пробуждения переключает задача подсчёта по запросу из прерываний
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) ArmInputWakeup(c_Inputs[i].pin, !digitalRead(c_Inputs[i].pin));
+  ArmInputWakeup(BTN_CLEAR_PIN, !digitalRead(BTN_CLEAR_PIN));
+  ArmInputWakeup(BTN_FLASH_PIN, !digitalRead(BTN_FLASH_PIN));
+  gpio_wakeup_enable((gpio_num_t)PIN_INP_AC_CUTOFF, GPIO_INTR_HIGH_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  #else
+  _pm_config.light_sleep_enable = false;
+  #endif
+  esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "capture", &pm_CaptureLock);
+  if (esp_pm_configure(&_pm_config) != ESP_OK) {
+    #ifdef DEBUG_LEVEL_PORT
+    Serial.println("Power management is not configured.");
+    #endif
+  }
+#endif
+}
+
 // =================================== инициализация контроллера и программных модулей ======================================
 // начальная инициализация программы - выполняется при подаче дежурного питания.
 // дальнейшее включение усилителя - уже в рамках работающей программы
 void setup() { // инициализация контроллера и программных модулей
   uint8_t MacAddress[8];                        // временная переменная для MAC адреса текущей ESP 
   String  Mac_Postfix;                          // строка для создания постфикса имени из MAC
+  uint8_t _loaded = CP_NONE;                    // части конфигурации, загруженные из NVS (ConfigPart_t)
+  uint8_t _migrated = CP_NONE;                  // части, перенесенные из образа EEPROM прежней версии
+  bool    _saved;
 
   #ifdef DEBUG_LEVEL_PORT                       // вывод в порт при отладке кода
   // инициализируем порт отладки 
@@ -1167,10 +5075,10 @@ void setup() { // инициализация контроллера и прог
   #endif
 
  // инициализация входов и выходов  
-  pinMode(LED_RED_PIN, OUTPUT);               // инициализируем pin светодиода канала 1
-  pinMode(LED_BLUE_PIN, OUTPUT);              // инициализируем pin светодиода канала 2 
-  pinMode(PIN_INP_CH1, INPUT);                // инициализируем вход канала 1
-  pinMode(PIN_INP_CH2, INPUT);                // инициализируем вход канала 2
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (c_Inputs[i].led != C_PIN_NONE) pinMode(c_Inputs[i].led, OUTPUT);    // инициализируем pin светодиода канала
+    pinMode(c_Inputs[i].pin, INPUT);                                         // инициализируем вход канала
+  }
   pinMode(PIN_INP_AC_CUTOFF, INPUT);          // инициализируем вход датчика наличия напряжения
 
   // инициализация генератора случайных чисел MAC адресом
@@ -1188,15 +5096,13 @@ void setup() { // инициализация контроллера и прог
   ControllerName += Mac_Postfix;
 
     // включаем индикацию
-  digitalWrite(LED_BLUE_PIN, HIGH);
-  digitalWrite(LED_RED_PIN, HIGH);
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) if (c_Inputs[i].led != C_PIN_NONE) digitalWrite(c_Inputs[i].led, HIGH);
   
   // задержка для контроля индикации 
   vTaskDelay(pdMS_TO_TICKS(500));
 
   // гасим всю индикацию
-  digitalWrite(LED_BLUE_PIN, LOW);
-  digitalWrite(LED_RED_PIN, LOW);
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) if (c_Inputs[i].led != C_PIN_NONE) digitalWrite(c_Inputs[i].led, LOW);
   
 
   // инициализируем кнопку CLEAR
@@ -1209,25 +5115,32 @@ void setup() { // инициализация контроллера и прог
   bttn_flash.setTimeout(500);        // настройка таймаута на удержание (по умолчанию 500 мс)
   bttn_flash.setClickTimeout(200);   // настройка таймаута между кликами (по умолчанию 300 мс)
 
+  // ключи JSON и гистограммы по входам из таблицы c_Inputs
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    BuildChannelKeys(i, ch_Keys[i]);
+    hist_IsrToCount[i].bounds_us = c_IsrToCountBounds_us;
+  }
+
   // инициализируем блок конфигурации значениями по умолчанию
   SetConfigByDefault();
 
-  // инициализация работы с EEPROM
-  s_EnableEEPROM = EEPROM.begin(sizeof(curConfig));   // инициализируем работу с EEPROM 
+  // инициализация хранилища конфигурации: блок текущего формата, иначе перенос образа EEPROM прежней версии, иначе значения по умолчанию
+  SetChannelParamsByDefault();
+  s_EnableEEPROM = cfg_Store.begin(C_CFG_NAMESPACE, false);
+  if (s_EnableEEPROM) {
+    _loaded = ReadConfigStore();
+    // частей, которых нет в NVS, ищем в образе EEPROM прежней версии (он мог остаться, если перенос прервался), иначе - по умолчанию
+    if (_loaded != CP_ALL) _migrated = ReadLegacyEEPROM(_loaded);
+    // записываем только отсутствующие или испорченные части - целая часть не перезаписывается значениями по умолчанию
+    _saved = true;
+    if (!(_loaded & CP_STATIC)) _saved = WriteStaticConfig(curConfig);
+    if (!(_loaded & CP_COUNTERS)) _saved = WriteCounters(curConfig) and _saved;
+    if (_saved) RemoveLegacyEEPROM();                                      // образ удаляем только после записи обеих частей в новом формате
+  }
 
   #ifdef DEBUG_LEVEL_PORT    
   if (s_EnableEEPROM) {  // если инициализация успешна - то:   
-    if (ReadEEPROMConfig()) { // читаем конфигурацию из EEPROM и проверяем контрольную сумму для блока данных
-      // контрольная сумма блока данных верна - используем его в качестве конфигурации      
-      Serial.println("EEPROM config is valid. Applay config.");
-      }
-    else { // контрольная сумма данных не сошлась - считаем блок испорченным, инициализируем и перезаписываем его
-      Serial.println("EEPROM config broken - try to rewrite.");    
-      SetConfigByDefault();
-      EEPROM.put(0,curConfig);     
-      if (EEPROM.commit()) Serial.println("EPPROM update success.");
-        else Serial.println("Error in write to EPPROM.");
-    }
+    Serial.printf("Config loaded (parts %u, migrated %u, slot %u, generation %u, source %u, legacy layout %u/%u).\n", _loaded, _migrated, cfg_ActiveSlot, cfg_Generation, s_ConfigSource, s_LegacyLayout, s_LegacyChannels);
     Serial.printf("\n--- Инициализация блока управления прошла со следующими параметрами: ---\n");
     Serial.printf("  WiFi SSid: %s\n", curConfig.wifi_ssid);    
     Serial.printf("  WiFi pwd: %s\n", curConfig.wifi_pwd);
@@ -1240,31 +5153,25 @@ void setup() { // инициализация контроллера и прог
     Serial.printf("  REPORT topic: %s\n", curConfig.report_topic);
     Serial.printf("  LWT topic: %s\n", curConfig.lwt_topic);
     Serial.println("---");    
-    Serial.printf("  Counter 01: %u\n", curConfig.counter_01);
-    Serial.printf("  Counter 02: %u\n", curConfig.counter_02);
+    for (uint8_t i = 0; i < C_INP_CHANNELS; i++) Serial.printf("  Counter %02u: %u\n", i+1, curConfig.counter[i]);
     Serial.printf("  Reboot counter: %u\n", curConfig.counter_reboot);
     Serial.printf("---\n\n");
     }
   else { Serial.println("Warning! Блок работает без сохранения конфигурации !!!"); 
   } 
-  #else
-  if (s_EnableEEPROM) {  // если инициализация успешна - то:   
-    if (!ReadEEPROMConfig()) { // читаем конфигурацию из EEPROM и проверяем контрольную сумму для блока данных
-      // если контрольная сумма данных не сошлась - считаем блок испорченным, инициализируем и перезаписываем его
-      SetConfigByDefault();
-      EEPROM.put(0,curConfig);     
-      EEPROM.commit();
-    }
-  }  
-  #endif  
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) Serial.printf("  Input %u: mode %u, gate %u ms\n", i+1, chParams.mode[i], chParams.gate_ms[i]);
+  #endif
+
+  // пробная загрузка новой прошивки: учёт загрузок без подтверждения и возврат на прежнюю
+  OtaCheckTrial();
 
   // увеличиваем счетчик перезагрузок 
   curConfig.counter_reboot++;
-  curConfig.simple_crc16 = GetCrc16Simple((uint8_t*)&curConfig, sizeof(curConfig)-4);   // и сразу пересчитываем CRC
+  Trace(TE_BOOT, esp_reset_reason(), curConfig.counter_reboot);
 
   // настраиваем MQTT клиента
   mqttClient.setCredentials(curConfig.mqtt_usr,curConfig.mqtt_pwd);
-  mqttClient.setServer(curConfig.mqtt_host_s, curConfig.mqtt_port);
+  LoadBrokerList(curConfig);                                        // адрес сервера задает задача WiFi перед каждым подключением
   mqttClient.onConnect(onMqttConnect);
   mqttClient.onDisconnect(onMqttDisconnect);
   mqttClient.onSubscribe(onMqttSubscribe);
@@ -1272,26 +5179,42 @@ void setup() { // инициализация контроллера и прог
   mqttClient.onMessage(onMqttMessage);
   mqttClient.onPublish(onMqttPublish);
 
-  // настраиваем семафоры - сбрасываем их
-  xSemaphoreGive(sem_InputJSONdoc);
-  xSemaphoreGiveFromISR(sem_CurConfigWrite,NULL);
-  
+  // настраиваем учёт загрузки CPU и энергосбережение
+  SetupPowerManagement();
+
   // создаем отдельные параллельные задачи, выполняющие группы функций  
-  // стартуем основные задачи
-  if (xTaskCreate(eventHandlerTask, "events", 4096, NULL, 1, NULL) != pdPASS) Halt("Error: Event handler task not created!");     // все плохо, задачу не создали
-  if (xTaskCreate(applayChangesTask, "applay", 4096, NULL, 1, NULL) != pdPASS) Halt("Error: Applay changes task not created!");   // все плохо, задачу не создали
-  if (xTaskCreate(reportTask, "report", 4096, NULL, 1, NULL) != pdPASS) Halt("Error: Report task not created!");                  // все плохо, задачу не создали
-  if (xTaskCreate(countingTask, "count", 4096, NULL, 1, NULL) != pdPASS) Halt("Error: Report task not created!");                 // все плохо, задачу не создали
-  // стартуем коммуникационные задачи
-  if (xTaskCreate(wifiTask, "wifi", 4096*2, NULL, 1, NULL) != pdPASS) Halt("Error: WiFi communication task not created!");        // все плохо, задачу не создали
-  if (xTaskCreate(webServerTask, "web", 4096*2, NULL, 1, NULL) != pdPASS) Halt("Error: Web server task not created!");            // все плохо, задачу не создали
+  // стартуем основные задачи - на ядре приложения
+  if (!CreateTask(countingTask, "count", C_TASK_COUNT_STACK, C_TASK_COUNT_PRIO, &th_Counting, APP_CPU_NUM)) Halt("Error: Counting task not created!");              // все плохо, задачу не создали
+  if (!CreateTask(eventHandlerTask, "events", C_TASK_EVENTS_STACK, C_TASK_EVENTS_PRIO, &th_Events, APP_CPU_NUM)) Halt("Error: Event handler task not created!");   // все плохо, задачу не создали
+  // стартуем коммуникационные задачи - на ядре стека протоколов
+  if (!CreateTask(reportTask, "report", C_TASK_REPORT_STACK, C_TASK_REPORT_PRIO, &th_Report, PRO_CPU_NUM)) Halt("Error: Report task not created!");                // все плохо, задачу не создали
+  if (!CreateTask(wifiTask, "wifi", C_TASK_WIFI_STACK, C_TASK_NET_PRIO, &th_WiFi, PRO_CPU_NUM)) Halt("Error: WiFi communication task not created!");               // все плохо, задачу не создали
+  if (!CreateTask(webServerTask, "web", C_TASK_WEB_STACK, C_TASK_NET_PRIO, &th_Web, PRO_CPU_NUM)) Halt("Error: Web server task not created!");                     // все плохо, задачу не создали
+  if (!CreateTask(udpTask, "udp", C_TASK_UDP_STACK, C_TASK_NET_PRIO, &th_Udp, PRO_CPU_NUM)) Halt("Error: UDP query task not created!");                           // все плохо, задачу не создали
+  #ifdef MODBUS_SERVER
+  if (!CreateTask(modbusTask, "modbus", C_TASK_MODBUS_STACK, C_TASK_NET_PRIO, &th_Modbus, PRO_CPU_NUM)) Halt("Error: Modbus server task not created!");           // все плохо, задачу не создали
+  #endif
+  #ifdef LOAD_SIMULATION
+  if (!CreateTask(loadSimTask, "load", C_TASK_WEB_STACK, C_TASK_NET_PRIO, &th_Load, PRO_CPU_NUM)) Halt("Error: Load simulation task not created!");                // все плохо, задачу не создали
+  #endif
+  #ifdef DEBUG_LEVEL_PORT
+  if (!CreateTask(traceTask, "trace", C_TASK_TRACE_STACK, C_TASK_TRACE_PRIO, &th_Trace, PRO_CPU_NUM)) Halt("Error: Trace output task not created!");                // все плохо, задачу не создали
+  #endif
+  #ifdef PULSE_SIMULATOR
+  if (!CreateTask(pulseSimTask, "sim", C_TASK_SIM_STACK, C_TASK_EVENTS_PRIO, &th_Sim, PRO_CPU_NUM)) Halt("Error: Pulse simulator task not created!");             // все плохо, задачу не создали
+  #endif
 
 }
 
 void loop() { // не используемый основной цикл
-  // присваиваем обработчики прерываний на счётчики и датчик питания
-  attachInterrupt(PIN_INP_CH1,&ISR_handler_counter01,FALLING);			      // назначаем прерывание на GPIO входа #1 по ниспадающему фронту
-  attachInterrupt(PIN_INP_CH2,&ISR_handler_counter02,FALLING);			      // назначаем прерывание на GPIO входа #2 по ниспадающему фронту
+  // выставляем индикацию по текущему состоянию входов - дальше ее ведут обработчики прерываний
+  // присваиваем обработчики прерываний (или таймер захвата в режиме частоты) на счётчики и датчик питания
+  for (uint8_t i = 0; i < C_INP_CHANNELS; i++) {
+    if (c_Inputs[i].led != C_PIN_NONE) digitalWrite(c_Inputs[i].led, ReadCounterInput(i));
+    ApplyChannelMode(i);                                                // вход - по режиму из параметров входов
+  }
   attachInterrupt(PIN_INP_AC_CUTOFF,&ISR_handler_cutoff_sensor,RISING);		// назначаем прерывание на GPIO датчика пропажи питания по восходящему фронту
+  attachInterrupt(BTN_CLEAR_PIN,&ISR_handler_buttons,CHANGE);			      // назначаем прерывание на GPIO кнопки CLEAR - запуск опроса кнопок
+  attachInterrupt(BTN_FLASH_PIN,&ISR_handler_buttons,CHANGE);			      // назначаем прерывание на GPIO кнопки FLASH - запуск опроса кнопок
   vTaskDelete(NULL);   // удаляем не нужную задачу loop()  
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+/*
+************************************************************************
+*   Включаемый файл: порционный вывод страницы /metrics (формат текстовой
+*         выгрузки Prometheus) через буфер фиксированного размера
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+// Текст копится в буфере и отправляется клиенту порциями при заполнении. Описание метрики (# HELP и # TYPE) выводится
+// частями прямо в буфер, поэтому длина текста описания не ограничена. Строка значения форматируется целиком - обрезанная строка
+// склеилась бы со следующей, и сервер Prometheus отверг бы всю страницу, поэтому строка длиннее буфера не выводится совсем.
+// Файл не зависит от Arduino и FreeRTOS - формат всех описаний метрик прошивки проверяет тест test/test_metrics_format.
+
+typedef void (*MetricsSink_t)(const char *Data, size_t Len); // отправка накопленной порции клиенту
+
+struct MetricsOut {
+  char           *buf;                            // буфер порции
+  size_t          size;                           // размер буфера
+  size_t          len;                            // текущее заполнение буфера
+  MetricsSink_t   sink;                           // отправка порции
+};
+
+inline void MetricsOutFlush(MetricsOut &Out) { // отправка накопленной порции
+  if (Out.len == 0) return;
+  Out.sink(Out.buf, Out.len);
+  Out.len = 0;
+}
+
+inline void MetricsOutWrite(MetricsOut &Out, const char *Data, size_t Len) { // текст любой длины - частями через буфер
+  while (Len > 0) {
+    if (Out.len == Out.size) MetricsOutFlush(Out);
+    size_t _part = (Len < Out.size - Out.len) ? Len : Out.size - Out.len;
+    memcpy(Out.buf + Out.len, Data, _part);
+    Out.len += _part;
+    Data += _part;
+    Len -= _part;
+  }
+}
+
+inline void MetricsOutText(MetricsOut &Out, const char *Text) {
+  MetricsOutWrite(Out, Text, strlen(Text));
+}
+
+inline void MetricsOutHeader(MetricsOut &Out, const char *Name, const char *Type, const char *Help) { // описание метрики: # HELP и # TYPE
+  MetricsOutText(Out, "# HELP ");
+  MetricsOutText(Out, Name);
+  MetricsOutText(Out, " ");
+  MetricsOutText(Out, Help);
+  MetricsOutText(Out, "\n# TYPE ");
+  MetricsOutText(Out, Name);
+  MetricsOutText(Out, " ");
+  MetricsOutText(Out, Type);
+  MetricsOutText(Out, "\n");
+}
+
+inline bool MetricsOutVPrintf(MetricsOut &Out, const char *fmt, va_list args) { // строка значения - целиком или никак
+  va_list _copy;
+  va_copy(_copy, args);
+  int _len = vsnprintf(Out.buf + Out.len, Out.size - Out.len, fmt, _copy);    // сначала - в остаток буфера
+  va_end(_copy);
+  if (_len < 0) return false;
+  if ((size_t)_len < Out.size - Out.len) {
+    Out.len += _len;
+    return true;
+  }
+  if ((size_t)_len >= Out.size) return false;                                 // не поместится и в пустой буфер - не выводим
+  MetricsOutFlush(Out);                                                        // не влезла в остаток - отправляем накопленное и повторяем
+  vsnprintf(Out.buf, Out.size, fmt, args);
+  Out.len = _len;
+  return true;
+}
+
+inline bool MetricsOutPrintf(MetricsOut &Out, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  bool _result = MetricsOutVPrintf(Out, fmt, args);
+  va_end(args);
+  return _result;
+}
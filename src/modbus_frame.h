@@ -0,0 +1,99 @@
+/*
+************************************************************************
+*   Включаемый файл: разбор кадров Modbus TCP (MBAP + PDU) - чтение
+*         (FC3/FC4) и запись (FC6/FC16) регистров, коды исключений
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+
+// Карта регистров описывается обработчиком: все значения 32-битные и занимают пару регистров (старшее слово первым),
+// запись разрешена только в регистры до WritableEnd(). Запись должна покрывать пары целиком: половина 32-битного значения,
+// дополненная текущей второй половиной, дала бы значение, которого никто не записывал, - поэтому FC6 (один регистр) в регистры
+// записи всегда отклоняется, а 32-битные значения пишутся через FC16. Файл не зависит от Arduino и FreeRTOS - его проверяет
+// тест test/test_modbus.
+
+#define C_MB_MBAP_SIZE        7                   // заголовок MBAP: номер транзакции, протокол, длина, идентификатор устройства
+#define C_MB_READ_MAX         125                 // регистров в одном запросе чтения
+#define C_MB_WRITE_MAX        123                 // регистров в одном запросе записи FC16
+
+// функции Modbus
+#define MB_FC_READ_HOLDING      0x03
+#define MB_FC_READ_INPUT        0x04
+#define MB_FC_WRITE_SINGLE      0x06
+#define MB_FC_WRITE_MULTIPLE    0x10
+
+// коды исключений Modbus
+#define MB_EX_ILLEGAL_FUNCTION  0x01
+#define MB_EX_ILLEGAL_ADDRESS   0x02
+#define MB_EX_ILLEGAL_VALUE     0x03
+
+inline uint16_t ModbusGet16(const uint8_t *Data) {
+  return (Data[0] << 8) | Data[1];
+}
+
+inline uint32_t ModbusGet32(const uint8_t *Data, uint16_t Index) { // Index-е 32-битное значение данных записи
+  return ((uint32_t)ModbusGet16(Data + Index * 4) << 16) | ModbusGet16(Data + Index * 4 + 2);
+}
+
+inline int32_t ModbusFrameLength(const uint8_t *Adu, uint16_t Fill, uint16_t Size) { // длина кадра по заголовку MBAP: 0 - заголовок не принят, -1 - это не Modbus
+  if (Fill < C_MB_MBAP_SIZE) return 0;
+  uint16_t _frame = 6 + ModbusGet16(Adu + 4);                                   // длина в заголовке считается от идентификатора устройства
+  if ((Adu[2] != 0) or (Adu[3] != 0) or (_frame < C_MB_MBAP_SIZE + 1) or (_frame > Size)) return -1;
+  return _frame;
+}
+
+// обработка кадра Len байт в том же буфере, возвращает длину ответа. Обработчик Map:
+//   uint16_t Count()                                        - количество регистров
+//   uint16_t WritableEnd()                                  - регистры до этого адреса доступны для записи
+//   void     Read(uint16_t Address, uint16_t Count, uint16_t *Regs)      - значения регистров из согласованной копии
+//   uint8_t  Write(uint16_t Address, uint16_t Count, const uint8_t *Data) - запись пар регистров (Address и Count четные),
+//                                                              возвращает код исключения (0 - успешно)
+template<class Map>
+uint16_t ModbusHandleFrame(uint8_t *Adu, uint16_t Len, Map &Regs) {
+  uint8_t  *_pdu = Adu + C_MB_MBAP_SIZE;                                        // PDU идет после заголовка MBAP
+  uint8_t  _function = _pdu[0];
+  uint16_t _address = ModbusGet16(_pdu + 1);
+  uint16_t _count = ModbusGet16(_pdu + 3);
+  uint16_t _pdu_len = 0;
+  uint8_t  _exception = 0;
+
+  switch (_function) {
+    case MB_FC_READ_HOLDING:                                                    // чтение holding регистров
+    case MB_FC_READ_INPUT: {                                                    // чтение input регистров
+      uint16_t _regs[C_MB_READ_MAX];
+      if ((Len < 12) or (_count == 0) or (_count > C_MB_READ_MAX)) { _exception = MB_EX_ILLEGAL_VALUE; break; }
+      if ((uint32_t)_address + _count > Regs.Count()) { _exception = MB_EX_ILLEGAL_ADDRESS; break; }
+      Regs.Read(_address, _count, _regs);
+      _pdu[1] = _count * 2;
+      for (uint16_t i = 0; i < _count; i++) {
+        _pdu[2 + i * 2] = _regs[i] >> 8;
+        _pdu[3 + i * 2] = _regs[i] & 0xFF;
+      }
+      _pdu_len = 2 + _count * 2;
+      break;
+    }
+    case MB_FC_WRITE_SINGLE:                                                    // запись одного регистра - половина 32-битного значения
+      if (Len < 12) { _exception = MB_EX_ILLEGAL_VALUE; break; }
+      _exception = MB_EX_ILLEGAL_ADDRESS;                                       // в карте нет 16-битных регистров записи
+      break;
+    case MB_FC_WRITE_MULTIPLE:                                                  // запись нескольких holding регистров
+      if ((Len < 13) or (_count == 0) or (_count > C_MB_WRITE_MAX) or (_pdu[5] != _count * 2) or (Len < 13 + _count * 2)) { _exception = MB_EX_ILLEGAL_VALUE; break; }
+      if (((uint32_t)_address + _count > Regs.WritableEnd()) or (_address & 1) or (_count & 1)) { _exception = MB_EX_ILLEGAL_ADDRESS; break; }
+      _exception = Regs.Write(_address, _count, _pdu + 6);
+      _pdu_len = 5;                                                             // ответ - адрес и количество из запроса
+      break;
+    default:
+      _exception = MB_EX_ILLEGAL_FUNCTION;
+  }
+  if (_exception != 0) {
+    _pdu[0] = _function | 0x80;
+    _pdu[1] = _exception;
+    _pdu_len = 2;
+  }
+  Adu[4] = (_pdu_len + 1) >> 8;                                                 // длина в заголовке MBAP: идентификатор устройства + PDU
+  Adu[5] = (_pdu_len + 1) & 0xFF;
+  return C_MB_MBAP_SIZE + _pdu_len;
+}
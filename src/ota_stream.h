@@ -0,0 +1,242 @@
+/*
+************************************************************************
+*   Включаемый файл: разбор потока обновления прошивки (образ или дельта),
+*      переключение на новую прошивку и пробные загрузки с возвратом
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Поток обновления - полный образ прошивки или дельта относительно работающей прошивки (tools/ota_delta.py), формат - little-endian:
+//   OtaDeltaHeader, затем команды: OD_COPY [u32 смещение][u32 длина] - копировать из работающей прошивки,
+//                                  OD_INSERT [u32 длина][данные] - вставить данные из дельты.
+// Дельта принимается только если SHA256 начала работающей прошивки совпадает с base_sha256, результат проверяется по target_sha256.
+// Запись, чтение работающей прошивки, NVS и выбор раздела загрузки выполняет параметр Io шаблонов: в прошивке - разделы OTA и NVS,
+// в тесте test/test_ota_update - эмулятор FLASH с обрывом питания между любыми операциями. Файл не зависит от Arduino и FreeRTOS.
+
+#define C_OTA_DELTA_MAGIC     0x544C4443          // сигнатура дельты "CDLT"
+#define C_OTA_DELTA_VERSION   1                   // версия формата дельты
+#define C_OTA_IMAGE_MAGIC     0xE9                // первый байт образа прошивки ESP32
+#define C_OTA_COPY_SIZE       512                 // размер порции копирования из текущей прошивки при применении дельты
+
+enum OtaError_t : uint8_t {
+  OE_NONE,
+  OE_BUSY,                                        // обновление уже идет
+  OE_NO_MEMORY,                                   // нет памяти под блоки конвейера или задачу записи
+  OE_PARTITION,                                   // нет неактивного раздела OTA или не удалось начать запись
+  OE_WRITE,                                       // ошибка записи во FLASH
+  OE_FORMAT,                                      // неизвестный формат образа или испорченная дельта
+  OE_BASE,                                        // дельта построена не от работающей прошивки
+  OE_HASH,                                        // SHA256 полученной прошивки не совпала
+  OE_IMAGE,                                       // образ не прошел проверку загрузчика
+  OE_TIMEOUT,                                     // прием или запись остановились
+  OE_DOWNLOAD,                                    // ошибка загрузки по ссылке
+  OE_ABORTED,                                     // прием прерван отправителем
+  OE_SIGNATURE,                                   // нет подписи обновления или подпись неверна
+  OE_URL                                          // ссылка на образ длиннее C_OTA_URL_SIZE
+};
+
+enum OtaDeltaOp_t : uint8_t {
+  OD_COPY = 1,                                    // копировать из работающей прошивки
+  OD_INSERT = 2                                   // вставить данные из дельты
+};
+
+struct __attribute__((packed)) OtaDeltaHeader {   // заголовок дельты
+  uint32_t        magic;                          // C_OTA_DELTA_MAGIC
+  uint8_t         version;                        // C_OTA_DELTA_VERSION
+  uint8_t         reserved[3];
+  uint32_t        base_size;                      // длина образа, от которого построена дельта
+  uint8_t         base_sha256[32];                // SHA256 этого образа
+  uint32_t        target_size;                    // длина новой прошивки
+  uint8_t         target_sha256[32];              // SHA256 новой прошивки
+};
+
+enum OtaDecodeState_t : uint8_t {                 // состояние разбора потока в задаче записи
+  ODS_DETECT,                                     // по первому байту определяем полный образ или дельту
+  ODS_IMAGE,                                      // полный образ - пишется как есть
+  ODS_HEADER,                                     // заголовок дельты
+  ODS_OP,                                         // код команды дельты
+  ODS_ARGS,                                       // параметры команды
+  ODS_INSERT                                      // данные команды OD_INSERT
+};
+
+struct OtaDecoder {                               // разбор потока образа (локальная переменная задачи записи)
+  OtaDecodeState_t state;
+  uint8_t         op;                             // текущая команда дельты
+  uint8_t         args[8];                        // параметры команды (могут прийти в разных блоках)
+  uint8_t         args_len;
+  uint8_t         args_need;
+  OtaDeltaHeader  header;
+  uint8_t         header_len;
+  uint32_t        insert_left;                    // осталось данных команды OD_INSERT
+  bool            delta;                          // принимается дельта
+  bool            check_hash;                     // результат проверяется по expected_sha256
+  uint8_t         expected_sha256[32];
+  uint32_t        written;                        // записано байт новой прошивки
+  OtaError_t      error;                          // первая ошибка разбора или записи
+};
+
+inline void OtaDecodeStart(OtaDecoder &Dec, const uint8_t *Expected) { // начало разбора, Expected - ожидаемая SHA256 (NULL - не задана)
+  memset(&Dec, 0, sizeof(Dec));
+  Dec.check_hash = (Expected != NULL);
+  if (Dec.check_hash) memcpy(Dec.expected_sha256, Expected, sizeof(Dec.expected_sha256));
+}
+
+inline bool OtaFail(OtaDecoder &Dec, OtaError_t Error) { // фиксируем причину прерывания (первая ошибка - основная)
+  if (Dec.error == OE_NONE) Dec.error = Error;
+  return false;
+}
+
+// Io::Output(Data, Len) - запись порции новой прошивки (и расчет ее SHA256), Io::ReadBase(Offset, Buf, Len) - чтение работающей прошивки,
+// Io::CheckBase(Header) - SHA256 начала работающей прошивки совпадает с base_sha256 дельты
+template <class Io> bool OtaEmit(OtaDecoder &Dec, Io &IO, const uint8_t *Data, size_t Len) { // запись очередной порции новой прошивки
+  if (Dec.delta and (Dec.written + Len > Dec.header.target_size)) return OtaFail(Dec, OE_FORMAT);  // дельта дает прошивку длиннее заявленной
+  if (!IO.Output(Data, Len)) return OtaFail(Dec, OE_WRITE);
+  Dec.written += Len;
+  return true;
+}
+
+template <class Io> void OtaCopyBase(OtaDecoder &Dec, Io &IO, uint32_t Offset, uint32_t Len) { // команда OD_COPY - копирование участка работающей прошивки
+  uint8_t _buf[C_OTA_COPY_SIZE];
+
+  if ((Offset > Dec.header.base_size) or (Len > Dec.header.base_size - Offset)) {
+    OtaFail(Dec, OE_FORMAT);                                                 // участок за пределами проверенной части прошивки
+    return;
+  }
+  while ((Len > 0) and (Dec.error == OE_NONE)) {
+    uint32_t _n = (Len < sizeof(_buf)) ? Len : sizeof(_buf);
+    if (!IO.ReadBase(Offset, _buf, _n)) OtaFail(Dec, OE_WRITE);
+      else OtaEmit(Dec, IO, _buf, _n);
+    Offset += _n;
+    Len -= _n;
+  }
+}
+
+template <class Io> void OtaDecode(OtaDecoder &Dec, Io &IO, const uint8_t *Data, size_t Len) { // разбор очередного блока: полный образ пишется как есть, дельта применяется
+  size_t _n;
+  while ((Len > 0) and (Dec.error == OE_NONE)) {
+    switch (Dec.state) {
+      case ODS_DETECT:                                                       // байт не забираем - только смотрим
+        if (Data[0] == C_OTA_IMAGE_MAGIC) Dec.state = ODS_IMAGE;
+        else if (Data[0] == (uint8_t)C_OTA_DELTA_MAGIC) {
+          Dec.state = ODS_HEADER;
+          Dec.delta = true;
+        } else OtaFail(Dec, OE_FORMAT);
+        break;
+      case ODS_IMAGE:
+        OtaEmit(Dec, IO, Data, Len);
+        return;
+      case ODS_HEADER:
+        _n = (Len < sizeof(Dec.header) - Dec.header_len) ? Len : sizeof(Dec.header) - Dec.header_len;
+        memcpy((uint8_t*)&Dec.header + Dec.header_len, Data, _n);
+        Dec.header_len += _n;
+        Data += _n;
+        Len -= _n;
+        if (Dec.header_len < sizeof(Dec.header)) break;
+        if ((Dec.header.magic != C_OTA_DELTA_MAGIC) or (Dec.header.version != C_OTA_DELTA_VERSION)) OtaFail(Dec, OE_FORMAT);
+        else if (!IO.CheckBase(Dec.header)) OtaFail(Dec, OE_BASE);
+        else if (Dec.check_hash and (memcmp(Dec.expected_sha256, Dec.header.target_sha256, 32) != 0)) OtaFail(Dec, OE_HASH);
+        else {                                                               // результат проверяется по SHA256 из заголовка
+          memcpy(Dec.expected_sha256, Dec.header.target_sha256, 32);
+          Dec.check_hash = true;
+          Dec.state = ODS_OP;
+        }
+        break;
+      case ODS_OP:
+        Dec.op = *Data++;
+        Len--;
+        Dec.args_len = 0;
+        Dec.args_need = (Dec.op == OD_COPY) ? 8 : ((Dec.op == OD_INSERT) ? 4 : 0);
+        if (Dec.args_need == 0) OtaFail(Dec, OE_FORMAT);
+          else Dec.state = ODS_ARGS;
+        break;
+      case ODS_ARGS: {
+        _n = (Len < (size_t)(Dec.args_need - Dec.args_len)) ? Len : (size_t)(Dec.args_need - Dec.args_len);
+        memcpy(Dec.args + Dec.args_len, Data, _n);
+        Dec.args_len += _n;
+        Data += _n;
+        Len -= _n;
+        if (Dec.args_len < Dec.args_need) break;
+        uint32_t _arg0, _arg1;
+        memcpy(&_arg0, Dec.args, 4);
+        if (Dec.op == OD_COPY) {
+          memcpy(&_arg1, Dec.args + 4, 4);
+          OtaCopyBase(Dec, IO, _arg0, _arg1);
+          Dec.state = ODS_OP;
+        } else {
+          Dec.insert_left = _arg0;
+          Dec.state = (_arg0 > 0) ? ODS_INSERT : ODS_OP;
+        }
+        break;
+      }
+      case ODS_INSERT:
+        _n = (Len < Dec.insert_left) ? Len : Dec.insert_left;
+        OtaEmit(Dec, IO, Data, _n);
+        Data += _n;
+        Len -= _n;
+        Dec.insert_left -= _n;
+        if (Dec.insert_left == 0) Dec.state = ODS_OP;
+        break;
+    }
+  }
+}
+
+inline OtaError_t OtaDecodeEnd(OtaDecoder &Dec, const uint8_t *Hash) { // конец потока: дельта применена целиком, SHA256 записанного (Hash) совпала
+  if (Dec.delta and ((Dec.state != ODS_OP) or (Dec.written != Dec.header.target_size))) OtaFail(Dec, OE_FORMAT);
+  if (Dec.written == 0) OtaFail(Dec, OE_FORMAT);
+  if (Dec.check_hash and (memcmp(Hash, Dec.expected_sha256, sizeof(Dec.expected_sha256)) != 0)) OtaFail(Dec, OE_HASH);
+  return Dec.error;
+}
+
+// Пробный режим новой прошивки хранится одной записью NVS (запись ключа атомарна): адрес раздела, в который выполнено переключение,
+// и номер загрузки. Запись делается до переключения раздела загрузки, поэтому обрыв питания между ними не оставляет новую прошивку
+// без пробного режима, а запись для другого раздела (переключение не состоялось или возврат уже выполнен) при загрузке удаляется.
+struct __attribute__((packed)) OtaTrial {
+  uint32_t        address;                        // адрес раздела новой прошивки
+  uint8_t         boots;                          // загрузок без подтверждения (включая текущую)
+};
+
+enum OtaBootAction_t : uint8_t {
+  OB_CONFIRMED,                                   // работающая прошивка подтверждена
+  OB_TRIAL,                                       // пробная загрузка - прошивка должна подтвердить себя
+  OB_ROLLBACK                                     // выбран раздел прежней прошивки - нужна перезагрузка
+};
+
+// Io::End() - проверка записанного образа, Io::SetBoot(Address) - выбор раздела загрузки,
+// Io::PutTrial(Trial) / Io::GetTrial(Trial) / Io::RemoveTrial() - запись пробного режима в NVS, Io::PutRolledBack() - признак возврата
+template <class Io> OtaError_t OtaCommit(Io &IO, uint32_t Address) { // переключение на записанную прошивку в пробном режиме
+  OtaTrial _trial = {Address, 1};
+  if (!IO.End()) return OE_IMAGE;                                          // проверка образа загрузчиком (контрольная сумма, заголовок)
+  if (!IO.PutTrial(_trial)) return OE_WRITE;                               // без пробного режима не переключаемся - возврата бы не было
+  if (!IO.SetBoot(Address)) {
+    IO.RemoveTrial();
+    return OE_PARTITION;
+  }
+  return OE_NONE;
+}
+
+// при загрузке: учёт загрузок не подтвержденной прошивки, после MaxBoots загрузок - выбор раздела Previous (Boots - номер пробной загрузки)
+template <class Io> OtaBootAction_t OtaBootCheck(Io &IO, uint32_t Running, uint32_t Previous, uint8_t MaxBoots, uint8_t &Boots) {
+  OtaTrial _trial;
+  Boots = 0;
+  if (!IO.GetTrial(_trial)) return OB_CONFIRMED;
+  if (_trial.address != Running) {                                         // переключение не состоялось или возврат уже выполнен
+    IO.RemoveTrial();
+    return OB_CONFIRMED;
+  }
+  if (_trial.boots > MaxBoots) {
+    // сначала выбираем прежний раздел, потом удаляем запись - при обрыве питания между ними прежняя прошивка удалит ее сама
+    bool _switched = (Previous != Running) and IO.SetBoot(Previous);
+    if (_switched) IO.PutRolledBack();
+    IO.RemoveTrial();                                                      // прежней прошивки нет - остаемся на этой
+    return _switched ? OB_ROLLBACK : OB_CONFIRMED;
+  }
+  Boots = _trial.boots;
+  _trial.boots++;
+  IO.PutTrial(_trial);
+  return OB_TRIAL;
+}
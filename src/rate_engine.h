@@ -0,0 +1,80 @@
+/*
+************************************************************************
+*   Включаемый файл: расчет скорости счёта по входу (последний интервал,
+*         сглаженная скорость и скользящее окно) в фиксированной точке
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Скорости хранятся в фиксированной точке: импульсов в минуту * 1000. Расчет идет только по переданным моментам импульсов
+// и "текущему" моменту, память не выделяется. Файл не зависит от Arduino и FreeRTOS - его использует тест test/test_heap_soak.
+
+#define C_RATE_TIMEOUT 600000                     // если импульсов нет дольше этого времени - скорость счёта считаем нулевой (10 мин)
+#define C_RATE_EWMA_SHIFT 2                       // коэффициент сглаживания скорости 1/2^N (2 - новое значение входит с весом 1/4)
+#define C_RATE_WINDOW 60000                       // длительность скользящего окна расчета скорости в мс
+#define C_RATE_WINDOW_PULSES 16                   // количество запоминаемых моментов импульсов для скользящего окна
+
+struct RateEngine {
+  uint32_t        last_us;                        // момент последнего засчитанного импульса в мкс
+  uint32_t        period_us;                      // интервал между двумя последними импульсами в мкс
+  uint32_t        ewma_mppm;                      // сглаженная (EWMA) скорость по интервалам между импульсами
+  uint32_t        window_us[C_RATE_WINDOW_PULSES];// моменты последних импульсов для скользящего окна (кольцевой буфер)
+  uint8_t         head;                           // позиция следующей записи в кольцевом буфере
+  uint8_t         fill;                           // количество записей в кольцевом буфере
+};
+
+struct FlowRates {                                // скорости счёта по входу на текущий момент (импульсов в минуту * 1000)
+  uint32_t        instant;                        // по последнему интервалу между импульсами
+  uint32_t        ewma;                           // сглаженная по интервалам между импульсами
+  uint32_t        window;                         // по количеству импульсов в скользящем окне
+};
+
+inline uint32_t PeriodToRate(uint32_t Period_us) { // интервал между импульсами в мкс -> импульсов в минуту * 1000
+  return (Period_us == 0) ? 0 : (uint32_t)(60000000000ULL / Period_us);
+}
+
+inline uint32_t RateMin(uint32_t A, uint32_t B) {
+  return (A < B) ? A : B;
+}
+
+inline void RateAdd(RateEngine &Rate, uint32_t Now_us) { // учёт засчитанного импульса
+  if ((Rate.fill > 0) and (Now_us - Rate.last_us > (uint32_t)C_RATE_TIMEOUT * 1000)) {       // после долгой паузы расчет начинается заново
+    Rate.fill = 0;
+    Rate.ewma_mppm = 0;
+  }
+  if (Rate.fill > 0) {
+    Rate.period_us = Now_us - Rate.last_us;
+    int32_t _instant = PeriodToRate(Rate.period_us);
+    if (Rate.ewma_mppm == 0) Rate.ewma_mppm = _instant;                         // первый интервал - сглаживать нечего
+      else Rate.ewma_mppm += (_instant - (int32_t)Rate.ewma_mppm) / (1 << C_RATE_EWMA_SHIFT);
+  }
+  Rate.last_us = Now_us;
+  Rate.window_us[Rate.head] = Now_us;
+  Rate.head = (Rate.head + 1) % C_RATE_WINDOW_PULSES;
+  if (Rate.fill < C_RATE_WINDOW_PULSES) Rate.fill++;
+}
+
+inline void RateCompute(const RateEngine &Rate, uint32_t Now_us, FlowRates &Rates) { // скорости счёта на момент Now_us
+  uint32_t _since = Now_us - Rate.last_us;
+  uint8_t  _in_window = 0;
+  memset(&Rates, 0, sizeof(Rates));
+  if ((Rate.fill == 0) or (_since > (uint32_t)C_RATE_TIMEOUT * 1000)) return;     // импульсов не было или они давно прекратились
+  // скорость не может быть больше, чем если бы следующий импульс пришел прямо сейчас - так скорость спадает до нуля после остановки
+  uint32_t _limit = PeriodToRate(_since);
+  if (Rate.fill > 1) {
+    Rates.instant = RateMin(PeriodToRate(Rate.period_us), _limit);
+    Rates.ewma = RateMin(Rate.ewma_mppm, _limit);
+  }
+  for (uint8_t i = 0; i < Rate.fill; i++) {
+    if (Now_us - Rate.window_us[i] <= (uint32_t)C_RATE_WINDOW * 1000) _in_window++;
+  }
+  if ((_in_window == C_RATE_WINDOW_PULSES) and (Rate.fill == C_RATE_WINDOW_PULSES)) {    // в окно попали все запомненные импульсы - считаем по их интервалу
+    uint32_t _oldest = Rate.window_us[Rate.head];                                       // самая старая запись - следующая за последней
+    Rates.window = RateMin(PeriodToRate((Rate.last_us - _oldest) / (C_RATE_WINDOW_PULSES - 1)), _limit);
+  }
+  else Rates.window = (uint64_t)_in_window * 60000000 / C_RATE_WINDOW;
+}
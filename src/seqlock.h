@@ -0,0 +1,36 @@
+/*
+************************************************************************
+*   Включаемый файл: согласованные копии блока данных без блокирования
+*         читателей (seqlock) для контроллера подсчёта импульсов
+*                        (с) 2024, by Dr@Cosha
+************************************************************************
+*/
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Писатели (по одному - взаимоисключение обеспечивает вызывающий) увеличивают номер версии до и после изменения,
+// нечетный номер - идет запись. Читатели копируют блок и повторяют копирование, если номер версии изменился.
+// Файл не зависит от Arduino и FreeRTOS - логику проверяет тест test/test_seqlock на компьютере.
+
+inline void SeqWriteBegin(volatile uint32_t &Seq) { // начало изменения блока
+  Seq = Seq + 1;                                                    // нечетный номер - блок в процессе изменения
+  __sync_synchronize();
+}
+
+inline void SeqWriteEnd(volatile uint32_t &Seq) { // окончание изменения блока
+  __sync_synchronize();
+  Seq = Seq + 1;                                                    // четный номер - блок согласован
+}
+
+inline void SeqReadCopy(const volatile uint32_t &Seq, void *Dest, const volatile void *Src, size_t Size) { // согласованная копия блока
+  uint32_t _seq_start, _seq_end;
+  do {
+    do { _seq_start = Seq; } while (_seq_start & 1);                // ждем окончания текущей записи
+    __sync_synchronize();
+    memcpy(Dest, (const void*)Src, Size);
+    __sync_synchronize();
+    _seq_end = Seq;
+  } while (_seq_start != _seq_end);                                 // если во время копирования была запись - повторяем
+}
@@ -19,4 +19,3 @@ String CSW_PAGE_STYLE = R"=====(<style> div,fieldset,input,select{padding:5px;fo
  @-webkit-keyframes blink {0%{ color: #ff0000; }50%{ color: #1f1f1f; }100%{ color: #ff0000;}} @keyframes blink{0%{color:#ff0000;}50%{color:#1f1f1f;}100%{color:#ff0000;}}</style>)=====";
 String CSW_PAGE_FOOTER = R"=====(</form><p></p><div style="text-align:right;font-size:11px;"><hr><a style="color:#aaa;">(c)Dr.Cosha 2024 (based on design by Theo Arends)</a></div></div></body></html>)=====";
 
-bool f_ApplayChanges = false;                   // флаг для генерации страницы примененных изменений
\ No newline at end of file
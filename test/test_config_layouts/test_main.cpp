@@ -0,0 +1,235 @@
+// Разбор всех раскладок хранения конфигурации на компьютере (src/config_store.h): образы EEPROM прежних версий
+// (единственный блок v1.3b, две копии с номером записи, блоки параметров входов версий 1 и 2), статический блок
+// версии 3 с короткими записями входов прежних сборок и копии счётчиков, записанные сборками с другим количеством входов.
+// Образы собираются в буфере так же, как их писали прежние версии прошивки, и разбираются теми же функциями, что при загрузке.
+//
+// Запуск:  pio test -e native -f test_config_layouts
+
+#include <unity.h>
+#include <stdio.h>
+#include "config_store.h"
+
+uint8_t test_Image[C_LEGACY_EEPROM_SIZE];          // образ EEPROM (библиотека EEPROM дополняет короткий образ нулями)
+
+void FillLegacyParams(LegacyParams &Params, uint32_t Counter) { // блок v1.3b с CRC, как его писала прежняя прошивка
+  memset(&Params, 0, sizeof(Params));
+  Params.counter[0] = Counter;
+  Params.counter[1] = Counter * 2;
+  Params.counter_reboot = 7;
+  strcpy(Params.wifi_ssid, "home");
+  strcpy(Params.mqtt_host_s, "192.168.1.10");
+  Params.mqtt_port = 1883;
+  snprintf(Params.command_topic, sizeof(Params.command_topic), "cmd/%u", Counter);
+  Params.simple_crc16 = GetCrc16Simple((uint8_t*)&Params, sizeof(Params) - 4);
+}
+
+void PutLegacySlot(uint8_t Slot, uint32_t Counter, uint32_t Generation) { // копия формата с двумя копиями
+  LegacySlot _slot;
+  memset(&_slot, 0, sizeof(_slot));
+  FillLegacyParams(_slot.params, Counter);
+  _slot.generation = Generation;
+  _slot.slot_crc = GetCrc16Simple((uint8_t*)&_slot, offsetof(LegacySlot, slot_crc));
+  memcpy(test_Image + Slot * sizeof(LegacySlot), &_slot, sizeof(_slot));
+}
+
+void PutChannelsV1() {
+  LegacyChannelsV1 _ch = {1, {1, 2}, 0, {500, 2000}, 0};
+  _ch.crc = GetCrc16Simple((uint8_t*)&_ch, offsetof(LegacyChannelsV1, crc));
+  memcpy(test_Image + C_LEGACY_CHANNELS_ADDR, &_ch, sizeof(_ch));
+}
+
+void PutChannelsV2() {
+  LegacyChannelsV2 _ch = {2, {2, 1}, 0, {1000, 3000}, {30, 40}, {50, 60}, {7, 8}, 0};
+  _ch.crc = GetCrc16Simple((uint8_t*)&_ch, offsetof(LegacyChannelsV2, crc));
+  memcpy(test_Image + C_LEGACY_CHANNELS_ADDR, &_ch, sizeof(_ch));
+}
+
+size_t PutRecord(uint8_t *Buf, size_t Pos, uint8_t Id, const void *Data, uint8_t Size) { // запись [номер][длина][данные]
+  Buf[Pos] = Id;
+  Buf[Pos + 1] = Size;
+  memcpy(Buf + Pos + 2, Data, Size);
+  return Pos + 2 + Size;
+}
+
+size_t CloseBlock(uint8_t *Buf, size_t Len, uint8_t Version) { // заголовок статического блока
+  ConfigHeader _header = {C_CFG_MAGIC, Version, 0, (uint16_t)(Len - sizeof(ConfigHeader)), 0};
+  _header.crc = GetCrc16Simple(Buf + sizeof(ConfigHeader), _header.length);
+  memcpy(Buf, &_header, sizeof(_header));
+  return Len;
+}
+
+void setUp(void) {
+  memset(test_Image, 0, sizeof(test_Image));
+}
+
+void tearDown(void) {}
+
+void test_legacy_struct_sizes(void) {
+  // раскладка образа задана прежними версиями прошивки и не должна меняться
+  TEST_ASSERT_EQUAL_UINT32(496, sizeof(LegacyParams));
+  TEST_ASSERT_EQUAL_UINT32(504, sizeof(LegacySlot));
+  TEST_ASSERT_EQUAL_UINT32(1008, C_LEGACY_CHANNELS_ADDR);
+  TEST_ASSERT_EQUAL_UINT32(10, sizeof(LegacyChannelsV1));
+  TEST_ASSERT_EQUAL_UINT32(22, sizeof(LegacyChannelsV2));
+  TEST_ASSERT_EQUAL_UINT32(10, sizeof(ConfigHeader));
+  TEST_ASSERT_EQUAL_UINT32(10, sizeof(ChannelRecord));
+}
+
+void test_single_block_v13b(void) {
+  LegacyParams _params, _read;
+  LegacyChannelsV2 _ch = LegacyChannelsV2();
+  FillLegacyParams(_params, 100);
+  memcpy(test_Image, &_params, sizeof(_params));
+  // образ v1.3b короче раскладки с двумя копиями
+  TEST_ASSERT_EQUAL(LL_SINGLE, DecodeLegacyConfig(test_Image, sizeof(_params), _read));
+  TEST_ASSERT_EQUAL_UINT32(100, _read.counter[0]);
+  TEST_ASSERT_EQUAL_UINT32(200, _read.counter[1]);
+  TEST_ASSERT_EQUAL_STRING("cmd/100", _read.command_topic);
+  TEST_ASSERT_EQUAL(0, DecodeLegacyChannels(test_Image, sizeof(_params), _ch));
+  // дополненный нулями образ не принимается за копию с номером 0
+  TEST_ASSERT_EQUAL(LL_SINGLE, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+  // испорченный блок - переноса нет
+  test_Image[10] ^= 1;
+  TEST_ASSERT_EQUAL(LL_NONE, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+}
+
+void test_two_slots_newest_wins(void) {
+  LegacyParams _read;
+  PutLegacySlot(0, 100, 5);
+  PutLegacySlot(1, 101, 6);
+  TEST_ASSERT_EQUAL(LL_SLOTS, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+  TEST_ASSERT_EQUAL_UINT32(101, _read.counter[0]);
+  // номер записи переполнился
+  PutLegacySlot(0, 200, 1);
+  PutLegacySlot(1, 199, 0xFFFFFFFF);
+  TEST_ASSERT_EQUAL(LL_SLOTS, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+  TEST_ASSERT_EQUAL_UINT32(200, _read.counter[0]);
+}
+
+void test_two_slots_interrupted_write(void) {
+  LegacyParams _read;
+  PutLegacySlot(0, 100, 5);
+  PutLegacySlot(1, 101, 6);
+  test_Image[sizeof(LegacySlot) + 20] ^= 0xFF;       // запись второй копии прервалась
+  TEST_ASSERT_EQUAL(LL_SLOTS, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+  TEST_ASSERT_EQUAL_UINT32(100, _read.counter[0]);
+  // испорчен только номер записи первой копии - ее блок параметров целый и читается как v1.3b
+  PutLegacySlot(1, 101, 6);
+  test_Image[sizeof(LegacySlot) + 20] ^= 0xFF;
+  test_Image[offsetof(LegacySlot, generation)] ^= 1;
+  TEST_ASSERT_EQUAL(LL_SINGLE, DecodeLegacyConfig(test_Image, sizeof(test_Image), _read));
+  TEST_ASSERT_EQUAL_UINT32(100, _read.counter[0]);
+}
+
+void test_channels_v1_keeps_filter(void) {
+  LegacyChannelsV2 _ch = {0, {0, 0}, 0, {0, 0}, {11, 12}, {21, 22}, {31, 32}, 0};
+  PutLegacySlot(0, 1, 1);
+  PutChannelsV1();
+  TEST_ASSERT_EQUAL(1, DecodeLegacyChannels(test_Image, sizeof(test_Image), _ch));
+  TEST_ASSERT_EQUAL_UINT8(2, _ch.mode[1]);
+  TEST_ASSERT_EQUAL_UINT16(2000, _ch.gate_ms[1]);
+  TEST_ASSERT_EQUAL_UINT16(11, _ch.min_low_ms[0]);                       // параметры фильтра не тронуты
+  TEST_ASSERT_EQUAL_UINT16(32, _ch.hyst_ms[1]);
+  // образ оборван посреди блока
+  TEST_ASSERT_EQUAL(0, DecodeLegacyChannels(test_Image, C_LEGACY_CHANNELS_ADDR + 4, _ch));
+}
+
+void test_channels_v2(void) {
+  LegacyChannelsV2 _ch = LegacyChannelsV2();
+  PutChannelsV2();
+  TEST_ASSERT_EQUAL(2, DecodeLegacyChannels(test_Image, sizeof(test_Image), _ch));
+  TEST_ASSERT_EQUAL_UINT8(2, _ch.mode[0]);
+  TEST_ASSERT_EQUAL_UINT16(3000, _ch.gate_ms[1]);
+  TEST_ASSERT_EQUAL_UINT16(40, _ch.min_low_ms[1]);
+  TEST_ASSERT_EQUAL_UINT16(50, _ch.min_high_ms[0]);
+  TEST_ASSERT_EQUAL_UINT16(8, _ch.hyst_ms[1]);
+  test_Image[C_LEGACY_CHANNELS_ADDR + 5] ^= 1;
+  TEST_ASSERT_EQUAL(0, DecodeLegacyChannels(test_Image, sizeof(test_Image), _ch));
+  test_Image[C_LEGACY_CHANNELS_ADDR] = 3;                               // неизвестная версия блока
+  TEST_ASSERT_EQUAL(0, DecodeLegacyChannels(test_Image, sizeof(test_Image), _ch));
+}
+
+void test_static_block_v3_records(void) {
+  uint8_t        _buf[256];
+  size_t         _len = sizeof(ConfigHeader), _pos = sizeof(ConfigHeader);
+  const uint8_t  _short[4] = {1, 2, 0xE8, 0x03};                        // запись входа ранней сборки: индекс, режим, время усреднения
+  ChannelRecord  _full = {0, 1, 500, 10, 20, 3};
+  ChannelRecord  _rec = {1, 0, 0, 44, 55, 6};
+  uint8_t        _id, _size;
+  const uint8_t *_data;
+  ConfigHeader   _header;
+
+  _len = PutRecord(_buf, _len, 1, "home", 4);
+  _len = PutRecord(_buf, _len, 200, "future", 6);                         // запись более новой версии
+  _len = PutRecord(_buf, _len, 10, &_full, sizeof(_full));
+  _len = PutRecord(_buf, _len, 10, _short, sizeof(_short));
+  CloseBlock(_buf, _len, 3);
+  TEST_ASSERT_TRUE(CheckConfigBlock(_buf, _len, _header));
+  TEST_ASSERT_EQUAL_UINT8(3, _header.version);
+  TEST_ASSERT_EQUAL(1, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  TEST_ASSERT_EQUAL_UINT8(1, _id);
+  TEST_ASSERT_EQUAL_MEMORY("home", _data, 4);
+  TEST_ASSERT_EQUAL(1, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  TEST_ASSERT_EQUAL_UINT8(200, _id);
+  TEST_ASSERT_EQUAL(1, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  TEST_ASSERT_EQUAL_UINT8(sizeof(ChannelRecord), _size);
+  TEST_ASSERT_EQUAL(1, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  MergeChannelRecord(_data, _size, _rec);                                 // короткая запись меняет только свои поля
+  TEST_ASSERT_EQUAL_UINT8(2, _rec.mode);
+  TEST_ASSERT_EQUAL_UINT16(1000, _rec.gate_ms);
+  TEST_ASSERT_EQUAL_UINT16(44, _rec.min_low_ms);
+  TEST_ASSERT_EQUAL_UINT16(6, _rec.hyst_ms);
+  TEST_ASSERT_EQUAL(0, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  // запись выходит за границу блока (CRC при этом верный)
+  _buf[sizeof(ConfigHeader) + 1] = 250;
+  CloseBlock(_buf, _len, 3);
+  _pos = sizeof(ConfigHeader);
+  TEST_ASSERT_TRUE(CheckConfigBlock(_buf, _len, _header));
+  TEST_ASSERT_EQUAL(-1, NextConfigRecord(_buf, _len, _pos, _id, _size, _data));
+  // испорченные CRC, сигнатура и длина
+  _buf[_len - 1] ^= 1;
+  TEST_ASSERT_FALSE(CheckConfigBlock(_buf, _len, _header));
+  _buf[_len - 1] ^= 1;
+  TEST_ASSERT_FALSE(CheckConfigBlock(_buf, _len - 1, _header));
+  _buf[0] ^= 1;
+  TEST_ASSERT_FALSE(CheckConfigBlock(_buf, _len, _header));
+  TEST_ASSERT_FALSE(CheckConfigBlock(_buf, 4, _header));
+}
+
+void test_counter_slots_other_channel_counts(void) {
+  uint8_t  _buf[CounterSlotSize(C_CNT_MAX_CHANNELS)];
+  uint32_t _one[1] = {111};
+  uint32_t _four[4] = {1, 2, 3, 4};
+  uint32_t _read[2];
+  uint16_t _reboot;
+  uint32_t _gen;
+  size_t   _len;
+
+  // сборка с одним входом - второй счётчик с нуля
+  _len = EncodeCounterSlot(_one, 1, 9, 3, 42, _buf);
+  TEST_ASSERT_TRUE(DecodeCounterSlot(_buf, _len, _read, 2, _reboot, _gen));
+  TEST_ASSERT_EQUAL_UINT32(111, _read[0]);
+  TEST_ASSERT_EQUAL_UINT32(0, _read[1]);
+  TEST_ASSERT_EQUAL_UINT16(9, _reboot);
+  TEST_ASSERT_EQUAL_UINT32(42, _gen);
+  // сборка с четырьмя входами - переносятся общие
+  _len = EncodeCounterSlot(_four, 4, 1, 3, 43, _buf);
+  TEST_ASSERT_TRUE(DecodeCounterSlot(_buf, _len, _read, 2, _reboot, _gen));
+  TEST_ASSERT_EQUAL_UINT32(2, _read[1]);
+  // оборванная копия: номер записи читается, значения - нет
+  TEST_ASSERT_FALSE(DecodeCounterSlot(_buf, _len - 1, _read, 2, _reboot, _gen));
+  TEST_ASSERT_EQUAL_UINT32(43, _gen);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_legacy_struct_sizes);
+  RUN_TEST(test_single_block_v13b);
+  RUN_TEST(test_two_slots_newest_wins);
+  RUN_TEST(test_two_slots_interrupted_write);
+  RUN_TEST(test_channels_v1_keeps_filter);
+  RUN_TEST(test_channels_v2);
+  RUN_TEST(test_static_block_v3_records);
+  RUN_TEST(test_counter_slots_other_channel_counts);
+  return UNITY_END();
+}
@@ -0,0 +1,243 @@
+// Задача подсчёта прошивки на компьютере (src/counting_task.h): тот же проход CountingStep и то же время до пробуждения
+// CountingWait_us, что выполняет countingTask, на виртуальных часах. Планировщик повторяет работу FreeRTOS: обработчик прерывания
+// кладет фронт генератора импульсов в буфер фильтра (FilterPushEdge) и будит задачу, задача просыпается с задержкой планирования
+// или по тику, до которого заснула. Входы в режиме частоты получают фронты с метками таймера захвата, как от CaptureCallback.
+// В конце прогона пропадает питание: фронты больше не принимаются, задача делает последний проход, закрывает окна частоты
+// (CountingFlush) и пишет копию счётчиков (src/config_store.h) - в копии должно быть ровно столько импульсов, сколько генератор
+// замкнул до обрыва. Для каждого набора частот и задержек выводится сравнение сгенерированных и засчитанных импульсов.
+//
+// Запуск:  pio test -e native -f test_counting_task
+
+#include <unity.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include "counting_task.h"
+#include "config_store.h"
+
+#define C_SEED          0x2545F491                // то же начальное значение, что C_SIM_SEED прошивки
+#define C_SECONDS       600                       // длительность каждого прогона по виртуальным часам
+#define C_CHANNELS      4                         // входы 1-2 считают импульсы, 3-4 измеряют частоту
+#define C_TICK_US       1000                      // тик FreeRTOS прошивки (1 кГц)
+#define C_START_US      0xFFF00000                // часы прошивки идут давно - метки фильтров переполняются за прогон
+#define C_START_MS      0xFFFF0000                // то же для millis - окна частоты переходят через переполнение
+#define C_CAPTURE_CLOCK 80000000                  // частота таймера захвата прошивки в Гц
+#define C_FREQ_TOL_PPM  1000                      // допуск частоты - 0.1%
+
+struct TaskCase {
+  const char      *name;
+  SimWave         wave;                           // сигнал счётного входа 1 (вход 2 - с периодом в полтора раза больше)
+  FilterTiming    timing;                         // параметры фильтра счётных входов
+  uint32_t        freq_period_us;                 // сигнал входа 3 в режиме частоты (вход 4 - вдвое медленнее)
+  uint16_t        gate_ms;                        // окно измерения частоты
+  uint32_t        max_lag_us;                     // наибольшая задержка пробуждения задачи после фронта
+};
+
+SimWave MakeWave(uint32_t Period, uint32_t Jitter, uint32_t Width, uint32_t BounceSpan, uint32_t MinLow) {
+  SimWave _wave = SimWave();
+  _wave.period_ms = Period;
+  _wave.jitter_ms = Jitter;
+  _wave.width_ms = Width;
+  _wave.bounce_edges = 3;
+  _wave.bounce_span_ms = BounceSpan;
+  _wave.glitch_pct = 5;
+  _wave.glitch_max_us = MinLow * 500;             // как в прошивке - помеха короче половины min_low
+  return _wave;
+}
+
+const TaskCase c_Cases[] = {
+  {"default 5 Hz",    MakeWave(200, 40, 80, 2, 50),     {50000, 20000, 5000},  20000, 1000, 2000},   // параметры прошивки по умолчанию
+  {"water 1 Hz",      MakeWave(1000, 300, 150, 3, 100), {100000, 50000, 8000}, 8333,  1000, 5000},
+  {"fast 20 Hz busy", MakeWave(50, 10, 20, 1, 10),      {10000, 10000, 2000},  1000,  100,  20000},
+  {"max 100 Hz",      MakeWave(10, 2, 5, 0, 4),         {4000, 2000, 1000},    400,   500,  1000},
+};
+
+struct VirtualPort {                              // платформа задачи подсчёта на виртуальных часах (CountingPort прошивки)
+  uint8_t         mode[C_CHANNELS];
+  FilterTiming    timing[C_CHANNELS];
+  uint16_t        gate_ms[C_CHANNELS];
+  InputFilter     filters[C_CHANNELS];
+  FreqMeter       meters[C_CHANNELS];
+  uint32_t        next_gate[C_CHANNELS];
+  uint32_t        counter[C_CHANNELS];            // curConfig.counter
+  uint32_t        glitches[C_CHANNELS];           // count_DebounceReject
+  uint32_t        bounces[C_CHANNELS];            // count_BounceEdges
+  uint32_t        windows[C_CHANNELS];            // закрытых окон частоты
+  FreqResult      result[C_CHANNELS];             // частота и скважность по последнему окну
+  uint32_t        max_delay_us;                   // наибольшая задержка подсчёта от окончания min_low
+  uint32_t        now_us;                         // виртуальные часы от начала прогона
+
+  uint8_t Channels() { return C_CHANNELS; }
+  uint8_t Mode(uint8_t Channel) { return mode[Channel]; }
+  InputFilter &Filter(uint8_t Channel) { return filters[Channel]; }
+  FilterTiming Timing(uint8_t Channel) { return timing[Channel]; }
+  uint32_t FilterNow() { return C_START_US + now_us; }
+  uint32_t Millis() { return C_START_MS + now_us / 1000; }
+  uint32_t &NextGate(uint8_t Channel) { return next_gate[Channel]; }
+  uint16_t Gate(uint8_t Channel) { return gate_ms[Channel]; }
+  FreqMeter CloseWindow(uint8_t Channel) { return FreqMeterClose(meters[Channel]); }
+
+  void Pulse(uint8_t Channel, uint32_t Start_us) {
+    uint32_t _delay = FilterNow() - Start_us - timing[Channel].low_us;
+    if (_delay > max_delay_us) max_delay_us = _delay;
+    counter[Channel]++;
+  }
+
+  void Bounce(uint8_t Channel) { bounces[Channel]++; }
+  void Glitch(uint8_t Channel) { glitches[Channel]++; }
+
+  void Window(uint8_t Channel, const FreqMeter &Window) {
+    result[Channel] = FreqMeterResult(Window, C_CAPTURE_CLOCK);
+    counter[Channel] += Window.pulses;
+    windows[Channel]++;
+  }
+};
+
+struct TaskResult {
+  uint32_t        generated[C_CHANNELS];          // импульсов, замкнутых генератором до обрыва питания
+  uint32_t        sim_glitches[C_CHANNELS];       // сгенерировано помех
+  uint32_t        saved[C_CHANNELS];              // значения в копии счётчиков, записанной при обрыве
+  FreqResult      freq[C_CHANNELS];               // частота и скважность по последнему полному окну
+  uint32_t        overflows;                      // фронтов, не поместившихся в буфер фильтра
+  uint32_t        edges;                          // фронтов за прогон
+  uint32_t        wakeups;                        // проходов задачи подсчёта
+  double          host_ms;                        // время прогона на компьютере
+};
+
+// Прогон Seconds виртуальных секунд и обрыв питания. Port после прогона - состояние задачи подсчёта
+TaskResult RunTask(const TaskCase &Case, VirtualPort &Port, uint32_t Seconds, uint32_t Schedule_Seed) {
+  TaskResult _res;
+  SimWave    _waves[C_CHANNELS];
+  SimChannel _sim[C_CHANNELS];
+  uint32_t   _random = C_SEED;
+  uint32_t   _schedule = Schedule_Seed;
+  uint32_t   _wake = 0;                                                 // момент пробуждения задачи (первый проход - при старте)
+  uint32_t   _end = Seconds * 1000000;
+  auto       _start = std::chrono::steady_clock::now();
+
+  memset(&_res, 0, sizeof(_res));
+  memset(&Port, 0, sizeof(Port));
+  for (uint8_t i = 0; i < C_CHANNELS; i++) {                            // входы разомкнуты, окна начинаются при старте (ApplyChannelMode)
+    bool _count = (i < 2);
+    _waves[i] = Case.wave;
+    if (i == 1) _waves[i].period_ms = Case.wave.period_ms * 3 / 2;
+    _waves[i].frequency = !_count;
+    _waves[i].freq_period_us = Case.freq_period_us * (i == 3 ? 2 : 1);
+    _waves[i].freq_duty_pct = 30;
+    SimStart(_sim[i], _waves[i]);
+    Port.mode[i] = _count ? CM_COUNT : CM_FREQUENCY;
+    Port.timing[i] = Case.timing;
+    Port.gate_ms[i] = Case.gate_ms;
+    Port.filters[i].core.state = FS_OPEN;
+    FreqMeterReset(Port.meters[i], false);
+    Port.next_gate[i] = Port.Millis() + Case.gate_ms;
+  }
+  while (true) {
+    uint8_t _ch = 0;                                                    // вход с ближайшим фронтом
+    for (uint8_t i = 1; i < C_CHANNELS; i++) {
+      if (_sim[i].next_edge < _sim[_ch].next_edge) _ch = i;
+    }
+    uint32_t _edge = _sim[_ch].next_edge;
+    if ((_edge <= _end) and (_edge <= _wake)) {                         // прерывание входа раньше пробуждения задачи
+      Port.now_us = _edge;
+      SimEdge(_sim[_ch], _waves[_ch], _random);
+      _res.edges++;
+      if (Port.mode[_ch] == CM_FREQUENCY) {                             // таймер захвата задачу не будит
+        FreqMeterEdge(Port.meters[_ch], _sim[_ch].closed, Port.FilterNow() * (C_CAPTURE_CLOCK / 1000000));
+        continue;
+      }
+      if (!FilterPushEdge(Port.filters[_ch], _sim[_ch].closed, Port.FilterNow())) _res.overflows++;
+      uint32_t _notified = _edge + SimRandom(_schedule, Case.max_lag_us + 1);
+      if (_notified < _wake) _wake = _notified;
+      continue;
+    }
+    if (_wake > _end) break;
+    Port.now_us = _wake;                                                // задача проснулась: все фронты до этого момента уже в буферах
+    CountingStep(Port);
+    _res.wakeups++;
+    uint32_t _wait_us = CountingWait_us(Port);                          // ожидание в тиках - как в countingTask
+    if (_wait_us == C_WAIT_FOREVER) _wake = UINT32_MAX;
+      else _wake = Port.now_us + ((_wait_us > 0) ? ((_wait_us + 999) / 1000 + 1) * C_TICK_US : 0);
+  }
+  // обрыв питания: обработчик входа фронты больше не передает, задача делает последний проход и сохраняет счётчики
+  Port.now_us = _end;
+  CountingStep(Port);
+  memcpy(_res.freq, Port.result, sizeof(_res.freq));
+  CountingFlush(Port);
+  uint8_t  _slot[CounterSlotSize(C_CHANNELS)];
+  uint16_t _reboot;
+  uint32_t _generation;
+  TEST_ASSERT_TRUE(DecodeCounterSlot(_slot, EncodeCounterSlot(Port.counter, C_CHANNELS, 0, 3, 1, _slot), _res.saved, C_CHANNELS, _reboot, _generation));
+  for (uint8_t i = 0; i < C_CHANNELS; i++) {
+    _res.generated[i] = SimPulsesDone(_sim[i], _end, (Port.mode[i] == CM_COUNT) ? Case.timing.low_us : 0);
+    _res.sim_glitches[i] = _sim[i].glitches - (_sim[i].glitch ? 1 : 0);
+  }
+  _res.host_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - _start).count();
+  return _res;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_counting_task_matches_generator(void) {
+  printf("\n%-16s %5s %10s %10s %9s %9s %12s\n", "case", "input", "generated", "saved", "glitches", "rejected", "frequency");
+  for (const TaskCase &_case : c_Cases) {
+    VirtualPort _port;
+    TaskResult  _res = RunTask(_case, _port, C_SECONDS, 1);
+    for (uint8_t i = 0; i < C_CHANNELS; i++) {
+      char _msg[80];
+      snprintf(_msg, sizeof(_msg), "%s input %u", _case.name, i + 1);
+      printf("%-16s %5u %10u %10u %9u %9u ", _case.name, i + 1, _res.generated[i], _res.saved[i], _res.sim_glitches[i], _port.glitches[i]);
+      if (_port.mode[i] == CM_COUNT) printf("%12s\n", "-");
+        else printf("%8u.%03u\n", _res.freq[i].freq_mhz / 1000, _res.freq[i].freq_mhz % 1000);
+      TEST_ASSERT_EQUAL_UINT32_MESSAGE(_res.generated[i], _port.counter[i], _msg);           // засчитано ровно сгенерированное
+      TEST_ASSERT_EQUAL_UINT32_MESSAGE(_port.counter[i], _res.saved[i], _msg);               // и все оно попало в копию при обрыве
+      if (_port.mode[i] == CM_COUNT) {
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(_res.sim_glitches[i], _port.glitches[i], _msg);
+        TEST_ASSERT_GREATER_THAN(0, _port.bounces[i]);
+      }
+      else {
+        uint32_t _expected_mhz = 1000000000UL / (_case.freq_period_us * (i == 3 ? 2 : 1));
+        TEST_ASSERT_GREATER_THAN((uint32_t)(C_SECONDS * 1000 / _case.gate_ms - 2), _port.windows[i]);   // окна не пропускаются
+        TEST_ASSERT_UINT32_WITHIN_MESSAGE((uint64_t)_expected_mhz * C_FREQ_TOL_PPM / 1000000 + 1, _expected_mhz, _res.freq[i].freq_mhz, _msg);
+      }
+    }
+    printf("%-16s %u edges, %u task wakeups, %u lost edges, count delay up to %.1f ms, %.1f M edges/s on this computer\n", "", _res.edges,
+           _res.wakeups, _res.overflows, _port.max_delay_us / 1000.0, _res.edges / (_res.host_ms * 1000.0));
+    TEST_ASSERT_EQUAL_UINT32(0, _res.overflows);
+    // задержка подсчёта - задержка пробуждения и округление ожидания до тиков
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(_case.max_lag_us + 2 * C_TICK_US, _port.max_delay_us);
+  }
+}
+
+void test_result_does_not_depend_on_schedule(void) {
+  // другие задержки пробуждения меняют только моменты проходов задачи, засчитанные импульсы те же
+  for (const TaskCase &_case : c_Cases) {
+    VirtualPort _base_port, _port;
+    RunTask(_case, _base_port, 60, 1);
+    for (uint32_t _seed = 2; _seed < 5; _seed++) {
+      RunTask(_case, _port, 60, _seed * 7919);
+      TEST_ASSERT_EQUAL_UINT32_ARRAY(_base_port.counter, _port.counter, C_CHANNELS);
+      TEST_ASSERT_EQUAL_UINT32_ARRAY(_base_port.glitches, _port.glitches, C_CHANNELS);
+    }
+  }
+}
+
+void test_starved_task_reports_lost_edges(void) {
+  // задача подсчёта не успевает разбирать буфер фронтов - потери видны в счётчике переполнений, а не только в расхождении
+  TaskCase   _case = c_Cases[3];
+  VirtualPort _port;
+  _case.max_lag_us = 200000;
+  TaskResult _res = RunTask(_case, _port, 60, 1);
+  TEST_ASSERT_GREATER_THAN(0, _res.overflows);
+  TEST_ASSERT_NOT_EQUAL(_res.generated[0], _port.counter[0]);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_counting_task_matches_generator);
+  RUN_TEST(test_result_does_not_depend_on_schedule);
+  RUN_TEST(test_starved_task_reports_lost_edges);
+  return UNITY_END();
+}
@@ -0,0 +1,127 @@
+// Режим частоты на компьютере (src/freq_meter.h): генератор импульсов (src/input_filter.h) строит прямоугольный сигнал
+// с известными частотой и скважностью, фронты передаются с метками времени в тактах таймера захвата - так же, как задача
+// генератора прошивки в режиме PULSE_SIMULATOR передает их в FreqEdge. Окна измерения закрываются по виртуальным часам, в каждом
+// окне частота и скважность должны совпасть с сигналом, а замыкания за все окна - с количеством импульсов генератора.
+// Метки таймера за прогон переполняются много раз (32 бита тактов - 53.7 с).
+//
+// Запуск:  pio test -e native -f test_freq_mode
+
+#include <unity.h>
+#include <stdio.h>
+#include "input_filter.h"
+#include "freq_meter.h"
+
+#define C_CAPTURE_CLOCK 80000000                  // частота таймера захвата прошивки в Гц
+#define C_SECONDS      600                        // длительность каждого прогона по виртуальным часам
+#define C_START_US     0xFFF00000                 // момент старта генератора в мкс (часы прошивки идут давно)
+#define C_FREQ_TOL_PPM 1000                       // допуск частоты - 0.1%
+#define C_DUTY_TOL_PM  2                          // допуск скважности в тысячных
+
+struct FreqCase {
+  const char      *name;
+  uint32_t        period_us;                      // период сигнала
+  uint32_t        duty_pct;                       // доля замкнутого состояния
+  uint32_t        gate_ms;                        // окно измерения
+};
+
+const FreqCase c_Cases[] = {
+  {"sim ch1 50 Hz",   20000,  30, 1000},          // генератор прошивки по умолчанию (C_SIM_FREQ_PERIOD_CH1, C_SIM_FREQ_DUTY)
+  {"sim ch2 120 Hz",  8333,   30, 1000},          // C_SIM_FREQ_PERIOD_CH2
+  {"1 kHz short gate", 1000,  50, 100},           // C_GATE_MIN
+  {"5 Hz long gate",  200000, 10, 10000},         // C_GATE_MAX
+  {"2.5 kHz 90%",     400,    90, 500},
+};
+
+struct FreqRun {
+  SimWave         wave;
+  SimChannel      sim;
+  FreqMeter       meter;
+  uint32_t        clock_us;                       // виртуальные часы от старта генератора
+  uint32_t        random;
+  uint64_t        counted;                        // замыканий за закрытые окна
+};
+
+void StartRun(FreqRun &Run, const FreqCase &Case) {
+  Run.wave = SimWave();
+  Run.wave.period_ms = 100;                       // первый импульс через 100 мс после старта
+  Run.wave.freq_period_us = Case.period_us;
+  Run.wave.freq_duty_pct = Case.duty_pct;
+  Run.wave.frequency = true;
+  SimStart(Run.sim, Run.wave);
+  FreqMeterReset(Run.meter, false);
+  Run.clock_us = 0;
+  Run.random = 1;
+  Run.counted = 0;
+}
+
+FreqResult RunWindow(FreqRun &Run, uint32_t Gate_ms, bool Generate = true) { // фронты до конца окна, затем окно закрывается
+  uint32_t _end = Run.clock_us + Gate_ms * 1000;
+  while (Generate and ((int32_t)(_end - Run.sim.next_edge) >= 0)) {
+    uint32_t _edge = Run.sim.next_edge;
+    SimEdge(Run.sim, Run.wave, Run.random);
+    FreqMeterEdge(Run.meter, Run.sim.closed, (C_START_US + _edge) * (C_CAPTURE_CLOCK / 1000000));
+  }
+  Run.clock_us = _end;
+  FreqMeter _window = FreqMeterClose(Run.meter);
+  Run.counted += _window.pulses;
+  return FreqMeterResult(_window, C_CAPTURE_CLOCK);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_frequency_and_duty_match_the_generator(void) {
+  for (const FreqCase &_case : c_Cases) {
+    FreqRun  _run;
+    uint32_t _expected_mhz = 1000000000UL / _case.period_us;
+    uint32_t _windows = C_SECONDS * 1000 / _case.gate_ms;
+    uint32_t _min_mhz = UINT32_MAX, _max_mhz = 0, _min_pm = UINT32_MAX, _max_pm = 0;
+    char     _msg[120];
+    StartRun(_run, _case);
+    RunWindow(_run, _case.gate_ms);                                    // первое окно - сигнал еще не начался или в нем нет полного периода
+    for (uint32_t w = 1; w < _windows; w++) {
+      FreqResult _r = RunWindow(_run, _case.gate_ms);
+      snprintf(_msg, sizeof(_msg), "%s window %u: %u mHz, duty %u pm", _case.name, w, _r.freq_mhz, _r.duty_pm);
+      TEST_ASSERT_UINT32_WITHIN_MESSAGE((uint64_t)_expected_mhz * C_FREQ_TOL_PPM / 1000000 + 1, _expected_mhz, _r.freq_mhz, _msg);
+      TEST_ASSERT_UINT32_WITHIN_MESSAGE(C_DUTY_TOL_PM, _case.duty_pct * 10, _r.duty_pm, _msg);
+      TEST_ASSERT_EQUAL_UINT32_MESSAGE(SimPulsesDone(_run.sim, _run.clock_us, 0), _run.counted, _msg);   // замыкания окна - в счётчик, без потерь
+      if (_r.freq_mhz < _min_mhz) _min_mhz = _r.freq_mhz;
+      if (_r.freq_mhz > _max_mhz) _max_mhz = _r.freq_mhz;
+      if (_r.duty_pm < _min_pm) _min_pm = _r.duty_pm;
+      if (_r.duty_pm > _max_pm) _max_pm = _r.duty_pm;
+    }
+    printf("%-18s expected %6u.%03u Hz %2u%%: measured %u.%03u..%u.%03u Hz, duty %u..%u pm, %u windows, %llu pulses\n", _case.name,
+           _expected_mhz / 1000, _expected_mhz % 1000, _case.duty_pct, _min_mhz / 1000, _min_mhz % 1000, _max_mhz / 1000, _max_mhz % 1000,
+           _min_pm, _max_pm, _windows, (unsigned long long)_run.counted);
+  }
+}
+
+void test_stopped_input_reports_level(void) {
+  // сигнал пропал - после окна с последними периодами частота 0, скважность по уровню входа (метка последнего спада не переносится
+  // в следующие окна - после переполнения таймера захвата она дала бы неверный период)
+  const bool c_levels[] = {true, false};
+  for (bool _level : c_levels) {
+    FreqRun _run;
+    StartRun(_run, c_Cases[0]);
+    for (uint8_t w = 0; w < 3; w++) RunWindow(_run, 1000);
+    while (_run.sim.closed != _level) {                                // останавливаем генератор в нужном состоянии входа
+      uint32_t _edge = _run.sim.next_edge;
+      SimEdge(_run.sim, _run.wave, _run.random);
+      FreqMeterEdge(_run.meter, _run.sim.closed, (C_START_US + _edge) * (C_CAPTURE_CLOCK / 1000000));
+    }
+    RunWindow(_run, 1000, false);                                      // окно с последними периодами
+    for (uint8_t w = 0; w < 60; w++) {                                 // дольше переполнения таймера захвата
+      FreqResult _r = RunWindow(_run, 1000, false);
+      TEST_ASSERT_EQUAL_UINT32(0, _r.freq_mhz);
+      TEST_ASSERT_EQUAL_UINT32(_level ? 1000 : 0, _r.duty_pm);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_frequency_and_duty_match_the_generator);
+  RUN_TEST(test_stopped_input_reports_level);
+  return UNITY_END();
+}
@@ -0,0 +1,227 @@
+// Длительная работа без выделения памяти на компьютере: неделя по виртуальным часам установившегося режима прошивки - генератор
+// импульсов, буфер фронтов и фильтр входов - та же обработка FilterDrain, что в задаче подсчёта (src/input_filter.h), расчет скорости счёта (src/rate_engine.h),
+// текст отчёта в буфер на стеке и копии счётчиков (src/config_store.h). Все выделения памяти (malloc и new) считаются - после
+// первого цикла отчёта их не должно быть ни одного. Часы фильтра и расчета скорости за неделю переполняются много раз.
+// Сборка JSON, MQTT и WEB на компьютере не собираются - на модуле то же проверяет cntr_heap_block_growth (/metrics).
+//
+// Запуск:  pio test -e native -f test_heap_soak
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <new>
+#include "input_filter.h"
+#include "rate_engine.h"
+#include "config_store.h"
+
+#define C_DAYS         7                          // длительность прогона по виртуальным часам
+#define C_CHANNELS     2                          // входов, как в прошивке по умолчанию
+#define C_REPORT_MS    60000                      // период отчёта
+#define C_SAVE_MS      600000                     // период записи копии счётчиков
+#define C_SLOTS        2                          // копий счётчиков
+#define C_VOLUME_ML    10000                      // объем на один импульс в мл
+#define C_FORMAT       3                          // версия формата копии счётчиков (C_CFG_FORMAT_VERSION прошивки)
+
+uint64_t g_Allocations = 0;                       // выделений памяти с начала работы
+
+#ifdef __GLIBC__                                  // malloc библиотеки C перекрывается только в glibc
+extern "C" void *__libc_malloc(size_t Size);
+extern "C" void *__libc_calloc(size_t Count, size_t Size);
+extern "C" void *__libc_realloc(void *Ptr, size_t Size);
+extern "C" void *malloc(size_t Size) {
+  g_Allocations++;
+  return __libc_malloc(Size);
+}
+extern "C" void *calloc(size_t Count, size_t Size) {
+  g_Allocations++;
+  return __libc_calloc(Count, Size);
+}
+extern "C" void *realloc(void *Ptr, size_t Size) {
+  g_Allocations++;
+  return __libc_realloc(Ptr, Size);
+}
+#endif
+
+void *operator new(size_t Size) {
+  g_Allocations++;
+  void *_ptr = malloc(Size);
+  if (_ptr == NULL) throw std::bad_alloc();
+  return _ptr;
+}
+void *operator new[](size_t Size) { return operator new(Size); }
+void operator delete(void *Ptr) noexcept { free(Ptr); }
+void operator delete[](void *Ptr) noexcept { free(Ptr); }
+void operator delete(void *Ptr, size_t) noexcept { free(Ptr); }
+void operator delete[](void *Ptr, size_t) noexcept { free(Ptr); }
+
+size_t TextAppend(char *Buf, size_t Size, size_t Len, const char *fmt, ...) { // как BufPrintf прошивки
+  if (Len >= Size) return Len;
+  va_list args;
+  va_start(args, fmt);
+  int _add = vsnprintf(Buf + Len, Size - Len, fmt, args);
+  va_end(args);
+  if (_add < 0) return Len;
+  return (Len + _add < Size - 1) ? Len + _add : Size - 1;
+}
+
+struct SoakChannel {
+  SimWave         wave;
+  FilterTiming    timing;
+  SimChannel      sim;
+  InputFilter     filter;                         // буфер фронтов и состояние фильтра, как inp_Filters прошивки
+  uint32_t        counter;
+  RateEngine      rate;
+  uint32_t        now_us;                         // момент, до которого обрабатываются переходы фильтра
+
+  uint32_t Now() {                                // обработчик событий FilterDrain
+    return now_us;
+  }
+
+  void Event(FilterEvent_t Event, uint32_t Start_us) {
+    if (Event != FE_PULSE) return;
+    counter++;
+    RateAdd(rate, Start_us + timing.low_us);
+  }
+};
+
+struct SoakResult {
+  uint64_t        allocations;                    // выделений после первого отчёта
+  uint32_t        reports;
+  uint32_t        saves;
+  uint32_t        generated[C_CHANNELS];
+  uint32_t        counted[C_CHANNELS];
+  uint32_t        restored[C_CHANNELS];           // значения из последней записанной копии
+  size_t          max_report_len;
+  uint32_t        ewma[C_CHANNELS];               // сглаженная скорость в последнем отчёте
+};
+
+SimWave MakeWave(uint32_t Period, uint32_t Jitter, uint32_t Width, uint32_t MinLow) {
+  SimWave _wave = SimWave();
+  _wave.period_ms = Period;
+  _wave.jitter_ms = Jitter;
+  _wave.width_ms = Width;
+  _wave.bounce_edges = 3;
+  _wave.bounce_span_ms = 2;
+  _wave.glitch_pct = 5;
+  _wave.glitch_max_us = MinLow * 500;
+  return _wave;
+}
+
+void ProcessEdges(SoakChannel &Ch, uint32_t Now_us) { // задача подсчёта: накопленные фронты и переходы фильтра до момента Now_us
+  Ch.now_us = Now_us;
+  FilterDrain(Ch.filter, Ch.timing, Ch);
+}
+
+SoakResult RunSoak(uint32_t Days) {
+  SoakResult  _res = SoakResult();
+  SoakChannel _ch[C_CHANNELS] = {};
+  uint8_t     _slots[C_SLOTS][CounterSlotSize(C_CHANNELS)];
+  uint8_t     _active = 0;
+  uint32_t    _generation = 0;
+  uint32_t    _random = 0x2545F491;
+  uint32_t    _schedule = 1;
+  uint32_t    _clock = 0;                                               // младшие 32 бита micros() - переполняются каждые 71 минуту
+  uint64_t    _elapsed_us = 0;
+  uint64_t    _end_us = (uint64_t)Days * 86400 * 1000000;
+  uint64_t    _next_report = C_REPORT_MS * 1000ULL, _next_save = C_SAVE_MS * 1000ULL;
+  uint64_t    _base = 0;
+
+  _ch[0].wave = MakeWave(1000, 300, 150, 100);                          // вода 1 Гц
+  _ch[0].timing = {100000, 50000, 8000};
+  _ch[1].wave = MakeWave(200, 40, 80, 50);                              // параметры генератора прошивки по умолчанию, 5 Гц
+  _ch[1].timing = {50000, 20000, 5000};
+  memset(_slots, 0xFF, sizeof(_slots));
+  for (SoakChannel &_c : _ch) SimStart(_c.sim, _c.wave);
+  while (_elapsed_us < _end_us) {
+    uint32_t _step = 1000 + SimRandom(_schedule, 4000);                 // задача подсчёта просыпается по тикам
+    uint32_t _now = _clock + _step;
+    for (SoakChannel &_c : _ch) {
+      while ((int32_t)(_now - _c.sim.next_edge) >= 0) {                 // фронты генератора - в буфер, при переполнении обрабатываем
+        InputFilter &_f = _c.filter;
+        if ((uint8_t)((_f.head + 1) % C_EDGE_QUEUE) == _f.tail) ProcessEdges(_c, _f.edges[(_f.head + C_EDGE_QUEUE - 1) % C_EDGE_QUEUE].time_us);
+        _f.edges[_f.head].time_us = _c.sim.next_edge;
+        SimEdge(_c.sim, _c.wave, _random);
+        _f.edges[_f.head].closed = _c.sim.closed;
+        _f.head = (_f.head + 1) % C_EDGE_QUEUE;
+      }
+      ProcessEdges(_c, _now);
+    }
+    _clock = _now;
+    _elapsed_us += _step;
+    if (_elapsed_us >= _next_report) {                                  // отчёт: скорости и значения - текстом в буфер на стеке
+      char   _text[128 + 96 * C_CHANNELS];
+      size_t _len = TextAppend(_text, sizeof(_text), 0, "{");
+      for (uint8_t i = 0; i < C_CHANNELS; i++) {
+        FlowRates _rates;
+        RateCompute(_ch[i].rate, _clock, _rates);
+        uint32_t _ml = (uint64_t)_rates.ewma * C_VOLUME_ML / 1000;
+        _len = TextAppend(_text, sizeof(_text), _len, "%s\"cnt0%u\":%u,\"flow_%u\":%u.%03u,\"rate_%u\":%u", (i > 0) ? "," : "", i + 1,
+                          _ch[i].counter, i + 1, _ml / 1000, _ml % 1000, i + 1, _rates.window);
+        _res.ewma[i] = _rates.ewma;
+      }
+      _len = TextAppend(_text, sizeof(_text), _len, ",\"uptime\":%llu}", (unsigned long long)(_elapsed_us / 1000000));
+      if (_len > _res.max_report_len) _res.max_report_len = _len;
+      if (_res.reports == 0) _base = g_Allocations;                     // первый цикл отчёта - прогрев (буферы библиотеки C)
+      _res.reports++;
+      _next_report += C_REPORT_MS * 1000ULL;
+    }
+    if (_elapsed_us >= _next_save) {                                    // копия счётчиков - в следующую ячейку
+      uint32_t _counters[C_CHANNELS];
+      for (uint8_t i = 0; i < C_CHANNELS; i++) _counters[i] = _ch[i].counter;
+      _active = NextCounterSlot(_active, C_SLOTS);
+      EncodeCounterSlot(_counters, C_CHANNELS, 1, C_FORMAT, ++_generation, _slots[_active]);
+      _res.saves++;
+      _next_save += C_SAVE_MS * 1000ULL;
+    }
+  }
+  _res.allocations = g_Allocations - _base;
+  uint16_t _reboot;
+  uint32_t _gen;
+  TEST_ASSERT_TRUE(DecodeCounterSlot(_slots[_active], sizeof(_slots[_active]), _res.restored, C_CHANNELS, _reboot, _gen));
+  for (uint8_t i = 0; i < C_CHANNELS; i++) {
+    _res.counted[i] = _ch[i].counter;
+    _res.generated[i] = SimPulsesDone(_ch[i].sim, _clock, _ch[i].timing.low_us);   // замкнутые к концу прогона не меньше min_low
+  }
+  return _res;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_allocations_are_counted(void) {
+  // без этой проверки ноль выделений в прогоне ничего бы не значил
+  void *(*volatile _alloc)(size_t) = malloc;
+  uint64_t _before = g_Allocations;
+  void *_ptr = _alloc(64);
+  int  *_obj = new int(1);
+  TEST_ASSERT_NOT_NULL(_ptr);
+  TEST_ASSERT_GREATER_OR_EQUAL(_before + 2, g_Allocations);
+  free(_ptr);
+  delete _obj;
+}
+
+void test_week_without_allocations(void) {
+  SoakResult _res = RunSoak(C_DAYS);
+  printf("\n%-8s %10s %10s %10s %10s %12s\n", "input", "generated", "counted", "restored", "ewma", "allocations");
+  for (uint8_t i = 0; i < C_CHANNELS; i++) {
+    printf("inp%-5u %10u %10u %10u %10u %12llu\n", i + 1, _res.generated[i], _res.counted[i], _res.restored[i], _res.ewma[i],
+           (unsigned long long)_res.allocations);
+  }
+  printf("reports %u, saves %u, longest report %u bytes\n", _res.reports, _res.saves, (uint32_t)_res.max_report_len);
+  TEST_ASSERT_EQUAL_UINT32(C_DAYS * 1440, _res.reports);
+  TEST_ASSERT_EQUAL_UINT64(0, _res.allocations);
+  for (uint8_t i = 0; i < C_CHANNELS; i++) {
+    TEST_ASSERT_EQUAL_UINT32(_res.generated[i], _res.counted[i]);
+    TEST_ASSERT_UINT32_WITHIN(_res.counted[i] / 100, _res.counted[i], _res.restored[i]);   // копия - не старше периода записи
+    TEST_ASSERT_GREATER_THAN(0, _res.ewma[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_allocations_are_counted);
+  RUN_TEST(test_week_without_allocations);
+  return UNITY_END();
+}
@@ -0,0 +1,194 @@
+// Формат страницы /metrics на компьютере (src/metrics_format.h): все описания метрик, найденные в src/main.cpp (вызовы
+// MetricsHeader, в том числе в необязательных частях сборки), выводятся через буфер меньше длины описания вместе со строкой
+// значения, и вся выгрузка проверяется по правилам текстового формата Prometheus: каждая строка закончена, # HELP и # TYPE
+// идут парой с одним именем, тип известен, строки значений относятся к описанной перед ними метрике.
+//
+// Запуск:  pio test -e native -f test_metrics_format
+
+#include <unity.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include "metrics_format.h"
+
+#define C_BUF_SIZE     64                         // буфер порции меньше самого короткого описания - описания выводятся частями
+#define C_HELP_MAX     100                        // описание метрики - одна короткая фраза, подробности - в Readme
+
+struct MetricInfo {
+  std::string     name;
+  std::string     type;
+  std::string     help;
+};
+
+std::string test_Page;                            // все отправленные порции
+uint32_t    test_Chunks = 0;
+
+void TestSink(const char *Data, size_t Len) {
+  test_Page.append(Data, Len);
+  test_Chunks++;
+}
+
+std::string SourcePath() { // src/main.cpp рядом с каталогом test/ этого теста
+  std::string _file = __FILE__;
+  size_t _pos = _file.rfind("test_metrics_format");
+  return ((_pos == std::string::npos) ? std::string("test/") : _file.substr(0, _pos)) + "../src/main.cpp";
+}
+
+bool ReadLiteral(const std::string &Src, size_t &Pos, std::string &Text) { // строка C++ (и склеенные подряд строки) начиная с Pos
+  bool _found = false;
+  while (true) {
+    while ((Pos < Src.size()) and isspace((unsigned char)Src[Pos])) Pos++;
+    if ((Pos >= Src.size()) or (Src[Pos] != '"')) return _found;
+    for (Pos++; (Pos < Src.size()) and (Src[Pos] != '"'); Pos++) {
+      if (Src[Pos] == '\\') Pos++;                                      // экранированный символ берется как есть
+      Text += Src[Pos];
+    }
+    Pos++;
+    _found = true;
+  }
+}
+
+std::vector<MetricInfo> LoadMetrics() { // все описания метрик из вызовов MetricsHeader("<имя>", "<тип>", "<описание>")
+  std::vector<MetricInfo> _list;
+  std::string _src;
+  char        _chunk[4096];
+  size_t      _read;
+  FILE *_f = fopen(SourcePath().c_str(), "rb");
+  TEST_ASSERT_NOT_NULL_MESSAGE(_f, SourcePath().c_str());
+  while ((_read = fread(_chunk, 1, sizeof(_chunk), _f)) > 0) _src.append(_chunk, _read);
+  fclose(_f);
+  for (size_t _pos = _src.find("MetricsHeader(\""); _pos != std::string::npos; _pos = _src.find("MetricsHeader(\"", _pos)) {
+    MetricInfo _info;
+    _pos += strlen("MetricsHeader(");
+    TEST_ASSERT_TRUE(ReadLiteral(_src, _pos, _info.name));
+    TEST_ASSERT_EQUAL_CHAR(',', _src[_pos++]);
+    TEST_ASSERT_TRUE(ReadLiteral(_src, _pos, _info.type));
+    TEST_ASSERT_EQUAL_CHAR(',', _src[_pos++]);
+    TEST_ASSERT_TRUE_MESSAGE(ReadLiteral(_src, _pos, _info.help), _info.name.c_str());
+    _list.push_back(_info);
+  }
+  return _list;
+}
+
+bool ValidName(const std::string &Name) { // имя метрики: [a-zA-Z_:][a-zA-Z0-9_:]*
+  if (Name.empty() or isdigit((unsigned char)Name[0])) return false;
+  for (char _c : Name) if (!isalnum((unsigned char)_c) and (_c != '_') and (_c != ':')) return false;
+  return true;
+}
+
+bool SampleOf(const std::string &Sample, const std::string &Family, const std::string &Type) { // строка значения относится к метрике
+  if (Sample == Family) return true;
+  if ((Type != "histogram") or (Sample.compare(0, Family.size(), Family) != 0)) return false;
+  std::string _suffix = Sample.substr(Family.size());
+  return (_suffix == "_bucket") or (_suffix == "_sum") or (_suffix == "_count");
+}
+
+void CheckExposition(const std::string &Page) { // проверка выгрузки по правилам текстового формата
+  std::string _family, _type, _help_name;
+  size_t      _line_no = 0;
+  TEST_ASSERT_TRUE_MESSAGE(Page.empty() or (Page[Page.size() - 1] == '\n'), "last line is not terminated");
+  for (size_t _pos = 0; _pos < Page.size(); _line_no++) {
+    size_t      _end = Page.find('\n', _pos);
+    std::string _line = Page.substr(_pos, _end - _pos);
+    char        _msg[200];
+    _pos = _end + 1;
+    snprintf(_msg, sizeof(_msg), "line %u: %.150s", (uint32_t)_line_no + 1, _line.c_str());
+    TEST_ASSERT_FALSE_MESSAGE(_line.empty(), _msg);
+    if (_line.compare(0, 7, "# HELP ") == 0) {
+      size_t _space = _line.find(' ', 7);
+      TEST_ASSERT_TRUE_MESSAGE(_space != std::string::npos, _msg);
+      _help_name = _line.substr(7, _space - 7);
+      TEST_ASSERT_TRUE_MESSAGE(ValidName(_help_name), _msg);
+      TEST_ASSERT_TRUE_MESSAGE(_line.find("# TYPE") == std::string::npos, _msg);      // описание не склеено с типом
+      continue;
+    }
+    if (_line.compare(0, 7, "# TYPE ") == 0) {
+      size_t _space = _line.find(' ', 7);
+      TEST_ASSERT_TRUE_MESSAGE(_space != std::string::npos, _msg);
+      _family = _line.substr(7, _space - 7);
+      _type = _line.substr(_space + 1);
+      TEST_ASSERT_EQUAL_STRING_MESSAGE(_help_name.c_str(), _family.c_str(), _msg);    // # TYPE сразу за своим # HELP
+      TEST_ASSERT_TRUE_MESSAGE((_type == "counter") or (_type == "gauge") or (_type == "histogram") or (_type == "summary") or
+                               (_type == "untyped"), _msg);
+      _help_name.clear();
+      continue;
+    }
+    TEST_ASSERT_NOT_EQUAL_MESSAGE('#', _line[0], _msg);
+    TEST_ASSERT_TRUE_MESSAGE(_help_name.empty(), _msg);                              // после # HELP должен идти # TYPE
+    size_t      _name_end = _line.find_first_of("{ ");
+    std::string _sample = _line.substr(0, _name_end);
+    TEST_ASSERT_TRUE_MESSAGE(SampleOf(_sample, _family, _type), _msg);
+    size_t _value = (_line[_name_end] == '{') ? _line.find("} ", _name_end) : _name_end;
+    TEST_ASSERT_TRUE_MESSAGE(_value != std::string::npos, _msg);
+    _value = _line.find_first_not_of(' ', _value + 1);
+    TEST_ASSERT_TRUE_MESSAGE(_value != std::string::npos, _msg);
+    char *_num_end;
+    strtod(_line.c_str() + _value, &_num_end);
+    TEST_ASSERT_TRUE_MESSAGE((*_num_end == '\0') and (_num_end != _line.c_str() + _value), _msg);
+  }
+}
+
+void setUp(void) {
+  test_Page.clear();
+  test_Chunks = 0;
+}
+
+void tearDown(void) {}
+
+void test_every_header_renders_valid_exposition(void) {
+  char       _buf[C_BUF_SIZE];
+  MetricsOut _out = {_buf, sizeof(_buf), 0, TestSink};
+  std::vector<MetricInfo> _metrics = LoadMetrics();
+  TEST_ASSERT_GREATER_THAN(50, _metrics.size());                      // вызовы найдены - иначе проверять нечего
+  for (const MetricInfo &_m : _metrics) {
+    char _msg[120];
+    snprintf(_msg, sizeof(_msg), "%s: help is %u characters", _m.name.c_str(), (uint32_t)_m.help.size());
+    TEST_ASSERT_TRUE_MESSAGE(_m.help.size() < C_HELP_MAX, _msg);
+    MetricsOutHeader(_out, _m.name.c_str(), _m.type.c_str(), _m.help.c_str());
+    if (_m.type == "histogram") {
+      TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "%s_bucket{le=\"+Inf\"} %u\n", _m.name.c_str(), 3));
+      TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "%s_sum %u.%06u\n", _m.name.c_str(), 1, 250));
+      TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "%s_count %u\n", _m.name.c_str(), 3));
+    }
+    else TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "%s{n=\"%u\"} %u\n", _m.name.c_str(), 1, 42));
+  }
+  MetricsOutFlush(_out);
+  printf("\n%u metrics, %u bytes in %u chunks\n", (uint32_t)_metrics.size(), (uint32_t)test_Page.size(), test_Chunks);
+  CheckExposition(test_Page);
+}
+
+void test_long_help_is_not_cut(void) {
+  // прежний вывод через строку на 160 байт обрезал такое описание вместе с переводом строки - следующая строка склеивалась с # TYPE
+  char        _buf[C_BUF_SIZE];
+  MetricsOut  _out = {_buf, sizeof(_buf), 0, TestSink};
+  std::string _help(300, 'x');
+  MetricsOutHeader(_out, "cntr_long_help", "gauge", _help.c_str());
+  MetricsOutPrintf(_out, "cntr_long_help 1\n");
+  MetricsOutFlush(_out);
+  TEST_ASSERT_EQUAL_STRING(("# HELP cntr_long_help " + _help + "\n# TYPE cntr_long_help gauge\ncntr_long_help 1\n").c_str(), test_Page.c_str());
+  CheckExposition(test_Page);
+}
+
+void test_sample_lines_are_whole_or_absent(void) {
+  char        _buf[C_BUF_SIZE];
+  MetricsOut  _out = {_buf, sizeof(_buf), 0, TestSink};
+  std::string _labels(C_BUF_SIZE, 'a');
+  MetricsOutHeader(_out, "cntr_test", "gauge", "Test.");
+  for (uint32_t i = 0; i < 20; i++) TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "cntr_test{n=\"%u\"} %u\n", i, i * 1000));   // переходят через границы порций
+  TEST_ASSERT_FALSE(MetricsOutPrintf(_out, "cntr_test{l=\"%s\"} 1\n", _labels.c_str()));    // длиннее буфера - не выводится
+  TEST_ASSERT_TRUE(MetricsOutPrintf(_out, "cntr_test 7\n"));
+  MetricsOutFlush(_out);
+  TEST_ASSERT_GREATER_THAN(1, test_Chunks);
+  TEST_ASSERT_TRUE(test_Page.find(_labels) == std::string::npos);
+  TEST_ASSERT_TRUE(test_Page.find("cntr_test{n=\"19\"} 19000\ncntr_test 7\n") != std::string::npos);
+  CheckExposition(test_Page);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_every_header_renders_valid_exposition);
+  RUN_TEST(test_long_help_is_not_cut);
+  RUN_TEST(test_sample_lines_are_whole_or_absent);
+  return UNITY_END();
+}
@@ -0,0 +1,188 @@
+// Разбор кадров Modbus TCP на компьютере (src/modbus_frame.h): чтение FC3/FC4, запись FC6/FC16 и все пути исключений.
+// Карта регистров - как у прошивки с двумя входами: значения 32-битные (старшее слово первым), запись разрешена только
+// в счётчики (регистры 0..5), счётчик перезагрузок (4-5) 16-битный. Отклоненная запись не должна менять ни одного значения.
+//
+// Запуск:  pio test -e native -f test_modbus
+
+#include <unity.h>
+#include <string.h>
+#include "modbus_frame.h"
+
+#define C_VALUES       8                          // 32-битных значений в карте (16 регистров, как для двух входов)
+#define C_WRITABLE     6                          // регистры счётчиков и счётчика перезагрузок
+#define C_RB_REGISTER  4                          // счётчик перезагрузок
+#define C_UNIT         1                          // идентификатор устройства
+
+struct TestMap {
+  uint32_t        values[C_VALUES];
+  uint32_t        writes;                         // выполненных вызовов Write
+
+  uint16_t Count() { return C_VALUES * 2; }
+  uint16_t WritableEnd() { return C_WRITABLE; }
+  void Read(uint16_t Address, uint16_t Count, uint16_t *Regs) {
+    for (uint16_t i = 0; i < Count; i++) {
+      uint16_t _r = Address + i;
+      Regs[i] = (_r & 1) ? values[_r / 2] & 0xFFFF : values[_r / 2] >> 16;
+    }
+  }
+  uint8_t Write(uint16_t Address, uint16_t Count, const uint8_t *Data) {
+    for (uint16_t i = 0; i < Count / 2; i++) {
+      if ((Address + i * 2 == C_RB_REGISTER) and (ModbusGet32(Data, i) > 0xFFFF)) return MB_EX_ILLEGAL_VALUE;
+    }
+    for (uint16_t i = 0; i < Count / 2; i++) values[Address / 2 + i] = ModbusGet32(Data, i);
+    writes++;
+    return 0;
+  }
+};
+
+TestMap  test_Map;
+uint8_t  test_Adu[260];
+
+void setUp(void) {
+  for (uint8_t i = 0; i < C_VALUES; i++) test_Map.values[i] = 0x10000 * (i + 1) + 0x100 + i;
+  test_Map.writes = 0;
+  memset(test_Adu, 0, sizeof(test_Adu));
+}
+
+void tearDown(void) {}
+
+uint16_t Frame(uint8_t Function, const uint8_t *Data, uint16_t DataLen) { // кадр запроса: MBAP (транзакция 0x1234) + PDU, возвращает длину
+  test_Adu[0] = 0x12;
+  test_Adu[1] = 0x34;
+  test_Adu[2] = 0;
+  test_Adu[3] = 0;
+  test_Adu[4] = (DataLen + 2) >> 8;
+  test_Adu[5] = (DataLen + 2) & 0xFF;
+  test_Adu[6] = C_UNIT;
+  test_Adu[7] = Function;
+  memcpy(test_Adu + 8, Data, DataLen);
+  return 8 + DataLen;
+}
+
+uint16_t Read(uint8_t Function, uint16_t Address, uint16_t Count) {
+  uint8_t _data[4] = {(uint8_t)(Address >> 8), (uint8_t)Address, (uint8_t)(Count >> 8), (uint8_t)Count};
+  return ModbusHandleFrame(test_Adu, Frame(Function, _data, sizeof(_data)), test_Map);
+}
+
+uint16_t WriteMultiple(uint16_t Address, uint16_t Count, const uint32_t *Values) { // Values - пары регистров, при нечетном Count последняя - половина
+  uint8_t _data[5 + 2 * C_MB_WRITE_MAX] = {(uint8_t)(Address >> 8), (uint8_t)Address, (uint8_t)(Count >> 8), (uint8_t)Count, (uint8_t)(Count * 2)};
+  for (uint16_t i = 0; i < Count; i++) {
+    uint16_t _reg = (i & 1) ? Values[i / 2] & 0xFFFF : Values[i / 2] >> 16;
+    _data[5 + i * 2] = _reg >> 8;
+    _data[6 + i * 2] = _reg & 0xFF;
+  }
+  return ModbusHandleFrame(test_Adu, Frame(MB_FC_WRITE_MULTIPLE, _data, 5 + Count * 2), test_Map);
+}
+
+void AssertException(uint16_t Len, uint8_t Function, uint8_t Exception) {
+  TEST_ASSERT_EQUAL_UINT16(9, Len);
+  TEST_ASSERT_EQUAL_HEX8(Function | 0x80, test_Adu[7]);
+  TEST_ASSERT_EQUAL_HEX8(Exception, test_Adu[8]);
+  TEST_ASSERT_EQUAL_UINT8(0, test_Adu[4]);
+  TEST_ASSERT_EQUAL_UINT8(3, test_Adu[5]);                                      // идентификатор устройства + функция + код
+}
+
+void AssertValuesUnchanged(void) {
+  for (uint8_t i = 0; i < C_VALUES; i++) TEST_ASSERT_EQUAL_HEX32(0x10000 * (i + 1) + 0x100 + i, test_Map.values[i]);
+  TEST_ASSERT_EQUAL_UINT32(0, test_Map.writes);
+}
+
+void test_read_registers_framing(void) {
+  const uint8_t c_functions[] = {MB_FC_READ_HOLDING, MB_FC_READ_INPUT};
+  for (uint8_t f = 0; f < sizeof(c_functions); f++) {
+    uint16_t _len = Read(c_functions[f], 3, 5);                                  // с нечетного адреса - чтение половин пар разрешено
+    TEST_ASSERT_EQUAL_UINT16(9 + 10, _len);
+    TEST_ASSERT_EQUAL_HEX8(0x12, test_Adu[0]);                                  // номер транзакции, протокол и устройство сохранены
+    TEST_ASSERT_EQUAL_HEX8(0x34, test_Adu[1]);
+    TEST_ASSERT_EQUAL_HEX8(0, test_Adu[2]);
+    TEST_ASSERT_EQUAL_HEX8(0, test_Adu[3]);
+    TEST_ASSERT_EQUAL_UINT8(0, test_Adu[4]);
+    TEST_ASSERT_EQUAL_UINT8(_len - 6, test_Adu[5]);
+    TEST_ASSERT_EQUAL_HEX8(C_UNIT, test_Adu[6]);
+    TEST_ASSERT_EQUAL_HEX8(c_functions[f], test_Adu[7]);
+    TEST_ASSERT_EQUAL_UINT8(10, test_Adu[8]);                                   // количество байт
+    const uint16_t c_expected[] = {0x0101, 0x0003, 0x0102, 0x0004, 0x0103};     // младшее слово 2-го значения, затем пары 3-го и 4-го
+    for (uint8_t i = 0; i < 5; i++) TEST_ASSERT_EQUAL_HEX16(c_expected[i], ModbusGet16(test_Adu + 9 + i * 2));
+  }
+  TEST_ASSERT_EQUAL_UINT16(9 + 2 * C_VALUES * 2, Read(MB_FC_READ_HOLDING, 0, C_VALUES * 2));   // вся карта
+  TEST_ASSERT_EQUAL_HEX32(test_Map.values[C_VALUES - 1], ModbusGet32(test_Adu + 9, C_VALUES - 1));
+}
+
+void test_read_exceptions(void) {
+  AssertException(Read(MB_FC_READ_HOLDING, 0, 0), MB_FC_READ_HOLDING, MB_EX_ILLEGAL_VALUE);
+  AssertException(Read(MB_FC_READ_INPUT, 0, C_MB_READ_MAX + 1), MB_FC_READ_INPUT, MB_EX_ILLEGAL_VALUE);
+  AssertException(Read(MB_FC_READ_HOLDING, C_VALUES * 2 - 1, 2), MB_FC_READ_HOLDING, MB_EX_ILLEGAL_ADDRESS);
+  AssertException(Read(MB_FC_READ_INPUT, 0xFFFF, 2), MB_FC_READ_INPUT, MB_EX_ILLEGAL_ADDRESS);     // адрес + количество не переполняются
+  uint8_t _short[2] = {0, 0};
+  AssertException(ModbusHandleFrame(test_Adu, Frame(MB_FC_READ_HOLDING, _short, sizeof(_short)), test_Map), MB_FC_READ_HOLDING, MB_EX_ILLEGAL_VALUE);
+  AssertException(ModbusHandleFrame(test_Adu, Frame(0x05, _short, sizeof(_short)), test_Map), 0x05, MB_EX_ILLEGAL_FUNCTION);
+}
+
+void test_write_multiple_counters(void) {
+  const uint32_t c_values[] = {0xDEADBEEF, 0x00012345, 0x0000FFFF};
+  uint16_t _len = WriteMultiple(0, 6, c_values);
+  TEST_ASSERT_EQUAL_UINT16(12, _len);                                            // ответ: адрес и количество из запроса
+  TEST_ASSERT_EQUAL_HEX8(MB_FC_WRITE_MULTIPLE, test_Adu[7]);
+  TEST_ASSERT_EQUAL_HEX16(0, ModbusGet16(test_Adu + 8));
+  TEST_ASSERT_EQUAL_HEX16(6, ModbusGet16(test_Adu + 10));
+  TEST_ASSERT_EQUAL_UINT8(6, test_Adu[5]);
+  TEST_ASSERT_EQUAL_UINT32(1, test_Map.writes);
+  for (uint8_t i = 0; i < 3; i++) TEST_ASSERT_EQUAL_HEX32(c_values[i], test_Map.values[i]);
+  TEST_ASSERT_EQUAL_HEX32(0x40103, test_Map.values[3]);                        // следующие значения не тронуты
+  TEST_ASSERT_EQUAL_UINT16(12, WriteMultiple(2, 2, c_values));                  // одно значение со второго счётчика
+  TEST_ASSERT_EQUAL_HEX32(0xDEADBEEF, test_Map.values[1]);
+}
+
+void test_write_single_register_is_rejected(void) {
+  // FC6 пишет половину 32-битного счётчика - вторая половина осталась бы прежней, и в счётчик попало бы значение, которого никто не записывал
+  for (uint16_t _reg = 0; _reg < C_VALUES * 2; _reg++) {
+    uint8_t _data[4] = {0, (uint8_t)_reg, 0x12, 0x34};
+    AssertException(ModbusHandleFrame(test_Adu, Frame(MB_FC_WRITE_SINGLE, _data, sizeof(_data)), test_Map), MB_FC_WRITE_SINGLE, MB_EX_ILLEGAL_ADDRESS);
+  }
+  uint8_t _short[2] = {0, 0};
+  AssertException(ModbusHandleFrame(test_Adu, Frame(MB_FC_WRITE_SINGLE, _short, sizeof(_short)), test_Map), MB_FC_WRITE_SINGLE, MB_EX_ILLEGAL_VALUE);
+  AssertValuesUnchanged();
+}
+
+void test_write_multiple_exceptions(void) {
+  const uint32_t c_values[] = {1, 2, 3, 4};
+  AssertException(WriteMultiple(1, 2, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_ADDRESS);       // половины двух разных счётчиков
+  AssertException(WriteMultiple(0, 3, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_ADDRESS);       // старшая половина второго счётчика
+  AssertException(WriteMultiple(4, 4, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_ADDRESS);       // за счётчиком - регистры только для чтения
+  AssertException(WriteMultiple(6, 2, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_ADDRESS);
+  AssertException(WriteMultiple(0xFFFE, 2, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_ADDRESS);
+  AssertException(WriteMultiple(0, 0, c_values), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_VALUE);
+  const uint32_t c_reboot[] = {7, 0x10000};                                      // счётчик перезагрузок 16-битный - не пишется ни один счётчик
+  AssertException(WriteMultiple(2, 4, c_reboot), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_VALUE);
+  uint8_t _data[9] = {0, 0, 0, 2, 3, 0, 1, 0, 2};                                // количество байт не совпадает с количеством регистров
+  AssertException(ModbusHandleFrame(test_Adu, Frame(MB_FC_WRITE_MULTIPLE, _data, sizeof(_data)), test_Map), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_VALUE);
+  uint8_t _cut[7] = {0, 0, 0, 2, 4, 0, 1};                                       // данных меньше, чем заявлено
+  AssertException(ModbusHandleFrame(test_Adu, Frame(MB_FC_WRITE_MULTIPLE, _cut, sizeof(_cut)), test_Map), MB_FC_WRITE_MULTIPLE, MB_EX_ILLEGAL_VALUE);
+  AssertValuesUnchanged();
+}
+
+void test_frame_length(void) {
+  uint16_t _len = Frame(MB_FC_READ_HOLDING, (const uint8_t*)"\0\0\0\1", 4);
+  TEST_ASSERT_EQUAL_INT32(0, ModbusFrameLength(test_Adu, 6, sizeof(test_Adu)));             // заголовок еще не принят
+  TEST_ASSERT_EQUAL_INT32(_len, ModbusFrameLength(test_Adu, 7, sizeof(test_Adu)));          // длина известна по заголовку
+  TEST_ASSERT_EQUAL_INT32(_len, ModbusFrameLength(test_Adu, _len + 5, sizeof(test_Adu)));   // за кадром - начало следующего
+  test_Adu[2] = 1;                                                                           // другой протокол
+  TEST_ASSERT_EQUAL_INT32(-1, ModbusFrameLength(test_Adu, _len, sizeof(test_Adu)));
+  test_Adu[2] = 0;
+  test_Adu[4] = 0x01;                                                                        // кадр больше буфера
+  TEST_ASSERT_EQUAL_INT32(-1, ModbusFrameLength(test_Adu, _len, sizeof(test_Adu)));
+  test_Adu[4] = 0;
+  test_Adu[5] = 1;                                                                           // нет даже кода функции
+  TEST_ASSERT_EQUAL_INT32(-1, ModbusFrameLength(test_Adu, _len, sizeof(test_Adu)));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_read_registers_framing);
+  RUN_TEST(test_read_exceptions);
+  RUN_TEST(test_write_multiple_counters);
+  RUN_TEST(test_write_single_register_is_rejected);
+  RUN_TEST(test_write_multiple_exceptions);
+  RUN_TEST(test_frame_length);
+  return UNITY_END();
+}
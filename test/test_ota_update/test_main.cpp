@@ -0,0 +1,385 @@
+// Обновление прошивки с обрывом питания и обрывом передачи на компьютере (src/ota_stream.h): эмулятор FLASH с двумя разделами
+// прошивки, выбором раздела загрузки (otadata) и NVS. Разбор потока, переключение на новую прошивку и пробные загрузки выполняются
+// теми же шаблонами, что в прошивке. Питание пропадает перед каждой по очереди операцией записи (запись порции образа обрывается
+// на случайном байте), после чего модуль загружается заново - так же, как после сбоя. Проверяется, что модуль всегда загружает
+// целую прошивку, работающая прошивка не портится, неподтвержденная прошивка не остается навсегда, а оборванный поток не принимается.
+//
+// Запуск:  pio test -e native -f test_ota_update
+
+#include <unity.h>
+#include <stdio.h>
+#include <vector>
+#include "ota_stream.h"
+
+#define C_PART_SIZE    65536                      // размер раздела прошивки
+#define C_ADDR_A       0x10000u                   // адрес раздела работающей прошивки
+#define C_ADDR_B       0x20000u                   // адрес неактивного раздела
+#define C_MAX_BOOTS    3                          // как C_OTA_TRIAL_BOOTS прошивки
+#define C_MAX_BOOT_RUNS 12                        // загрузок после обновления до установившегося состояния
+#define C_BLOCK        4096                       // наибольший блок приема (C_OTA_BLOCK_SIZE)
+
+typedef std::vector<uint8_t> Bytes;
+
+enum FirmwareKind_t : uint8_t {
+  FK_GOOD = 'G',                                  // прошивка подтверждает себя после загрузки
+  FK_BAD = 'B'                                    // прошивка перезагружается, не дойдя до подтверждения
+};
+
+uint32_t TestRandom(uint32_t &State, uint32_t Range) { // xorshift32, 0..Range-1
+  State ^= State << 13;
+  State ^= State >> 17;
+  State ^= State << 5;
+  return (Range > 0) ? State % Range : 0;
+}
+
+uint32_t Fnv(const uint8_t *Data, size_t Len, uint32_t Hash = 2166136261u) {
+  for (size_t i = 0; i < Len; i++) Hash = (Hash ^ Data[i]) * 16777619u;
+  return Hash;
+}
+
+void TestHash(const uint8_t *Data, size_t Len, uint8_t *Hash) { // 32 байта вместо SHA256 (на компьютере нет mbedtls)
+  for (uint32_t i = 0; i < 8; i++) {
+    uint32_t _h = Fnv(Data, Len, 2166136261u ^ (i * 0x9E3779B9u));
+    memcpy(Hash + i * 4, &_h, 4);
+  }
+}
+
+// образ: [C_OTA_IMAGE_MAGIC][u32 длина][вид прошивки][данные][u32 контрольная сумма] - загрузчик проверяет заголовок и сумму
+Bytes MakeImage(uint32_t Len, uint32_t Seed, FirmwareKind_t Kind) {
+  Bytes _image(Len);
+  uint32_t _random = Seed;
+  _image[0] = C_OTA_IMAGE_MAGIC;
+  memcpy(&_image[1], &Len, 4);
+  _image[5] = Kind;
+  for (uint32_t i = 6; i < Len - 4; i++) _image[i] = (uint8_t)TestRandom(_random, 256);
+  uint32_t _sum = Fnv(_image.data(), Len - 4);
+  memcpy(&_image[Len - 4], &_sum, 4);
+  return _image;
+}
+
+bool ImageValid(const Bytes &Part) {
+  uint32_t _len, _sum;
+  if (Part[0] != C_OTA_IMAGE_MAGIC) return false;
+  memcpy(&_len, &Part[1], 4);
+  if ((_len < 10) or (_len > Part.size())) return false;
+  memcpy(&_sum, &Part[_len - 4], 4);
+  return _sum == Fnv(Part.data(), _len - 4);
+}
+
+// дельта new относительно old: совпадающие участки от 16 байт на тех же смещениях копируются из работающей прошивки, остальное вставляется
+Bytes MakeDelta(const Bytes &Old, const Bytes &New) {
+  OtaDeltaHeader _header = {C_OTA_DELTA_MAGIC, C_OTA_DELTA_VERSION, {0, 0, 0}, (uint32_t)Old.size(), {0}, (uint32_t)New.size(), {0}};
+  Bytes _delta;
+  auto _put = [&](uint32_t Value) { _delta.insert(_delta.end(), (uint8_t*)&Value, (uint8_t*)&Value + 4); };
+  auto _same = [&](uint32_t Pos) { return (Pos < Old.size()) and (Old[Pos] == New[Pos]); };
+
+  TestHash(Old.data(), Old.size(), _header.base_sha256);
+  TestHash(New.data(), New.size(), _header.target_sha256);
+  _delta.insert(_delta.end(), (uint8_t*)&_header, (uint8_t*)&_header + sizeof(_header));
+  for (uint32_t _pos = 0, _insert = 0; _pos <= New.size(); ) {
+    uint32_t _run = 0;
+    while ((_pos + _run < New.size()) and _same(_pos + _run)) _run++;
+    if ((_run < 16) and (_pos < New.size())) {
+      _pos += (_run > 0) ? _run : 1;
+      continue;
+    }
+    if (_pos > _insert) {                                               // накопленные отличия
+      _delta.push_back(OD_INSERT);
+      _put(_pos - _insert);
+      _delta.insert(_delta.end(), New.begin() + _insert, New.begin() + _pos);
+    }
+    if (_run == 0) break;
+    _delta.push_back(OD_COPY);
+    _put(_pos);
+    _put(_run);
+    _pos += _run;
+    _insert = _pos;
+  }
+  return _delta;
+}
+
+struct Device {                                   // эмулятор: разделы прошивки, otadata и NVS
+  Bytes           part[2];                        // разделы A и B
+  uint32_t        boot;                           // выбранный раздел загрузки (запись otadata атомарна)
+  bool            has_trial;                      // запись пробного режима в NVS (запись ключа атомарна)
+  OtaTrial        trial;
+  bool            rolled_back;
+  int32_t         budget;                         // операций записи до обрыва питания (-1 - без обрыва)
+  bool            cut;                            // питание пропало - запись больше не выполняется
+  uint32_t        random;
+  uint32_t        ops;                            // выполнено операций записи
+
+  Bytes &Part(uint32_t Address) { return part[(Address == C_ADDR_A) ? 0 : 1]; }
+
+  bool Spend() {                                  // разрешение на очередную операцию записи
+    if (cut) return false;
+    if (budget == 0) {
+      cut = true;
+      return false;
+    }
+    if (budget > 0) budget--;
+    ops++;
+    return true;
+  }
+};
+
+struct TestIo {                                   // Io шаблонов ota_stream.h поверх эмулятора
+  Device          *dev;
+  uint32_t        running;
+  uint32_t        target;
+  uint32_t        pos;                            // позиция записи в разделе target
+  Bytes           out;                            // записанная прошивка (для "SHA256")
+
+  bool Output(const uint8_t *Data, size_t Len) {
+    Bytes &_part = dev->Part(target);
+    if (pos + Len > _part.size()) return false;
+    if (!dev->Spend()) {                          // запись оборвалась на случайном байте
+      if (dev->cut) memcpy(&_part[pos], Data, TestRandom(dev->random, Len + 1));
+      return false;
+    }
+    memcpy(&_part[pos], Data, Len);
+    pos += Len;
+    out.insert(out.end(), Data, Data + Len);
+    return true;
+  }
+  bool ReadBase(uint32_t Offset, uint8_t *Buf, size_t Len) {
+    Bytes &_part = dev->Part(running);
+    if (Offset + Len > _part.size()) return false;
+    memcpy(Buf, &_part[Offset], Len);
+    return true;
+  }
+  bool CheckBase(const OtaDeltaHeader &Header) {
+    uint8_t _hash[32];
+    if (Header.base_size > C_PART_SIZE) return false;
+    TestHash(dev->Part(running).data(), Header.base_size, _hash);
+    return memcmp(_hash, Header.base_sha256, 32) == 0;
+  }
+  bool End() { return ImageValid(dev->Part(target)); }
+  bool SetBoot(uint32_t Address) {
+    if (!dev->Spend()) return false;
+    dev->boot = Address;
+    return true;
+  }
+  bool PutTrial(const OtaTrial &Trial) {
+    if (!dev->Spend()) return false;
+    dev->has_trial = true;
+    dev->trial = Trial;
+    return true;
+  }
+  bool GetTrial(OtaTrial &Trial) {
+    Trial = dev->trial;
+    return dev->has_trial;
+  }
+  void RemoveTrial() {
+    if (dev->Spend()) dev->has_trial = false;
+  }
+  void PutRolledBack() {
+    if (dev->Spend()) dev->rolled_back = true;
+  }
+};
+
+// прежний порядок: раздел загрузки переключался до записи пробного режима
+OtaError_t OldOrderCommit(TestIo &IO, uint32_t Address) {
+  OtaTrial _trial = {Address, 1};
+  if (!IO.End()) return OE_IMAGE;
+  if (!IO.SetBoot(Address)) return OE_PARTITION;
+  IO.PutTrial(_trial);
+  return OE_NONE;
+}
+
+Device MakeDevice(const Bytes &Old, uint32_t Seed) {
+  Device _dev;
+  _dev.part[0].assign(C_PART_SIZE, 0xFF);
+  _dev.part[1].assign(C_PART_SIZE, 0xFF);
+  memcpy(_dev.part[0].data(), Old.data(), Old.size());
+  _dev.boot = C_ADDR_A;
+  _dev.has_trial = false;
+  _dev.trial = OtaTrial();
+  _dev.rolled_back = false;
+  _dev.budget = -1;
+  _dev.cut = false;
+  _dev.random = Seed;
+  _dev.ops = 0;
+  return _dev;
+}
+
+uint32_t Bootloader(Device &Dev) { // выбранный раздел, если образ в нем целый, иначе другой целый
+  if (ImageValid(Dev.Part(Dev.boot))) return Dev.boot;
+  uint32_t _other = (Dev.boot == C_ADDR_A) ? C_ADDR_B : C_ADDR_A;
+  TEST_ASSERT_TRUE_MESSAGE(ImageValid(Dev.Part(_other)), "no valid firmware to boot");
+  return _other;
+}
+
+// обновление, как его выполняют OtaBegin, otaWriteTask и OtaEnd (Stream_Len - сколько байт потока успело прийти)
+OtaError_t RunUpdate(Device &Dev, const Bytes &Stream, size_t Stream_Len, const uint8_t *Expected, bool Old_Order = false) {
+  uint32_t   _running = Bootloader(Dev);
+  TestIo     _io = {&Dev, _running, (_running == C_ADDR_A) ? C_ADDR_B : C_ADDR_A, 0, Bytes()};
+  OtaDecoder _dec;
+  uint8_t    _hash[32];
+  size_t     _pos = 0;
+
+  if (!Dev.Spend()) return OE_WRITE;                                    // esp_ota_begin: стирание начала неактивного раздела
+  memset(Dev.Part(_io.target).data(), 0xFF, C_BLOCK);
+  OtaDecodeStart(_dec, Expected);
+  while ((_pos < Stream_Len) and (_dec.error == OE_NONE)) {
+    size_t _n = 1 + TestRandom(Dev.random, C_BLOCK);
+    if (_n > Stream_Len - _pos) _n = Stream_Len - _pos;
+    OtaDecode(_dec, _io, Stream.data() + _pos, _n);
+    _pos += _n;
+  }
+  if (Dev.cut) return OE_WRITE;
+  TestHash(_io.out.data(), _io.out.size(), _hash);
+  if (OtaDecodeEnd(_dec, _hash) != OE_NONE) return _dec.error;
+  return Old_Order ? OldOrderCommit(_io, _io.target) : OtaCommit(_io, _io.target);
+}
+
+struct BootResult {
+  uint32_t        running;                        // раздел, на котором модуль остановился
+  uint32_t        bad_boots;                      // загрузок неподтверждающейся прошивки
+  bool            stable;                         // прошивка подтверждена и пробного режима нет
+};
+
+BootResult RunBoots(Device &Dev) { // загрузки до установившегося состояния, как OtaCheckTrial и OtaConfirm
+  BootResult _res = {0, 0, false};
+  for (uint32_t i = 0; i < C_MAX_BOOT_RUNS; i++) {
+    if (Dev.cut) {                                                      // питание вернулось
+      Dev.cut = false;
+      Dev.budget = -1;
+    }
+    uint32_t _running = Bootloader(Dev);
+    uint32_t _other = (_running == C_ADDR_A) ? C_ADDR_B : C_ADDR_A;
+    TestIo   _io = {&Dev, _running, _other, 0, Bytes()};
+    uint8_t  _boots;
+    _res.running = _running;
+    OtaBootAction_t _action = OtaBootCheck(_io, _running, ImageValid(Dev.Part(_other)) ? _other : _running, C_MAX_BOOTS, _boots);
+    if (Dev.cut or (_action == OB_ROLLBACK)) continue;
+    if (Dev.Part(_running)[5] == FK_BAD) {                              // перезагрузка до подтверждения
+      _res.bad_boots++;
+      continue;
+    }
+    if (_action == OB_TRIAL) _io.RemoveTrial();                         // OtaConfirm
+    if (Dev.cut) continue;
+    _res.stable = !Dev.has_trial;
+    if (_res.stable) return _res;
+  }
+  return _res;
+}
+
+struct Scenario {
+  const char      *name;
+  bool            delta;
+  FirmwareKind_t  kind;
+};
+
+const Scenario c_Scenarios[] = {
+  {"image, good", false, FK_GOOD},
+  {"image, bad",  false, FK_BAD},
+  {"delta, good", true,  FK_GOOD},
+  {"delta, bad",  true,  FK_BAD},
+};
+
+void BuildStream(const Scenario &Case, Bytes &Old, Bytes &New, Bytes &Stream, uint8_t *Expected) {
+  Old = MakeImage(40000, 11, FK_GOOD);
+  New = MakeImage(42000, 11, Case.kind);                                // то же начало данных - дельта копирует его
+  for (uint32_t i = 20000; i < 26000; i++) New[i] ^= 0x5A;
+  uint32_t _sum = Fnv(New.data(), New.size() - 4);
+  memcpy(&New[New.size() - 4], &_sum, 4);
+  Stream = Case.delta ? MakeDelta(Old, New) : New;
+  TestHash(New.data(), New.size(), Expected);
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_power_cut_at_every_write(void) {
+  printf("\n%-12s %6s %8s %8s %10s %10s\n", "case", "cuts", "on_old", "on_new", "rollbacks", "max_bad");
+  for (const Scenario &_case : c_Scenarios) {
+    Bytes   _old, _new, _stream;
+    uint8_t _expected[32];
+    BuildStream(_case, _old, _new, _stream, _expected);
+    // число операций записи без обрыва
+    Device _dev = MakeDevice(_old, 1);
+    TEST_ASSERT_EQUAL(OE_NONE, RunUpdate(_dev, _stream, _stream.size(), _expected));
+    RunBoots(_dev);
+    uint32_t _total = _dev.ops;
+    uint32_t _on_old = 0, _on_new = 0, _rollbacks = 0, _max_bad = 0;
+    for (uint32_t _cut = 0; _cut <= _total; _cut++) {
+      _dev = MakeDevice(_old, 1);                                       // та же разбивка потока на блоки, что без обрыва
+      _dev.budget = _cut;
+      RunUpdate(_dev, _stream, _stream.size(), _expected);
+      BootResult _res = RunBoots(_dev);
+      TEST_ASSERT_TRUE(_res.stable);                                    // пробный режим не остается
+      TEST_ASSERT_EQUAL_MEMORY(_old.data(), _dev.part[0].data(), _old.size());   // работающая прошивка не тронута
+      if (_case.kind == FK_BAD) TEST_ASSERT_EQUAL_UINT32(C_ADDR_A, _res.running);
+      TEST_ASSERT_LESS_OR_EQUAL_UINT32(C_MAX_BOOTS + 1, _res.bad_boots);
+      if (_res.running == C_ADDR_A) _on_old++;
+        else _on_new++;
+      if (_dev.rolled_back) _rollbacks++;
+      if (_res.bad_boots > _max_bad) _max_bad = _res.bad_boots;
+    }
+    printf("%-12s %6u %8u %8u %10u %10u\n", _case.name, _total + 1, _on_old, _on_new, _rollbacks, _max_bad);
+    if (_case.kind == FK_GOOD) TEST_ASSERT_GREATER_THAN(0, _on_new);
+  }
+}
+
+void test_old_order_keeps_bad_firmware(void) {
+  // если раздел загрузки переключить до записи пробного режима, обрыв питания между ними оставляет новую прошивку без возврата
+  Bytes   _old, _new, _stream;
+  uint8_t _expected[32];
+  uint32_t _stuck = 0;
+  BuildStream(c_Scenarios[1], _old, _new, _stream, _expected);
+  Device _dev = MakeDevice(_old, 1);
+  RunUpdate(_dev, _stream, _stream.size(), _expected, true);
+  uint32_t _total = _dev.ops;
+  for (uint32_t _cut = 0; _cut <= _total; _cut++) {
+    _dev = MakeDevice(_old, 1);
+    _dev.budget = _cut;
+    RunUpdate(_dev, _stream, _stream.size(), _expected, true);
+    if (RunBoots(_dev).running == C_ADDR_B) _stuck++;
+  }
+  TEST_ASSERT_GREATER_THAN(0, _stuck);
+}
+
+void test_truncated_stream_never_accepted(void) {
+  // передача оборвалась на любом байте - поток не принимается, даже если оборвался на границе команды дельты
+  for (const Scenario &_case : c_Scenarios) {
+    Bytes   _old, _new, _stream;
+    uint8_t _expected[32];
+    BuildStream(_case, _old, _new, _stream, _expected);
+    uint32_t _step = _case.delta ? 1 : 97;
+    for (size_t _len = 0; _len < _stream.size(); _len += _step) {
+      Device _dev = MakeDevice(_old, (uint32_t)_len + 1);
+      TEST_ASSERT_NOT_EQUAL(OE_NONE, RunUpdate(_dev, _stream, _len, _expected));
+      TEST_ASSERT_EQUAL_UINT32(C_ADDR_A, _dev.boot);
+      TEST_ASSERT_FALSE(_dev.has_trial);
+    }
+    // повтор целиком после обрыва проходит
+    Device _dev = MakeDevice(_old, 7);
+    RunUpdate(_dev, _stream, _stream.size() / 2, _expected);
+    TEST_ASSERT_EQUAL(OE_NONE, RunUpdate(_dev, _stream, _stream.size(), _expected));
+    TEST_ASSERT_EQUAL_MEMORY(_new.data(), _dev.part[1].data(), _new.size());
+  }
+}
+
+void test_delta_from_other_firmware_rejected(void) {
+  Bytes   _old, _new, _stream;
+  uint8_t _expected[32];
+  BuildStream(c_Scenarios[2], _old, _new, _stream, _expected);
+  Device _dev = MakeDevice(MakeImage(40000, 12, FK_GOOD), 3);
+  TEST_ASSERT_EQUAL(OE_BASE, RunUpdate(_dev, _stream, _stream.size(), _expected));
+  // ожидаемая SHA256 не совпадает с target_sha256 дельты
+  _dev = MakeDevice(_old, 3);
+  _expected[0] ^= 1;
+  TEST_ASSERT_EQUAL(OE_HASH, RunUpdate(_dev, _stream, _stream.size(), _expected));
+  TEST_ASSERT_EQUAL_UINT32(C_ADDR_A, _dev.boot);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_power_cut_at_every_write);
+  RUN_TEST(test_old_order_keeps_bad_firmware);
+  RUN_TEST(test_truncated_stream_never_accepted);
+  RUN_TEST(test_delta_from_other_firmware_rejected);
+  return UNITY_END();
+}
@@ -0,0 +1,146 @@
+// Проверка подсчёта импульсов на компьютере (src/input_filter.h): генератор строит сигнал с дребезгом, разбросом периода и
+// короткими помехами по виртуальным часам, фильтр входа обрабатывает фронты так же, как задача подсчёта прошивки в режиме
+// PULSE_SIMULATOR - пачками, в случайные моменты, с часами фильтра, которые не обгоняют уже переданные фронты.
+// Для каждого набора параметров выводится сравнение сгенерированных и засчитанных импульсов.
+//
+// Запуск:  pio test -e native -f test_pulse_sim
+
+#include <unity.h>
+#include <stdio.h>
+#include <vector>
+#include "input_filter.h"
+
+#define C_SEED         0x2545F491                 // то же начальное значение, что C_SIM_SEED прошивки
+#define C_SECONDS      3600                       // длительность каждого прогона по виртуальным часам
+
+struct BenchCase {
+  const char      *name;
+  SimWave         wave;
+  FilterTiming    timing;
+};
+
+struct BenchResult {
+  uint32_t        generated;                      // сгенерировано импульсов
+  uint32_t        glitches;                       // сгенерировано помех
+  uint32_t        counted;                        // засчитано фильтром
+  uint32_t        rejected;                       // отброшено фильтром как помехи
+  uint32_t        bounces;                        // фронтов дребезга, поглощенных гистерезисом
+  uint32_t        hash;                           // свертка моментов засчитанных импульсов
+};
+
+struct PendingEdge {
+  uint32_t        time_us;
+  bool            closed;
+};
+
+SimWave MakeWave(uint32_t Period, uint32_t Jitter, uint32_t Width, uint32_t BounceSpan, uint32_t MinLow) {
+  SimWave _wave = SimWave();
+  _wave.period_ms = Period;
+  _wave.jitter_ms = Jitter;
+  _wave.width_ms = Width;
+  _wave.bounce_edges = 3;
+  _wave.bounce_span_ms = BounceSpan;
+  _wave.glitch_pct = 5;
+  _wave.glitch_max_us = MinLow * 500;             // как в прошивке - помеха короче половины min_low
+  return _wave;
+}
+
+const BenchCase c_Cases[] = {
+  {"default 5 Hz",  MakeWave(200, 40, 80, 2, 50),  {50000, 20000, 5000}},     // параметры генератора и фильтра прошивки по умолчанию
+  {"water 1 Hz",    MakeWave(1000, 300, 150, 3, 100), {100000, 50000, 8000}},
+  {"fast 20 Hz",    MakeWave(50, 10, 20, 1, 10),   {10000, 10000, 2000}},
+  {"max 100 Hz",    MakeWave(10, 2, 5, 0, 4),      {4000, 2000, 1000}},
+};
+
+// Max_Lag_us - наибольшая задержка задачи подсчёта после продвижения часов генератора.
+// Clock_Ahead - фильтр считает время от часов, опережающих переданные фронты (так было до виртуальных часов)
+BenchResult RunBench(const BenchCase &Case, uint32_t Schedule_Seed, uint32_t Max_Lag_us, bool Clock_Ahead = false) {
+  BenchResult _res = {0, 0, 0, 0, 0, 2166136261u};
+  SimChannel _sim;
+  FilterCore _filter = {FS_OPEN, 0, 0};
+  std::vector<PendingEdge> _pending;
+  uint32_t _random = C_SEED;
+  uint32_t _schedule = Schedule_Seed;
+  uint32_t _clock = 0;                                                  // виртуальные часы: фронты до этого момента переданы
+  uint64_t _end = (uint64_t)C_SECONDS * 1000000;
+  auto _process = [&](uint32_t Now_us) {                              // обработка накопленных фронтов, как FilterDrain в задаче подсчёта
+    for (size_t i = 0; i <= _pending.size(); i++) {
+      uint32_t _t = (i < _pending.size()) ? _pending[i].time_us : Now_us;
+      FilterEvent_t _event;
+      while ((_event = FilterAdvanceStep(_filter, Case.timing, _t)) != FE_WAIT) {
+        if (_event == FE_PULSE) {
+          _res.counted++;
+          _res.hash = (_res.hash ^ _filter.start_us) * 16777619u;
+        }
+        if (_event == FE_GLITCH) _res.rejected++;
+      }
+      if ((i < _pending.size()) and (FilterEdgeStep(_filter, _pending[i].closed, _t) == FE_BOUNCE)) _res.bounces++;
+    }
+    _pending.clear();
+  };
+  auto _deliver = [&]() {                                               // фронт генератора в буфер фильтра
+    uint32_t _edge = _sim.next_edge;
+    SimEdge(_sim, Case.wave, _random);
+    _pending.push_back({_edge, _sim.closed});
+  };
+  SimStart(_sim, Case.wave);
+  while (_clock < _end) {
+    // задача генератора просыпается по тикам, выполняет наступившие фронты и продвигает часы
+    uint32_t _now = _clock + 1000 + SimRandom(_schedule, 5000);
+    while ((int32_t)(_now - _sim.next_edge) >= 0) _deliver();
+    _clock = _now;
+    // задача подсчёта занята другой работой и обрабатывает накопленные фронты не каждый раз
+    if (SimRandom(_schedule, Max_Lag_us / 1000 + 1) > 2) continue;
+    _process(Clock_Ahead ? _clock + SimRandom(_schedule, Max_Lag_us + 1) : _clock);
+  }
+  // доводим текущее переключение до конца и останавливаем часы перед началом следующего запланированного импульса
+  while (_sim.closed or (_sim.bounces > 0)) _deliver();
+  _process(_sim.next_edge - 1);
+  _res.generated = _sim.pulses - (_sim.glitch ? 0 : 1);
+  _res.glitches = _sim.glitches - (_sim.glitch ? 1 : 0);
+  return _res;
+}
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_counted_matches_generated(void) {
+  printf("\n%-14s %10s %10s %10s %10s %10s\n", "case", "generated", "counted", "glitches", "rejected", "bounces");
+  for (const BenchCase &_case : c_Cases) {
+    BenchResult _res = RunBench(_case, 1, 30000);
+    printf("%-14s %10u %10u %10u %10u %10u\n", _case.name, _res.generated, _res.counted, _res.glitches, _res.rejected, _res.bounces);
+    TEST_ASSERT_GREATER_THAN(0, _res.glitches);
+    TEST_ASSERT_GREATER_THAN(0, _res.bounces);
+    TEST_ASSERT_EQUAL_UINT32(_res.generated, _res.counted);
+    TEST_ASSERT_EQUAL_UINT32(_res.glitches, _res.rejected);
+  }
+}
+
+void test_result_does_not_depend_on_schedule(void) {
+  // одинаковое начальное значение генератора - одинаковый результат при любой загрузке задачи подсчёта
+  for (const BenchCase &_case : c_Cases) {
+    BenchResult _base = RunBench(_case, 1, 0);
+    for (uint32_t _seed = 2; _seed < 6; _seed++) {
+      BenchResult _res = RunBench(_case, _seed * 7919, 20000 * _seed);
+      TEST_ASSERT_EQUAL_UINT32(_base.counted, _res.counted);
+      TEST_ASSERT_EQUAL_UINT32(_base.rejected, _res.rejected);
+      TEST_ASSERT_EQUAL_UINT32(_base.bounces, _res.bounces);
+      TEST_ASSERT_EQUAL_UINT32(_base.hash, _res.hash);
+    }
+  }
+}
+
+void test_clock_ahead_of_edges_miscounts(void) {
+  // если часы фильтра обгоняют переданные фронты, помехи засчитываются как импульсы и результат зависит от загрузки
+  BenchResult _res = RunBench(c_Cases[0], 1, 40000, true);
+  TEST_ASSERT_GREATER_THAN(_res.generated, _res.counted);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_counted_matches_generated);
+  RUN_TEST(test_result_does_not_depend_on_schedule);
+  RUN_TEST(test_clock_ahead_of_edges_miscounts);
+  return UNITY_END();
+}
@@ -0,0 +1,120 @@
+// Нагрузочный тест согласованных копий curConfig (src/seqlock.h): потоки-писатели меняют блок так же, как задачи прошивки
+// (по одному - под мьютексом, как под mux_CurConfigWrite), потоки-читатели непрерывно берут копии, как отчёт, WEB и запись
+// в NVS. Каждая копия должна быть согласованной: все поля от одной записи и контрольная сумма совпадает с полями.
+//
+// Запуск:  pio test -e native -f test_seqlock
+
+#include <unity.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "seqlock.h"
+
+#define C_WRITERS      2                          // писатели: задача подсчёта и задача событий
+#define C_READERS      3                          // читатели: отчёт, WEB, запись конфигурации
+#define C_SNAPSHOTS    200000                     // копий на читателя
+
+// блок того же порядка размера, что и GlobalParams: счётчики, строки и контрольная сумма
+struct TestConfig {
+  uint32_t        counter[2];
+  uint16_t        counter_reboot;
+  char            topic[80];
+  uint32_t        generation;                     // номер записи писателя
+  uint16_t        crc;
+};
+
+volatile uint32_t test_Seq = 0;
+TestConfig        test_Config;
+std::mutex        test_WriteLock;
+std::atomic<bool> test_Stop(false);
+
+uint16_t TestCrc(const TestConfig &Cfg) { // контрольная сумма по всем полям кроме crc
+  const uint8_t *_p = (const uint8_t*)&Cfg;
+  uint16_t _crc = 0xFFFF;
+  for (size_t i = 0; i < offsetof(TestConfig, crc); i++) _crc = (uint16_t)((_crc << 5) ^ (_crc >> 11) ^ _p[i]);
+  return _crc;
+}
+
+void FillConfig(TestConfig &Cfg, uint32_t Generation) { // все поля записи зависят от ее номера
+  memset(&Cfg, 0, sizeof(Cfg));
+  Cfg.counter[0] = Generation;
+  Cfg.counter[1] = ~Generation;
+  Cfg.counter_reboot = (uint16_t)(Generation * 7);
+  memset(Cfg.topic, 'a' + Generation % 26, sizeof(Cfg.topic) - 1);
+  Cfg.generation = Generation;
+  Cfg.crc = TestCrc(Cfg);
+}
+
+void WriterTask(uint32_t First) {
+  uint32_t _gen = First;
+  while (!test_Stop.load()) {
+    std::lock_guard<std::mutex> _lock(test_WriteLock);
+    SeqWriteBegin(test_Seq);
+    FillConfig(test_Config, _gen);                // поле за полем, как запись curConfig
+    SeqWriteEnd(test_Seq);
+    _gen += C_WRITERS;
+  }
+}
+
+void ReaderTask(std::atomic<uint32_t> *Torn, std::atomic<uint32_t> *Changes) {
+  TestConfig _snap;
+  uint32_t   _last = 0;
+  for (uint32_t i = 0; i < C_SNAPSHOTS; i++) {
+    SeqReadCopy(test_Seq, &_snap, &test_Config, sizeof(_snap));
+    TestConfig _expected;
+    FillConfig(_expected, _snap.generation);
+    if ((_snap.crc != TestCrc(_snap)) or (memcmp(&_snap, &_expected, sizeof(_snap)) != 0)) (*Torn)++;
+    if (_snap.generation != _last) (*Changes)++;
+    _last = _snap.generation;
+  }
+}
+
+void setUp(void) {
+  test_Seq = 0;
+  FillConfig(test_Config, 0);
+  test_Stop = false;
+}
+
+void tearDown(void) {}
+
+void test_snapshots_are_never_torn(void) {
+  std::atomic<uint32_t> _torn(0), _changes(0);
+  std::vector<std::thread> _writers, _readers;
+  for (uint32_t i = 0; i < C_WRITERS; i++) _writers.emplace_back(WriterTask, i + 1);
+  for (uint32_t i = 0; i < C_READERS; i++) _readers.emplace_back(ReaderTask, &_torn, &_changes);
+  for (auto &t : _readers) t.join();
+  test_Stop = true;
+  for (auto &t : _writers) t.join();
+  TEST_ASSERT_EQUAL_UINT32(0, _torn.load());
+  TEST_ASSERT_GREATER_THAN(C_READERS, _changes.load());      // читатели действительно видели новые записи
+  TEST_ASSERT_EQUAL_UINT32(0, test_Seq & 1);                  // после последней записи блок согласован
+}
+
+void test_snapshot_waits_for_writer(void) {
+  // писатель "завис" посреди записи: читатель не получает копию, пока запись не закончена
+  std::atomic<bool> _done(false);
+  TestConfig _snap;
+  SeqWriteBegin(test_Seq);
+  test_Config.counter[0] = 12345;                             // половина записи
+  std::thread _reader([&]() {
+    SeqReadCopy(test_Seq, &_snap, &test_Config, sizeof(_snap));
+    _done = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  TEST_ASSERT_FALSE(_done.load());
+  FillConfig(test_Config, 12345);
+  SeqWriteEnd(test_Seq);
+  _reader.join();
+  TEST_ASSERT_TRUE(_done.load());
+  TEST_ASSERT_EQUAL_UINT32(12345, _snap.generation);
+  TEST_ASSERT_EQUAL_UINT16(TestCrc(_snap), _snap.crc);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_snapshots_are_never_torn);
+  RUN_TEST(test_snapshot_waits_for_writer);
+  return UNITY_END();
+}
@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+# Замер времени переключения модуля счётчиков между MQTT серверами (основной -> резервный и возврат на основной).
+#
+# Скрипт поднимает на компьютере два простейших MQTT сервера (CONNECT/SUBSCRIBE/PUBLISH/PING без хранения сообщений), модуль
+# настраивается на них: основной сервер <адрес компьютера>:18831, в поле "Backup MQTT hosts" - <адрес компьютера>:18832.
+# В каждом раунде основной сервер "отказывает", замеряется время до подключения модуля к резервному и до первой публикации
+# в нем, затем основной поднимается снова и замеряется время возврата (модуль проверяет основной сервер раз в 30 сек).
+#
+# Отказ сервера:   --fault down - сервер остановлен (соединение разорвано, порт закрыт);
+#                  --fault hang - соединение разорвано, сервер принимает TCP, но не отвечает на CONNECT (перегружен).
+#
+# Пример:  python3 tools/broker_failover.py --rounds 5 --device 192.168.1.50 --out failover.json
+# С --device после раундов читается страница /metrics модуля (гистограмма cntr_mqtt_outage_seconds, счётчики DNS и переключений).
+
+import argparse
+import json
+import queue
+import re
+import socket
+import statistics
+import threading
+import time
+import urllib.request
+
+CONNECT, CONNACK, PUBLISH, PUBACK, SUBSCRIBE, SUBACK = 1, 2, 3, 4, 8, 9
+PINGREQ, PINGRESP, DISCONNECT = 12, 13, 14
+
+
+def read_exact(conn, size):
+    data = b""
+    while len(data) < size:
+        chunk = conn.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("closed")
+        data += chunk
+    return data
+
+
+def read_packet(conn):
+    first = read_exact(conn, 1)[0]
+    length, shift = 0, 0
+    while True:
+        byte = read_exact(conn, 1)[0]
+        length |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            break
+        shift += 7
+    return first >> 4, first & 0x0F, read_exact(conn, length)
+
+
+class StandIn:
+    """MQTT сервер-заглушка: отвечает на подключение, подписку, публикацию и PING, о событиях сообщает в очередь."""
+
+    def __init__(self, name, host, port, events):
+        self.name, self.host, self.port, self.events = name, host, port, events
+        self.listener = None
+        self.clients = []
+        self.hang = False
+        self.lock = threading.Lock()
+
+    def start(self, hang=False):
+        self.hang = hang
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((self.host, self.port))
+        self.listener.listen(4)
+        threading.Thread(target=self.accept_loop, args=(self.listener,), daemon=True).start()
+
+    def stop(self, keep_listening=False):
+        with self.lock:
+            for conn in self.clients:
+                try:
+                    conn.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+                conn.close()
+            self.clients = []
+        if not keep_listening and self.listener:
+            self.listener.close()
+            self.listener = None
+
+    def accept_loop(self, listener):
+        while True:
+            try:
+                conn, _ = listener.accept()
+            except OSError:
+                return
+            conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            with self.lock:
+                self.clients.append(conn)
+            threading.Thread(target=self.serve, args=(conn,), daemon=True).start()
+
+    def event(self, kind):
+        self.events.put((time.monotonic(), self.name, kind))
+
+    def serve(self, conn):
+        try:
+            while True:
+                kind, flags, body = read_packet(conn)
+                if kind == CONNECT:
+                    self.event("connect")
+                    if not self.hang:
+                        conn.sendall(bytes([CONNACK << 4, 2, 0, 0]))
+                elif kind == SUBSCRIBE:
+                    topics, pos = 0, 2
+                    while pos + 2 <= len(body):
+                        pos += 2 + int.from_bytes(body[pos:pos + 2], "big") + 1
+                        topics += 1
+                    conn.sendall(bytes([SUBACK << 4, 2 + topics]) + body[:2] + bytes(topics))
+                elif kind == PUBLISH:
+                    self.event("publish")
+                    if (flags >> 1) & 3:
+                        topic_len = int.from_bytes(body[:2], "big")
+                        conn.sendall(bytes([PUBACK << 4, 2]) + body[2 + topic_len:4 + topic_len])
+                elif kind == PINGREQ:
+                    conn.sendall(bytes([PINGRESP << 4, 0]))
+                elif kind == DISCONNECT:
+                    self.event("disconnect")
+                    break
+        except (ConnectionError, OSError):
+            pass
+        with self.lock:
+            if conn in self.clients:
+                self.clients.remove(conn)
+        conn.close()
+
+
+def wait_event(events, name, kind, timeout):
+    deadline = time.monotonic() + timeout
+    while True:
+        left = deadline - time.monotonic()
+        if left <= 0:
+            return None
+        try:
+            t, who, what = events.get(timeout=left)
+        except queue.Empty:
+            return None
+        if who == name and what == kind:
+            return t
+
+
+def drain(events):
+    while not events.empty():
+        events.get_nowait()
+
+
+def summary(values):
+    values = [v for v in values if v is not None]
+    if not values:
+        return None
+    return {"min": round(min(values), 3), "median": round(statistics.median(values), 3), "max": round(max(values), 3), "n": len(values)}
+
+
+def read_metrics(device):
+    with urllib.request.urlopen("http://%s/metrics" % device, timeout=10) as resp:
+        text = resp.read().decode()
+    wanted = re.compile(r"^cntr_(mqtt_(failovers|failbacks|reconnects)_total|mqtt_outage_\w+|dns_\w+|mqtt_broker_\w+)")
+    return {line.split(" ")[0]: float(line.split(" ")[1]) for line in text.splitlines() if wanted.match(line)}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MQTT broker failover timing with local broker stand-ins")
+    parser.add_argument("--bind", default="0.0.0.0", help="адрес, на котором слушают серверы-заглушки")
+    parser.add_argument("--primary", type=int, default=18831, help="порт основного сервера")
+    parser.add_argument("--backup", type=int, default=18832, help="порт резервного сервера")
+    parser.add_argument("--rounds", type=int, default=3)
+    parser.add_argument("--fault", choices=["down", "hang"], default="down")
+    parser.add_argument("--timeout", type=float, default=120, help="максимальное ожидание события, с")
+    parser.add_argument("--device", help="адрес модуля для чтения /metrics после замеров")
+    parser.add_argument("--out", help="файл для результатов в JSON")
+    args = parser.parse_args()
+
+    events = queue.Queue()
+    primary = StandIn("primary", args.bind, args.primary, events)
+    backup = StandIn("backup", args.bind, args.backup, events)
+    primary.start()
+    backup.start()
+    print("waiting for the module on the primary broker (port %u)..." % args.primary)
+    if wait_event(events, "primary", "connect", args.timeout) is None:
+        parser.exit(1, "the module did not connect to the primary broker\n")
+
+    rounds = []
+    for n in range(args.rounds):
+        time.sleep(3)                                      # модуль успевает подписаться и опубликовать отчёт
+        drain(events)
+        t_fault = time.monotonic()
+        if args.fault == "down":
+            primary.stop()
+        else:
+            primary.stop(keep_listening=True)
+            primary.hang = True
+        t_connect = wait_event(events, "backup", "connect", args.timeout)
+        t_publish = wait_event(events, "backup", "publish", args.timeout) if t_connect else None
+        if args.fault == "down":
+            primary.start()
+        else:
+            primary.hang = False
+        drain(events)
+        t_restore = time.monotonic()
+        t_back = wait_event(events, "primary", "connect", args.timeout)
+        result = {
+            "failover_s": t_connect - t_fault if t_connect else None,
+            "first_publish_s": t_publish - t_fault if t_publish else None,
+            "failback_s": t_back - t_restore if t_back else None,
+        }
+        rounds.append(result)
+        print("round %u: failover %s s, first publish %s s, failback %s s" % (n + 1, *(
+            "%.3f" % v if v is not None else "-" for v in result.values())))
+
+    report = {
+        "fault": args.fault,
+        "rounds": rounds,
+        "failover_s": summary([r["failover_s"] for r in rounds]),
+        "first_publish_s": summary([r["first_publish_s"] for r in rounds]),
+        "failback_s": summary([r["failback_s"] for r in rounds]),
+    }
+    if args.device:
+        report["metrics"] = read_metrics(args.device)
+    print(json.dumps({k: v for k, v in report.items() if k != "rounds"}, indent=2))
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump(report, f, indent=2)
+    primary.stop()
+    backup.stop()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# Отчёт о расходе статической RAM (DRAM) и IRAM прошивки модуля счётчиков по подсистемам.
+#
+# Подключается к сборке PlatformIO (extra_scripts = post:tools/memory_budget.py) и выполняется после сборки firmware.elf:
+# таблица выводится в лог сборки и сохраняется в .pio/build/<env>/memory_budget.txt. Если в platformio.ini заданы
+# custom_dram_budget / custom_iram_budget (байт), превышение бюджета останавливает сборку.
+#
+# Отдельный запуск:   python3 tools/memory_budget.py .pio/build/esp32dev/firmware.elf --dram-budget 120000
+#
+# Подсистема определяется по имени символа (префиксы глобальных переменных прошивки: trace_, ota_, cfg_, hist_ ...),
+# символы библиотек и SDK группируются по известным префиксам, остальное - в "other". Стек задач в режиме
+# STATIC_ALLOCATION виден отдельной строкой (task_Stacks), в обычном режиме стеки выделяются из кучи и в отчёт не попадают.
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+DRAM = (0x3FF80000, 0x40000000)
+IRAM = (0x40070000, 0x400C2000)
+
+SUBSYSTEMS = [
+    ("task stacks", r"^task_(Stacks|Blocks)"),
+    ("queues/semaphores", r"^(q_|sem_)"),
+    ("trace", r"^trace_|Trace"),
+    ("pulse log", r"^pulse_Log|PulseLog"),
+    ("ota", r"^ota_|Ota"),
+    ("config", r"^cfg_|curConfig|chParams|ch_Keys|Config"),
+    ("json", r"JSONdoc|ArduinoJson"),
+    ("mqtt", r"mqtt|Mqtt|MQTT|AsyncClient|AsyncTCP"),
+    ("web", r"WEB_Server|Metrics|handle[A-Z]|WebServer"),
+    ("statistics", r"^(hist_|count_|val_|prof_|tm_|tmu_)|Histogram|Profile"),
+    ("inputs", r"^(inp_|rate_|freq_|sim_|s_Capture)|ISR_|Capture|Filter|Rate"),
+    ("wifi/lwip", r"^(wifi|esp_wifi|lwip|tcp|udp|pbuf|netif|ieee80211|ppT|pp_|lmac|sta_|hostap|dhcp|dns|etharp|ip4|igmp|mem_|memp)"),
+    ("freertos", r"^(x|v|ux|pv|prv|ul)[A-Z]|^port|pxCurrent|Idle|^_xt|^_frxt"),
+    ("other", r""),
+]
+
+
+def region(addr):
+    if DRAM[0] <= addr < DRAM[1]:
+        return "dram"
+    if IRAM[0] <= addr < IRAM[1]:
+        return "iram"
+    return None
+
+
+def collect(elf, nm):
+    out = subprocess.run([nm, "-S", "--size-sort", "-C", elf], check=True, capture_output=True, text=True).stdout
+    rules = [(name, re.compile(pattern)) for name, pattern in SUBSYSTEMS]
+    table = {name: {"dram": 0, "iram": 0} for name, _ in SUBSYSTEMS}
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4:
+            continue
+        addr, size, _, symbol = int(parts[0], 16), int(parts[1], 16), parts[2], parts[3]
+        kind = region(addr)
+        if kind is None:
+            continue
+        for name, rule in rules:
+            if rule.search(symbol):
+                table[name][kind] += size
+                break
+    return table
+
+
+def report(table):
+    lines = ["%-20s %10s %10s" % ("subsystem", "DRAM", "IRAM")]
+    total = {"dram": 0, "iram": 0}
+    for name, _ in SUBSYSTEMS:
+        row = table[name]
+        if row["dram"] == 0 and row["iram"] == 0:
+            continue
+        lines.append("%-20s %10u %10u" % (name, row["dram"], row["iram"]))
+        total["dram"] += row["dram"]
+        total["iram"] += row["iram"]
+    lines.append("%-20s %10u %10u" % ("total", total["dram"], total["iram"]))
+    return total, "\n".join(lines)
+
+
+def check(total, dram_budget, iram_budget):
+    errors = []
+    if dram_budget and total["dram"] > dram_budget:
+        errors.append("DRAM %u bytes exceeds budget %u" % (total["dram"], dram_budget))
+    if iram_budget and total["iram"] > iram_budget:
+        errors.append("IRAM %u bytes exceeds budget %u" % (total["iram"], iram_budget))
+    return errors
+
+
+def run(elf, nm, dram_budget, iram_budget, out_file=None):
+    total, text = report(collect(elf, nm))
+    print("Memory budget (%s):\n%s" % (os.path.basename(elf), text))
+    if out_file:
+        with open(out_file, "w") as f:
+            f.write(text + "\n")
+    errors = check(total, dram_budget, iram_budget)
+    for e in errors:
+        print("error: %s" % e, file=sys.stderr)
+    return not errors
+
+
+def pio_hook():
+    Import("env")                                          # noqa: F821 - определено в SCons скрипте PlatformIO
+
+    def budget(option):
+        value = env.GetProjectOption(option, "")           # noqa: F821
+        return int(value, 0) if value else 0
+
+    def after_elf(source, target, env):
+        elf = str(target[0])
+        nm = re.sub(r"gcc$", "nm", env.subst("$CC"))
+        if not run(elf, nm, budget("custom_dram_budget"), budget("custom_iram_budget"),
+                   os.path.join(env.subst("$BUILD_DIR"), "memory_budget.txt")):
+            env.Exit(1)
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", after_elf)  # noqa: F821
+
+
+def main():
+    parser = argparse.ArgumentParser(description="static DRAM/IRAM usage by subsystem")
+    parser.add_argument("elf", help="firmware.elf")
+    parser.add_argument("--nm", default="xtensa-esp32-elf-nm")
+    parser.add_argument("--dram-budget", type=lambda v: int(v, 0), default=0, help="бюджет DRAM, байт (0 - без проверки)")
+    parser.add_argument("--iram-budget", type=lambda v: int(v, 0), default=0, help="бюджет IRAM, байт (0 - без проверки)")
+    args = parser.parse_args()
+    sys.exit(0 if run(args.elf, args.nm, args.dram_budget, args.iram_budget) else 1)
+
+
+try:
+    Import                                                 # noqa: F821 - есть только при запуске из PlatformIO (SCons)
+except NameError:
+    if __name__ == "__main__":
+        main()
+else:
+    pio_hook()
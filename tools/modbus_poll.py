@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+# Клиент Modbus TCP для модуля счётчиков (прошивка, собранная с флагом MODBUS_SERVER).
+#
+# Чтение всей карты регистров:      python3 tools/modbus_poll.py 192.168.1.50
+# Чтение input регистров (FC4):     python3 tools/modbus_poll.py 192.168.1.50 --input
+# Установка счётчика входа 1:       python3 tools/modbus_poll.py 192.168.1.50 --set 1=123456
+# Установка счётчика перезагрузок:  python3 tools/modbus_poll.py 192.168.1.50 --set rb=0
+#
+# Все значения 32-битные и занимают два регистра (старшее слово первым), поэтому счётчики пишутся только функцией FC16
+# целой парой регистров - запись одного регистра (FC6) модуль отклоняет исключением 02. Карта регистров зависит от количества
+# входов (--channels, как в таблице c_Inputs прошивки) и описана в src/main.cpp рядом с ModbusRegister_t и в Readme.
+
+import argparse
+import json
+import socket
+import struct
+import sys
+
+MODBUS_PORT = 502
+READ_HOLDING, READ_INPUT, WRITE_MULTIPLE = 0x03, 0x04, 0x10
+EXCEPTIONS = {1: "illegal function", 2: "illegal address", 3: "illegal value"}
+
+MBAP = struct.Struct(">HHHB")
+
+
+class ModbusError(Exception):
+    pass
+
+
+def register_map(channels):
+    names = ["cnt%02u" % (i + 1) for i in range(channels)] + ["cnt_reboot"]
+    names += ["rate%02u" % (i + 1) for i in range(channels)] + ["uptime"]
+    names += ["pulse_age%02u" % (i + 1) for i in range(channels)]
+    return names                                              # имя значения - по паре регистров, начиная с 0
+
+
+def request(sock, transaction, unit, pdu):
+    sock.sendall(MBAP.pack(transaction, 0, len(pdu) + 1, unit) + pdu)
+    header = receive(sock, MBAP.size)
+    reply_transaction, protocol, length, _ = MBAP.unpack(header)
+    if reply_transaction != transaction or protocol != 0 or length < 2:
+        raise ModbusError("bad MBAP header in reply")
+    reply = receive(sock, length - 1)
+    if reply[0] & 0x80:
+        raise ModbusError("exception %u (%s)" % (reply[1], EXCEPTIONS.get(reply[1], "unknown")))
+    if reply[0] != pdu[0]:
+        raise ModbusError("reply to another function")
+    return reply
+
+
+def receive(sock, size):
+    data = b""
+    while len(data) < size:
+        part = sock.recv(size - len(data))
+        if not part:
+            raise ModbusError("connection closed")
+        data += part
+    return data
+
+
+def read_values(sock, unit, function, count):
+    reply = request(sock, 1, unit, struct.pack(">BHH", function, 0, count * 2))
+    if reply[1] != count * 4:
+        raise ModbusError("unexpected byte count %u" % reply[1])
+    return struct.unpack(">%uI" % count, reply[2:2 + count * 4])
+
+
+def write_value(sock, unit, index, value):
+    pdu = struct.pack(">BHHBI", WRITE_MULTIPLE, index * 2, 2, 4, value)
+    reply = request(sock, 2, unit, pdu)
+    if reply[1:5] != pdu[1:5]:
+        raise ModbusError("write reply does not match the request")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Modbus TCP client for the counter module")
+    parser.add_argument("host", help="адрес модуля")
+    parser.add_argument("--port", type=int, default=MODBUS_PORT)
+    parser.add_argument("--unit", type=int, default=1, help="идентификатор устройства (модуль отвечает на любой)")
+    parser.add_argument("--channels", type=int, default=2, help="количество входов прошивки")
+    parser.add_argument("--input", action="store_true", help="читать input регистры (FC4) вместо holding (FC3)")
+    parser.add_argument("--set", action="append", default=[], metavar="N=VALUE",
+                        help="записать счётчик входа N (или rb - счётчик перезагрузок) перед чтением")
+    parser.add_argument("--timeout", type=float, default=2.0, help="время ожидания ответа, с")
+    args = parser.parse_args()
+
+    names = register_map(args.channels)
+    sock = socket.create_connection((args.host, args.port), timeout=args.timeout)
+    try:
+        for item in args.set:
+            channel, _, value = item.partition("=")
+            index = args.channels if channel == "rb" else int(channel) - 1
+            if not 0 <= index <= args.channels or not value:
+                parser.error("неверный аргумент --set %s" % item)
+            write_value(sock, args.unit, index, int(value, 0))
+        values = read_values(sock, args.unit, READ_INPUT if args.input else READ_HOLDING, len(names))
+    except (ModbusError, OSError) as error:
+        print("modbus: %s" % error, file=sys.stderr)
+        sys.exit(1)
+    finally:
+        sock.close()
+    print(json.dumps(dict(zip(names, values)), indent=2))
+
+
+if __name__ == "__main__":
+    main()
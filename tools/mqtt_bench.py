@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+# Замер пропускной способности и задержки обработки команд MQTT модулем счётчиков.
+#
+# Скрипт подключается к тому же MQTT серверу, что и модуль, и выполняет два теста:
+#   - задержка: по одной команде {"report"} с ожиданием публикации в топике [STATUS] - распределение задержки команда -> отчёт;
+#   - поток: серия команд {"report"} без ожидания с заданной частотой - сколько команд принято, отброшено и сколько отчётов пришло.
+# После тестов читается страница /metrics модуля (счётчики команд, отброшенных команд, гистограммы задержки и память).
+# Результат записывается в JSON файл, чтобы результаты разных версий прошивки можно было сравнивать.
+#
+# Пример:  python3 tools/mqtt_bench.py --broker 192.168.1.1 --device 192.168.1.50 --out bench.json
+# Требуется пакет paho-mqtt.
+
+import argparse
+import json
+import re
+import threading
+import time
+import urllib.request
+
+import paho.mqtt.client as mqtt
+
+
+def percentile(values, pct):
+    if not values:
+        return None
+    values = sorted(values)
+    k = min(len(values) - 1, int(round(pct / 100.0 * (len(values) - 1))))
+    return values[k]
+
+
+def read_metrics(device):
+    # берем из /metrics только значения без меток и с метками как есть
+    with urllib.request.urlopen("http://%s/metrics" % device, timeout=5) as resp:
+        text = resp.read().decode()
+    result = {}
+    for line in text.splitlines():
+        if line.startswith("#") or not line.strip():
+            continue
+        m = re.match(r"^(\S+)\s+(\S+)$", line)
+        if m:
+            result[m.group(1)] = float(m.group(2))
+    return result
+
+
+class Bench:
+    def __init__(self, args):
+        self.args = args
+        self.status = threading.Event()
+        self.status_count = 0
+        self.lock = threading.Lock()
+        self.client = mqtt.Client()
+        if args.user:
+            self.client.username_pw_set(args.user, args.password)
+        self.client.on_message = self.on_message
+        self.client.connect(args.broker, args.port)
+        self.client.subscribe(args.status_topic, qos=0)
+        self.client.loop_start()
+        time.sleep(1.0)                                  # пропускаем retained сообщение статуса
+        self.status.clear()
+        self.status_count = 0
+
+    def on_message(self, client, userdata, msg):
+        with self.lock:
+            self.status_count += 1
+        self.status.set()
+
+    def latency(self, count, timeout):
+        samples = []
+        lost = 0
+        for _ in range(count):
+            self.status.clear()
+            start = time.perf_counter()
+            self.client.publish(self.args.set_topic, '{"report":true}', qos=0)
+            if self.status.wait(timeout):
+                samples.append((time.perf_counter() - start) * 1000.0)
+            else:
+                lost += 1
+            time.sleep(self.args.pause)
+        return {
+            "sent": count,
+            "lost": lost,
+            "p50_ms": percentile(samples, 50),
+            "p90_ms": percentile(samples, 90),
+            "p99_ms": percentile(samples, 99),
+            "max_ms": max(samples) if samples else None,
+        }
+
+    def flood(self, count, rate):
+        with self.lock:
+            self.status_count = 0
+        interval = 1.0 / rate if rate > 0 else 0
+        start = time.perf_counter()
+        for i in range(count):
+            self.client.publish(self.args.set_topic, '{"report":true}', qos=0)
+            if interval:
+                delay = start + (i + 1) * interval - time.perf_counter()
+                if delay > 0:
+                    time.sleep(delay)
+        elapsed = time.perf_counter() - start
+        time.sleep(self.args.settle)                     # ждем окончания обработки на модуле
+        with self.lock:
+            reports = self.status_count
+        return {"sent": count, "elapsed_s": elapsed, "rate_per_s": count / elapsed if elapsed else None, "reports": reports}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MQTT command throughput and latency benchmark")
+    parser.add_argument("--broker", required=True)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("--device", help="IP адрес модуля для чтения /metrics")
+    parser.add_argument("--set-topic", default="diy/wtr_cntr01/set")
+    parser.add_argument("--status-topic", default="diy/wtr_cntr01/state")
+    parser.add_argument("--latency-count", type=int, default=100)
+    parser.add_argument("--flood-count", type=int, default=500)
+    parser.add_argument("--flood-rate", type=float, default=0, help="команд в секунду, 0 - без ограничения")
+    parser.add_argument("--pause", type=float, default=0.05, help="пауза между командами в тесте задержки, с")
+    parser.add_argument("--settle", type=float, default=3.0)
+    parser.add_argument("--timeout", type=float, default=2.0)
+    parser.add_argument("--out", default="mqtt_bench.json")
+    args = parser.parse_args()
+
+    bench = Bench(args)
+    before = read_metrics(args.device) if args.device else {}
+    result = {"timestamp": int(time.time()), "latency": bench.latency(args.latency_count, args.timeout)}
+    result["flood"] = bench.flood(args.flood_count, args.flood_rate)
+    if args.device:
+        after = read_metrics(args.device)
+        keys = ("cntr_mqtt_commands_total", "cntr_mqtt_command_drops_total", "cntr_mqtt_command_errors_total",
+                "cntr_mqtt_publish_failures_total")
+        result["device"] = {k: after.get(k, 0) - before.get(k, 0) for k in keys}
+        result["device"]["heap_min_free_bytes"] = after.get("cntr_heap_min_free_bytes")
+        result["device"]["firmware"] = {k: v for k, v in after.items() if k.startswith("cntr_mqtt_command_seconds")}
+    with open(args.out, "w") as f:
+        json.dump(result, f, indent=2)
+    print(json.dumps(result, indent=2))
+
+
+if __name__ == "__main__":
+    main()
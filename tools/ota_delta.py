@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+# Построение дельты прошивки для обновления модуля счётчиков по сети (POST /update или команда {"ota":...}).
+#
+# Построение дельты:         python3 tools/ota_delta.py make old.bin new.bin new.delta
+# Проверка дельты:           python3 tools/ota_delta.py apply old.bin new.delta restored.bin
+# Подпись обновления:        python3 tools/ota_delta.py sign --key <ключ P_PROV_KEY> new.bin [--url http://server/new.delta]
+# Загрузка на модуль:        curl -F image=@new.delta "http://192.168.1.50/update?sha256=<hex>&sig=<hex>"
+#
+# old.bin - образ прошивки, которая сейчас работает на модуле (модуль проверяет его SHA256 и отказывается применять чужую дельту).
+# Команда apply разбирает дельту так же, как модуль (теми же порциями и с теми же проверками), и пишет результат в файл -
+# совпадение SHA256 результата с new.bin проверяется до загрузки на модуль.
+#
+# Модуль принимает обновление только с подписью HMAC-SHA256 ключом P_PROV_KEY по тексту "ota|<ссылка>|<sha256 новой прошивки>"
+# (для загрузки на /update ссылка пустая) - команда sign печатает готовую команду MQTT или параметры запроса /update.
+# Без подписи обновление принимает только прошивка, собранная с флагом OTA_UNSIGNED.
+#
+# Формат (little-endian) описан в src/ota_stream.h рядом со структурой OtaDeltaHeader.
+
+import argparse
+import hashlib
+import hmac
+import json
+import struct
+import sys
+
+MAGIC = 0x544C4443
+VERSION = 1
+HEADER = struct.Struct("<IB3xI32sI32s")
+OP_COPY, OP_INSERT = 1, 2
+KEY = 16                    # длина совпадения для поиска в старом образе
+STEP = 4                    # шаг индексации старого образа (код ESP32 выровнен по 4 байта)
+MIN_COPY = 24               # более короткие совпадения выгоднее вставить как данные
+BLOCK = 4096                # размер блока приема на модуле (для apply)
+
+
+def make_delta(old, new):
+    index = {}
+    for pos in range(0, len(old) - KEY + 1, STEP):
+        index.setdefault(old[pos:pos + KEY], pos)
+    ops = []
+    literal = bytearray()
+    last_end = None
+    i = 0
+    while i < len(new):
+        best_pos, best_len = None, 0
+        candidates = []
+        if last_end is not None and last_end < len(old):
+            candidates.append(last_end)                   # продолжение предыдущего копирования
+        found = index.get(new[i:i + KEY])
+        if found is not None:
+            candidates.append(found)
+        for pos in candidates:
+            length = 0
+            while i + length < len(new) and pos + length < len(old) and new[i + length] == old[pos + length]:
+                length += 1
+            if length > best_len:
+                best_pos, best_len = pos, length
+        if best_len >= MIN_COPY:
+            if literal:
+                ops.append(struct.pack("<BI", OP_INSERT, len(literal)) + bytes(literal))
+                literal = bytearray()
+            ops.append(struct.pack("<BII", OP_COPY, best_pos, best_len))
+            i += best_len
+            last_end = best_pos + best_len
+        else:
+            literal.append(new[i])
+            i += 1
+            if last_end is not None:
+                last_end += 1                             # замена байта на месте - копирование продолжится после нее
+    if literal:
+        ops.append(struct.pack("<BI", OP_INSERT, len(literal)) + bytes(literal))
+    header = HEADER.pack(MAGIC, VERSION, len(old), hashlib.sha256(old).digest(), len(new), hashlib.sha256(new).digest())
+    return header + b"".join(ops)
+
+
+class Decoder:
+    """Разбор дельты порциями - так же, как задача записи на модуле."""
+
+    def __init__(self, base):
+        self.base = base
+        self.buf = bytearray()
+        self.header = None
+        self.out = bytearray()
+
+    def feed(self, data):
+        self.buf += data
+        if self.header is None:
+            if len(self.buf) < HEADER.size:
+                return
+            magic, version, base_size, base_sha, target_size, target_sha = HEADER.unpack_from(self.buf)
+            if magic != MAGIC or version != VERSION:
+                raise ValueError("unknown delta format")
+            if base_size > len(self.base) or hashlib.sha256(self.base[:base_size]).digest() != base_sha:
+                raise ValueError("delta is built for another base image")
+            self.header = (base_size, target_size, target_sha)
+            del self.buf[:HEADER.size]
+        while self.buf:
+            op = self.buf[0]
+            if op == OP_COPY:
+                if len(self.buf) < 9:
+                    return
+                offset, length = struct.unpack_from("<II", self.buf, 1)
+                if offset > self.header[0] or length > self.header[0] - offset:
+                    raise ValueError("copy outside of the base image")
+                self.output(self.base[offset:offset + length])
+                del self.buf[:9]
+            elif op == OP_INSERT:
+                if len(self.buf) < 5:
+                    return
+                length, = struct.unpack_from("<I", self.buf, 1)
+                if len(self.buf) < 5 + length:
+                    return
+                self.output(self.buf[5:5 + length])
+                del self.buf[:5 + length]
+            else:
+                raise ValueError("unknown command %u" % op)
+
+    def output(self, data):
+        if len(self.out) + len(data) > self.header[1]:
+            raise ValueError("result is longer than declared")
+        self.out += data
+
+    def finish(self):
+        if self.header is None or self.buf or len(self.out) != self.header[1]:
+            raise ValueError("delta is truncated")
+        if hashlib.sha256(self.out).digest() != self.header[2]:
+            raise ValueError("SHA256 of the result does not match")
+        return bytes(self.out)
+
+
+def sign(key, url, sha256):
+    return hmac.new(key.encode(), ("ota|%s|%s" % (url, sha256)).encode(), hashlib.sha256).hexdigest()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="firmware delta builder")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("make", help="построить дельту old -> new")
+    p.add_argument("old")
+    p.add_argument("new")
+    p.add_argument("out")
+    p = sub.add_parser("apply", help="применить дельту к old (проверка)")
+    p.add_argument("old")
+    p.add_argument("delta")
+    p.add_argument("out")
+    p = sub.add_parser("sign", help="подпись обновления ключом P_PROV_KEY")
+    p.add_argument("--key", required=True, help="ключ HMAC (P_PROV_KEY прошивки)")
+    p.add_argument("--url", default="", help="ссылка на образ или дельту для команды {\"ota\":...} (для /update не задается)")
+    p.add_argument("image", help="новый образ прошивки - подписывается его SHA256 (и для дельты тоже)")
+    args = parser.parse_args()
+
+    if args.cmd == "sign":
+        with open(args.image, "rb") as f:
+            sha256 = hashlib.sha256(f.read()).hexdigest()
+        sig = sign(args.key, args.url, sha256)
+        if args.url:
+            print(json.dumps({"ota": args.url, "sha256": sha256, "sig": sig}, separators=(",", ":")))
+        else:
+            print("sha256=%s&sig=%s" % (sha256, sig))
+        return
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    if args.cmd == "make":
+        with open(args.new, "rb") as f:
+            new = f.read()
+        delta = make_delta(old, new)
+        with open(args.out, "wb") as f:
+            f.write(delta)
+        print("image %u bytes, delta %u bytes (%.1f%%), sha256 %s" %
+              (len(new), len(delta), 100.0 * len(delta) / len(new), hashlib.sha256(new).hexdigest()))
+    else:
+        with open(args.delta, "rb") as f:
+            delta = f.read()
+        decoder = Decoder(old)
+        try:
+            for pos in range(0, len(delta), BLOCK):
+                decoder.feed(delta[pos:pos + BLOCK])
+            result = decoder.finish()
+        except ValueError as e:
+            print("error: %s" % e, file=sys.stderr)
+            sys.exit(1)
+        with open(args.out, "wb") as f:
+            f.write(result)
+        print("result %u bytes, sha256 %s" % (len(result), hashlib.sha256(result).hexdigest()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+# Сборка подписанного блока настроек для модулей счётчиков (команда {"provision":...} в топике [SET] или в групповом топике).
+#
+# Блок для всех модулей с меткой water:
+#     python3 tools/provision.py --key <ключ P_PROV_KEY> --topic site/all/set --to tag:water wn=SiteNet wp=secret mh=10.0.0.5 ms=1883 c1l=30 c1h=30 > blob.txt
+#     mosquitto_pub -h 10.0.0.5 -t site/all/set -f blob.txt
+# Проверка подписи сохраненного блока:
+#     python3 tools/provision.py --key <ключ> --topic site/all/set --verify blob.txt
+#
+# Параметры задаются именами полей страницы конфигурации: wn/wp - SSID и пароль WiFi, mh/ms/mb - MQTT сервер, порт и резервные серверы,
+# mu/mp - пользователь и пароль MQTT, ts/tr/tl - топики команд, отчётов и LWT, gt - групповые топики, dt - метки, di - номер модуля,
+# c<N>m/g/l/h/y - режим входа N, время усреднения частоты, мин. замыкание, мин. размыкание и гистерезис фильтра в мс.
+# Номер блока (--seq, по умолчанию - текущее время в секундах) должен расти: модуль не применяет блок с номером не больше последнего.
+# Подписывается текст "<топик>|<сообщение>": топик публикации (--topic) и условие выбора модулей (--to) входят в подпись - блок нельзя
+# переадресовать модулям, не подписанным на этот топик, или другим модулям группы. Блок, опубликованный в другой топик, модуль отклоняет.
+# Формат описан в src/main.cpp рядом с SelectCommand, результат модуль публикует в топик [STATUS]/result.
+
+import argparse
+import hashlib
+import hmac
+import json
+import sys
+import time
+
+SIG_TAIL = ',"sig":"'
+MAX_SIZE = 511                              # C_MQTT_CMD_SIZE - 1: более длинные команды модуль отбрасывает
+NUMERIC = {"ms", "di"}
+
+
+def field_value(name, text):
+    if name in NUMERIC or (name.startswith("c") and name[-1:] in "mglhy" and name[1:-1].isdigit()):
+        return int(text)
+    return text
+
+
+def sign(key, topic, text):
+    return hmac.new(key.encode(), (topic + "|" + text).encode(), hashlib.sha256).hexdigest()
+
+
+def build(key, topic, fields, seq, selector=None):
+    body = json.dumps({"provision": fields, "seq": seq}, separators=(",", ":"), ensure_ascii=False)
+    text = ("@%s " % selector if selector else "") + body[:-1]          # подпись добавляется последним полем объекта
+    return text + SIG_TAIL + sign(key, topic, text) + '"}'
+
+
+def verify(key, topic, message):
+    message = message.rstrip()
+    pos = message.rfind(SIG_TAIL)
+    if pos < 0 or not message.endswith('"}') or len(message) - pos != len(SIG_TAIL) + 64 + 2:
+        return False
+    sig = message[pos + len(SIG_TAIL):-2]
+    return hmac.compare_digest(sig, sign(key, topic, message[:pos]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="signed configuration block builder")
+    parser.add_argument("--key", required=True, help="ключ HMAC (P_PROV_KEY прошивки)")
+    parser.add_argument("--topic", required=True, help="топик, в который будет опубликован блок ([SET] модуля или групповой)")
+    parser.add_argument("--seq", type=int, default=int(time.time()), help="номер блока (по умолчанию - время в секундах)")
+    parser.add_argument("--to", help="условие выбора модулей, например tag:water+id:1-50,id:200")
+    parser.add_argument("--verify", metavar="FILE", help="проверить подпись сохраненного блока")
+    parser.add_argument("fields", nargs="*", metavar="name=value", help="параметры блока")
+    args = parser.parse_args()
+
+    if args.verify:
+        with open(args.verify, encoding="utf-8") as f:
+            ok = verify(args.key, args.topic, f.read())
+        print("signature ok" if ok else "bad signature", file=sys.stderr)
+        sys.exit(0 if ok else 1)
+    if not args.fields:
+        parser.error("нужно задать хотя бы один параметр name=value")
+    fields = {}
+    for item in args.fields:
+        name, sep, value = item.partition("=")
+        if not sep or not name:
+            parser.error("параметр %r не в формате name=value" % item)
+        fields[name] = field_value(name, value)
+    message = build(args.key, args.topic, fields, args.seq, args.to)
+    if len(message.encode()) > MAX_SIZE:
+        parser.exit(1, "block is %u bytes, the module accepts up to %u - split it into several blocks\n" % (len(message.encode()), MAX_SIZE))
+    print(message)
+
+
+if __name__ == "__main__":
+    main()
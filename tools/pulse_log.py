@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# Выгрузка журнала импульсов модуля счётчиков (страница /pulses в двоичном формате).
+#
+# Разовая выгрузка в CSV:            python3 tools/pulse_log.py 192.168.1.50 > pulses.csv
+# Непрерывный сбор без пропусков:    python3 tools/pulse_log.py 192.168.1.50 --follow 30 >> pulses.csv
+# В режиме --follow каждый следующий запрос передает since=next_seq прошлой выгрузки, поэтому записи не повторяются.
+# Если между запросами засчитано больше импульсов, чем помещается в журнал, номера seq в выгрузке идут с пропуском.
+#
+# Формат (little-endian) описан в src/main.cpp рядом со структурами PulseLogHeader/PulseLogEntry.
+
+import argparse
+import struct
+import sys
+import time
+import urllib.request
+
+MAGIC = 0x474F4C50
+VERSION = 1
+HEADER = struct.Struct("<IBBBBIIIq")
+ENTRY = struct.Struct("<IHBx")
+
+
+def fetch(host, since):
+    url = "http://%s/pulses?format=bin" % host
+    if since is not None:
+        url += "&since=%u" % since
+    with urllib.request.urlopen(url, timeout=10) as resp:
+        data = resp.read()
+    if len(data) < HEADER.size:
+        raise ValueError("short reply")
+    magic, version, entry_size, channels, synced, first_seq, count, next_seq, offset_us = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or entry_size != ENTRY.size:
+        raise ValueError("unknown log format")
+    records = []
+    pos = HEADER.size
+    while pos + ENTRY.size <= len(data):
+        time_lo, time_hi, channel = ENTRY.unpack_from(data, pos)
+        mono_us = (time_hi << 32) | time_lo
+        records.append((channel + 1, mono_us, mono_us + offset_us if synced else None))
+        pos += ENTRY.size
+    return next_seq, records
+
+
+def main():
+    parser = argparse.ArgumentParser(description="pulse log downloader")
+    parser.add_argument("host", help="адрес модуля")
+    parser.add_argument("--since", type=int, help="номер первой нужной записи")
+    parser.add_argument("--follow", type=float, default=0, help="период повторной выгрузки, с (0 - один раз)")
+    args = parser.parse_args()
+
+    since = args.since
+    print("channel,mono_us,unix_us")
+    while True:
+        since, records = fetch(args.host, since)
+        for channel, mono_us, unix_us in records:
+            print("%u,%u,%s" % (channel, mono_us, "" if unix_us is None else unix_us))
+        sys.stdout.flush()
+        if args.follow <= 0:
+            break
+        time.sleep(args.follow)
+
+
+if __name__ == "__main__":
+    main()
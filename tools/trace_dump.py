@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Выгрузка и расшифровка журнала трассировки модуля счётчиков (страница /trace в двоичном формате).
+#
+# Разовая выгрузка:                  python3 tools/trace_dump.py 192.168.1.50
+# Непрерывный сбор без пропусков:    python3 tools/trace_dump.py 192.168.1.50 --follow 2
+# Включение категорий:               python3 tools/trace_dump.py 192.168.1.50 --mask 0x1FF
+# Расшифровка сообщения из MQTT:     python3 tools/trace_dump.py --file trace.bin
+# (сообщение топика [STATUS]/trace после команды {"trace":"dump"}, например mosquitto_sub -C 1 -t .../state/trace > trace.bin)
+#
+# Время событий выводится в мс относительно момента выгрузки (time_us - младшие 32 бита micros() модуля).
+# Формат (little-endian) и смысл аргументов событий описаны в src/main.cpp рядом со структурами TraceHeader/TraceEntry.
+
+import argparse
+import struct
+import sys
+import time
+import urllib.request
+
+MAGIC = 0x43525443
+VERSION = 1
+HEADER = struct.Struct("<IBBHIIIII")
+ENTRY = struct.Struct("<IIBBHI")
+
+CATEGORIES = ["system", "wifi", "mqtt", "command", "config", "input", "pulse", "web", "ota"]
+
+# имена событий - как в c_TraceNames прошивки (номер события = категория << 4 | номер в категории)
+EVENTS = {
+    0x00: "boot", 0x01: "reboot", 0x02: "power_cut", 0x03: "power_saved", 0x04: "trace_mask", 0x05: "diag_overflow",
+    0x10: "wifi_connect", 0x11: "wifi_up", 0x12: "wifi_fail", 0x13: "wifi_lost", 0x14: "wifi_off", 0x15: "wifi_ap",
+    0x16: "wifi_ap_clients",
+    0x20: "mqtt_connect", 0x21: "mqtt_up", 0x22: "mqtt_down", 0x23: "mqtt_timeout", 0x24: "mqtt_lost",
+    0x25: "mqtt_subscribed", 0x26: "mqtt_published", 0x27: "mqtt_publish_fail", 0x28: "mqtt_report",
+    0x29: "mqtt_broker", 0x2A: "mqtt_dns", 0x2B: "mqtt_dns_fail", 0x2C: "mqtt_failback",
+    0x2D: "mqtt_report_overflow",
+    0x30: "cmd_received", 0x31: "cmd_dropped", 0x32: "cmd_parse_error", 0x33: "cmd_done", 0x34: "cmd_set_counter",
+    0x35: "cmd_bad_value", 0x36: "cmd_batch", 0x37: "cmd_skipped", 0x38: "cmd_provision", 0x39: "cmd_not_allowed",
+    0x40: "cfg_static_saved", 0x41: "cfg_counters_saved", 0x42: "cfg_field", 0x43: "cfg_defaults", 0x44: "cfg_apply",
+    0x50: "inp_mode", 0x51: "inp_filter", 0x52: "inp_hyst", 0x53: "inp_no_capture",
+    0x60: "pulse", 0x61: "pulse_glitch", 0x62: "edge_overflow", 0x63: "freq_gate",
+    0x70: "web_page",
+    0x80: "ota_begin", 0x81: "ota_end", 0x82: "ota_not_started", 0x83: "ota_rollback", 0x84: "ota_confirmed",
+}
+IP_EVENTS = {0x11, 0x15, 0x2A}                                   # arg1 - IP адрес
+
+
+def format_arg1(event, arg1):
+    if event in IP_EVENTS:
+        return ".".join(str((arg1 >> shift) & 0xFF) for shift in (0, 8, 16, 24))
+    return str(arg1)
+
+
+def parse(data):
+    if len(data) < HEADER.size:
+        raise ValueError("short reply")
+    magic, version, entry_size, _, mask, first_seq, count, next_seq, now_us = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or entry_size != ENTRY.size:
+        raise ValueError("unknown trace format")
+    records = []
+    pos = HEADER.size
+    while pos + ENTRY.size <= len(data):
+        seq, time_us, event, core, arg0, arg1 = ENTRY.unpack_from(data, pos)
+        age_ms = ((now_us - time_us) & 0xFFFFFFFF) / 1000.0
+        records.append((seq, -age_ms, core, event, arg0, arg1))
+        pos += ENTRY.size
+    return mask, next_seq, records
+
+
+def fetch(host, since, mask):
+    url = "http://%s/trace?format=bin" % host
+    if since is not None:
+        url += "&since=%u" % since
+    if mask is not None:
+        url += "&mask=%u" % mask
+    with urllib.request.urlopen(url, timeout=10) as resp:
+        return parse(resp.read())
+
+
+def main():
+    parser = argparse.ArgumentParser(description="trace ring downloader and decoder")
+    parser.add_argument("host", nargs="?", help="адрес модуля")
+    parser.add_argument("--file", help="расшифровать сохраненную выгрузку (сообщение MQTT или ответ /trace?format=bin)")
+    parser.add_argument("--since", type=int, help="номер первого нужного события")
+    parser.add_argument("--mask", type=lambda v: int(v, 0), help="включить категории (бит на категорию: %s)" %
+                        ", ".join("%u - %s" % (i, c) for i, c in enumerate(CATEGORIES)))
+    parser.add_argument("--follow", type=float, default=0, help="период повторной выгрузки, с (0 - один раз)")
+    args = parser.parse_args()
+    if not args.file and not args.host:
+        parser.error("нужно указать адрес модуля или --file")
+
+    print("seq,time_ms,core,event,arg0,arg1")
+    since = args.since
+    mask = args.mask
+    while True:
+        if args.file:
+            with open(args.file, "rb") as f:
+                mask_now, since, records = parse(f.read())
+        else:
+            mask_now, since, records = fetch(args.host, since, mask)
+            mask = None                                    # маска задается один раз
+        for seq, time_ms, core, event, arg0, arg1 in records:
+            print("%u,%.3f,%u,%s,%u,%s" % (seq, time_ms, core, EVENTS.get(event, "0x%02X" % event), arg0, format_arg1(event, arg1)))
+        sys.stdout.flush()
+        if args.file or args.follow <= 0:
+            print("# mask 0x%X (%s), next_seq %u" % (mask_now, ",".join(c for i, c in enumerate(CATEGORIES) if mask_now & (1 << i)), since),
+                  file=sys.stderr)
+            break
+        time.sleep(args.follow)
+
+
+if __name__ == "__main__":
+    main()
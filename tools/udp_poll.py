@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+# Клиент UDP протокола опроса модулей счётчиков.
+#
+# Опрос одного модуля:           python3 tools/udp_poll.py 192.168.1.50
+# Поиск всех модулей в сети:     python3 tools/udp_poll.py --discover
+# Если в прошивке задан ключ P_UDP_KEY, его нужно передать параметром --key - запросы подписываются,
+# а подпись ответов проверяется. Модуль принимает подписанный запрос, только если его номер больше номера
+# последнего запроса с того же адреса, поэтому номер берется из текущего времени в единицах 10 мс.
+#
+# Формат кадров (little-endian) описан в src/main.cpp рядом со структурами UdpRequest/UdpResponse.
+
+import argparse
+import hashlib
+import hmac
+import json
+import socket
+import struct
+import time
+
+UDP_PORT = 4210
+MAGIC_REQUEST = 0x51544E43
+MAGIC_RESPONSE = 0x52544E43
+VERSION = 1
+QUERY, DISCOVER = 1, 2
+FLAG_HMAC = 0x01
+HMAC_SIZE = 16
+
+REQUEST_HEADER = struct.Struct("<IBBBBI")
+RESPONSE_BODY = struct.Struct("<IBBBBIIIII6s2x")
+
+
+def sign(key, data):
+    return hmac.new(key, data, hashlib.sha256).digest()[:HMAC_SIZE]
+
+
+def build_request(kind, seq, key):
+    flags = FLAG_HMAC if key else 0
+    frame = REQUEST_HEADER.pack(MAGIC_REQUEST, VERSION, kind, flags, 0, seq)
+    if key:
+        frame += sign(key, frame)
+    return frame
+
+
+def parse_response(data, key):
+    if len(data) < RESPONSE_BODY.size:
+        return None
+    body = data[:RESPONSE_BODY.size]
+    magic, version, kind, flags, _, seq, uptime, cnt1, cnt2, cnt_rb, mac = RESPONSE_BODY.unpack(body)
+    if magic != MAGIC_RESPONSE or version != VERSION:
+        return None
+    if key:
+        if not (flags & FLAG_HMAC) or len(data) != RESPONSE_BODY.size + HMAC_SIZE:
+            return None
+        if not hmac.compare_digest(sign(key, body), data[RESPONSE_BODY.size:]):
+            return None
+    return {
+        "mac": ":".join("%02X" % b for b in mac),
+        "seq": seq,
+        "uptime": uptime,
+        "cnt01": cnt1,
+        "cnt02": cnt2,
+        "cnt_reboot": cnt_rb,
+        "signed": bool(flags & FLAG_HMAC),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="UDP query protocol client")
+    parser.add_argument("host", nargs="?", help="адрес модуля (не нужен при --discover)")
+    parser.add_argument("--discover", action="store_true", help="широковещательный поиск модулей")
+    parser.add_argument("--broadcast", default="255.255.255.255")
+    parser.add_argument("--port", type=int, default=UDP_PORT)
+    parser.add_argument("--key", help="ключ HMAC (P_UDP_KEY в прошивке)")
+    parser.add_argument("--timeout", type=float, default=0.5, help="время ожидания ответов, с")
+    args = parser.parse_args()
+    if not args.discover and not args.host:
+        parser.error("нужно указать адрес модуля или --discover")
+
+    key = args.key.encode() if args.key else None
+    seq = int(time.time() * 100) & 0xFFFFFFFF
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    sock.settimeout(args.timeout)
+    target = args.broadcast if args.discover else args.host
+    start = time.perf_counter()
+    sock.sendto(build_request(DISCOVER if args.discover else QUERY, seq, key), (target, args.port))
+
+    found = {}
+    deadline = start + args.timeout
+    while time.perf_counter() < deadline:
+        try:
+            data, addr = sock.recvfrom(256)
+        except socket.timeout:
+            break
+        reply = parse_response(data, key)
+        if reply is None or reply["seq"] != seq:
+            continue
+        reply["ip"] = addr[0]
+        reply["rtt_ms"] = round((time.perf_counter() - start) * 1000.0, 2)
+        found[reply["mac"]] = reply
+        if not args.discover:
+            break
+    print(json.dumps(list(found.values()), indent=2))
+
+
+if __name__ == "__main__":
+    main()